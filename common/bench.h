@@ -0,0 +1,142 @@
+/*
+ * bench.h - Latency samples and benchmark reports
+ *
+ * Header-only collector for the --bench mode of the Windows and Linux
+ * tools: each phase keeps its raw samples in microseconds, and the report
+ * gives count, p50/p90/p99 (nearest rank) and max per phase plus overall
+ * throughput, as a text table, CSV or JSON.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    BENCH_TEXT,
+    BENCH_CSV,
+    BENCH_JSON
+} bench_format;
+
+typedef struct {
+    const char *name;
+    uint32_t *us;               // Samples in microseconds
+    size_t count;
+    size_t capacity;
+} bench_phase;
+
+typedef struct {
+    const char *backend;
+    unsigned operations;
+    unsigned failures;
+    double seconds;             // Wall time of all operations
+} bench_run;
+
+/*
+ * Parse "text", "csv" or "json". Returns 0 on anything else.
+ */
+static inline int bench_parse_format(const char *name, bench_format *format)
+{
+    if (strcmp(name, "text") == 0)
+        *format = BENCH_TEXT;
+    else if (strcmp(name, "csv") == 0)
+        *format = BENCH_CSV;
+    else if (strcmp(name, "json") == 0)
+        *format = BENCH_JSON;
+    else
+        return 0;
+    return 1;
+}
+
+/*
+ * Record one sample. Returns 0 when out of memory.
+ */
+static inline int bench_add(bench_phase *phase, uint64_t us)
+{
+    if (phase->count == phase->capacity) {
+        size_t capacity = phase->capacity ? phase->capacity * 2 : 256;
+        uint32_t *grown = (uint32_t *)realloc(phase->us, capacity * sizeof(uint32_t));
+        if (!grown)
+            return 0;
+        phase->us = grown;
+        phase->capacity = capacity;
+    }
+    phase->us[phase->count++] = (uint32_t)(us > UINT32_MAX ? UINT32_MAX : us);
+    return 1;
+}
+
+static inline void bench_free(bench_phase *phase)
+{
+    free(phase->us);
+    phase->us = NULL;
+    phase->count = phase->capacity = 0;
+}
+
+static inline int bench_compare_us(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Nearest-rank percentile in milliseconds. Sorts the samples.
+ */
+static inline double bench_percentile_ms(bench_phase *phase, unsigned percent)
+{
+    if (phase->count == 0)
+        return 0.0;
+
+    qsort(phase->us, phase->count, sizeof(uint32_t), bench_compare_us);
+    size_t rank = (phase->count * percent + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return phase->us[rank - 1] / 1000.0;
+}
+
+/*
+ * Print the report for a finished run.
+ */
+static inline void bench_report(FILE *out, bench_format format, const bench_run *run,
+                                bench_phase *phases, size_t phase_count)
+{
+    double tps = run->seconds > 0 ? run->operations / run->seconds : 0.0;
+
+    if (format == BENCH_TEXT) {
+        fprintf(out, "Backend %s: %u operations, %u failed, %.3f s, %.1f transactions/s\n\n",
+                run->backend, run->operations, run->failures, run->seconds, tps);
+        fprintf(out, "%-10s %7s %10s %10s %10s %10s\n", "phase (ms)", "count", "p50", "p90", "p99", "max");
+    } else if (format == BENCH_CSV) {
+        fprintf(out, "backend,phase,count,p50_ms,p90_ms,p99_ms,max_ms,operations,failures,tps\n");
+    } else {
+        fprintf(out, "{\"backend\":\"%s\",\"operations\":%u,\"failures\":%u,\"seconds\":%.6f,\"tps\":%.3f,\"phases\":{",
+                run->backend, run->operations, run->failures, run->seconds, tps);
+    }
+
+    for (size_t i = 0; i < phase_count; i++) {
+        bench_phase *phase = &phases[i];
+        double p50 = bench_percentile_ms(phase, 50);
+        double p90 = bench_percentile_ms(phase, 90);
+        double p99 = bench_percentile_ms(phase, 99);
+        double max = phase->count ? phase->us[phase->count - 1] / 1000.0 : 0.0;
+
+        if (format == BENCH_TEXT)
+            fprintf(out, "%-10s %7zu %10.3f %10.3f %10.3f %10.3f\n",
+                    phase->name, phase->count, p50, p90, p99, max);
+        else if (format == BENCH_CSV)
+            fprintf(out, "%s,%s,%zu,%.3f,%.3f,%.3f,%.3f,%u,%u,%.3f\n",
+                    run->backend, phase->name, phase->count, p50, p90, p99, max,
+                    run->operations, run->failures, tps);
+        else
+            fprintf(out, "%s\"%s\":{\"count\":%zu,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+                    i ? "," : "", phase->name, phase->count, p50, p90, p99, max);
+    }
+
+    if (format == BENCH_JSON)
+        fprintf(out, "}}\n");
+}
+
+#endif // BENCH_H
@@ -0,0 +1,287 @@
+/*
+ * ddcci.h - DDC/CI packet codec
+ *
+ * Header-only, allocation-free builders and parsers for the DDC/CI
+ * messages used by the NVAPI, ADL and Linux I2C backends.
+ * Compiles as C99 and C++; under C++14 or newer every function is
+ * constexpr so packets can be built and checked at compile time.
+ *
+ * Outgoing packets start at the host source address byte. The 0x6E
+ * destination address is not stored, since the I2C driver (or
+ * NvAPI_I2CWrite) puts it on the wire itself; it is still folded into
+ * the checksum. Backends that need it in the buffer (ADL) prepend it.
+ *
+ * Incoming replies start at the 0x6E source byte as read from 0x6F.
+ */
+
+#ifndef DDCCI_H
+#define DDCCI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus) && (__cplusplus >= 201402L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201402L))
+#define DDCCI_FN static constexpr inline
+#define DDCCI_HAS_CONSTEXPR 1
+#else
+#define DDCCI_FN static inline
+#define DDCCI_HAS_CONSTEXPR 0
+#endif
+
+// I2C addresses
+#define DDCCI_I2C_ADDR          0x37    // 7-bit DDC/CI slave address
+#define DDCCI_DEST_ADDR         0x6E    // 0x37 << 1, write
+#define DDCCI_HOST_ADDR         0x51    // Host source address for VCP commands
+#define DDCCI_REPLY_SEED        0x50    // Virtual host address used in reply checksums
+
+// Opcodes
+#define DDCCI_OP_GET_VCP        0x01
+#define DDCCI_OP_GET_VCP_REPLY  0x02
+#define DDCCI_OP_SET_VCP        0x03
+#define DDCCI_OP_SAVE_SETTINGS  0x0C
+#define DDCCI_OP_TABLE_READ     0xE2
+#define DDCCI_OP_CAPS_REPLY     0xE3
+#define DDCCI_OP_TABLE_REPLY    0xE4
+#define DDCCI_OP_TABLE_WRITE    0xE7
+#define DDCCI_OP_CAPS_REQUEST   0xF3
+
+// Packet sizes (including checksum)
+#define DDCCI_SET_VCP_LEN           7   // src, 0x84, 0x03, code, hi, lo, chk
+#define DDCCI_GET_VCP_LEN           5   // src, 0x82, 0x01, code, chk
+#define DDCCI_GET_VCP_REPLY_LEN     11  // 0x6E, 0x88, 0x02, rc, code, type, max hi/lo, cur hi/lo, chk
+#define DDCCI_CAPS_REQUEST_LEN      6   // src, 0x83, 0xF3, off hi, off lo, chk
+#define DDCCI_TABLE_READ_LEN        7   // src, 0x84, 0xE2, code, off hi, off lo, chk
+#define DDCCI_SAVE_SETTINGS_LEN     4   // src, 0x81, 0x0C, chk
+#define DDCCI_MAX_FRAGMENT          32  // Max data bytes in one table/capabilities fragment
+#define DDCCI_TABLE_WRITE_MAX_LEN   (7 + DDCCI_MAX_FRAGMENT)
+#define DDCCI_FRAGMENT_REPLY_MAX_LEN (6 + DDCCI_MAX_FRAGMENT)   // 0x6E, len, op, off hi, off lo, data, chk
+
+// MCCS minimum delays (milliseconds)
+#define DDCCI_SET_VCP_DELAY_MS  50      // After a Set VCP before the next command
+#define DDCCI_REPLY_DELAY_MS    40      // After a request before reading its reply
+
+typedef enum {
+    DDCCI_OK = 0,
+    DDCCI_ERR_CHECKSUM,         // Reply checksum mismatch
+    DDCCI_ERR_NULL_MSG,         // Monitor sent a null message (busy / not ready)
+    DDCCI_ERR_UNSUPPORTED,      // Monitor reported the VCP code as unsupported
+    DDCCI_ERR_PROTOCOL,         // Malformed or unexpected reply
+    DDCCI_ERR_NAK,              // Monitor did not acknowledge the transfer
+    DDCCI_ERR_BUS_BUSY,         // Adapter or bus busy, try again later
+    DDCCI_ERR_IO                // No such display or no access to its bus
+} ddcci_status;
+
+typedef struct {
+    uint8_t  code;              // VCP code the reply is for
+    uint8_t  type;              // 0x00 = set parameter, 0x01 = momentary
+    uint16_t max_value;
+    uint16_t cur_value;
+} ddcci_vcp_reply;
+
+/*
+ * Short description of a status, for error messages.
+ */
+DDCCI_FN const char *ddcci_status_text(ddcci_status status)
+{
+    switch (status) {
+    case DDCCI_OK:              return "ok";
+    case DDCCI_ERR_CHECKSUM:    return "reply checksum mismatch";
+    case DDCCI_ERR_NULL_MSG:    return "monitor sent a null message";
+    case DDCCI_ERR_UNSUPPORTED: return "VCP code not supported";
+    case DDCCI_ERR_PROTOCOL:    return "malformed reply";
+    case DDCCI_ERR_NAK:         return "monitor did not acknowledge";
+    case DDCCI_ERR_BUS_BUSY:    return "bus busy";
+    case DDCCI_ERR_IO:          return "display not accessible";
+    }
+    return "unknown error";
+}
+
+/*
+ * Whether a failed transaction is worth repeating. A NAK, a null message
+ * or a corrupt reply usually means the monitor was not ready yet; an
+ * unsupported code or a missing device will fail the same way again.
+ */
+DDCCI_FN int ddcci_status_is_transient(ddcci_status status)
+{
+    return status == DDCCI_ERR_CHECKSUM || status == DDCCI_ERR_NULL_MSG ||
+           status == DDCCI_ERR_PROTOCOL || status == DDCCI_ERR_NAK ||
+           status == DDCCI_ERR_BUS_BUSY;
+}
+
+/*
+ * XOR checksum of buf[0..len) seeded with the first address byte.
+ */
+DDCCI_FN uint8_t ddcci_checksum(uint8_t seed, const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        seed ^= buf[i];
+    return seed;
+}
+
+/*
+ * Set VCP Feature. src is 0x51 for VCP codes, or a vendor sub-address
+ * (e.g. 0x50 for LG input switching). Straight-line, no branches.
+ */
+DDCCI_FN size_t ddcci_build_set_vcp(uint8_t *out, uint8_t src, uint8_t code, uint16_t value)
+{
+    out[0] = src;
+    out[1] = 0x84;
+    out[2] = DDCCI_OP_SET_VCP;
+    out[3] = code;
+    out[4] = (uint8_t)(value >> 8);
+    out[5] = (uint8_t)(value & 0xFF);
+    out[6] = (uint8_t)(DDCCI_DEST_ADDR ^ out[0] ^ out[1] ^ out[2] ^ out[3] ^ out[4] ^ out[5]);
+    return DDCCI_SET_VCP_LEN;
+}
+
+/*
+ * Get VCP Feature request.
+ */
+DDCCI_FN size_t ddcci_build_get_vcp(uint8_t *out, uint8_t src, uint8_t code)
+{
+    out[0] = src;
+    out[1] = 0x82;
+    out[2] = DDCCI_OP_GET_VCP;
+    out[3] = code;
+    out[4] = (uint8_t)(DDCCI_DEST_ADDR ^ out[0] ^ out[1] ^ out[2] ^ out[3]);
+    return DDCCI_GET_VCP_LEN;
+}
+
+/*
+ * Capabilities Request for the fragment starting at offset.
+ */
+DDCCI_FN size_t ddcci_build_caps_request(uint8_t *out, uint16_t offset)
+{
+    out[0] = DDCCI_HOST_ADDR;
+    out[1] = 0x83;
+    out[2] = DDCCI_OP_CAPS_REQUEST;
+    out[3] = (uint8_t)(offset >> 8);
+    out[4] = (uint8_t)(offset & 0xFF);
+    out[5] = (uint8_t)(DDCCI_DEST_ADDR ^ out[0] ^ out[1] ^ out[2] ^ out[3] ^ out[4]);
+    return DDCCI_CAPS_REQUEST_LEN;
+}
+
+/*
+ * Table Read request for the fragment of table VCP code starting at offset.
+ */
+DDCCI_FN size_t ddcci_build_table_read(uint8_t *out, uint8_t code, uint16_t offset)
+{
+    out[0] = DDCCI_HOST_ADDR;
+    out[1] = 0x84;
+    out[2] = DDCCI_OP_TABLE_READ;
+    out[3] = code;
+    out[4] = (uint8_t)(offset >> 8);
+    out[5] = (uint8_t)(offset & 0xFF);
+    out[6] = (uint8_t)(DDCCI_DEST_ADDR ^ out[0] ^ out[1] ^ out[2] ^ out[3] ^ out[4] ^ out[5]);
+    return DDCCI_TABLE_READ_LEN;
+}
+
+/*
+ * Table Write of up to DDCCI_MAX_FRAGMENT bytes. out must hold
+ * DDCCI_TABLE_WRITE_MAX_LEN bytes. Returns packet length.
+ */
+DDCCI_FN size_t ddcci_build_table_write(uint8_t *out, uint8_t code, uint16_t offset,
+                                        const uint8_t *data, size_t data_len)
+{
+    size_t n = data_len < DDCCI_MAX_FRAGMENT ? data_len : DDCCI_MAX_FRAGMENT;
+    out[0] = DDCCI_HOST_ADDR;
+    out[1] = (uint8_t)(0x80 | (4 + n));
+    out[2] = DDCCI_OP_TABLE_WRITE;
+    out[3] = code;
+    out[4] = (uint8_t)(offset >> 8);
+    out[5] = (uint8_t)(offset & 0xFF);
+    for (size_t i = 0; i < n; ++i)
+        out[6 + i] = data[i];
+    out[6 + n] = ddcci_checksum(DDCCI_DEST_ADDR, out, 6 + n);
+    return 7 + n;
+}
+
+/*
+ * Save Current Settings.
+ */
+DDCCI_FN size_t ddcci_build_save_settings(uint8_t *out)
+{
+    out[0] = DDCCI_HOST_ADDR;
+    out[1] = 0x81;
+    out[2] = DDCCI_OP_SAVE_SETTINGS;
+    out[3] = (uint8_t)(DDCCI_DEST_ADDR ^ out[0] ^ out[1] ^ out[2]);
+    return DDCCI_SAVE_SETTINGS_LEN;
+}
+
+/*
+ * Validate the framing and checksum of a reply read from 0x6F.
+ * On success *payload_len holds the number of bytes after the length byte
+ * (opcode included, checksum excluded).
+ */
+DDCCI_FN ddcci_status ddcci_check_reply(const uint8_t *buf, size_t len, size_t *payload_len)
+{
+    if (len < 3 || buf[0] != DDCCI_DEST_ADDR || (buf[1] & 0x80) == 0)
+        return DDCCI_ERR_PROTOCOL;
+
+    size_t n = buf[1] & 0x7F;
+    if (n + 3 > len)
+        return DDCCI_ERR_PROTOCOL;
+    if (ddcci_checksum(DDCCI_REPLY_SEED, buf, n + 2) != buf[n + 2])
+        return DDCCI_ERR_CHECKSUM;
+    if (n == 0)
+        return DDCCI_ERR_NULL_MSG;
+
+    *payload_len = n;
+    return DDCCI_OK;
+}
+
+/*
+ * Parse a Get VCP Feature reply.
+ */
+DDCCI_FN ddcci_status ddcci_parse_get_vcp_reply(const uint8_t *buf, size_t len, ddcci_vcp_reply *out)
+{
+    size_t n = 0;
+    ddcci_status status = ddcci_check_reply(buf, len, &n);
+    if (status != DDCCI_OK)
+        return status;
+    if (n != 8 || buf[2] != DDCCI_OP_GET_VCP_REPLY)
+        return DDCCI_ERR_PROTOCOL;
+    if (buf[3] != 0x00)
+        return DDCCI_ERR_UNSUPPORTED;
+
+    out->code = buf[4];
+    out->type = buf[5];
+    out->max_value = (uint16_t)((buf[6] << 8) | buf[7]);
+    out->cur_value = (uint16_t)((buf[8] << 8) | buf[9]);
+    return DDCCI_OK;
+}
+
+/*
+ * Parse a Capabilities Reply (op 0xE3) or Table Read Reply (op 0xE4).
+ * On success data points into buf and data_len may be 0 at end of data.
+ */
+DDCCI_FN ddcci_status ddcci_parse_fragment_reply(const uint8_t *buf, size_t len, uint8_t op,
+                                                 uint16_t *offset, const uint8_t **data, size_t *data_len)
+{
+    size_t n = 0;
+    ddcci_status status = ddcci_check_reply(buf, len, &n);
+    if (status != DDCCI_OK)
+        return status;
+    if (n < 3 || buf[2] != op)
+        return DDCCI_ERR_PROTOCOL;
+
+    *offset = (uint16_t)((buf[3] << 8) | buf[4]);
+    *data = buf + 5;
+    *data_len = n - 3;
+    return DDCCI_OK;
+}
+
+#if DDCCI_HAS_CONSTEXPR
+namespace ddcci_selftest {
+    // Brightness request from the NVAPI i2c sample: 51 82 01 10 AC
+    constexpr uint8_t get_vcp_checksum()
+    {
+        uint8_t p[DDCCI_GET_VCP_LEN] = {};
+        ddcci_build_get_vcp(p, DDCCI_HOST_ADDR, 0x10);
+        return p[DDCCI_GET_VCP_LEN - 1];
+    }
+    static_assert(get_vcp_checksum() == 0xAC, "DDC/CI checksum");
+}
+#endif
+
+#endif // DDCCI_H
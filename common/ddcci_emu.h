@@ -0,0 +1,334 @@
+/*
+ * ddcci_emu.h - Virtual DDC/CI monitor
+ *
+ * Header-only software model of a monitor's DDC/CI endpoint, used by the
+ * "virtual" backend so the whole command path can run without a GPU or
+ * a monitor. It consumes the same packets the I2C backends put on the
+ * wire (starting at the source address byte, see ddcci.h) and produces
+ * the bytes a real monitor would return from 0x6F.
+ *
+ * Modelled behavior:
+ *   - a VCP table with continuous and non-continuous codes
+ *   - a capabilities string served in 32 byte fragments
+ *   - an EDID base block with a per-monitor serial number
+ *   - a reply latency: reading a reply earlier yields a null message
+ *   - a recovery time after each command during which the monitor NAKs
+ *   - random NAK and reply corruption injection
+ *   - dropped writes: a Set VCP acknowledged but never applied
+ *   - LG style input switching: 0xF4 written on register 0x50, which
+ *     cannot be read back but changes input source 0x60
+ *
+ * Time is passed in by the caller in milliseconds from any monotonic clock.
+ */
+
+#ifndef DDCCI_EMU_H
+#define DDCCI_EMU_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ddcci.h"
+#include "edid.h"
+
+#define DDCCI_EMU_MAX_DISPLAYS  8
+#define DDCCI_EMU_LG_REGISTER   0x50    // LG vendor sub-address
+#define DDCCI_EMU_LG_INPUT      0xF4    // LG input select on the vendor register
+
+// Defaults for a well-behaved monitor that still needs some pacing
+#define DDCCI_EMU_DEFAULT_LATENCY_MS    30
+#define DDCCI_EMU_DEFAULT_RECOVERY_MS   20
+
+typedef struct {
+    int displays;               // Number of virtual monitors
+    uint32_t latency_ms;        // Request to reply being ready
+    uint32_t recovery_ms;       // After a command, before the next is accepted
+    uint32_t nak_permille;      // Chance of a NAK on any transfer
+    uint32_t corrupt_permille;  // Chance of a bit flip in a reply
+    uint32_t drop_permille;     // Chance of a Set VCP being acknowledged but ignored
+    uint32_t seed;              // Injection RNG seed, 0 for a fixed default
+} ddcci_emu_config;
+
+typedef struct {
+    uint8_t supported;
+    uint8_t continuous;         // Clamp writes to max_value
+    uint16_t cur_value;
+    uint16_t max_value;
+} ddcci_emu_vcp;
+
+typedef struct {
+    ddcci_emu_config config;
+    ddcci_emu_vcp vcp[256];
+    uint8_t edid[EDID_BLOCK_LEN];
+    uint16_t lg_input;          // Last value written to LG 0xF4
+
+    uint8_t reply[DDCCI_FRAGMENT_REPLY_MAX_LEN];
+    size_t reply_len;           // 0 when no reply is pending
+    uint64_t reply_ready_ms;
+    uint64_t busy_until_ms;
+    uint32_t rng;
+} ddcci_emu;
+
+static const char ddcci_emu_caps[] =
+    "(prot(monitor)type(LCD)model(VIRTUAL)cmds(01 02 03 0C E3 F3)"
+    "vcp(10 12 14(05 08 0B) 16 18 1A 60(0F 11 12 1B) 62 D6(01 04 05))"
+    "mccs_ver(2.1))";
+
+static inline void ddcci_emu_config_init(ddcci_emu_config *config)
+{
+    config->displays = 2;
+    config->latency_ms = DDCCI_EMU_DEFAULT_LATENCY_MS;
+    config->recovery_ms = DDCCI_EMU_DEFAULT_RECOVERY_MS;
+    config->nak_permille = 0;
+    config->corrupt_permille = 0;
+    config->drop_permille = 0;
+    config->seed = 0;
+}
+
+/*
+ * Parse "key=value,key=value" over the defaults, e.g.
+ * "displays=1,latency=60,nak=50". Keys: displays, latency, recovery,
+ * nak, corrupt, drop (per mille), seed. Returns 0 on an unknown key.
+ */
+static inline int ddcci_emu_config_parse(ddcci_emu_config *config, const char *spec)
+{
+    while (spec && *spec) {
+        const char *eq = strchr(spec, '=');
+        const char *end = strchr(spec, ',');
+        if (!end)
+            end = spec + strlen(spec);
+        if (!eq || eq > end)
+            return 0;
+
+        size_t key_len = (size_t)(eq - spec);
+        unsigned long value = strtoul(eq + 1, NULL, 0);
+        if (key_len == 8 && strncmp(spec, "displays", 8) == 0)
+            config->displays = value < 1 ? 1 : value > DDCCI_EMU_MAX_DISPLAYS ? DDCCI_EMU_MAX_DISPLAYS : (int)value;
+        else if (key_len == 7 && strncmp(spec, "latency", 7) == 0)
+            config->latency_ms = (uint32_t)value;
+        else if (key_len == 8 && strncmp(spec, "recovery", 8) == 0)
+            config->recovery_ms = (uint32_t)value;
+        else if (key_len == 3 && strncmp(spec, "nak", 3) == 0)
+            config->nak_permille = (uint32_t)(value > 1000 ? 1000 : value);
+        else if (key_len == 7 && strncmp(spec, "corrupt", 7) == 0)
+            config->corrupt_permille = (uint32_t)(value > 1000 ? 1000 : value);
+        else if (key_len == 4 && strncmp(spec, "drop", 4) == 0)
+            config->drop_permille = (uint32_t)(value > 1000 ? 1000 : value);
+        else if (key_len == 4 && strncmp(spec, "seed", 4) == 0)
+            config->seed = (uint32_t)value;
+        else
+            return 0;
+
+        spec = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+static inline void ddcci_emu_set_vcp(ddcci_emu *emu, uint8_t code, int continuous,
+                                     uint16_t cur_value, uint16_t max_value)
+{
+    emu->vcp[code].supported = 1;
+    emu->vcp[code].continuous = (uint8_t)continuous;
+    emu->vcp[code].cur_value = cur_value;
+    emu->vcp[code].max_value = max_value;
+}
+
+/*
+ * Build the EDID base block: manufacturer "VRT", product 0x0001 and the
+ * given serial, so every virtual monitor has a distinct EDID hash.
+ */
+static inline void ddcci_emu_build_edid(uint8_t *edid, uint32_t serial)
+{
+    static const char name[] = "VIRTUAL DDC";
+    uint16_t vendor = (uint16_t)((('V' - '@') << 10) | (('R' - '@') << 5) | ('T' - '@'));
+    uint8_t sum = 0;
+
+    memset(edid, 0, EDID_BLOCK_LEN);
+    memset(edid + 1, 0xFF, 6);
+    edid[8] = (uint8_t)(vendor >> 8);
+    edid[9] = (uint8_t)(vendor & 0xFF);
+    edid[10] = 0x01;
+    edid[12] = (uint8_t)(serial & 0xFF);
+    edid[13] = (uint8_t)(serial >> 8);
+    edid[14] = (uint8_t)(serial >> 16);
+    edid[15] = (uint8_t)(serial >> 24);
+    edid[16] = 1;                   // Week
+    edid[17] = 2024 - 1990;         // Year
+    edid[18] = 1;                   // EDID 1.4
+    edid[19] = 4;
+    edid[20] = 0xA5;                // Digital, 8 bpc, DisplayPort
+
+    // Monitor name descriptor in the second slot
+    uint8_t *desc = edid + 72;
+    desc[3] = 0xFC;
+    memset(desc + 5, ' ', 13);
+    memcpy(desc + 5, name, sizeof(name) - 1);
+    desc[5 + sizeof(name) - 1] = 0x0A;
+
+    for (int i = 0; i < EDID_BLOCK_LEN - 1; ++i)
+        sum = (uint8_t)(sum + edid[i]);
+    edid[EDID_BLOCK_LEN - 1] = (uint8_t)(0x100 - sum);
+}
+
+/*
+ * Power on virtual monitor number index (0-based) with factory values.
+ */
+static inline void ddcci_emu_init(ddcci_emu *emu, const ddcci_emu_config *config, int index)
+{
+    memset(emu, 0, sizeof(*emu));
+    emu->config = *config;
+    emu->rng = (config->seed ? config->seed : 0x2545F491u) + (uint32_t)index * 0x9E3779B9u;
+    if (emu->rng == 0)
+        emu->rng = 1;
+
+    ddcci_emu_set_vcp(emu, 0x10, 1, 50, 100);       // Brightness
+    ddcci_emu_set_vcp(emu, 0x12, 1, 70, 100);       // Contrast
+    ddcci_emu_set_vcp(emu, 0x14, 0, 0x05, 0x0B);    // Color preset
+    ddcci_emu_set_vcp(emu, 0x16, 1, 100, 100);      // Red gain
+    ddcci_emu_set_vcp(emu, 0x18, 1, 100, 100);      // Green gain
+    ddcci_emu_set_vcp(emu, 0x1A, 1, 100, 100);      // Blue gain
+    ddcci_emu_set_vcp(emu, 0x60, 0, 0x0F, 0x1B);    // Input source: DisplayPort 1
+    ddcci_emu_set_vcp(emu, 0x62, 1, 30, 100);       // Volume
+    ddcci_emu_set_vcp(emu, 0xD6, 0, 0x01, 0x05);    // Power mode: on
+    emu->lg_input = 0xD0;
+
+    ddcci_emu_build_edid(emu->edid, 0x1000u + (uint32_t)index);
+}
+
+static inline uint32_t ddcci_emu_random(ddcci_emu *emu)
+{
+    emu->rng ^= emu->rng << 13;
+    emu->rng ^= emu->rng >> 17;
+    emu->rng ^= emu->rng << 5;
+    return emu->rng;
+}
+
+static inline int ddcci_emu_chance(ddcci_emu *emu, uint32_t permille)
+{
+    return permille && ddcci_emu_random(emu) % 1000 < permille;
+}
+
+/*
+ * Queue a reply: 0x6E, 0x80 | n, payload[0..n), checksum.
+ */
+static inline void ddcci_emu_queue_reply(ddcci_emu *emu, const uint8_t *payload, size_t n, uint64_t now_ms)
+{
+    emu->reply[0] = DDCCI_DEST_ADDR;
+    emu->reply[1] = (uint8_t)(0x80 | n);
+    if (n)
+        memcpy(emu->reply + 2, payload, n);
+    emu->reply[n + 2] = ddcci_checksum(DDCCI_REPLY_SEED, emu->reply, n + 2);
+    emu->reply_len = n + 3;
+    emu->reply_ready_ms = now_ms + emu->config.latency_ms;
+}
+
+/*
+ * LG input codes on 0xF4 and the MCCS 0x60 input they select.
+ */
+static inline uint16_t ddcci_emu_lg_to_vcp_input(uint16_t value)
+{
+    switch (value) {
+    case 0x90: return 0x11;     // HDMI 1
+    case 0x91: return 0x12;     // HDMI 2
+    case 0xD0: return 0x0F;     // DisplayPort
+    case 0xD1: return 0x1B;     // USB-C
+    }
+    return 0;
+}
+
+/*
+ * Host writes a packet to 0x6E. Returns DDCCI_ERR_NAK when the monitor
+ * does not acknowledge, DDCCI_OK otherwise; like a real monitor it
+ * silently ignores packets with a bad checksum or an unknown opcode.
+ */
+static inline ddcci_status ddcci_emu_write(ddcci_emu *emu, const uint8_t *buf, size_t len, uint64_t now_ms)
+{
+    if (now_ms < emu->busy_until_ms || ddcci_emu_chance(emu, emu->config.nak_permille))
+        return DDCCI_ERR_NAK;
+    emu->busy_until_ms = now_ms + emu->config.recovery_ms;
+
+    if (len < 3 || len != (size_t)(buf[1] & 0x7F) + 3 ||
+        ddcci_checksum(DDCCI_DEST_ADDR, buf, len - 1) != buf[len - 1])
+        return DDCCI_OK;
+
+    uint8_t src = buf[0];
+    uint8_t op = buf[2];
+
+    if (op == DDCCI_OP_SET_VCP && len == DDCCI_SET_VCP_LEN) {
+        uint8_t code = buf[3];
+        uint16_t value = (uint16_t)((buf[4] << 8) | buf[5]);
+
+        if (ddcci_emu_chance(emu, emu->config.drop_permille)) {
+            // Missed by the monitor, which does not say so
+        } else if (src == DDCCI_EMU_LG_REGISTER && code == DDCCI_EMU_LG_INPUT) {
+            uint16_t input = ddcci_emu_lg_to_vcp_input(value);
+            emu->lg_input = value;
+            if (input)
+                emu->vcp[0x60].cur_value = input;
+        } else if (src == DDCCI_HOST_ADDR && emu->vcp[code].supported) {
+            ddcci_emu_vcp *vcp = &emu->vcp[code];
+            vcp->cur_value = vcp->continuous && value > vcp->max_value ? vcp->max_value : value;
+        }
+        emu->reply_len = 0;
+    } else if (op == DDCCI_OP_GET_VCP && len == DDCCI_GET_VCP_LEN) {
+        uint8_t code = buf[3];
+
+        if (src != DDCCI_HOST_ADDR) {
+            // Vendor registers have no readback; the monitor stays silent
+            ddcci_emu_queue_reply(emu, NULL, 0, now_ms);
+        } else {
+            const ddcci_emu_vcp *vcp = &emu->vcp[code];
+            uint8_t payload[8] = {
+                DDCCI_OP_GET_VCP_REPLY, (uint8_t)(vcp->supported ? 0x00 : 0x01), code, 0x00,
+                (uint8_t)(vcp->max_value >> 8), (uint8_t)(vcp->max_value & 0xFF),
+                (uint8_t)(vcp->cur_value >> 8), (uint8_t)(vcp->cur_value & 0xFF)
+            };
+            ddcci_emu_queue_reply(emu, payload, sizeof(payload), now_ms);
+        }
+    } else if (op == DDCCI_OP_CAPS_REQUEST && len == DDCCI_CAPS_REQUEST_LEN) {
+        uint16_t offset = (uint16_t)((buf[3] << 8) | buf[4]);
+        size_t caps_len = sizeof(ddcci_emu_caps) - 1;
+        size_t n = offset < caps_len ? caps_len - offset : 0;
+        uint8_t payload[3 + DDCCI_MAX_FRAGMENT];
+
+        if (n > DDCCI_MAX_FRAGMENT)
+            n = DDCCI_MAX_FRAGMENT;
+        payload[0] = DDCCI_OP_CAPS_REPLY;
+        payload[1] = buf[3];
+        payload[2] = buf[4];
+        memcpy(payload + 3, ddcci_emu_caps + (offset < caps_len ? offset : caps_len), n);
+        ddcci_emu_queue_reply(emu, payload, 3 + n, now_ms);
+    } else {
+        // Save settings and anything unknown: accepted, no reply
+        emu->reply_len = 0;
+    }
+    return DDCCI_OK;
+}
+
+/*
+ * Host reads len bytes from 0x6F. A reply that is not ready yet, or no
+ * pending reply at all, reads as a null message. Returns DDCCI_ERR_NAK
+ * when the monitor does not acknowledge.
+ */
+static inline ddcci_status ddcci_emu_read(ddcci_emu *emu, uint8_t *buf, size_t len, uint64_t now_ms)
+{
+    if (ddcci_emu_chance(emu, emu->config.nak_permille))
+        return DDCCI_ERR_NAK;
+
+    memset(buf, 0, len);
+    if (emu->reply_len == 0 || now_ms < emu->reply_ready_ms) {
+        uint8_t null_msg[3] = { DDCCI_DEST_ADDR, 0x80, 0 };
+        null_msg[2] = ddcci_checksum(DDCCI_REPLY_SEED, null_msg, 2);
+        memcpy(buf, null_msg, len < 3 ? len : 3);
+        return DDCCI_OK;
+    }
+
+    memcpy(buf, emu->reply, len < emu->reply_len ? len : emu->reply_len);
+    if (len > 0 && ddcci_emu_chance(emu, emu->config.corrupt_permille)) {
+        size_t n = len < emu->reply_len ? len : emu->reply_len;
+        buf[ddcci_emu_random(emu) % n] ^= (uint8_t)(1u << (ddcci_emu_random(emu) % 8));
+    }
+    emu->reply_len = 0;
+    return DDCCI_OK;
+}
+
+#endif // DDCCI_EMU_H
@@ -0,0 +1,276 @@
+/*
+ * edid.h - EDID block helpers
+ *
+ * Header-only helpers shared by the Windows and Linux tools for
+ * identifying a monitor by the content of its EDID base block: content
+ * hash, parser for the vendor/product/serial/name fields, hex encoding
+ * for the on-disk EDID cache, a fixed-size hash index for looking
+ * displays up by serial number or model, and wildcard matching of the
+ * same keys for selecting a set of displays.
+ */
+
+#ifndef EDID_H
+#define EDID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define EDID_BLOCK_LEN      128
+#define EDID_HASH_INIT      0xcbf29ce484222325ULL   // FNV-1a 64-bit offset basis
+#define EDID_TEXT_LEN       14      // 13 characters of a display descriptor + NUL
+#define EDID_INDEX_SLOTS    256     // Power of two, well above the display limit
+
+// Identity fields of an EDID base block
+typedef struct {
+    char vendor[4];                 // PNP id, e.g. "GSM"
+    uint16_t product;               // Manufacturer's product code
+    uint32_t serial;                // Numeric serial, 0 if not set
+    char serial_text[EDID_TEXT_LEN];    // Serial number descriptor, may be empty
+    char name[EDID_TEXT_LEN];       // Monitor name descriptor, may be empty
+} edid_info;
+
+// Open-addressed map from a hashed lookup key to a display
+typedef struct {
+    uint64_t key[EDID_INDEX_SLOTS];     // 0 for an empty slot
+    int value[EDID_INDEX_SLOTS];
+} edid_index;
+
+/*
+ * Check the fixed 00 FF FF FF FF FF FF 00 header.
+ */
+static inline int edid_has_header(const uint8_t *edid)
+{
+    return edid[0] == 0x00 && edid[1] == 0xFF && edid[2] == 0xFF && edid[3] == 0xFF &&
+           edid[4] == 0xFF && edid[5] == 0xFF && edid[6] == 0xFF && edid[7] == 0x00;
+}
+
+/*
+ * Fold len bytes into a running FNV-1a 64-bit hash.
+ */
+static inline uint64_t edid_hash_update(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Content hash of an EDID base block, used as a stable monitor identity.
+ */
+static inline uint64_t edid_hash(const uint8_t *edid)
+{
+    return edid_hash_update(EDID_HASH_INIT, edid, EDID_BLOCK_LEN);
+}
+
+/*
+ * Manufacturer id, product code and serial number (bytes 8-15) packed
+ * into one value. Unlike the content hash it survives changes to the rest
+ * of the block, e.g. a firmware update or a different EDID override.
+ */
+static inline uint64_t edid_identity(const uint8_t *edid)
+{
+    uint64_t id = 0;
+    for (int i = 8; i < 16; ++i)
+        id = (id << 8) | edid[i];
+    return id;
+}
+
+/*
+ * Text of a display descriptor: up to 13 characters, ended by a newline
+ * and padded with spaces. Unprintable bytes become '?'.
+ */
+static inline void edid_descriptor_text(const uint8_t *desc, char *out)
+{
+    int len = 0;
+    for (int i = 5; i < 18 && desc[i] != 0x0A; ++i)
+        out[len++] = desc[i] >= 0x20 && desc[i] < 0x7F ? (char)desc[i] : '?';
+    while (len > 0 && out[len - 1] == ' ')
+        len--;
+    out[len] = '\0';
+}
+
+/*
+ * Parse the identity fields of a base block. Returns 0 without a valid
+ * header.
+ */
+static inline int edid_parse(const uint8_t *edid, edid_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    if (!edid_has_header(edid))
+        return 0;
+
+    // Three 5-bit letters, 1 = 'A'
+    uint16_t vendor = (uint16_t)((edid[8] << 8) | edid[9]);
+    info->vendor[0] = (char)('@' + ((vendor >> 10) & 0x1F));
+    info->vendor[1] = (char)('@' + ((vendor >> 5) & 0x1F));
+    info->vendor[2] = (char)('@' + (vendor & 0x1F));
+    info->product = (uint16_t)(edid[10] | (edid[11] << 8));
+    info->serial = (uint32_t)edid[12] | ((uint32_t)edid[13] << 8) |
+                   ((uint32_t)edid[14] << 16) | ((uint32_t)edid[15] << 24);
+
+    // Display descriptors: four 18 byte slots, tagged by byte 3
+    for (int slot = 54; slot < 126; slot += 18) {
+        const uint8_t *desc = edid + slot;
+        if (desc[0] != 0 || desc[1] != 0 || desc[2] != 0)
+            continue;
+        if (desc[3] == 0xFC)
+            edid_descriptor_text(desc, info->name);
+        else if (desc[3] == 0xFF)
+            edid_descriptor_text(desc, info->serial_text);
+    }
+    return 1;
+}
+
+/*
+ * Hex encoding of a block for the text cache files; out holds
+ * 2 * EDID_BLOCK_LEN + 1 characters.
+ */
+static inline void edid_to_hex(const uint8_t *edid, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < EDID_BLOCK_LEN; ++i) {
+        out[2 * i] = digits[edid[i] >> 4];
+        out[2 * i + 1] = digits[edid[i] & 0x0F];
+    }
+    out[2 * EDID_BLOCK_LEN] = '\0';
+}
+
+/*
+ * Decode edid_to_hex() output. Returns 0 if hex is short or malformed.
+ */
+static inline int edid_from_hex(const char *hex, uint8_t *edid)
+{
+    for (int i = 0; i < 2 * EDID_BLOCK_LEN; ++i) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (v < 0)
+            return 0;
+        edid[i / 2] = (uint8_t)(i % 2 ? (edid[i / 2] << 4) | v : v);
+    }
+    return 1;
+}
+
+/*
+ * Index key of a kind ("serial", "model") and text, ignoring case and
+ * spaces. Never 0, which marks an empty slot.
+ */
+static inline uint64_t edid_index_key(const char *kind, const char *text)
+{
+    uint64_t hash = edid_hash_update(EDID_HASH_INIT, kind, strlen(kind) + 1);
+    for (; *text; ++text) {
+        if (*text == ' ')
+            continue;
+        uint8_t c = (uint8_t)(*text >= 'A' && *text <= 'Z' ? *text - 'A' + 'a' : *text);
+        hash = edid_hash_update(hash, &c, 1);
+    }
+    return hash ? hash : 1;
+}
+
+static inline void edid_index_clear(edid_index *index)
+{
+    memset(index->key, 0, sizeof(index->key));
+}
+
+/*
+ * Map kind:text to value. The first value added for a key is kept, so
+ * a model shared by several monitors selects the lowest display.
+ */
+static inline void edid_index_add(edid_index *index, const char *kind, const char *text, int value)
+{
+    if (!text[0])
+        return;
+
+    uint64_t key = edid_index_key(kind, text);
+    for (unsigned i = 0; i < EDID_INDEX_SLOTS; ++i) {
+        unsigned slot = (unsigned)(key + i) & (EDID_INDEX_SLOTS - 1);
+        if (index->key[slot] == key)
+            return;
+        if (index->key[slot] == 0) {
+            index->key[slot] = key;
+            index->value[slot] = value;
+            return;
+        }
+    }
+}
+
+/*
+ * Look up kind:text. Returns the value, or -1.
+ */
+static inline int edid_index_find(const edid_index *index, const char *kind, const char *text)
+{
+    uint64_t key = edid_index_key(kind, text);
+    for (unsigned i = 0; i < EDID_INDEX_SLOTS; ++i) {
+        unsigned slot = (unsigned)(key + i) & (EDID_INDEX_SLOTS - 1);
+        if (index->key[slot] == key)
+            return index->value[slot];
+        if (index->key[slot] == 0)
+            return -1;
+    }
+    return -1;
+}
+
+/*
+ * Add the serial and model keys of one monitor: the serial descriptor
+ * and numeric serial, the name descriptor and the PNP model id
+ * (vendor + product code, e.g. "GSM5B7F").
+ */
+static inline void edid_index_add_info(edid_index *index, const edid_info *info, int value)
+{
+    char text[16];
+
+    edid_index_add(index, "serial", info->serial_text, value);
+    if (info->serial) {
+        snprintf(text, sizeof(text), "%lu", (unsigned long)info->serial);
+        edid_index_add(index, "serial", text, value);
+    }
+    edid_index_add(index, "model", info->name, value);
+    snprintf(text, sizeof(text), "%s%04X", info->vendor, info->product);
+    edid_index_add(index, "model", text, value);
+}
+
+/*
+ * Match text against a pattern with * and ? wildcards, ignoring case
+ * and spaces like the index keys.
+ */
+static inline int edid_match(const char *pattern, const char *text)
+{
+    while (*pattern == ' ')
+        pattern++;
+    while (*text == ' ')
+        text++;
+
+    if (*pattern == '*')
+        return edid_match(pattern + 1, text) || (*text && edid_match(pattern, text + 1));
+    if (!*pattern || !*text)
+        return !*pattern && !*text;
+
+    char p = *pattern >= 'A' && *pattern <= 'Z' ? *pattern - 'A' + 'a' : *pattern;
+    char t = *text >= 'A' && *text <= 'Z' ? *text - 'A' + 'a' : *text;
+    return (p == '?' || p == t) && edid_match(pattern + 1, text + 1);
+}
+
+/*
+ * Match the serial or model keys of one monitor, as added by
+ * edid_index_add_info(), against a wildcard pattern.
+ */
+static inline int edid_info_matches(const edid_info *info, const char *kind, const char *pattern)
+{
+    char text[16];
+
+    if (strcmp(kind, "serial") == 0) {
+        snprintf(text, sizeof(text), "%lu", (unsigned long)info->serial);
+        return (info->serial_text[0] && edid_match(pattern, info->serial_text)) ||
+               (info->serial && edid_match(pattern, text));
+    }
+    snprintf(text, sizeof(text), "%s%04X", info->vendor, info->product);
+    return (info->name[0] && edid_match(pattern, info->name)) || edid_match(pattern, text);
+}
+
+#endif // EDID_H
@@ -0,0 +1,67 @@
+/*
+ * fade.h - Timed ramps of continuous VCP codes
+ *
+ * Header-only schedule for --fade: a linear ramp of a continuous control
+ * such as brightness from its current value to a target over a fixed
+ * duration. The caller writes whatever value the ramp has reached each
+ * time the monitor is ready for the next transaction, so a monitor that
+ * needs long delays gets fewer, larger steps and the fade still ends on
+ * time, while a fast one gets every step. Clocks and writes are left to
+ * the caller.
+ */
+
+#ifndef FADE_H
+#define FADE_H
+
+#include <stdint.h>
+
+#define FADE_MAX_MS     60000   // Longest fade accepted
+
+typedef struct {
+    uint16_t from;
+    uint16_t to;
+    uint32_t duration_ms;
+} fade_ramp;
+
+/*
+ * Check for a code whose value is a level rather than a choice, so the
+ * values between two settings are meaningful: luminance, contrast and
+ * the video gains.
+ */
+static inline int fade_code_is_continuous(uint8_t code)
+{
+    return code == 0x10 || code == 0x12 || code == 0x16 || code == 0x18 || code == 0x1A;
+}
+
+static inline uint32_t fade_distance(uint16_t a, uint16_t b)
+{
+    return a > b ? (uint32_t)(a - b) : (uint32_t)(b - a);
+}
+
+/*
+ * Value the ramp has reached elapsed_ms after it started.
+ */
+static inline uint16_t fade_value_at(const fade_ramp *ramp, uint64_t elapsed_ms)
+{
+    if (elapsed_ms >= ramp->duration_ms)
+        return ramp->to;
+
+    uint32_t moved = (uint32_t)(fade_distance(ramp->from, ramp->to) * elapsed_ms / ramp->duration_ms);
+    return (uint16_t)(ramp->to > ramp->from ? ramp->from + moved : ramp->from - moved);
+}
+
+/*
+ * Time since the start at which the ramp first moves past value, i.e.
+ * when the next write has something new to send.
+ */
+static inline uint64_t fade_next_ms(const fade_ramp *ramp, uint16_t value)
+{
+    uint32_t steps = fade_distance(ramp->from, ramp->to);
+    uint32_t done = fade_distance(ramp->from, value);
+
+    if (steps == 0 || done >= steps)
+        return ramp->duration_ms;
+    return ((uint64_t)(done + 1) * ramp->duration_ms + steps - 1) / steps;
+}
+
+#endif // FADE_H
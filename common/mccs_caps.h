@@ -0,0 +1,307 @@
+/*
+ * mccs_caps.h - MCCS capabilities string
+ *
+ * Header-only reassembly and parsing of the capabilities string a monitor
+ * returns over DDC/CI in fragments of up to 32 bytes, e.g.
+ *
+ *     (prot(monitor)type(LCD)model(U2415)cmds(01 02 03 07 0C E3 F3)
+ *      vcp(10 12 14(05 08 0B) 60(0F 11 12) D6(01 04 05))
+ *      vcpname(F4(Input Select))mccs_ver(2.1))
+ *
+ * The parsed form is a compact table: a bitmap of the VCP codes listed in
+ * vcp(), the values listed for non-continuous codes and the names given
+ * in vcpname(), so a code can be checked before it is written.
+ */
+
+#ifndef MCCS_CAPS_H
+#define MCCS_CAPS_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "ddcci.h"
+
+#define MCCS_CAPS_MAX_LEN       2048    // Longest string accepted, NUL excluded
+#define MCCS_CAPS_VALUE_POOL    512     // Listed values of all codes together
+#define MCCS_CAPS_NAME_POOL     512     // vcpname() names, NUL separated
+
+typedef struct {
+    uint8_t supported[32];              // Bitmap of the codes in vcp()
+    uint8_t value_count[256];           // Values listed for a code, 0 if none
+    uint16_t value_start[256];          // Into values[]
+    uint16_t name_start[256];           // Into names[], 0 if unnamed
+    uint16_t value_used;
+    uint16_t name_used;
+    uint8_t values[MCCS_CAPS_VALUE_POOL];
+    char names[MCCS_CAPS_NAME_POOL];    // names[0] is the empty name
+    char model[32];                     // From model(), may be empty
+} mccs_caps;
+
+/*
+ * Check a Capabilities Reply read from 0x6F for the fragment at offset and
+ * copy its data out. data must hold DDCCI_MAX_FRAGMENT bytes; *data_len
+ * is 0 at the end of the string. A reply for another offset is a
+ * protocol error, so a stale reply is retried rather than spliced in.
+ */
+static inline ddcci_status mccs_caps_parse_fragment(const uint8_t *buf, size_t len, uint16_t offset,
+                                                    uint8_t *data, size_t *data_len)
+{
+    uint16_t reply_offset = 0;
+    const uint8_t *payload = NULL;
+    size_t n = 0;
+
+    ddcci_status status = ddcci_parse_fragment_reply(buf, len, DDCCI_OP_CAPS_REPLY,
+                                                     &reply_offset, &payload, &n);
+    if (status != DDCCI_OK)
+        return status;
+    if (reply_offset != offset || n > DDCCI_MAX_FRAGMENT)
+        return DDCCI_ERR_PROTOCOL;
+
+    memcpy(data, payload, n);
+    *data_len = n;
+    return DDCCI_OK;
+}
+
+/*
+ * Append fragment data to the string in caps[0..*len), which must hold
+ * MCCS_CAPS_MAX_LEN + 1 bytes. NUL padding is dropped and other control
+ * bytes become spaces, so the string stays one line.
+ * Returns 0 if the string would grow past MCCS_CAPS_MAX_LEN.
+ */
+static inline int mccs_caps_append(char *caps, size_t *len, const uint8_t *data, size_t data_len)
+{
+    for (size_t i = 0; i < data_len; i++) {
+        if (data[i] == 0)
+            continue;
+        if (*len == MCCS_CAPS_MAX_LEN)
+            return 0;
+        caps[(*len)++] = data[i] < 0x20 ? ' ' : (char)data[i];
+    }
+    caps[*len] = '\0';
+    return 1;
+}
+
+static inline int mccs_caps_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * Read a code or value of one or two hex digits at *p. Codes may be run
+ * together without spaces ("vcp(021012)"), so at most two digits are taken.
+ * Returns -1 if *p is not a hex digit.
+ */
+static inline int mccs_caps_byte(const char **p, const char *end)
+{
+    int hi = *p < end ? mccs_caps_hex(**p) : -1;
+    if (hi < 0)
+        return -1;
+    (*p)++;
+
+    int lo = *p < end ? mccs_caps_hex(**p) : -1;
+    if (lo < 0)
+        return hi;
+    (*p)++;
+    return hi * 16 + lo;
+}
+
+/*
+ * Skip past the ')' matching the '(' just before p, or to end when the
+ * string was cut short.
+ */
+static inline const char *mccs_caps_close(const char *p, const char *end)
+{
+    for (int depth = 1; p < end; p++) {
+        if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p + 1;
+    }
+    return end;
+}
+
+/*
+ * Find the top level group "name(...)" and return its body, without the
+ * parentheses, in [*body, *body_end). The string may or may not be
+ * wrapped in an outer pair of parentheses. Returns 0 if there is none.
+ */
+static inline int mccs_caps_group(const char *caps, const char *name,
+                                  const char **body, const char **body_end)
+{
+    size_t name_len = strlen(name);
+    const char *end = caps + strlen(caps);
+    const char *p = caps;
+    int depth = 0;
+
+    while (p < end && *p == ' ')
+        p++;
+    int top = p < end && *p == '(';
+
+    for (; p < end; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            depth--;
+        } else if (depth == top && (p == caps || !isalnum((unsigned char)p[-1])) &&
+                   (size_t)(end - p) > name_len && strncmp(p, name, name_len) == 0) {
+            const char *open = p + name_len;
+            while (open < end && *open == ' ')
+                open++;
+            if (open < end && *open == '(') {
+                *body = open + 1;
+                *body_end = mccs_caps_close(open + 1, end);
+                if (*body_end > *body && (*body_end)[-1] == ')')
+                    (*body_end)--;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * vcp(10 12 14(05 08 0B) 60(0F 11 12) ...): codes, each optionally
+ * followed by its list of allowed values. Nested lists inside a value
+ * list (MCCS 3 sub-values) are skipped.
+ */
+static inline void mccs_caps_parse_vcp(mccs_caps *caps, const char *p, const char *end)
+{
+    while (p < end) {
+        int code = mccs_caps_byte(&p, end);
+        if (code < 0) {
+            p = *p == '(' ? mccs_caps_close(p + 1, end) : p + 1;
+            continue;
+        }
+        caps->supported[code >> 3] |= (uint8_t)(1u << (code & 7));
+
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end || *p != '(')
+            continue;
+
+        caps->value_start[code] = caps->value_used;
+        caps->value_count[code] = 0;
+        for (p++; p < end && *p != ')'; ) {
+            int value = mccs_caps_byte(&p, end);
+            if (value >= 0) {
+                if (caps->value_used < MCCS_CAPS_VALUE_POOL && caps->value_count[code] < 255) {
+                    caps->values[caps->value_used++] = (uint8_t)value;
+                    caps->value_count[code]++;
+                }
+            } else {
+                p = *p == '(' ? mccs_caps_close(p + 1, end) : p + 1;
+            }
+        }
+        if (p < end)
+            p++;
+    }
+}
+
+/*
+ * vcpname(F4(Input Select) F5(...)): names of vendor codes.
+ */
+static inline void mccs_caps_parse_vcpname(mccs_caps *caps, const char *p, const char *end)
+{
+    while (p < end) {
+        int code = mccs_caps_byte(&p, end);
+        if (code < 0) {
+            p = *p == '(' ? mccs_caps_close(p + 1, end) : p + 1;
+            continue;
+        }
+
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end || *p != '(')
+            continue;
+
+        const char *name = ++p;
+        while (p < end && *p != '(' && *p != ')')
+            p++;
+        const char *name_end = p;
+        while (name < name_end && *name == ' ')
+            name++;
+        while (name_end > name && name_end[-1] == ' ')
+            name_end--;
+
+        size_t n = (size_t)(name_end - name);
+        if (n > 0 && caps->name_used + n + 1 <= MCCS_CAPS_NAME_POOL) {
+            caps->name_start[code] = caps->name_used;
+            memcpy(caps->names + caps->name_used, name, n);
+            caps->names[caps->name_used + n] = '\0';
+            caps->name_used = (uint16_t)(caps->name_used + n + 1);
+        }
+        p = mccs_caps_close(p, end);
+    }
+}
+
+/*
+ * Parse a reassembled capabilities string. Returns 1 if it had a vcp()
+ * group; without one nothing can be validated against it.
+ */
+static inline int mccs_caps_parse(const char *text, mccs_caps *caps)
+{
+    const char *body, *body_end;
+
+    memset(caps, 0, sizeof(*caps));
+    caps->name_used = 1;
+
+    if (mccs_caps_group(text, "model", &body, &body_end)) {
+        size_t n = (size_t)(body_end - body);
+        if (n >= sizeof(caps->model))
+            n = sizeof(caps->model) - 1;
+        memcpy(caps->model, body, n);
+        caps->model[n] = '\0';
+    }
+    if (mccs_caps_group(text, "vcpname", &body, &body_end))
+        mccs_caps_parse_vcpname(caps, body, body_end);
+    if (!mccs_caps_group(text, "vcp", &body, &body_end))
+        return 0;
+    mccs_caps_parse_vcp(caps, body, body_end);
+    return 1;
+}
+
+static inline int mccs_caps_supports(const mccs_caps *caps, uint8_t code)
+{
+    return (caps->supported[code >> 3] >> (code & 7)) & 1;
+}
+
+/*
+ * Name of a code from vcpname(), or NULL.
+ */
+static inline const char *mccs_caps_name(const mccs_caps *caps, uint8_t code)
+{
+    return caps->name_start[code] ? caps->names + caps->name_start[code] : NULL;
+}
+
+/*
+ * Print the table: one line per supported code with its name and values.
+ */
+static inline void mccs_caps_print(FILE *out, const mccs_caps *caps)
+{
+    fprintf(out, "Model: %s\n", caps->model[0] ? caps->model : "unknown");
+    fprintf(out, "VCP codes:\n");
+    for (int code = 0; code < 256; code++) {
+        if (!mccs_caps_supports(caps, (uint8_t)code))
+            continue;
+
+        const char *name = mccs_caps_name(caps, (uint8_t)code);
+        fprintf(out, "  0x%02X", code);
+        if (name)
+            fprintf(out, " %s", name);
+        if (caps->value_count[code]) {
+            fprintf(out, "  values:");
+            for (int i = 0; i < caps->value_count[code]; i++)
+                fprintf(out, " %02X", caps->values[caps->value_start[code] + i]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+#endif // MCCS_CAPS_H
@@ -0,0 +1,228 @@
+/*
+ * mccs_timing.h - Adaptive DDC/CI timing model
+ *
+ * Header-only model of how long one monitor needs between DDC/CI
+ * transactions and before a reply can be read. Each delay starts at the
+ * MCCS minimum and adapts to observed outcomes: a run of clean
+ * transactions shortens it, while two NAKs or corrupt replies in a row
+ * double it and raise a floor it does not shrink below, so the model
+ * settles on the smallest delay that has proven safe for that monitor.
+ * A lone failure is taken for bus noise and retried at the same delay;
+ * a monitor that is really too slow fails the retry too. At a delay that
+ * has already completed a clean run it takes three. A floor is not
+ * forever either: a long clean run halves it and it expires after
+ * MCCS_TIMING_FLOOR_TTL seconds, so a burst of noise or a monitor busy
+ * switching inputs does not slow every later run. Only failures that
+ * look like a monitor that was not ready count at all.
+ *
+ * The write delay is learned from whether the next transaction is
+ * acknowledged, but a monitor can acknowledge a Set VCP and still drop
+ * it. So it stays at or above the MCCS minimum until a read-back has
+ * confirmed that the monitor takes writes at shorter delays.
+ *
+ * Also holds the retry backoff schedule for transient failures.
+ * Clocks, sleeping and persistence are left to the caller.
+ */
+
+#ifndef MCCS_TIMING_H
+#define MCCS_TIMING_H
+
+#include <stdint.h>
+#include "ddcci.h"
+
+#define MCCS_TIMING_MIN_MS      5       // Lower bound for any learned delay
+#define MCCS_TIMING_MAX_MS      1000    // Worst case used by the NVAPI i2c sample
+#define MCCS_TIMING_STREAK      8       // Clean transactions before a delay is shortened
+#define MCCS_TIMING_FLOOR_STREAK 32     // Clean transactions before a floor is halved
+#define MCCS_TIMING_FLOOR_TTL   3600    // Seconds a raised floor is kept across runs
+
+#define MCCS_RETRY_ATTEMPTS     4       // Tries per transaction, first one included
+#define MCCS_RETRY_BASE_MS      20      // Backoff before the first retry
+#define MCCS_RETRY_MAX_MS       800     // Backoff cap
+
+typedef struct {
+    uint16_t ms;                // Current delay
+    uint16_t floor_ms;          // Shortest delay not known to fail
+    uint16_t min_ms;            // Shortest delay allowed at all
+    uint16_t proven_ms;         // Delay of the last clean streak, 0 if none since a raise
+    uint8_t streak;             // Clean transactions since the last change
+    uint8_t clean;              // Clean transactions since the floor last moved
+    uint8_t misses;             // Failures in a row, 1 again after a raise
+    uint64_t floor_time;        // Wall clock seconds the floor was last raised, 0 if unknown
+} mccs_delay;
+
+typedef struct {
+    mccs_delay write;           // From the end of one transaction to the next
+    mccs_delay reply;           // From a request to reading its reply
+} mccs_timing;
+
+static inline void mccs_delay_init(mccs_delay *d, uint16_t ms, uint16_t min_ms)
+{
+    d->ms = ms;
+    d->floor_ms = min_ms;
+    d->min_ms = min_ms;
+    d->streak = 0;
+    d->clean = 0;
+    d->misses = 0;
+    d->proven_ms = 0;
+    d->floor_time = 0;
+}
+
+static inline void mccs_timing_init(mccs_timing *t)
+{
+    mccs_delay_init(&t->write, DDCCI_SET_VCP_DELAY_MS, DDCCI_SET_VCP_DELAY_MS);
+    mccs_delay_init(&t->reply, DDCCI_REPLY_DELAY_MS, MCCS_TIMING_MIN_MS);
+}
+
+/*
+ * Classify a transaction outcome as evidence about a delay: 1 for a
+ * clean transaction (a clean "unsupported" reply included), 0 for a
+ * failure that looks like the monitor was not ready (NAK, null message,
+ * garbled reply), -1 for anything that says nothing about timing.
+ */
+static inline int mccs_timing_outcome(ddcci_status status)
+{
+    switch (status) {
+    case DDCCI_OK:
+    case DDCCI_ERR_UNSUPPORTED:
+        return 1;
+    case DDCCI_ERR_NAK:
+    case DDCCI_ERR_NULL_MSG:
+    case DDCCI_ERR_CHECKSUM:
+    case DDCCI_ERR_PROTOCOL:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Check for a write after which the monitor may stop answering for a
+ * while, so the failures that follow are not a timing problem: input
+ * source and power mode.
+ */
+static inline int mccs_code_drops_link(uint8_t register_address, uint8_t code)
+{
+    return register_address == DDCCI_HOST_ADDR && (code == 0x60 || code == 0xD6);
+}
+
+/*
+ * Fold one outcome into a delay. The second failure in a row, or the
+ * third at a proven delay, doubles it and puts the floor above the delay
+ * that failed; a streak of clean
+ * transactions takes a quarter off and a long one halves the floor.
+ * now_s is the wall clock in seconds. Returns 1 if the delay or floor
+ * changed.
+ */
+static inline int mccs_delay_adapt(mccs_delay *d, int ok, uint64_t now_s)
+{
+    if (!ok) {
+        d->misses++;
+        if (d->misses < (d->proven_ms && d->ms >= d->proven_ms ? 3 : 2))
+            return 0;
+
+        uint32_t floor_ms = d->ms + d->ms / 4 + 1;
+        uint32_t ms = (uint32_t)d->ms * 2;
+
+        d->misses = 1;
+        d->proven_ms = 0;
+        d->streak = 0;
+        d->clean = 0;
+        d->floor_ms = (uint16_t)(floor_ms > MCCS_TIMING_MAX_MS ? MCCS_TIMING_MAX_MS : floor_ms);
+        d->floor_time = now_s;
+        d->ms = (uint16_t)(ms > MCCS_TIMING_MAX_MS ? MCCS_TIMING_MAX_MS : ms);
+        return 1;
+    }
+
+    int changed = 0;
+    if (d->clean < MCCS_TIMING_FLOOR_STREAK)
+        d->clean++;
+    if (d->clean == MCCS_TIMING_FLOOR_STREAK && d->floor_ms > d->min_ms) {
+        uint16_t floor_ms = (uint16_t)(d->floor_ms / 2);
+        d->floor_ms = floor_ms < d->min_ms ? d->min_ms : floor_ms;
+        d->clean = 0;
+        changed = 1;
+    }
+
+    if (d->streak < MCCS_TIMING_STREAK)
+        d->streak++;
+    if (d->streak < MCCS_TIMING_STREAK)
+        return changed;
+
+    d->proven_ms = d->ms;
+    d->misses = 0;
+    if (d->ms <= d->floor_ms)
+        return changed;
+
+    uint16_t ms = (uint16_t)(d->ms - d->ms / 4);
+    d->streak = 0;
+    d->ms = ms < d->floor_ms ? d->floor_ms : ms;
+    return 1;
+}
+
+/*
+ * Drop a floor raised more than MCCS_TIMING_FLOOR_TTL seconds ago, or at
+ * an unknown time, and bring the delay back to initial_ms if it is
+ * longer; a monitor that really needs more fails once and relearns it.
+ * Also keeps a loaded delay within its bounds.
+ */
+static inline void mccs_delay_expire(mccs_delay *d, uint16_t initial_ms, uint64_t now_s)
+{
+    if (d->floor_ms > d->min_ms &&
+        (d->floor_time == 0 || now_s < d->floor_time || now_s - d->floor_time >= MCCS_TIMING_FLOOR_TTL)) {
+        d->floor_ms = d->min_ms;
+        d->floor_time = 0;
+        if (d->ms > initial_ms)
+            d->ms = initial_ms;
+    }
+    if (d->floor_ms < d->min_ms)
+        d->floor_ms = d->min_ms;
+    if (d->ms < d->floor_ms)
+        d->ms = d->floor_ms;
+}
+
+static inline void mccs_timing_expire(mccs_timing *t, uint64_t now_s)
+{
+    mccs_delay_expire(&t->write, DDCCI_SET_VCP_DELAY_MS, now_s);
+    mccs_delay_expire(&t->reply, DDCCI_REPLY_DELAY_MS, now_s);
+}
+
+/*
+ * Fold the result of reading back a written value. A match shows the
+ * monitor takes writes at the current delay, so the write delay may
+ * shrink below the MCCS minimum from now on; a mismatch means a write
+ * was acknowledged and dropped, which counts as a failure and puts the
+ * minimum back. Returns 1 if anything changed.
+ */
+static inline int mccs_timing_confirm(mccs_timing *t, int ok, uint64_t now_s)
+{
+    if (ok) {
+        if (t->write.min_ms == MCCS_TIMING_MIN_MS)
+            return 0;
+        t->write.min_ms = MCCS_TIMING_MIN_MS;
+        return 1;
+    }
+
+    t->write.min_ms = DDCCI_SET_VCP_DELAY_MS;
+    mccs_delay_adapt(&t->write, 0, now_s);
+    mccs_delay_expire(&t->write, DDCCI_SET_VCP_DELAY_MS, now_s);
+    return 1;
+}
+
+/*
+ * Backoff before retry number retry (0 = first retry): doubles from
+ * MCCS_RETRY_BASE_MS up to MCCS_RETRY_MAX_MS, with the upper half
+ * replaced by jitter from random so monitors sharing a bus or daemon
+ * clients retrying together do not stay in lockstep.
+ */
+static inline uint32_t mccs_backoff_ms(unsigned retry, uint32_t random)
+{
+    uint32_t ms = MCCS_RETRY_BASE_MS;
+    while (retry-- > 0 && ms < MCCS_RETRY_MAX_MS)
+        ms *= 2;
+    if (ms > MCCS_RETRY_MAX_MS)
+        ms = MCCS_RETRY_MAX_MS;
+    return ms / 2 + random % (ms / 2 + 1);
+}
+
+#endif // MCCS_TIMING_H
@@ -0,0 +1,75 @@
+/*
+ * mccs_verify.h - Read-back policy for written VCP values
+ *
+ * Header-only policy for --verify: which codes can be read back after a
+ * Set VCP Feature, and whether the value read back confirms the write.
+ * Codes that drop the DDC/CI link when they take effect (input source,
+ * power mode), one-shot commands such as factory resets, and vendor
+ * registers that have no Get VCP Feature are written without a check.
+ * The one-shot commands are also kept out of the --if-changed shadow.
+ * Reading, pacing and rewriting are left to the caller.
+ */
+
+#ifndef MCCS_VERIFY_H
+#define MCCS_VERIFY_H
+
+#include <stdint.h>
+#include "ddcci.h"
+
+#define MCCS_VERIFY_ATTEMPTS    3       // Writes per verified command, first one included
+
+/*
+ * Check for a one-shot command: a write that starts an action instead of
+ * setting a value, so there is nothing to read back and writing it again
+ * is not a no-op.
+ */
+static inline int mccs_code_is_action(uint8_t register_address, uint8_t code)
+{
+    if (register_address != DDCCI_HOST_ADDR)
+        return 0;
+
+    switch (code) {
+    case 0x01:      // Degauss
+    case 0x04:      // Restore factory defaults
+    case 0x05:      // Restore factory luminance / contrast
+    case 0x06:      // Restore factory geometry
+    case 0x08:      // Restore factory color
+    case 0x0A:      // Restore factory TV defaults
+    case 0xB0:      // Settings save / restore
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Check whether a write of code on register_address can be confirmed by
+ * reading it back.
+ */
+static inline int mccs_verify_applies(uint8_t register_address, uint8_t code)
+{
+    if (register_address != DDCCI_HOST_ADDR || mccs_code_is_action(register_address, code))
+        return 0;
+
+    switch (code) {
+    case 0x60:      // Input source: the monitor often leaves DDC/CI behind
+    case 0xD6:      // Power mode: standby stops answering
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Check a reply read after writing value. A level past the maximum is
+ * clamped by the monitor, so reading the maximum back counts as a match;
+ * writing it again would not change anything.
+ */
+static inline int mccs_verify_matches(uint16_t value, const ddcci_vcp_reply *reply)
+{
+    if (reply->cur_value == value)
+        return 1;
+    return reply->max_value && value > reply->max_value && reply->cur_value == reply->max_value;
+}
+
+#endif // MCCS_VERIFY_H
@@ -0,0 +1,169 @@
+/*
+ * trace.h - Hot path trace probes
+ *
+ * Header-only probes for finding where the time of a command goes
+ * (backend init, enumeration, packet build, bus transfers, delays).
+ * Compiled in only with -DDDC_TRACE; otherwise every macro expands to
+ * nothing and costs nothing.
+ *
+ * Each probe records one complete event into a fixed ring buffer of the
+ * most recent TRACE_RING_SIZE events, without locks or allocation.
+ * TRACE_INIT() arms the export: if $WRITEVALUETODISPLAY_TRACE names a
+ * file, the ring is written there as Chrome trace event JSON (load it in
+ * chrome://tracing or https://ui.perfetto.dev) at exit and on
+ * TRACE_FLUSH().
+ *
+ *     TRACE_BEGIN(t);
+ *     ok = i2c_write(...);
+ *     TRACE_END(t, "i2c_write");
+ *
+ * Names must be string literals. On Windows include windows.h first.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef DDC_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#define TRACE_ENV       "WRITEVALUETODISPLAY_TRACE"
+#define TRACE_RING_SIZE 4096    // Power of two
+
+#ifdef __cplusplus
+#define TRACE_THREAD_LOCAL thread_local
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+    const char *name;           // NULL for a slot not written yet
+    uint64_t start_us;
+    uint32_t dur_us;
+    uint32_t tid;
+} trace_event;
+
+static trace_event g_trace_ring[TRACE_RING_SIZE];
+static volatile uint32_t g_trace_next;
+static const char *g_trace_path;
+
+static inline uint64_t trace_now_us(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart * 1000000 +
+                      now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+static inline uint32_t trace_claim_slot(void)
+{
+#ifdef _WIN32
+    return (uint32_t)InterlockedIncrement((volatile LONG *)&g_trace_next) - 1;
+#else
+    return __atomic_fetch_add(&g_trace_next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+// Small per-thread id, so the trace viewer shows one lane per worker
+static inline uint32_t trace_tid(void)
+{
+    static volatile uint32_t next_tid;
+    static TRACE_THREAD_LOCAL uint32_t tid;
+    if (tid == 0) {
+#ifdef _WIN32
+        tid = (uint32_t)InterlockedIncrement((volatile LONG *)&next_tid);
+#else
+        tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+#endif
+    }
+    return tid;
+}
+
+static inline void trace_record(const char *name, uint64_t start_us, uint64_t end_us)
+{
+    trace_event *event = &g_trace_ring[trace_claim_slot() & (TRACE_RING_SIZE - 1)];
+    event->start_us = start_us;
+    event->dur_us = (uint32_t)(end_us - start_us);
+    event->tid = trace_tid();
+    event->name = name;
+}
+
+/*
+ * Write the ring, oldest event first, as Chrome trace event JSON.
+ */
+static inline void trace_flush(void)
+{
+    if (!g_trace_path)
+        return;
+
+    FILE *fp = NULL;
+#ifdef _WIN32
+    if (fopen_s(&fp, g_trace_path, "w") != 0)
+        return;
+#else
+    fp = fopen(g_trace_path, "w");
+    if (!fp)
+        return;
+#endif
+
+    uint32_t next = g_trace_next;
+    uint32_t first = next > TRACE_RING_SIZE ? next - TRACE_RING_SIZE : 0;
+    int written = 0;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (uint32_t i = first; i < next; i++) {
+        const trace_event *event = &g_trace_ring[i & (TRACE_RING_SIZE - 1)];
+        if (!event->name)
+            continue;
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%u}",
+                written++ ? "," : "", event->name, event->tid,
+                (unsigned long long)event->start_us, event->dur_us);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+static inline void trace_init(void)
+{
+#ifdef _WIN32
+    static char path[MAX_PATH];
+    DWORD len = GetEnvironmentVariableA(TRACE_ENV, path, sizeof(path));
+    g_trace_path = len > 0 && len < sizeof(path) ? path : NULL;
+#else
+    g_trace_path = getenv(TRACE_ENV);
+    if (g_trace_path && !g_trace_path[0])
+        g_trace_path = NULL;
+#endif
+    if (g_trace_path)
+        atexit(trace_flush);
+}
+
+#define TRACE_INIT()            trace_init()
+#define TRACE_FLUSH()           trace_flush()
+#define TRACE_BEGIN(var)        uint64_t var = trace_now_us()
+#define TRACE_END(var, name)    trace_record(name, var, trace_now_us())
+
+#else
+
+#define TRACE_INIT()            ((void)0)
+#define TRACE_FLUSH()           ((void)0)
+#define TRACE_BEGIN(var)        ((void)0)
+#define TRACE_END(var, name)    ((void)0)
+
+#endif // DDC_TRACE
+
+#endif // TRACE_H
@@ -0,0 +1,148 @@
+#!/bin/sh
+# check.sh - Run the CLI against emulated monitors (--backend=virtual)
+#
+# Usage: sh check.sh [path/to/writeValueToDisplay], or make check
+#
+# Runs named alike share a cache directory, so the shadow and timing files
+# carry over between them; a new name starts empty. Monitor state lasts
+# for one process, so round trips are checked within a batch.
+
+BIN=${1:-./writeValueToDisplay}
+ROOT=$(mktemp -d) || exit 1
+trap 'rm -rf "$ROOT"' EXIT INT TERM
+
+passed=0
+failed=0
+out="$ROOT/out"
+
+# run NAME VIRTUAL_SPEC ARGS... - run with the cache of NAME, output in $out
+run() {
+    name=$1
+    spec=$2
+    shift 2
+    mkdir -p "$ROOT/$name"
+    XDG_CACHE_HOME="$ROOT/$name" WRITEVALUETODISPLAY_VIRTUAL=$spec \
+        "$BIN" --backend=virtual "$@" > "$out" 2>&1
+    status=$?
+}
+
+pass() {
+    passed=$((passed + 1))
+    echo "PASS  $1"
+}
+
+fail() {
+    failed=$((failed + 1))
+    echo "FAIL  $1"
+    sed 's/^/      /' "$out"
+}
+
+# expect DESCRIPTION STATUS [PATTERN [!]] - exit status and output
+expect() {
+    if [ "$status" -ne "$2" ]; then
+        fail "$1 (exit $status, expected $2)"
+    elif [ -n "$3" ] && [ "$4" = "!" ] && grep -q -- "$3" "$out"; then
+        fail "$1 (unexpected \"$3\")"
+    elif [ -n "$3" ] && [ "$4" != "!" ] && ! grep -q -- "$3" "$out"; then
+        fail "$1 (missing \"$3\")"
+    else
+        pass "$1"
+    fi
+}
+
+# Learned reply delay of the first monitor in a timing cache
+reply_delay() {
+    awk 'NR == 1 { print $4 }' "$ROOT/$1/writeValueToDisplay/timing" 2>/dev/null
+}
+
+# ------------------------------------------------------------
+# Codec round trips
+# ------------------------------------------------------------
+
+run codec displays=1 --get 0 0x10
+expect "Get VCP decodes the emulator's brightness" 0 "current 0x0032 (50), max 0x0064 (100)"
+
+run codec displays=2 --verify 0 0x20 0x10 , 1 0x0B 0x14 , 0 0x45 0x62
+expect "Set VCP values read back on every display" 0 "reads back" !
+
+run codec displays=1 --verify 0 0x1F4 0x10
+expect "a level past the maximum verifies as the clamped maximum" 0 "did not take" !
+
+run codec displays=1 --if-changed 0 0x90 0xF4 0x50 , 0 0x11 0x60
+expect "an LG vendor register write switches input 0x60" 0 "VCP 0x60 on display 0 is already 0x11, skipped"
+
+# ------------------------------------------------------------
+# Retries
+# ------------------------------------------------------------
+
+run retry-nak displays=1,nak=300,seed=2 0 0x20 0x10 , 0 0x21 0x10 , 0 0x22 0x10 , 0 0x23 0x10
+expect "writes are retried after NAKs" 0 "retrying"
+
+run retry-corrupt displays=1,corrupt=300,seed=2 --verify 0 0x20 0x10 , 0 0x21 0x10 , 0 0x22 0x10 , 0 0x23 0x10
+expect "reads are retried after corrupted replies" 0 "retrying"
+
+run retry-dead displays=1,nak=1000 0 0x20 0x10
+expect "a monitor that never acknowledges fails" 1 "Changing value failed"
+
+# ------------------------------------------------------------
+# --verify
+# ------------------------------------------------------------
+
+run verify displays=1,drop=1000 --verify 0 0x20 0x10
+expect "a write that never takes fails after 3 attempts" 1 "did not take 0x20"
+
+run verify-some displays=1,drop=500,seed=3 --verify 0 0x20 0x10 , 0 0x21 0x10 , 0 0x22 0x10
+expect "a dropped write is written again until it reads back" 0 "writing again"
+
+run verify-input displays=1,drop=1000 --verify 0 0x0F 0x60
+expect "input source is not read back" 0 "reads back" !
+
+# ------------------------------------------------------------
+# --if-changed
+# ------------------------------------------------------------
+
+run changed-same displays=1 --if-changed 0 0x32 0x10
+expect "a value the monitor already has is skipped" 0 "already 0x32, skipped"
+
+run changed displays=1 --if-changed 0 0x40 0x10 , 0 0x40 0x10
+expect "a repeated write in a batch is skipped" 0 "already 0x40, skipped"
+
+# The emulator starts over at 0x32, so a skip here came from the shadow
+run changed displays=1 --if-changed 0 0x40 0x10
+expect "a standard code written before is skipped within the TTL" 0 "already 0x40, skipped"
+
+run changed displays=1 --if-changed=0 0 0x40 0x10
+expect "an expired standard code is read from the monitor" 0 "skipped" !
+
+run changed displays=1 --if-changed 0 0x01 0x04 , 0 0x01 0x04
+expect "a factory reset is never skipped" 0 "skipped" !
+
+run changed displays=1 --if-changed 0 0xD0 0xF4 0x50
+expect "a vendor register is written the first time" 0 "skipped" !
+
+run changed displays=1 --if-changed 0 0xD0 0xF4 0x50
+expect "a vendor register written before is skipped" 0 "already 0xD0, skipped"
+
+run changed displays=1 --if-changed=0 0 0xD0 0xF4 0x50
+expect "an expired shadow entry is written again" 0 "skipped" !
+
+# ------------------------------------------------------------
+# Adaptive timing
+# ------------------------------------------------------------
+
+run timing displays=1,latency=120 --bench 20 --get 0 0x10
+slow=$(reply_delay timing)
+status=0
+if [ "${slow:-0}" -gt 100 ]; then pass "a slow monitor raises the reply delay ($slow ms)"
+else fail "a slow monitor raises the reply delay (${slow:-no} ms)"; fi
+
+run timing displays=1 --bench 60 --get 0 0x10
+fast=$(reply_delay timing)
+if [ "${fast:-1000}" -lt 100 ] && [ "$fast" -lt "$slow" ]; then
+    pass "the reply delay recovers once replies are fast ($slow -> $fast ms)"
+else
+    fail "the reply delay recovers once replies are fast ($slow -> ${fast:-no} ms)"
+fi
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
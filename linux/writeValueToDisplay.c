@@ -1,176 +1,4855 @@
 /*
  * writeValueToDisplay - Linux version
  *
- * Sends DDC/CI commands to monitors using ddcutil.
+ * Sends DDC/CI commands to monitors over /dev/i2c-N (native backend)
+ * or by invoking ddcutil (fallback backend), or through libddcutil when
+ * built with make LIBDDCUTIL=1.
  * CLI-compatible with the Windows NVAPI version.
  *
- * Dependencies: ddcutil, i2c-tools
+ * Dependencies: i2c-dev kernel module (native), ddcutil (fallback),
+ * libddcutil 2.x (optional)
  * User must be in 'i2c' group: sudo usermod -aG i2c $USER
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/netlink.h>
+#ifdef HAVE_LIBDDCUTIL
+#include <ddcutil_c_api.h>
+#include <ddcutil_status_codes.h>
+#endif
+#include "ddcci.h"
+#include "edid.h"
+#include "mccs_timing.h"
+#include "mccs_caps.h"
+#include "ddcci_emu.h"
+#include "bench.h"
+#include "fade.h"
+#include "mccs_verify.h"
+#include "trace.h"
 
 #define MAX_CMD_LEN 512
 #define MAX_LINE_LEN 256
+#define MAX_I2C_BUSES 64
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// 7-bit I2C address of the EDID EEPROM (DDC/CI is DDCCI_I2C_ADDR)
+#define EDID_I2C_ADDR 0x50
+
+typedef enum {
+    BACKEND_NATIVE,     // Direct I2C_RDWR ioctls on /dev/i2c-N
+    BACKEND_DDCUTIL,    // Shell out to the ddcutil CLI
+    BACKEND_LIBDDCUTIL, // ddcutil's library in process, with HAVE_LIBDDCUTIL
+    BACKEND_VIRTUAL     // Emulated monitors, for testing without hardware
+} backend_t;
+
+static backend_t g_backend = BACKEND_NATIVE;
+
+static const char *backend_name(void) {
+    switch (g_backend) {
+    case BACKEND_NATIVE:    return "native";
+    case BACKEND_DDCUTIL:   return "ddcutil";
+    case BACKEND_LIBDDCUTIL: return "libddcutil";
+    case BACKEND_VIRTUAL:   return "virtual";
+    }
+    return "unknown";
+}
+
+// One detected display: its I2C bus, EDID content hash and identity,
+// and DRM connector
+typedef struct {
+    int bus;
+    uint64_t edid_hash;
+    uint64_t edid_id;       // edid_identity(), 0 if unknown
+    char connector[32];     // e.g. "card0-DP-1", "-" if unknown
+} display_entry;
+
+// Display map and open bus handles, loaded from the topology cache or
+// enumerated once per process, and kept hot for the lifetime of the daemon
+static display_entry g_displays[MAX_I2C_BUSES];
+static int g_bus_fds[MAX_I2C_BUSES];
+static int g_display_count = -1;
+static int g_topology_cached = 0;   // g_displays came from the on-disk cache
+static int g_rescan = 0;            // --rescan: ignore the topology cache
+
+// Set while write_verified_locked() reads this thread's writes back itself
+static __thread int t_verifying;
+
+static int display_count(void);
+static int display_by_connector(const char *output);
+static uint64_t display_id(int display_num);
+static void edid_remember(const uint8_t *edid);
+static int timing_gate(uint64_t id);
+static void timing_done(uint64_t id, int gated, ddcci_status status);
+static int timing_reply_delay(uint64_t id);
+static void timing_reply_done(uint64_t id, ddcci_status status);
+static uint64_t monotonic_ms(void);
+static void pace_sleep(uint32_t ms);
+
+// ============================================================
+// DRM sysfs
+// ============================================================
+
+// Environment variable naming the primary connector, e.g. DP-1
+#define PRIMARY_ENV "WRITEVALUETODISPLAY_PRIMARY"
+
+// One DRM connector as exported in /sys/class/drm/cardN-<type>-<n>
+typedef struct {
+    char name[32];          // e.g. "card0-DP-1"
+    int bus;                // i2c-N of its DDC channel, -1 if none
+    int connected;          // status is "connected"
+    int enabled;            // enabled is "enabled" (driven by a CRTC)
+    int has_edid;
+    uint8_t edid[EDID_BLOCK_LEN];   // Valid if has_edid
+    uint64_t edid_hash;
+    uint64_t edid_id;
+} drm_connector;
+
+static int filter_connector(const struct dirent *ent) {
+    return strncmp(ent->d_name, "card", 4) == 0 && strchr(ent->d_name, '-') != NULL;
+}
+
+/*
+ * Read the first line of a sysfs attribute, without the newline.
+ * Returns 1 on success.
+ */
+static int read_sysfs_line(const char *path, char *buf, size_t size) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    if (!fgets(buf, size, fp))
+        buf[0] = '\0';
+    fclose(fp);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 1;
+}
+
+/*
+ * Read the kernel's copy of a connector's EDID base block.
+ * Returns 1 if a valid EDID header was read.
+ */
+static int drm_read_edid(const char *connector, uint8_t *edid) {
+    char path[PATH_MAX];
+    int ok;
+
+    snprintf(path, sizeof(path), "/sys/class/drm/%s/edid", connector);
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+    ok = fread(edid, 1, EDID_BLOCK_LEN, fp) == EDID_BLOCK_LEN && edid_has_header(edid);
+    fclose(fp);
+    return ok;
+}
+
+/*
+ * Find the i2c-N bus of a connector's DDC channel. Returns -1 if none.
+ */
+static int drm_connector_bus(const char *connector) {
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    int bus = -1;
+
+    // The ddc link points at the connector's I2C adapter; DP AUX
+    // adapters appear as an i2c-N child directory of the connector instead
+    snprintf(path, sizeof(path), "/sys/class/drm/%s/ddc", connector);
+    ssize_t len = readlink(path, link, sizeof(link) - 1);
+    if (len > 0) {
+        link[len] = '\0';
+        const char *base = strrchr(link, '/');
+        if (sscanf(base ? base + 1 : link, "i2c-%d", &bus) == 1)
+            return bus;
+    }
+
+    snprintf(path, sizeof(path), "/sys/class/drm/%s", connector);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    struct dirent *ent;
+    while (bus < 0 && (ent = readdir(dir)) != NULL) {
+        if (sscanf(ent->d_name, "i2c-%d", &bus) != 1)
+            bus = -1;
+    }
+    closedir(dir);
+    return bus;
+}
+
+/*
+ * Read every DRM connector in name order. Touches only sysfs, never the
+ * I2C bus or an external process.
+ * Returns number of entries written to connectors[].
+ */
+int drm_scan_connectors(drm_connector *connectors, int max_connectors) {
+    struct dirent **list;
+    int count = 0;
+    int n = scandir("/sys/class/drm", &list, filter_connector, alphasort);
+
+    for (int i = 0; i < n; i++) {
+        if (count < max_connectors) {
+            drm_connector *conn = &connectors[count++];
+            char path[PATH_MAX];
+            char value[32] = "";
+
+            snprintf(conn->name, sizeof(conn->name), "%.*s", (int)sizeof(conn->name) - 1, list[i]->d_name);
+            conn->bus = drm_connector_bus(conn->name);
+
+            snprintf(path, sizeof(path), "/sys/class/drm/%s/status", conn->name);
+            conn->connected = read_sysfs_line(path, value, sizeof(value)) && strcmp(value, "connected") == 0;
+            snprintf(path, sizeof(path), "/sys/class/drm/%s/enabled", conn->name);
+            conn->enabled = read_sysfs_line(path, value, sizeof(value)) && strcmp(value, "enabled") == 0;
+
+            conn->has_edid = drm_read_edid(conn->name, conn->edid);
+            conn->edid_hash = conn->has_edid ? edid_hash(conn->edid) : 0;
+            conn->edid_id = conn->has_edid ? edid_identity(conn->edid) : 0;
+        }
+        free(list[i]);
+    }
+    if (n >= 0)
+        free(list);
+
+    return count;
+}
+
+/*
+ * Check whether a connector name ("card0-DP-1") matches an output name,
+ * given either in full or without the card prefix ("DP-1", as xrandr
+ * and Wayland compositors print it).
+ */
+static int connector_matches(const char *connector, const char *output) {
+    const char *name = strchr(connector, '-');
+    return strcmp(connector, output) == 0 || (name && strcmp(name + 1, output) == 0);
+}
+
+/*
+ * Built-in panels (eDP, LVDS, DSI) have no DDC/CI.
+ */
+static int connector_is_internal(const char *connector) {
+    const char *name = strchr(connector, '-');
+    name = name ? name + 1 : connector;
+    return strncmp(name, "eDP", 3) == 0 || strncmp(name, "LVDS", 4) == 0 ||
+           strncmp(name, "DSI", 3) == 0;
+}
 
 /*
- * Detect primary display using xrandr and map to ddcutil display number.
+ * Detect the primary display from DRM sysfs and map it to a display
+ * number. The primary is the connector named by $WRITEVALUETODISPLAY_PRIMARY,
+ * else the first connected external connector that is lit, else the
+ * first connected one. Needs no X server, so it works under Wayland,
+ * on a bare console and in headless kiosks.
  * Returns 1-based display number, or 1 as fallback.
  */
 int detect_primary_display(void) {
-    FILE *fp;
-    char line[MAX_LINE_LEN];
-    char primary_output[64] = "";
+    drm_connector connectors[MAX_I2C_BUSES];
+    int count = drm_scan_connectors(connectors, MAX_I2C_BUSES);
+    const char *wanted = getenv(PRIMARY_ENV);
+    const drm_connector *primary = NULL;
 
-    // Find primary output name via xrandr
-    fp = popen("xrandr 2>/dev/null | grep ' connected primary'", "r");
-    if (!fp) {
-        fprintf(stderr, "Failed to run xrandr, using display 1\n");
+    // Emulated monitors are not on any DRM connector
+    if (g_backend == BACKEND_VIRTUAL)
         return 1;
-    }
 
-    if (fgets(line, sizeof(line), fp)) {
-        // Extract output name (first word)
-        sscanf(line, "%63s", primary_output);
+    for (int i = 0; i < count; i++) {
+        const drm_connector *conn = &connectors[i];
+
+        if (wanted && wanted[0]) {
+            if (connector_matches(conn->name, wanted)) {
+                primary = conn;
+                break;
+            }
+        } else if (conn->connected && !connector_is_internal(conn->name) &&
+                   (!primary || (conn->enabled && !primary->enabled))) {
+            primary = conn;
+        }
     }
-    pclose(fp);
 
-    if (strlen(primary_output) == 0) {
-        printf("Primary display not found, defaulting to display 1\n");
+    if (!primary) {
+        if (wanted && wanted[0])
+            printf("Connector %s not found, defaulting to display 1\n", wanted);
+        else
+            printf("Primary display not found, defaulting to display 1\n");
         return 1;
     }
 
-    printf("Primary display device found: %s\n", primary_output);
+    printf("Primary display device found: %s\n", primary->name);
+
+    // Map the connector to a display through the topology, by name, then
+    // by bus for displays enumerated without a connector name
+    int display_num = display_by_connector(primary->name);
+    for (int i = 0; display_num == 0 && primary->bus >= 0 && i < display_count(); i++) {
+        if (g_displays[i].bus == primary->bus)
+            display_num = i + 1;
+    }
+
+    if (display_num > 0) {
+        printf("Using display index %d for primary display\n", display_num - 1);
+        return display_num;
+    }
+
+    printf("Could not map %s to a display, using display 1\n", primary->name);
+    return 1;
+}
+
+/*
+ * Map one line of ddcutil output to a failure class. Returns 1 and sets
+ * *status if the line explains why the command failed.
+ */
+static int ddcutil_classify(const char *line, ddcci_status *status) {
+    if (strstr(line, "nsupported feature") || strstr(line, "not supported"))
+        *status = DDCCI_ERR_UNSUPPORTED;
+    else if (strstr(line, "not found") || strstr(line, "Invalid display") ||
+             strstr(line, "No displays") || strstr(line, "ermission denied"))
+        *status = DDCCI_ERR_IO;
+    else if (strstr(line, "EBUSY") || strstr(line, "busy"))
+        *status = DDCCI_ERR_BUS_BUSY;
+    else if (strstr(line, "NULL_RESPONSE") || strstr(line, "ull response"))
+        *status = DDCCI_ERR_NULL_MSG;
+    else if (strstr(line, "CHECKSUM") || strstr(line, "hecksum"))
+        *status = DDCCI_ERR_CHECKSUM;
+    else
+        return 0;
+    return 1;
+}
+
+/*
+ * Execute a ddcutil command, echoing its output, and classify the result.
+ * A nonzero exit with no recognizable reason counts as a NAK.
+ */
+ddcci_status run_ddcutil(const char *cmd) {
+    char line[MAX_LINE_LEN];
+    char full[MAX_CMD_LEN + 8];
+    ddcci_status status = DDCCI_ERR_NAK;
 
-    // Map output name to ddcutil display number
-    fp = popen("ddcutil detect 2>/dev/null", "r");
+    snprintf(full, sizeof(full), "%s 2>&1", cmd);
+    TRACE_BEGIN(t);
+    FILE *fp = popen(full, "r");
     if (!fp) {
-        fprintf(stderr, "Failed to run ddcutil detect, using display 1\n");
-        return 1;
+        fprintf(stderr, "Failed to execute command\n");
+        return DDCCI_ERR_IO;
     }
 
-    int current_display = 0;
+    int classified = 0;
     while (fgets(line, sizeof(line), fp)) {
-        // Look for "Display N" lines
-        if (strncmp(line, "Display ", 8) == 0) {
-            sscanf(line, "Display %d", &current_display);
+        fputs(line, stdout);
+        if (!classified)
+            classified = ddcutil_classify(line, &status);
+    }
+
+    int result = pclose(fp);
+    TRACE_END(t, "ddcutil_setvcp");
+    if (result == -1 || !WIFEXITED(result) || WEXITSTATUS(result) == 127)
+        return DDCCI_ERR_IO;
+    if (WEXITSTATUS(result) == 0)
+        return DDCCI_OK;
+    fprintf(stderr, "  ddcutil command failed with status %d\n", WEXITSTATUS(result));
+    return status;
+}
+
+// ============================================================
+// Native I2C Backend
+// ============================================================
+
+/*
+ * Check whether an I2C adapter is a display DDC channel rather than an
+ * SMBus/sensor controller, using the adapter name exported in sysfs.
+ */
+static int is_display_adapter(int bus) {
+    char path[64];
+    char name[MAX_LINE_LEN] = "";
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/sys/bus/i2c/devices/i2c-%d/name", bus);
+    fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    if (!fgets(name, sizeof(name), fp))
+        name[0] = '\0';
+    fclose(fp);
+
+    // Same adapters ddcutil ignores when probing for monitors
+    return strncmp(name, "SMBus", 5) != 0 &&
+           strncmp(name, "soc:i2cdsi", 10) != 0 &&
+           strncmp(name, "smu", 3) != 0 &&
+           strncmp(name, "mac-io", 6) != 0 &&
+           strncmp(name, "u4", 2) != 0;
+}
+
+static int i2c_open_bus(int bus) {
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/i2c-%d", bus);
+    return open(path, O_RDWR);
+}
+
+/*
+ * Classify the errno left by a failed I2C_RDWR. The adapter reports a
+ * missing ACK as EREMOTEIO/ENXIO (EIO on some drivers), arbitration loss
+ * and clock stretching timeouts as EAGAIN/ETIMEDOUT.
+ */
+static ddcci_status classify_errno(int err) {
+    switch (err) {
+    case EREMOTEIO:
+    case ENXIO:
+    case EIO:
+        return DDCCI_ERR_NAK;
+    case EAGAIN:
+    case EBUSY:
+    case ETIMEDOUT:
+    case EINTR:
+        return DDCCI_ERR_BUS_BUSY;
+    default:
+        return DDCCI_ERR_IO;
+    }
+}
+
+/*
+ * Issue a single I2C write message to the given 7-bit slave address.
+ */
+static int i2c_write(int fd, uint8_t addr, const uint8_t *buf, uint16_t len) {
+    struct i2c_msg msg = { addr, 0, len, (uint8_t *)buf };
+    struct i2c_rdwr_ioctl_data data = { &msg, 1 };
+    TRACE_BEGIN(t);
+    int result = ioctl(fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+    TRACE_END(t, "i2c_write");
+    return result;
+}
+
+/*
+ * Issue a single I2C read message from the given 7-bit slave address.
+ */
+static int i2c_read(int fd, uint8_t addr, uint8_t *buf, uint16_t len) {
+    struct i2c_msg msg = { addr, I2C_M_RD, len, buf };
+    struct i2c_rdwr_ioctl_data data = { &msg, 1 };
+    TRACE_BEGIN(t);
+    int result = ioctl(fd, I2C_RDWR, &data) < 0 ? -1 : 0;
+    TRACE_END(t, "i2c_read");
+    return result;
+}
+
+/*
+ * Read the EDID base block from the EEPROM at 0x50 on this bus.
+ * Returns 1 if a valid EDID header was read.
+ */
+static int read_edid(int fd, uint8_t *edid) {
+    uint8_t offset = 0;
+    struct i2c_msg msgs[2] = {
+        { EDID_I2C_ADDR, 0, 1, &offset },
+        { EDID_I2C_ADDR, I2C_M_RD, EDID_BLOCK_LEN, edid }
+    };
+    struct i2c_rdwr_ioctl_data data = { msgs, 2 };
+
+    if (ioctl(fd, I2C_RDWR, &data) < 0)
+        return 0;
+    return edid_has_header(edid);
+}
+
+/*
+ * Enumerate I2C buses with a monitor attached, in bus order.
+ * This matches the display numbering used by ddcutil. Buses that belong
+ * to a DRM connector are resolved from sysfs (status and the kernel's
+ * EDID copy) without touching the bus; only buses DRM does not know
+ * about (e.g. the NVIDIA proprietary driver) are probed for an EDID.
+ * Returns number of entries written to displays[].
+ */
+int enumerate_ddc_buses(display_entry *displays, int max_displays) {
+    drm_connector connectors[MAX_I2C_BUSES];
+    int connector_count = drm_scan_connectors(connectors, MAX_I2C_BUSES);
+    int count = 0;
+
+    for (int bus = 0; bus < MAX_I2C_BUSES && count < max_displays; bus++) {
+        const drm_connector *conn = NULL;
+        uint8_t edid[EDID_BLOCK_LEN];
+
+        for (int i = 0; !conn && i < connector_count; i++) {
+            if (connectors[i].bus == bus)
+                conn = &connectors[i];
         }
-        // Check if this display's DRM connector matches our primary
-        if (current_display > 0 && strstr(line, primary_output)) {
-            pclose(fp);
-            printf("Using display index %d for primary display\n", current_display - 1);
-            return current_display;
+
+        if (conn && !conn->connected)
+            continue;
+
+        display_entry *entry = &displays[count];
+        if (conn && conn->has_edid) {
+            entry->edid_hash = conn->edid_hash;
+            entry->edid_id = conn->edid_id;
+            edid_remember(conn->edid);
+        } else {
+            if (!is_display_adapter(bus))
+                continue;
+
+            int fd = i2c_open_bus(bus);
+            if (fd < 0)
+                continue;
+            int found = read_edid(fd, edid);
+            close(fd);
+            if (!found)
+                continue;
+            entry->edid_hash = edid_hash(edid);
+            entry->edid_id = edid_identity(edid);
+            edid_remember(edid);
         }
+
+        entry->bus = bus;
+        snprintf(entry->connector, sizeof(entry->connector), "%s", conn ? conn->name : "-");
+        count++;
     }
 
-    pclose(fp);
-    printf("Could not map %s to ddcutil display, using display 1\n", primary_output);
-    return 1;
+    return count;
 }
 
 /*
- * Execute ddcutil command and return exit status.
+ * Return an open descriptor for the 1-based display, or -1.
  */
-int run_ddcutil(const char *cmd) {
-    int result = system(cmd);
-    if (result == -1) {
-        fprintf(stderr, "Failed to execute command\n");
-        return 1;
+static int native_display_fd(int display_num) {
+    int slot = display_num - 1;
+
+    if (g_bus_fds[slot] < 0) {
+        g_bus_fds[slot] = i2c_open_bus(g_displays[slot].bus);
+        if (g_bus_fds[slot] < 0)
+            fprintf(stderr, "  Failed to open /dev/i2c-%d: %s\n", g_displays[slot].bus, strerror(errno));
+    }
+    return g_bus_fds[slot];
+}
+
+static void topology_invalidate(void);
+
+/*
+ * Write value to monitor via /dev/i2c-N.
+ *
+ * display_num: 1-based display number (same numbering as ddcutil)
+ * input_value: value to write (0x0000-0xFFFF)
+ * command_code: VCP code or manufacturer command
+ * register_address: I2C register (0x51 for standard VCP, 0x50 for LG custom)
+ *
+ * Returns DDCCI_OK or the class of the failure.
+ */
+ddcci_status native_write_value(int display_num, uint16_t input_value,
+                       uint8_t command_code, uint8_t register_address) {
+    int bus_count = display_count();
+
+    if (display_num < 1 || display_num > bus_count) {
+        fprintf(stderr, "Display %d not found (only %d displays detected)\n",
+                display_num - 1, bus_count);
+        return DDCCI_ERR_IO;
+    }
+
+    int fd = native_display_fd(display_num);
+    if (fd < 0)
+        return DDCCI_ERR_IO;
+
+    // Same packet as the Windows version; the 0x6E device address is put
+    // on the wire by the I2C adapter from msg.addr
+    uint8_t packet[DDCCI_SET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_set_vcp(packet, register_address, command_code, input_value);
+    TRACE_END(t_build, "build_set_vcp");
+
+    uint64_t id = display_id(display_num);
+    int gated = timing_gate(id);
+    int ok = i2c_write(fd, DDCCI_I2C_ADDR, packet, sizeof(packet)) == 0;
+    int err = errno;
+    timing_done(id, gated, ok ? DDCCI_OK : classify_errno(err));
+
+    if (!ok) {
+        fprintf(stderr, "  I2C write to /dev/i2c-%d failed: %s\n",
+                g_displays[display_num - 1].bus, strerror(err));
+        return classify_errno(err);
+    }
+
+    return DDCCI_OK;
+}
+
+/*
+ * Read a VCP value via /dev/i2c-N: send a Get VCP Feature request, give
+ * the monitor the MCCS reply delay, then read its 11 byte reply.
+ *
+ * Returns DDCCI_OK with the parsed reply in *reply, or the class of the
+ * failure.
+ */
+ddcci_status native_read_value(int display_num, uint8_t command_code,
+                      uint8_t register_address, ddcci_vcp_reply *reply) {
+    int bus_count = display_count();
+
+    if (display_num < 1 || display_num > bus_count) {
+        fprintf(stderr, "Display %d not found (only %d displays detected)\n",
+                display_num - 1, bus_count);
+        return DDCCI_ERR_IO;
+    }
+
+    int fd = native_display_fd(display_num);
+    if (fd < 0)
+        return DDCCI_ERR_IO;
+
+    uint8_t request[DDCCI_GET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_get_vcp(request, register_address, command_code);
+    TRACE_END(t_build, "build_get_vcp");
+
+    uint64_t id = display_id(display_num);
+    int gated = timing_gate(id);
+    int ok = i2c_write(fd, DDCCI_I2C_ADDR, request, sizeof(request)) == 0;
+    int err = errno;
+    timing_done(id, gated, ok ? DDCCI_OK : classify_errno(err));
+
+    if (!ok) {
+        fprintf(stderr, "  I2C write to /dev/i2c-%d failed: %s\n",
+                g_displays[display_num - 1].bus, strerror(err));
+        return classify_errno(err);
+    }
+
+    pace_sleep(timing_reply_delay(id));
+
+    uint8_t buf[DDCCI_GET_VCP_REPLY_LEN];
+    ok = i2c_read(fd, DDCCI_I2C_ADDR, buf, sizeof(buf)) == 0;
+    if (!ok) {
+        err = errno;
+        timing_reply_done(id, classify_errno(err));
+        fprintf(stderr, "  I2C read from /dev/i2c-%d failed: %s\n",
+                g_displays[display_num - 1].bus, strerror(err));
+        return classify_errno(err);
+    }
+
+    ddcci_status status = ddcci_parse_get_vcp_reply(buf, sizeof(buf), reply);
+    if (status == DDCCI_OK && reply->code != command_code)
+        status = DDCCI_ERR_PROTOCOL;
+
+    // A clean "unsupported" answer still means the reply was ready in time
+    timing_reply_done(id, status);
+    if (status != DDCCI_OK) {
+        fprintf(stderr, "  Get VCP 0x%02X failed: %s\n", command_code, ddcci_status_text(status));
+        return status;
+    }
+
+    return DDCCI_OK;
+}
+
+/*
+ * Read one Capabilities Reply fragment via /dev/i2c-N: send a
+ * Capabilities Request for offset, give the monitor the reply delay,
+ * then read the reply.
+ *
+ * Returns DDCCI_OK with the fragment in data (DDCCI_MAX_FRAGMENT bytes)
+ * and its length in *data_len, 0 at the end of the string, or the class
+ * of the failure.
+ */
+ddcci_status native_caps_fragment(int display_num, uint16_t offset,
+                                  uint8_t *data, size_t *data_len) {
+    int bus_count = display_count();
+
+    if (display_num < 1 || display_num > bus_count) {
+        fprintf(stderr, "Display %d not found (only %d displays detected)\n",
+                display_num - 1, bus_count);
+        return DDCCI_ERR_IO;
+    }
+
+    int fd = native_display_fd(display_num);
+    if (fd < 0)
+        return DDCCI_ERR_IO;
+
+    uint8_t request[DDCCI_CAPS_REQUEST_LEN];
+    ddcci_build_caps_request(request, offset);
+
+    uint64_t id = display_id(display_num);
+    int gated = timing_gate(id);
+    int ok = i2c_write(fd, DDCCI_I2C_ADDR, request, sizeof(request)) == 0;
+    int err = errno;
+    timing_done(id, gated, ok ? DDCCI_OK : classify_errno(err));
+
+    if (!ok) {
+        fprintf(stderr, "  I2C write to /dev/i2c-%d failed: %s\n",
+                g_displays[display_num - 1].bus, strerror(err));
+        return classify_errno(err);
+    }
+
+    pace_sleep(timing_reply_delay(id));
+
+    uint8_t buf[DDCCI_FRAGMENT_REPLY_MAX_LEN];
+    ok = i2c_read(fd, DDCCI_I2C_ADDR, buf, sizeof(buf)) == 0;
+    if (!ok) {
+        err = errno;
+        timing_reply_done(id, classify_errno(err));
+        fprintf(stderr, "  I2C read from /dev/i2c-%d failed: %s\n",
+                g_displays[display_num - 1].bus, strerror(err));
+        return classify_errno(err);
+    }
+
+    ddcci_status status = mccs_caps_parse_fragment(buf, sizeof(buf), offset, data, data_len);
+    timing_reply_done(id, status);
+    if (status != DDCCI_OK)
+        fprintf(stderr, "  Capabilities fragment at %u failed: %s\n", offset, ddcci_status_text(status));
+    return status;
+}
+
+
+// ============================================================
+// ddcutil Backend
+// ============================================================
+
+/*
+ * Enumerate displays with ddcutil detect.
+ * Returns number of entries written to displays[].
+ */
+int ddcutil_detect(display_entry *displays, int max_displays) {
+    char line[MAX_LINE_LEN];
+    int count = 0;
+    TRACE_BEGIN(t);
+    FILE *fp = popen("ddcutil detect 2>/dev/null", "r");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to run ddcutil detect\n");
+        return 0;
+    }
+
+    display_entry *entry = NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        int bus;
+
+        // "Display N" starts a usable display; "Invalid display" does not
+        if (strncmp(line, "Display ", 8) == 0) {
+            entry = count < max_displays ? &displays[count++] : NULL;
+            if (entry) {
+                entry->bus = -1;
+                entry->edid_hash = 0;
+                entry->edid_id = 0;
+                snprintf(entry->connector, sizeof(entry->connector), "-");
+            }
+        } else if (line[0] != ' ') {
+            entry = NULL;
+        } else if (entry && sscanf(line, " I2C bus: /dev/i2c-%d", &bus) == 1) {
+            entry->bus = bus;
+        } else if (entry && strstr(line, "DRM connector:")) {
+            sscanf(strstr(line, ":") + 1, "%31s", entry->connector);
+        }
+    }
+
+    pclose(fp);
+    TRACE_END(t, "ddcutil_detect");
+
+    // ddcutil detect does not print the raw EDID; take it from the
+    // kernel's copy on the connector
+    for (int i = 0; i < count; i++) {
+        uint8_t edid[EDID_BLOCK_LEN];
+        if (drm_read_edid(displays[i].connector, edid)) {
+            displays[i].edid_hash = edid_hash(edid);
+            displays[i].edid_id = edid_identity(edid);
+            edid_remember(edid);
+        }
     }
-    return WEXITSTATUS(result);
+
+    return count;
 }
 
 /*
  * Write value to monitor via ddcutil.
  *
  * display_num: 1-based ddcutil display number
- * input_value: value to write (0x00-0xFF)
+ * input_value: value to write (0x0000-0xFFFF)
  * command_code: VCP code or manufacturer command
  * register_address: I2C register (0x51 for standard VCP, 0x50 for LG custom)
+ *
+ * Returns DDCCI_OK or the class of the failure.
  */
-int write_value_to_monitor(int display_num, uint8_t input_value,
-                            uint8_t command_code, uint8_t register_address) {
+ddcci_status write_value_to_monitor(int display_num, uint16_t input_value,
+                                    uint8_t command_code, uint8_t register_address) {
     char cmd[MAX_CMD_LEN];
-    int result;
+    char target[32];
+
+    // Address the bus directly when the topology knows it, so ddcutil
+    // does not have to detect every display first
+    if (display_num >= 1 && display_num <= display_count() && g_displays[display_num - 1].bus >= 0)
+        snprintf(target, sizeof(target), "--bus %d", g_displays[display_num - 1].bus);
+    else
+        snprintf(target, sizeof(target), "-d %d", display_num);
 
     if (register_address == 0x51) {
-        // Standard VCP command
+        // Standard VCP command. ddcutil reads the value back itself
+        // unless --verify is about to do so.
         snprintf(cmd, sizeof(cmd),
-            "ddcutil -d %d setvcp x%02X x%02X",
-            display_num, command_code, input_value);
+            "ddcutil %s setvcp x%02X x%02X%s",
+            target, command_code, input_value, t_verifying ? " --noverify" : "");
     } else {
         // Manufacturer-specific command (e.g., LG with register 0x50)
         // Use --i2c-source-addr for custom register address
         snprintf(cmd, sizeof(cmd),
-            "ddcutil -d %d setvcp x%02X x00%02X "
+            "ddcutil %s setvcp x%02X x%04X "
             "--i2c-source-addr=x%02X --noverify --permit-unknown-feature",
-            display_num, command_code, input_value, register_address);
+            target, command_code, input_value, register_address);
+    }
+
+    return run_ddcutil(cmd);
+}
+
+/*
+ * Read a VCP value via ddcutil getvcp --brief, which prints
+ *   VCP 10 C 50 100                 continuous: current, max
+ *   VCP 60 SNC x0f                  simple non-continuous: current
+ *   VCP 14 CNC x00 x0b x00 x05      complex non-continuous: max hi/lo, cur hi/lo
+ *
+ * Returns DDCCI_OK with the parsed reply in *reply, or the class of the
+ * failure.
+ */
+ddcci_status ddcutil_read_value(int display_num, uint8_t command_code,
+                       uint8_t register_address, ddcci_vcp_reply *reply) {
+    char cmd[MAX_CMD_LEN];
+    char line[MAX_LINE_LEN];
+    char target[32];
+    char source[32] = "";
+    int found = 0;
+
+    if (display_num >= 1 && display_num <= display_count() && g_displays[display_num - 1].bus >= 0)
+        snprintf(target, sizeof(target), "--bus %d", g_displays[display_num - 1].bus);
+    else
+        snprintf(target, sizeof(target), "-d %d", display_num);
+    if (register_address != 0x51)
+        snprintf(source, sizeof(source), " --i2c-source-addr=x%02X", register_address);
+
+    snprintf(cmd, sizeof(cmd), "ddcutil %s getvcp x%02X --brief%s 2>&1",
+             target, command_code, source);
+    TRACE_BEGIN(t);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to run ddcutil getvcp\n");
+        return DDCCI_ERR_IO;
     }
 
-    result = run_ddcutil(cmd);
-    if (result != 0) {
-        fprintf(stderr, "  ddcutil command failed with status %d\n", result);
-        return 0;  // FALSE
+    ddcci_status status = DDCCI_ERR_NAK;
+    int classified = 0;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        unsigned int code, mh, ml, sh, sl;
+        char type[8];
+        int n = 0;
+
+        if (sscanf(line, "VCP %x %7s %n", &code, type, &n) != 2 || code != command_code) {
+            if (!classified)
+                classified = ddcutil_classify(line, &status);
+            continue;
+        }
+
+        reply->code = command_code;
+        reply->type = 0x00;
+        if (strcmp(type, "C") == 0 && sscanf(line + n, "%u %u", &sl, &ml) == 2) {
+            reply->cur_value = (uint16_t)sl;
+            reply->max_value = (uint16_t)ml;
+            found = 1;
+        } else if (strcmp(type, "SNC") == 0 && sscanf(line + n, "x%x", &sl) == 1) {
+            reply->cur_value = (uint16_t)sl;
+            reply->max_value = 0;
+            found = 1;
+        } else if (strcmp(type, "CNC") == 0 &&
+                   sscanf(line + n, "x%x x%x x%x x%x", &mh, &ml, &sh, &sl) == 4) {
+            reply->cur_value = (uint16_t)((sh << 8) | sl);
+            reply->max_value = (uint16_t)((mh << 8) | ml);
+            found = 1;
+        }
     }
 
-    return 1;  // TRUE
+    int result = pclose(fp);
+    TRACE_END(t, "ddcutil_getvcp");
+    if (found)
+        return DDCCI_OK;
+
+    fprintf(stderr, "  ddcutil getvcp failed with status %d\n",
+            result == -1 ? -1 : WEXITSTATUS(result));
+    if (result == -1 || !WIFEXITED(result) || WEXITSTATUS(result) == 127)
+        return DDCCI_ERR_IO;
+    return status;
 }
 
-void print_usage(void) {
-    printf("Incorrect Number of arguments!\n\n");
+/*
+ * Read the capabilities string via ddcutil capabilities --verbose, which
+ * prints it as received on an "Unparsed capabilities string:" line.
+ * caps must hold MCCS_CAPS_MAX_LEN + 1 bytes.
+ *
+ * Returns DDCCI_OK or the class of the failure.
+ */
+ddcci_status ddcutil_read_caps(int display_num, char *caps) {
+    char cmd[MAX_CMD_LEN];
+    char line[MCCS_CAPS_MAX_LEN + 64];
+    char target[32];
+    int found = 0;
 
-    printf("Arguments:\n");
-    printf("display_index   - Index assigned to monitor (0 for first screen, -1 for primary)\n");
-    printf("input_value     - value to write to screen (hex)\n");
-    printf("command_code    - VCP code or other (hex)\n");
-    printf("register_address - Address to write to, default 0x51 for VCP codes (hex)\n\n");
+    if (display_num >= 1 && display_num <= display_count() && g_displays[display_num - 1].bus >= 0)
+        snprintf(target, sizeof(target), "--bus %d", g_displays[display_num - 1].bus);
+    else
+        snprintf(target, sizeof(target), "-d %d", display_num);
 
-    printf("Usage:\n");
-    printf("writeValueToDisplay [display_index] [input_value] [command_code]\n");
-    printf("OR\n");
-    printf("writeValueToDisplay [display_index] [input_value] [command_code] [register_address]\n");
+    snprintf(cmd, sizeof(cmd), "ddcutil %s capabilities --verbose 2>&1", target);
+    TRACE_BEGIN(t);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to run ddcutil capabilities\n");
+        return DDCCI_ERR_IO;
+    }
+
+    ddcci_status status = DDCCI_ERR_NAK;
+    int classified = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        const char *text = strstr(line, "apabilities string:");
+        size_t len = 0;
+
+        if (found || !text) {
+            if (!found && !classified)
+                classified = ddcutil_classify(line, &status);
+            continue;
+        }
+
+        text += strlen("apabilities string:");
+        while (*text == ' ')
+            text++;
+        caps[0] = '\0';
+        found = mccs_caps_append(caps, &len, (const uint8_t *)text, strcspn(text, "\r\n"));
+    }
+
+    int result = pclose(fp);
+    TRACE_END(t, "ddcutil_capabilities");
+    if (found && caps[0])
+        return DDCCI_OK;
+
+    fprintf(stderr, "  ddcutil capabilities failed with status %d\n",
+            result == -1 ? -1 : WEXITSTATUS(result));
+    if (result == -1 || !WIFEXITED(result) || WEXITSTATUS(result) == 127)
+        return DDCCI_ERR_IO;
+    return status;
 }
 
-int main(int argc, char *argv[]) {
-    int display_index = 0;
-    uint8_t input_value = 0;
-    uint8_t command_code = 0;
-    uint8_t register_address = 0x51;
+#ifdef HAVE_LIBDDCUTIL
+// ============================================================
+// libddcutil Backend
+// ============================================================
 
-    // Usage: writeValueToDisplay [display_index] [input_value] [command_code]
-    // Uses default register address 0x51 used for VCP codes
-    if (argc == 4) {
-        display_index = atoi(argv[1]);
-        input_value = (uint8_t)strtol(argv[2], NULL, 16);
-        command_code = (uint8_t)strtol(argv[3], NULL, 16);
-    }
-    // Usage: writeValueToDisplay [display_index] [input_value] [command_code] [register_address]
-    else if (argc == 5) {
-        display_index = atoi(argv[1]);
-        input_value = (uint8_t)strtol(argv[2], NULL, 16);
-        command_code = (uint8_t)strtol(argv[3], NULL, 16);
-        register_address = (uint8_t)strtol(argv[4], NULL, 16);
-    }
-    else {
-        print_usage();
-        return 1;
+// Display handles, opened on first use and kept for the life of the
+// process, so a batch or the daemon pays for ddcutil's display lookup
+// once per display. libddcutil applies its quirk handling, retries and
+// sleeps inside every call.
+static DDCA_Display_Handle g_ddca_handles[MAX_I2C_BUSES];
+static int g_ddca_buses[MAX_I2C_BUSES];     // Bus each handle was opened on
+static pthread_mutex_t g_ddca_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Map a libddcutil status to ours. Only replies the monitor got wrong
+ * count as transient; anything libddcutil itself refused, including its
+ * own retries running out, is final.
+ */
+static ddcci_status libddcutil_status(DDCA_Status rc) {
+    switch (rc) {
+    case 0:
+        return DDCCI_OK;
+    case DDCRC_REPORTED_UNSUPPORTED:
+    case DDCRC_DETERMINED_UNSUPPORTED:
+    case DDCRC_UNIMPLEMENTED:
+        return DDCCI_ERR_UNSUPPORTED;
+    case DDCRC_NULL_RESPONSE:
+        return DDCCI_ERR_NULL_MSG;
+    case DDCRC_CHECKSUM:
+        return DDCCI_ERR_CHECKSUM;
+    case DDCRC_DDC_DATA:
+    case DDCRC_RESPONSE_ENVELOPE:
+    case DDCRC_INVALID_DATA:
+        return DDCCI_ERR_PROTOCOL;
+    case -EBUSY:
+        return DDCCI_ERR_BUS_BUSY;
+    case DDCRC_INVALID_DISPLAY:
+    case DDCRC_ARG:
+    case DDCRC_RETRIES:
+    default:
+        // Plain negative errno values too: the bus itself is not usable
+        return DDCCI_ERR_IO;
     }
+}
 
-    // Convert display_index to ddcutil display number (1-based)
-    int ddcutil_display;
-    if (display_index == -1) {
-        ddcutil_display = detect_primary_display();
-    } else {
-        ddcutil_display = display_index + 1;
+/*
+ * Enumerate displays with libddcutil. Its detection already read each
+ * EDID, and the DRM connector is looked up by bus in sysfs.
+ * Returns number of entries written to displays[].
+ */
+int libddcutil_detect(display_entry *displays, int max_displays) {
+    drm_connector connectors[MAX_I2C_BUSES];
+    DDCA_Display_Info_List *list = NULL;
+    int count = 0;
+
+    TRACE_BEGIN(t);
+    DDCA_Status rc = ddca_get_display_info_list2(false, &list);
+    TRACE_END(t, "ddca_detect");
+    if (rc != 0) {
+        fprintf(stderr, "libddcutil display detection failed: %s\n", ddca_rc_name(rc));
+        return 0;
     }
 
-    int result = write_value_to_monitor(ddcutil_display, input_value,
-                                         command_code, register_address);
-    if (!result) {
-        printf("Changing value failed\n");
+    int connector_count = drm_scan_connectors(connectors, MAX_I2C_BUSES);
+    for (int i = 0; i < list->ct && count < max_displays; i++) {
+        const DDCA_Display_Info *info = &list->info[i];
+        if (info->path.io_mode != DDCA_IO_I2C)
+            continue;
+
+        display_entry *entry = &displays[count++];
+        entry->bus = info->path.path.i2c_busno;
+        entry->edid_hash = edid_hash(info->edid_bytes);
+        entry->edid_id = edid_identity(info->edid_bytes);
+        edid_remember(info->edid_bytes);
+        snprintf(entry->connector, sizeof(entry->connector), "-");
+        for (int k = 0; k < connector_count; k++) {
+            if (connectors[k].bus == entry->bus)
+                snprintf(entry->connector, sizeof(entry->connector), "%s", connectors[k].name);
+        }
+    }
+
+    ddca_free_display_info_list(list);
+    return count;
+}
+
+/*
+ * Return the open handle of the 1-based display, opening it by bus
+ * number on first use, or NULL with the reason in *rc.
+ */
+static DDCA_Display_Handle libddcutil_handle(int display_num, DDCA_Status *rc) {
+    if (display_num < 1 || display_num > display_count()) {
+        *rc = DDCRC_INVALID_DISPLAY;
+        return NULL;
+    }
+
+    int slot = display_num - 1;
+    int bus = g_displays[slot].bus;
+    DDCA_Display_Handle dh;
+
+    pthread_mutex_lock(&g_ddca_lock);
+    // The display map may have been enumerated again since
+    if (g_ddca_handles[slot] && g_ddca_buses[slot] != bus) {
+        ddca_close_display(g_ddca_handles[slot]);
+        g_ddca_handles[slot] = NULL;
+    }
+    *rc = 0;
+    if (!g_ddca_handles[slot]) {
+        DDCA_Display_Identifier did = NULL;
+        DDCA_Display_Ref dref = NULL;
+
+        TRACE_BEGIN(t);
+        *rc = ddca_create_busno_display_identifier(bus, &did);
+        if (*rc == 0) {
+            *rc = ddca_get_display_ref(did, &dref);
+            ddca_free_display_identifier(did);
+        }
+        if (*rc == 0)
+            *rc = ddca_open_display2(dref, true, &g_ddca_handles[slot]);
+        TRACE_END(t, "ddca_open");
+        if (*rc == 0)
+            g_ddca_buses[slot] = bus;
+        else
+            fprintf(stderr, "  libddcutil cannot open /dev/i2c-%d: %s\n", bus, ddca_rc_name(*rc));
+    }
+    dh = g_ddca_handles[slot];
+    pthread_mutex_unlock(&g_ddca_lock);
+    return dh;
+}
+
+/*
+ * Write a VCP value through libddcutil. It cannot send from another
+ * source address, so vendor registers (LG 0x50) go through the CLI.
+ * Returns DDCCI_OK or the class of the failure.
+ */
+ddcci_status libddcutil_write_value(int display_num, uint16_t input_value,
+                                    uint8_t command_code, uint8_t register_address) {
+    DDCA_Status rc;
+
+    if (register_address != DDCCI_HOST_ADDR)
+        return write_value_to_monitor(display_num, input_value, command_code, register_address);
+
+    DDCA_Display_Handle dh = libddcutil_handle(display_num, &rc);
+    if (!dh)
+        return libddcutil_status(rc);
+
+    TRACE_BEGIN(t);
+    rc = ddca_set_non_table_vcp_value(dh, command_code, (uint8_t)(input_value >> 8),
+                                      (uint8_t)(input_value & 0xFF));
+    TRACE_END(t, "ddca_setvcp");
+    if (rc != 0)
+        fprintf(stderr, "  libddcutil setvcp failed: %s\n", ddca_rc_name(rc));
+    return libddcutil_status(rc);
+}
+
+/*
+ * Read a VCP value through libddcutil; vendor registers go through the
+ * CLI like writes. Returns DDCCI_OK with the reply in *reply, or the
+ * class of the failure.
+ */
+ddcci_status libddcutil_read_value(int display_num, uint8_t command_code,
+                                   uint8_t register_address, ddcci_vcp_reply *reply) {
+    DDCA_Non_Table_Vcp_Value value;
+    DDCA_Status rc;
+
+    if (register_address != DDCCI_HOST_ADDR)
+        return ddcutil_read_value(display_num, command_code, register_address, reply);
+
+    DDCA_Display_Handle dh = libddcutil_handle(display_num, &rc);
+    if (!dh)
+        return libddcutil_status(rc);
+
+    TRACE_BEGIN(t);
+    rc = ddca_get_non_table_vcp_value(dh, command_code, &value);
+    TRACE_END(t, "ddca_getvcp");
+    if (rc != 0) {
+        fprintf(stderr, "  libddcutil getvcp failed: %s\n", ddca_rc_name(rc));
+        return libddcutil_status(rc);
+    }
+
+    reply->code = command_code;
+    reply->type = 0x00;
+    reply->cur_value = (uint16_t)((value.sh << 8) | value.sl);
+    reply->max_value = (uint16_t)((value.mh << 8) | value.ml);
+    return DDCCI_OK;
+}
+
+/*
+ * Read the capabilities string through libddcutil.
+ * caps must hold MCCS_CAPS_MAX_LEN + 1 bytes.
+ * Returns DDCCI_OK or the class of the failure.
+ */
+ddcci_status libddcutil_read_caps(int display_num, char *caps) {
+    char *text = NULL;
+    size_t len = 0;
+    DDCA_Status rc;
+
+    DDCA_Display_Handle dh = libddcutil_handle(display_num, &rc);
+    if (!dh)
+        return libddcutil_status(rc);
+
+    TRACE_BEGIN(t);
+    rc = ddca_get_capabilities_string(dh, &text);
+    TRACE_END(t, "ddca_capabilities");
+    if (rc != 0) {
+        fprintf(stderr, "  libddcutil capabilities failed: %s\n", ddca_rc_name(rc));
+        return libddcutil_status(rc);
+    }
+
+    caps[0] = '\0';
+    int ok = mccs_caps_append(caps, &len, (const uint8_t *)text, strlen(text));
+    free(text);
+    if (!ok) {
+        fprintf(stderr, "  Capabilities string longer than %d bytes\n", MCCS_CAPS_MAX_LEN);
+        return DDCCI_ERR_PROTOCOL;
+    }
+    return DDCCI_OK;
+}
+#endif // HAVE_LIBDDCUTIL
+
+// ============================================================
+// Virtual Backend
+// ============================================================
+
+// Environment variable configuring the emulated monitors, see
+// ddcci_emu_config_parse(), e.g. "displays=1,latency=60,nak=50"
+#define VIRTUAL_ENV "WRITEVALUETODISPLAY_VIRTUAL"
+
+// Monitor state lives for the process, so it carries across the
+// commands of one batch or one daemon
+static ddcci_emu g_virtual[DDCCI_EMU_MAX_DISPLAYS];
+static pthread_mutex_t g_virtual_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Power on the emulated monitors described by WRITEVALUETODISPLAY_VIRTUAL.
+ * Each gets a pseudo bus number equal to its index and a
+ * "Virtual-N" connector name.
+ * Returns number of entries written to displays[].
+ */
+int virtual_detect(display_entry *displays, int max_displays) {
+    ddcci_emu_config config;
+
+    ddcci_emu_config_init(&config);
+    if (!ddcci_emu_config_parse(&config, getenv(VIRTUAL_ENV)))
+        fprintf(stderr, "Ignoring unknown settings in %s\n", VIRTUAL_ENV);
+
+    int count = config.displays < max_displays ? config.displays : max_displays;
+    for (int i = 0; i < count; i++) {
+        ddcci_emu_init(&g_virtual[i], &config, i);
+        displays[i].bus = i;
+        displays[i].edid_hash = edid_hash(g_virtual[i].edid);
+        displays[i].edid_id = edid_identity(g_virtual[i].edid);
+        snprintf(displays[i].connector, sizeof(displays[i].connector), "Virtual-%d", i + 1);
+    }
+    return count;
+}
+
+/*
+ * Write value to an emulated monitor, through the same packet codec and
+ * timing model as the native backend.
+ *
+ * Returns DDCCI_OK or the class of the failure.
+ */
+ddcci_status virtual_write_value(int display_num, uint16_t input_value,
+                                 uint8_t command_code, uint8_t register_address) {
+    int count = display_count();
+
+    if (display_num < 1 || display_num > count) {
+        fprintf(stderr, "Display %d not found (only %d displays detected)\n",
+                display_num - 1, count);
+        return DDCCI_ERR_IO;
+    }
+
+    uint8_t packet[DDCCI_SET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_set_vcp(packet, register_address, command_code, input_value);
+    TRACE_END(t_build, "build_set_vcp");
+
+    uint64_t id = display_id(display_num);
+    int gated = timing_gate(id);
+    pthread_mutex_lock(&g_virtual_lock);
+    TRACE_BEGIN(t);
+    ddcci_status status = ddcci_emu_write(&g_virtual[display_num - 1], packet, sizeof(packet), monotonic_ms());
+    TRACE_END(t, "emu_write");
+    pthread_mutex_unlock(&g_virtual_lock);
+    timing_done(id, gated, status);
+
+    if (status != DDCCI_OK)
+        fprintf(stderr, "  Write to virtual display %d failed: %s\n",
+                display_num - 1, ddcci_status_text(status));
+    return status;
+}
+
+/*
+ * Read a VCP value from an emulated monitor.
+ *
+ * Returns DDCCI_OK with the parsed reply in *reply, or the class of the
+ * failure.
+ */
+ddcci_status virtual_read_value(int display_num, uint8_t command_code,
+                                uint8_t register_address, ddcci_vcp_reply *reply) {
+    int count = display_count();
+
+    if (display_num < 1 || display_num > count) {
+        fprintf(stderr, "Display %d not found (only %d displays detected)\n",
+                display_num - 1, count);
+        return DDCCI_ERR_IO;
+    }
+
+    ddcci_emu *emu = &g_virtual[display_num - 1];
+    uint8_t request[DDCCI_GET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_get_vcp(request, register_address, command_code);
+    TRACE_END(t_build, "build_get_vcp");
+
+    uint64_t id = display_id(display_num);
+    int gated = timing_gate(id);
+    pthread_mutex_lock(&g_virtual_lock);
+    TRACE_BEGIN(t);
+    ddcci_status status = ddcci_emu_write(emu, request, sizeof(request), monotonic_ms());
+    TRACE_END(t, "emu_write");
+    pthread_mutex_unlock(&g_virtual_lock);
+    timing_done(id, gated, status);
+
+    if (status != DDCCI_OK) {
+        fprintf(stderr, "  Write to virtual display %d failed: %s\n",
+                display_num - 1, ddcci_status_text(status));
+        return status;
+    }
+
+    pace_sleep(timing_reply_delay(id));
+
+    uint8_t buf[DDCCI_GET_VCP_REPLY_LEN];
+    pthread_mutex_lock(&g_virtual_lock);
+    TRACE_BEGIN(t_read);
+    status = ddcci_emu_read(emu, buf, sizeof(buf), monotonic_ms());
+    TRACE_END(t_read, "emu_read");
+    pthread_mutex_unlock(&g_virtual_lock);
+
+    if (status == DDCCI_OK) {
+        status = ddcci_parse_get_vcp_reply(buf, sizeof(buf), reply);
+        if (status == DDCCI_OK && reply->code != command_code)
+            status = DDCCI_ERR_PROTOCOL;
+    }
+
+    timing_reply_done(id, status);
+    if (status != DDCCI_OK)
+        fprintf(stderr, "  Get VCP 0x%02X failed: %s\n", command_code, ddcci_status_text(status));
+    return status;
+}
+
+/*
+ * Read one Capabilities Reply fragment from an emulated monitor.
+ *
+ * Returns DDCCI_OK with the fragment in data and its length in
+ * *data_len, or the class of the failure.
+ */
+ddcci_status virtual_caps_fragment(int display_num, uint16_t offset,
+                                   uint8_t *data, size_t *data_len) {
+    int count = display_count();
+
+    if (display_num < 1 || display_num > count) {
+        fprintf(stderr, "Display %d not found (only %d displays detected)\n",
+                display_num - 1, count);
+        return DDCCI_ERR_IO;
+    }
+
+    ddcci_emu *emu = &g_virtual[display_num - 1];
+    uint8_t request[DDCCI_CAPS_REQUEST_LEN];
+    ddcci_build_caps_request(request, offset);
+
+    uint64_t id = display_id(display_num);
+    int gated = timing_gate(id);
+    pthread_mutex_lock(&g_virtual_lock);
+    ddcci_status status = ddcci_emu_write(emu, request, sizeof(request), monotonic_ms());
+    pthread_mutex_unlock(&g_virtual_lock);
+    timing_done(id, gated, status);
+
+    if (status != DDCCI_OK) {
+        fprintf(stderr, "  Write to virtual display %d failed: %s\n",
+                display_num - 1, ddcci_status_text(status));
+        return status;
+    }
+
+    pace_sleep(timing_reply_delay(id));
+
+    uint8_t buf[DDCCI_FRAGMENT_REPLY_MAX_LEN];
+    pthread_mutex_lock(&g_virtual_lock);
+    status = ddcci_emu_read(emu, buf, sizeof(buf), monotonic_ms());
+    pthread_mutex_unlock(&g_virtual_lock);
+
+    if (status == DDCCI_OK)
+        status = mccs_caps_parse_fragment(buf, sizeof(buf), offset, data, data_len);
+
+    timing_reply_done(id, status);
+    if (status != DDCCI_OK)
+        fprintf(stderr, "  Capabilities fragment at %u failed: %s\n", offset, ddcci_status_text(status));
+    return status;
+}
+
+// ============================================================
+// Display topology cache
+// ============================================================
+
+/*
+ * Cache file: $XDG_CACHE_HOME/writeValueToDisplay/topology
+ * (~/.cache/... when XDG_CACHE_HOME is unset). Creates the directory.
+ * Returns 0 if no cache location is available.
+ */
+int cache_path(const char *name, char *path, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+
+    if (xdg && xdg[0])
+        snprintf(dir, sizeof(dir), "%s/writeValueToDisplay", xdg);
+    else if (home && home[0])
+        snprintf(dir, sizeof(dir), "%s/.cache/writeValueToDisplay", home);
+    else
+        return 0;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        // Parent ~/.cache may not exist yet
+        char parent[PATH_MAX];
+        snprintf(parent, sizeof(parent), "%s", dir);
+        *strrchr(parent, '/') = '\0';
+        mkdir(parent, 0700);
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+            return 0;
+    }
+
+    snprintf(path, size, "%s/%s", dir, name);
+    return 1;
+}
+
+/*
+ * Take the cross-process lock file <name> in the cache directory, so a
+ * read-modify-write of a shared cache file does not lose what another
+ * process saved meanwhile. Returns the descriptor, whose close drops the
+ * lock, or -1 without a cache directory.
+ */
+static int cache_lock(const char *name) {
+    char path[PATH_MAX];
+
+    if (!cache_path(name, path, sizeof(path)))
+        return -1;
+    int fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    while (flock(fd, LOCK_EX) < 0 && errno == EINTR)
+        ;
+    return fd;
+}
+
+static int filter_i2c_dev(const struct dirent *ent) {
+    return strncmp(ent->d_name, "i2c-", 4) == 0;
+}
+
+/*
+ * Fold the contents of a small sysfs file into the hash.
+ */
+static uint64_t hash_file(uint64_t hash, const char *path) {
+    uint8_t buf[512];
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+
+    if (fd < 0)
+        return hash;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        hash = edid_hash_update(hash, buf, n);
+    close(fd);
+    return hash;
+}
+
+/*
+ * Cheap fingerprint of the current display hardware: every DRM
+ * connector's name, status and kernel-cached EDID, plus the set of
+ * /dev/i2c-N nodes. Reading these never touches the I2C bus, and any
+ * hotplug, monitor swap or adapter change alters the result.
+ */
+uint64_t topology_signature(void) {
+    struct dirent **list;
+    uint64_t hash = EDID_HASH_INIT;
+    int n;
+
+    n = scandir("/sys/class/drm", &list, filter_connector, alphasort);
+    for (int i = 0; i < n; i++) {
+        char path[PATH_MAX];
+
+        hash = edid_hash_update(hash, list[i]->d_name, strlen(list[i]->d_name));
+        snprintf(path, sizeof(path), "/sys/class/drm/%s/status", list[i]->d_name);
+        hash = hash_file(hash, path);
+        snprintf(path, sizeof(path), "/sys/class/drm/%s/edid", list[i]->d_name);
+        hash = hash_file(hash, path);
+        free(list[i]);
+    }
+    if (n >= 0)
+        free(list);
+
+    n = scandir("/dev", &list, filter_i2c_dev, alphasort);
+    for (int i = 0; i < n; i++) {
+        hash = edid_hash_update(hash, list[i]->d_name, strlen(list[i]->d_name));
+        free(list[i]);
+    }
+    if (n >= 0)
+        free(list);
+
+    return hash;
+}
+
+/*
+ * Load the cached topology if its signature still matches.
+ * Returns the display count, or -1 on a miss.
+ */
+static int topology_load(uint64_t signature) {
+    char path[PATH_MAX];
+    char line[MAX_LINE_LEN];
+    unsigned long long cached_signature = 0;
+    char cached_backend[16] = "";
+    int count = 0;
+
+    if (!cache_path("topology", path, sizeof(path)))
+        return -1;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    if (!fgets(line, sizeof(line), fp) ||
+        sscanf(line, "signature %llx %15s", &cached_signature, cached_backend) != 2 ||
+        cached_signature != signature || strcmp(cached_backend, backend_name()) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    while (count < MAX_I2C_BUSES && fgets(line, sizeof(line), fp)) {
+        display_entry *entry = &g_displays[count];
+        unsigned long long hash, id;
+        int index;
+
+        if (sscanf(line, "%d %d %llx %llx %31s", &index, &entry->bus, &hash, &id,
+                   entry->connector) != 5 || index != count) {
+            fclose(fp);
+            return -1;
+        }
+        entry->edid_hash = hash;
+        entry->edid_id = id;
+        count++;
+    }
+
+    fclose(fp);
+    return count;
+}
+
+static void topology_save(uint64_t signature) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 8];
+
+    if (!cache_path("topology", path, sizeof(path)))
+        return;
+
+    // Write to a temp file and rename, so concurrent readers never see
+    // a partial cache
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp)
+        return;
+
+    fprintf(fp, "signature %016llx %s\n", (unsigned long long)signature, backend_name());
+    for (int i = 0; i < g_display_count; i++)
+        fprintf(fp, "%d %d %016llx %016llx %s\n", i, g_displays[i].bus,
+                (unsigned long long)g_displays[i].edid_hash,
+                (unsigned long long)g_displays[i].edid_id, g_displays[i].connector);
+
+    if (fclose(fp) == 0 && rename(tmp_path, path) == 0)
+        return;
+    unlink(tmp_path);
+}
+
+/*
+ * Drop the on-disk cache after a failure on a cached bus, so the next
+ * run enumerates again.
+ */
+static void topology_invalidate(void) {
+    char path[PATH_MAX];
+
+    if (g_topology_cached && cache_path("topology", path, sizeof(path))) {
+        unlink(path);
+        g_topology_cached = 0;
+    }
+}
+
+/*
+ * Return the number of displays. The first call loads the topology
+ * cache, or enumerates with the active backend and saves the result.
+ */
+static void edid_flush(void);
+
+static int display_count(void) {
+    if (g_display_count >= 0)
+        return g_display_count;
+
+    TRACE_BEGIN(t);
+
+    // Emulated monitors are cheap to "enumerate" and must follow the
+    // current configuration, so they bypass the cache
+    if (g_backend == BACKEND_VIRTUAL) {
+        g_display_count = virtual_detect(g_displays, MAX_I2C_BUSES);
+        for (int i = 0; i < g_display_count; i++)
+            g_bus_fds[i] = -1;
+        TRACE_END(t, "enumerate");
+        return g_display_count;
+    }
+
+    uint64_t signature = topology_signature();
+
+    g_display_count = g_rescan ? -1 : topology_load(signature);
+    g_topology_cached = g_display_count >= 0;
+
+    if (g_display_count < 0) {
+        if (g_backend == BACKEND_NATIVE)
+            g_display_count = enumerate_ddc_buses(g_displays, MAX_I2C_BUSES);
+#ifdef HAVE_LIBDDCUTIL
+        else if (g_backend == BACKEND_LIBDDCUTIL)
+            g_display_count = libddcutil_detect(g_displays, MAX_I2C_BUSES);
+#endif
+        else
+            g_display_count = ddcutil_detect(g_displays, MAX_I2C_BUSES);
+
+        if (g_display_count > 0)
+            topology_save(signature);
+        edid_flush();
+    }
+
+    for (int i = 0; i < g_display_count; i++)
+        g_bus_fds[i] = -1;
+    TRACE_END(t, g_topology_cached ? "topology_load" : "enumerate");
+    return g_display_count;
+}
+
+/*
+ * Find the display on the given DRM connector ("card0-DP-1" or "DP-1").
+ * Returns 1-based display number, or 0 if not found.
+ */
+static int display_by_connector(const char *output) {
+    int count = display_count();
+
+    for (int i = 0; i < count; i++) {
+        if (connector_matches(g_displays[i].connector, output))
+            return i + 1;
+    }
+    return 0;
+}
+
+/*
+ * Stable identity of a display for the shadow and timing caches: its
+ * EDID hash, so state follows the monitor across bus renumbering, else
+ * its bus. Returns 0 for a display that does not exist.
+ */
+static uint64_t display_id(int display_num) {
+    if (display_num < 1 || display_num > display_count())
+        return 0;
+    if (g_displays[display_num - 1].edid_hash)
+        return g_displays[display_num - 1].edid_hash;
+    return (uint64_t)g_displays[display_num - 1].bus + 1;
+}
+
+
+// ============================================================
+// EDID cache
+// ============================================================
+
+#define EDID_CACHE_MAX 64
+
+// EDID blocks of the monitors seen, keyed by the hash of the raw block,
+// with their parsed identity. The cache file keeps the raw block, so a
+// hash that matches guarantees the content and the parser can change
+// without invalidating it.
+typedef struct {
+    uint64_t hash;
+    uint8_t block[EDID_BLOCK_LEN];
+    edid_info info;
+} edid_entry;
+
+static edid_entry g_edid[EDID_CACHE_MAX];
+static int g_edid_count = -1;       // -1 until the cache file is loaded
+static int g_edid_dirty = 0;
+static pthread_mutex_t g_edid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// serial:, connector: and model: keys of every display, built on first use
+static edid_index g_display_index;
+static int g_display_index_built = 0;
+static pthread_mutex_t g_display_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Load $XDG_CACHE_HOME/writeValueToDisplay/edid, one "hash hex-block"
+ * per line. Lines whose block does not hash to their key are dropped.
+ * Caller holds g_edid_lock.
+ */
+static void edid_load(void) {
+    char path[PATH_MAX];
+    char line[2 * EDID_BLOCK_LEN + 32];
+
+    g_edid_count = 0;
+    if (!cache_path("edid", path, sizeof(path)))
+        return;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+
+    while (g_edid_count < EDID_CACHE_MAX && fgets(line, sizeof(line), fp)) {
+        edid_entry *entry = &g_edid[g_edid_count];
+        unsigned long long hash;
+        int n = 0;
+
+        if (sscanf(line, "%llx %n", &hash, &n) != 1 || !edid_from_hex(line + n, entry->block) ||
+            edid_hash(entry->block) != hash || !edid_parse(entry->block, &entry->info))
+            continue;
+        entry->hash = hash;
+        g_edid_count++;
+    }
+    fclose(fp);
+}
+
+/*
+ * Find a block by hash. Caller holds g_edid_lock.
+ */
+static edid_entry *edid_find(uint64_t hash) {
+    if (g_edid_count < 0)
+        edid_load();
+    for (int i = 0; i < g_edid_count; i++) {
+        if (g_edid[i].hash == hash)
+            return &g_edid[i];
+    }
+    return NULL;
+}
+
+/*
+ * Add a block read from a monitor. When the cache is full the oldest
+ * entry makes room.
+ */
+static void edid_remember(const uint8_t *edid) {
+    uint64_t hash = edid_hash(edid);
+
+    pthread_mutex_lock(&g_edid_lock);
+    if (!edid_find(hash)) {
+        if (g_edid_count == EDID_CACHE_MAX) {
+            memmove(&g_edid[0], &g_edid[1], (EDID_CACHE_MAX - 1) * sizeof(edid_entry));
+            g_edid_count--;
+        }
+        edid_entry *entry = &g_edid[g_edid_count];
+        memcpy(entry->block, edid, EDID_BLOCK_LEN);
+        if (edid_parse(entry->block, &entry->info)) {
+            entry->hash = hash;
+            g_edid_count++;
+            g_edid_dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&g_edid_lock);
+}
+
+/*
+ * Write the cache file if blocks were added.
+ */
+static void edid_flush(void) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    char hex[2 * EDID_BLOCK_LEN + 1];
+
+    pthread_mutex_lock(&g_edid_lock);
+    if (!g_edid_dirty || !cache_path("edid", path, sizeof(path))) {
+        pthread_mutex_unlock(&g_edid_lock);
+        return;
+    }
+    g_edid_dirty = 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lu", path, (int)getpid(), (unsigned long)pthread_self());
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp) {
+        for (int i = 0; i < g_edid_count; i++) {
+            edid_to_hex(g_edid[i].block, hex);
+            fprintf(fp, "%016llx %s\n", (unsigned long long)g_edid[i].hash, hex);
+        }
+        if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+            unlink(tmp_path);
+    }
+    pthread_mutex_unlock(&g_edid_lock);
+}
+
+/*
+ * Read a display's EDID again from where enumeration found it: the
+ * kernel's copy on its DRM connector, or the EEPROM at 0x50 on its bus.
+ * Returns 1 if a valid block was read.
+ */
+static int edid_acquire(int display_num, uint8_t *edid) {
+    const display_entry *d = &g_displays[display_num - 1];
+
+    if (strcmp(d->connector, "-") != 0 && drm_read_edid(d->connector, edid))
+        return 1;
+    if (g_backend != BACKEND_NATIVE || d->bus < 0)
+        return 0;
+
+    int fd = native_display_fd(display_num);
+    return fd >= 0 && read_edid(fd, edid);
+}
+
+/*
+ * Parsed EDID of a display. Looked up by the hash the topology recorded,
+ * so a cached topology costs no bus or sysfs access; on a miss the block
+ * is read again, checked against that hash and cached. Emulated monitors
+ * are parsed in place and never cached, like their topology.
+ * Returns 0 if the display has no EDID.
+ */
+int display_edid(int display_num, edid_info *info) {
+    uint8_t edid[EDID_BLOCK_LEN];
+
+    if (display_num < 1 || display_num > display_count() || !g_displays[display_num - 1].edid_hash)
+        return 0;
+    if (g_backend == BACKEND_VIRTUAL)
+        return edid_parse(g_virtual[display_num - 1].edid, info);
+
+    uint64_t hash = g_displays[display_num - 1].edid_hash;
+    pthread_mutex_lock(&g_edid_lock);
+    edid_entry *entry = edid_find(hash);
+    if (entry)
+        *info = entry->info;
+    pthread_mutex_unlock(&g_edid_lock);
+    if (entry)
+        return 1;
+
+    if (!edid_acquire(display_num, edid) || edid_hash(edid) != hash)
+        return 0;
+    edid_remember(edid);
+    edid_flush();
+    return edid_parse(edid, info);
+}
+
+static const mccs_caps *caps_lookup(uint64_t key);
+static uint64_t display_caps_key(int display_num);
+
+/*
+ * Index every display by the serial and model keys of its EDID, the
+ * model() of its cached capabilities, and its connector with and without
+ * the card prefix, once per process, so a lookup is one hash probe
+ * instead of a scan of the buses. Built from the topology, EDID and caps
+ * caches, so a warm host resolves selectors without enumerating.
+ */
+static const edid_index *display_index(void) {
+    pthread_mutex_lock(&g_display_index_lock);
+    if (!g_display_index_built) {
+        int count = display_count();
+        edid_info info;
+
+        edid_index_clear(&g_display_index);
+        for (int i = 0; i < count; i++) {
+            const char *connector = g_displays[i].connector;
+            const char *output = strchr(connector, '-');
+
+            if (display_edid(i + 1, &info))
+                edid_index_add_info(&g_display_index, &info, i + 1);
+
+            const mccs_caps *caps = caps_lookup(display_caps_key(i + 1));
+            if (caps)
+                edid_index_add(&g_display_index, "model", caps->model, i + 1);
+
+            if (strcmp(connector, "-") != 0) {
+                edid_index_add(&g_display_index, "connector", connector, i + 1);
+                if (output)
+                    edid_index_add(&g_display_index, "connector", output + 1, i + 1);
+            }
+        }
+        g_display_index_built = 1;
+    }
+    pthread_mutex_unlock(&g_display_index_lock);
+    return &g_display_index;
+}
+
+/*
+ * Find the display whose EDID serial number (descriptor text or
+ * numeric) is serial. Returns 1-based display number, or 0 if not found.
+ */
+int display_by_serial(const char *serial) {
+    int display_num = edid_index_find(display_index(), "serial", serial);
+    return display_num > 0 ? display_num : 0;
+}
+
+/*
+ * Find the first display whose EDID monitor name, PNP model id
+ * ("GSM5B7F") or capabilities model() is model.
+ * Returns 1-based display number, or 0 if not found.
+ */
+int display_by_model(const char *model) {
+    int display_num = edid_index_find(display_index(), "model", model);
+    return display_num > 0 ? display_num : 0;
+}
+
+/*
+ * Find the display named by a selector: "serial:S", "connector:C" or
+ * "model:M". Returns 1-based display number, or 0 if not found.
+ */
+int display_by_selector(const char *selector) {
+    const char *value = strchr(selector, ':');
+    int display_num = 0;
+
+    if (!value)
+        return 0;
+    if (strncmp(selector, "serial:", 7) == 0)
+        display_num = display_by_serial(value + 1);
+    else if (strncmp(selector, "model:", 6) == 0)
+        display_num = display_by_model(value + 1);
+    else if (strncmp(selector, "connector:", 10) == 0)
+        display_num = edid_index_find(display_index(), "connector", value + 1);
+    return display_num > 0 ? display_num : 0;
+}
+
+/*
+ * Check a display against a selector whose value has * and ? wildcards,
+ * e.g. "model:GSM*" or "connector:DP-*", on the same keys as the index.
+ */
+int display_matches(int display_num, const char *selector) {
+    const char *value = strchr(selector, ':');
+    edid_info info;
+
+    if (!value || display_num < 1 || display_num > display_count())
+        return 0;
+    value++;
+
+    if (strncmp(selector, "connector:", 10) == 0) {
+        const char *connector = g_displays[display_num - 1].connector;
+        const char *output = strchr(connector, '-');
+        return strcmp(connector, "-") != 0 &&
+               (edid_match(value, connector) || (output && edid_match(value, output + 1)));
+    }
+
+    const char *kind = strncmp(selector, "serial:", 7) == 0 ? "serial" : "model";
+    if (display_edid(display_num, &info) && edid_info_matches(&info, kind, value))
+        return 1;
+    if (strcmp(kind, "model") != 0)
+        return 0;
+
+    const mccs_caps *caps = caps_lookup(display_caps_key(display_num));
+    return caps && caps->model[0] && edid_match(value, caps->model);
+}
+
+
+// ============================================================
+// VCP shadow cache
+// ============================================================
+
+#define SHADOW_MAX_ENTRIES 256
+#define SHADOW_DEFAULT_TTL 300      // Seconds a shadow value is trusted by --if-changed
+
+// Last value we wrote to or read from one code on one monitor, trusted by
+// --if-changed for the TTL instead of a bus transaction.
+typedef struct {
+    uint64_t display_id;
+    uint8_t register_address;
+    uint8_t command_code;
+    uint16_t value;
+    time_t stamp;
+} shadow_entry;
+
+// Shared by batch workers and daemon clients, and persisted next to the
+// topology cache so one-shot runs and the daemon see each other's writes
+static shadow_entry g_shadow[SHADOW_MAX_ENTRIES];
+static int g_shadow_count = -1;
+static pthread_mutex_t g_shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Caller holds g_shadow_lock
+static void shadow_load(void) {
+    char path[PATH_MAX];
+    char line[MAX_LINE_LEN];
+
+    g_shadow_count = 0;
+    if (!cache_path("shadow", path, sizeof(path)))
+        return;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+
+    while (g_shadow_count < SHADOW_MAX_ENTRIES && fgets(line, sizeof(line), fp)) {
+        shadow_entry *entry = &g_shadow[g_shadow_count];
+        unsigned long long id;
+        unsigned int reg, code, value;
+        long long stamp;
+
+        if (sscanf(line, "%llx %x %x %x %lld", &id, &reg, &code, &value, &stamp) != 5)
+            continue;
+        entry->display_id = id;
+        entry->register_address = (uint8_t)reg;
+        entry->command_code = (uint8_t)code;
+        entry->value = (uint16_t)value;
+        entry->stamp = (time_t)stamp;
+        g_shadow_count++;
+    }
+    fclose(fp);
+}
+
+// Caller holds g_shadow_lock
+static void shadow_save(void) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 16];
+
+    if (!cache_path("shadow", path, sizeof(path)))
+        return;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lu", path, (int)getpid(), (unsigned long)pthread_self());
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp)
+        return;
+
+    for (int i = 0; i < g_shadow_count; i++) {
+        const shadow_entry *entry = &g_shadow[i];
+        fprintf(fp, "%016llx %02x %02x %04x %lld\n", (unsigned long long)entry->display_id,
+                entry->register_address, entry->command_code, entry->value, (long long)entry->stamp);
+    }
+
+    if (fclose(fp) == 0 && rename(tmp_path, path) == 0)
+        return;
+    unlink(tmp_path);
+}
+
+/*
+ * Take the cross-process lock of the shadow file and re-read it, so a
+ * change is merged into what other processes saved since we last looked
+ * instead of overwriting it with our older copy. Caller holds
+ * g_shadow_lock. Returns the lock descriptor, or -1 without a cache
+ * directory, in which case the table stays in memory only.
+ */
+static int shadow_begin_update(void) {
+    int fd = cache_lock("shadow.lock");
+    shadow_load();
+    return fd;
+}
+
+// Caller holds g_shadow_lock
+static void shadow_end_update(int fd) {
+    shadow_save();
+    if (fd >= 0)
+        close(fd);
+}
+
+// Caller holds g_shadow_lock
+static shadow_entry *shadow_find(uint64_t id, uint8_t register_address, uint8_t command_code) {
+    if (g_shadow_count < 0)
+        shadow_load();
+
+    for (int i = 0; i < g_shadow_count; i++) {
+        shadow_entry *entry = &g_shadow[i];
+        if (entry->display_id == id && entry->register_address == register_address &&
+            entry->command_code == command_code)
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Look up a value no older than ttl seconds, as last saved by any
+ * process. Returns 1 if found.
+ */
+int shadow_lookup(uint64_t id, uint8_t register_address, uint8_t command_code,
+                  int ttl, uint16_t *value) {
+    int found = 0;
+
+    pthread_mutex_lock(&g_shadow_lock);
+    shadow_load();
+    shadow_entry *entry = shadow_find(id, register_address, command_code);
+    if (entry && time(NULL) - entry->stamp < ttl) {
+        *value = entry->value;
+        found = 1;
+    }
+    pthread_mutex_unlock(&g_shadow_lock);
+    return found;
+}
+
+/*
+ * Record a value just written to the monitor.
+ */
+void shadow_store(uint64_t id, uint8_t register_address, uint8_t command_code, uint16_t value) {
+    pthread_mutex_lock(&g_shadow_lock);
+    int lock = shadow_begin_update();
+    shadow_entry *entry = shadow_find(id, register_address, command_code);
+    if (!entry) {
+        if (g_shadow_count < SHADOW_MAX_ENTRIES) {
+            entry = &g_shadow[g_shadow_count++];
+        } else {
+            // Full: reuse the stalest entry
+            entry = &g_shadow[0];
+            for (int i = 1; i < g_shadow_count; i++) {
+                if (g_shadow[i].stamp < entry->stamp)
+                    entry = &g_shadow[i];
+            }
+        }
+        entry->display_id = id;
+        entry->register_address = register_address;
+        entry->command_code = command_code;
+    }
+    entry->value = value;
+    entry->stamp = time(NULL);
+    shadow_end_update(lock);
+    pthread_mutex_unlock(&g_shadow_lock);
+}
+
+/*
+ * Forget a value after a failed write left the monitor state unknown.
+ */
+void shadow_forget(uint64_t id, uint8_t register_address, uint8_t command_code) {
+    pthread_mutex_lock(&g_shadow_lock);
+    int lock = shadow_begin_update();
+    shadow_entry *entry = shadow_find(id, register_address, command_code);
+    if (entry) {
+        *entry = g_shadow[--g_shadow_count];
+        shadow_end_update(lock);
+    } else if (lock >= 0) {
+        close(lock);
+    }
+    pthread_mutex_unlock(&g_shadow_lock);
+}
+
+
+// ============================================================
+// Adaptive MCCS timing
+// ============================================================
+
+// Learned delays of one monitor, plus when its last transaction ended
+typedef struct {
+    uint64_t display_id;
+    mccs_timing timing;
+    uint64_t last_op_ms;        // Monotonic clock, 0 before the first transaction
+    int link_down;              // Input or power switched, failures say nothing about timing
+} timing_entry;
+
+// Shared by batch workers and daemon clients; the delays are persisted
+// so every run starts from what earlier runs learned
+static timing_entry g_timing[MAX_I2C_BUSES];
+static int g_timing_count = -1;
+static pthread_mutex_t g_timing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Time this thread has spent in pacing sleeps, for --bench
+static __thread uint64_t t_paced_us;
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Sleep for an MCCS delay or retry backoff, accounting the time slept.
+ */
+static void pace_sleep(uint32_t ms) {
+    uint64_t start = monotonic_us();
+    TRACE_BEGIN(t);
+    usleep(ms * 1000);
+    TRACE_END(t, "sleep");
+    t_paced_us += monotonic_us() - start;
+}
+
+/*
+ * Parse one line of the timing file into a freshly initialised model.
+ * Entries without floor times predate their expiry and are loaded with
+ * the floors already expired. Returns 0 for a malformed line.
+ */
+static int timing_parse(const char *line, uint64_t *id, mccs_timing *timing) {
+    unsigned long long display_id, write_time = 0, reply_time = 0;
+    unsigned int write_ms, write_floor, reply_ms, reply_floor;
+    unsigned int write_min = DDCCI_SET_VCP_DELAY_MS;
+
+    int fields = sscanf(line, "%llx %u %u %u %u %llu %llu %u", &display_id, &write_ms, &write_floor,
+                        &reply_ms, &reply_floor, &write_time, &reply_time, &write_min);
+    if (fields != 5 && fields != 8)
+        return 0;
+    *id = display_id;
+    mccs_timing_init(timing);
+    timing->write.ms = (uint16_t)write_ms;
+    timing->write.floor_ms = (uint16_t)write_floor;
+    timing->write.floor_time = write_time;
+    timing->write.min_ms = write_min == MCCS_TIMING_MIN_MS ? MCCS_TIMING_MIN_MS : DDCCI_SET_VCP_DELAY_MS;
+    timing->reply.ms = (uint16_t)reply_ms;
+    timing->reply.floor_ms = (uint16_t)reply_floor;
+    timing->reply.floor_time = reply_time;
+    mccs_timing_expire(timing, (uint64_t)time(NULL));
+    return 1;
+}
+
+// Take over the persisted part of a delay another process saved
+static void timing_adopt(mccs_delay *delay, const mccs_delay *saved) {
+    delay->ms = saved->ms;
+    delay->floor_ms = saved->floor_ms;
+    delay->floor_time = saved->floor_time;
+    delay->min_ms = saved->min_ms;
+}
+
+// Caller holds g_timing_lock
+static void timing_load(void) {
+    char path[PATH_MAX];
+    char line[MAX_LINE_LEN];
+
+    g_timing_count = 0;
+    if (!cache_path("timing", path, sizeof(path)))
+        return;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+
+    while (g_timing_count < MAX_I2C_BUSES && fgets(line, sizeof(line), fp)) {
+        timing_entry *entry = &g_timing[g_timing_count];
+
+        if (!timing_parse(line, &entry->display_id, &entry->timing))
+            continue;
+        entry->last_op_ms = 0;
+        entry->link_down = 0;
+        g_timing_count++;
+    }
+    fclose(fp);
+}
+
+// Caller holds g_timing_lock. Returns NULL only when the table is full.
+static timing_entry *timing_find(uint64_t id) {
+    if (g_timing_count < 0)
+        timing_load();
+
+    for (int i = 0; i < g_timing_count; i++) {
+        if (g_timing[i].display_id == id)
+            return &g_timing[i];
+    }
+    if (g_timing_count == MAX_I2C_BUSES)
+        return NULL;
+
+    timing_entry *entry = &g_timing[g_timing_count++];
+    entry->display_id = id;
+    mccs_timing_init(&entry->timing);
+    entry->last_op_ms = 0;
+    entry->link_down = 0;
+    return entry;
+}
+
+/*
+ * Save the delays of a changed entry. The file is shared by one-shot runs
+ * and the daemon, which loads it once, so it is re-read under its lock
+ * first: every other monitor keeps what was last saved for it, and our
+ * table takes that over, instead of our older copy overwriting it.
+ * Caller holds g_timing_lock.
+ */
+static void timing_save(const timing_entry *changed) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    char line[MAX_LINE_LEN];
+
+    if (!cache_path("timing", path, sizeof(path)))
+        return;
+
+    int lock = cache_lock("timing.lock");
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            uint64_t id;
+            mccs_timing saved;
+
+            if (!timing_parse(line, &id, &saved) || id == changed->display_id)
+                continue;
+            timing_entry *entry = timing_find(id);
+            if (entry) {
+                timing_adopt(&entry->timing.write, &saved.write);
+                timing_adopt(&entry->timing.reply, &saved.reply);
+            }
+        }
+        fclose(fp);
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lu", path, (int)getpid(), (unsigned long)pthread_self());
+    fp = fopen(tmp_path, "w");
+    if (fp) {
+        for (int i = 0; i < g_timing_count; i++) {
+            const mccs_timing *t = &g_timing[i].timing;
+            fprintf(fp, "%016llx %u %u %u %u %llu %llu %u\n", (unsigned long long)g_timing[i].display_id,
+                    t->write.ms, t->write.floor_ms, t->reply.ms, t->reply.floor_ms,
+                    (unsigned long long)t->write.floor_time, (unsigned long long)t->reply.floor_time,
+                    t->write.min_ms);
+        }
+        if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+            unlink(tmp_path);
+    }
+    if (lock >= 0)
+        close(lock);
+}
+
+/*
+ * Wait until the monitor is ready for its next transaction: the learned
+ * write delay after the end of the previous one. Nothing is waited for
+ * the first transaction, or when enough time has passed anyway.
+ * Returns 1 if a delay was enforced, so the outcome of the transaction
+ * says something about whether that delay was long enough.
+ */
+static int timing_gate(uint64_t id) {
+    uint64_t wait_ms = 0;
+    int gated = 0;
+
+    pthread_mutex_lock(&g_timing_lock);
+    timing_entry *entry = timing_find(id);
+    if (entry && entry->last_op_ms) {
+        uint64_t elapsed = monotonic_ms() - entry->last_op_ms;
+        gated = elapsed < (uint64_t)entry->timing.write.ms + MCCS_TIMING_MIN_MS;
+        if (elapsed < entry->timing.write.ms)
+            wait_ms = entry->timing.write.ms - elapsed;
+    }
+    pthread_mutex_unlock(&g_timing_lock);
+
+    if (wait_ms)
+        pace_sleep((uint32_t)wait_ms);
+    return gated;
+}
+
+/*
+ * Fold an outcome into one of an entry's delays. Failures that say
+ * nothing about timing are ignored, and so is every failure while the
+ * monitor may be away after an input or power switch, until it answers
+ * again. Caller holds g_timing_lock.
+ */
+static void timing_adapt(timing_entry *entry, mccs_delay *delay, ddcci_status status) {
+    int outcome = mccs_timing_outcome(status);
+
+    if (outcome > 0)
+        entry->link_down = 0;
+    if (outcome < 0 || (outcome == 0 && entry->link_down))
+        return;
+    if (mccs_delay_adapt(delay, outcome, (uint64_t)time(NULL)))
+        timing_save(entry);
+}
+
+/*
+ * Record the end of a transaction and, if it was gated, whether the
+ * monitor accepted it.
+ */
+static void timing_done(uint64_t id, int gated, ddcci_status status) {
+    pthread_mutex_lock(&g_timing_lock);
+    timing_entry *entry = timing_find(id);
+    if (entry) {
+        entry->last_op_ms = monotonic_ms();
+        if (gated)
+            timing_adapt(entry, &entry->timing.write, status);
+    }
+    pthread_mutex_unlock(&g_timing_lock);
+}
+
+/*
+ * Note a successful write of a code after which the monitor may stop
+ * answering for a while (see mccs_code_drops_link()).
+ */
+static void timing_link_drop(uint64_t id) {
+    pthread_mutex_lock(&g_timing_lock);
+    timing_entry *entry = timing_find(id);
+    if (entry)
+        entry->link_down = 1;
+    pthread_mutex_unlock(&g_timing_lock);
+}
+
+/*
+ * Record whether a written value read back as written.
+ */
+static void timing_confirm(uint64_t id, int ok) {
+    pthread_mutex_lock(&g_timing_lock);
+    timing_entry *entry = timing_find(id);
+    if (entry && mccs_timing_confirm(&entry->timing, ok, (uint64_t)time(NULL)))
+        timing_save(entry);
+    pthread_mutex_unlock(&g_timing_lock);
+}
+
+/*
+ * Delay between a request and reading its reply, in milliseconds.
+ */
+static int timing_reply_delay(uint64_t id) {
+    int ms = DDCCI_REPLY_DELAY_MS;
+
+    pthread_mutex_lock(&g_timing_lock);
+    timing_entry *entry = timing_find(id);
+    if (entry)
+        ms = entry->timing.reply.ms;
+    pthread_mutex_unlock(&g_timing_lock);
+    return ms;
+}
+
+/*
+ * Record whether a reply was ready and intact after the reply delay.
+ */
+static void timing_reply_done(uint64_t id, ddcci_status status) {
+    pthread_mutex_lock(&g_timing_lock);
+    timing_entry *entry = timing_find(id);
+    if (entry) {
+        entry->last_op_ms = monotonic_ms();
+        timing_adapt(entry, &entry->timing.reply, status);
+    }
+    pthread_mutex_unlock(&g_timing_lock);
+}
+
+
+// ============================================================
+// Bus locks
+// ============================================================
+
+#define BUS_LOCK_TIMEOUT_MS 5000    // Longest wait for another process's transaction
+#define BUS_LOCK_DIR "/tmp"         // Shared by every user, see bus_lock_open()
+
+// A blocking flock() handed to a helper thread, so its waiter can give
+// up after a timeout. A waiter that gave up leaves the descriptor to the
+// helper, which closes it once the lock comes through.
+enum { BUS_WAIT_PENDING, BUS_WAIT_LOCKED, BUS_WAIT_FAILED, BUS_WAIT_ABANDONED };
+
+typedef struct {
+    int fd;
+    int state;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} bus_wait;
+
+static void bus_wait_free(bus_wait *wait) {
+    pthread_cond_destroy(&wait->cond);
+    pthread_mutex_destroy(&wait->lock);
+    free(wait);
+}
+
+static void *bus_wait_thread(void *arg) {
+    bus_wait *wait = arg;
+    int rc;
+
+    while ((rc = flock(wait->fd, LOCK_EX)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&wait->lock);
+    if (wait->state == BUS_WAIT_ABANDONED) {
+        pthread_mutex_unlock(&wait->lock);
+        close(wait->fd);
+        bus_wait_free(wait);
+        return NULL;
+    }
+    wait->state = rc == 0 ? BUS_WAIT_LOCKED : BUS_WAIT_FAILED;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->lock);
+    return NULL;
+}
+
+/*
+ * Wait up to timeout_ms for the flock() of fd in a helper thread. The
+ * kernel wakes blocked waiters as soon as the holder lets go, so they
+ * are not starved by a process that keeps retaking the lock between
+ * polls. Returns 1 with the lock held, 0 on timeout or error, in which
+ * case fd is no longer the caller's.
+ */
+static int bus_lock_wait(int fd, int timeout_ms) {
+    bus_wait *wait = calloc(1, sizeof(*wait));
+    pthread_condattr_t attr;
+    pthread_attr_t thread_attr;
+    pthread_t thread;
+    struct timespec deadline;
+
+    if (!wait) {
+        close(fd);
+        return 0;
+    }
+    wait->fd = fd;
+    wait->state = BUS_WAIT_PENDING;
+    pthread_mutex_init(&wait->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wait->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    int started = pthread_create(&thread, &thread_attr, bus_wait_thread, wait) == 0;
+    pthread_attr_destroy(&thread_attr);
+    if (!started) {
+        bus_wait_free(wait);
+        close(fd);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&wait->lock);
+    while (wait->state == BUS_WAIT_PENDING &&
+           pthread_cond_timedwait(&wait->cond, &wait->lock, &deadline) != ETIMEDOUT)
+        ;
+    int state = wait->state;
+    if (state == BUS_WAIT_PENDING)
+        wait->state = BUS_WAIT_ABANDONED;
+    pthread_mutex_unlock(&wait->lock);
+
+    if (state == BUS_WAIT_PENDING)
+        return 0;
+    bus_wait_free(wait);
+    if (state == BUS_WAIT_FAILED)
+        close(fd);
+    return state == BUS_WAIT_LOCKED;
+}
+
+/*
+ * Open the lock file of a bus. Every user shares one file per bus in
+ * /tmp, the one directory all of them can create files in: /run/lock is
+ * root-only on some distributions, which would split root jobs and user
+ * runs onto different files. An existing file is opened without
+ * O_CREAT, which fs.protected_regular refuses on another user's file in
+ * sticky /tmp; a new one is made openable by everyone whatever our
+ * umask. Returns the descriptor, or -1 after reporting the error.
+ */
+static int bus_lock_open(int bus) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/writeValueToDisplay-i2c-%d.lock", BUS_LOCK_DIR, bus);
+    for (;;) {
+        int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0)
+            return fd;
+        if (errno == ENOENT) {
+            fd = open(path, O_RDONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+            if (fd >= 0) {
+                fchmod(fd, 0666);
+                return fd;
+            }
+            if (errno == EEXIST)
+                continue;       // Created by another process in between
+        }
+        fprintf(stderr, "  Cannot open bus lock %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+}
+
+/*
+ * Take the cross-process lock of a display's bus, so concurrent
+ * invocations (two hotkeys, a cron job and a user, the daemon and
+ * --no-daemon) are serialized instead of interleaving transactions on
+ * it. Different buses lock independently. The lock is flock() on the
+ * bus's file from bus_lock_open(), which the kernel drops if the holder
+ * dies. A free lock is taken right away; otherwise the caller blocks in
+ * flock() until the holder lets go, giving up after BUS_LOCK_TIMEOUT_MS.
+ * A lock file that cannot be opened fails like a busy bus, rather than
+ * letting the transaction run unserialized.
+ * Returns the lock descriptor, -1 if the bus could not be locked, or -2
+ * when no lock applies (virtual backend, unknown bus).
+ */
+static int bus_lock(int display_num) {
+    if (g_backend == BACKEND_VIRTUAL || display_num < 1 || display_num > display_count() ||
+        g_displays[display_num - 1].bus < 0)
+        return -2;
+
+    int bus = g_displays[display_num - 1].bus;
+    int fd = bus_lock_open(bus);
+    if (fd < 0)
+        return -1;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+        return fd;
+
+    TRACE_BEGIN(t);
+    if (errno != EWOULDBLOCK) {
+        close(fd);
+        fd = -1;
+    } else if (!bus_lock_wait(fd, BUS_LOCK_TIMEOUT_MS)) {
+        fd = -1;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "  /dev/i2c-%d is busy, another process held it for %d ms\n",
+                bus, BUS_LOCK_TIMEOUT_MS);
+        return -1;
+    }
+    TRACE_END(t, "bus_lock");
+    return fd;
+}
+
+/*
+ * Release a lock taken by bus_lock().
+ */
+static void bus_unlock(int fd) {
+    if (fd >= 0)
+        close(fd);
+}
+
+// ============================================================
+// Backend dispatch
+// ============================================================
+
+/*
+ * Settle the backend before the first command: the native backend falls
+ * back to libddcutil, if built in, or the ddcutil CLI when no I2C bus
+ * can be opened. Must run before any worker threads are started.
+ */
+void prepare_backend(void) {
+    TRACE_BEGIN(t);
+    if (g_backend == BACKEND_NATIVE && display_count() == 0) {
+#ifdef HAVE_LIBDDCUTIL
+        printf("No accessible /dev/i2c-N bus (is i2c-dev loaded?), falling back to libddcutil\n");
+        g_backend = BACKEND_LIBDDCUTIL;
+#else
+        printf("No accessible /dev/i2c-N bus (is i2c-dev loaded?), falling back to ddcutil\n");
+        g_backend = BACKEND_DDCUTIL;
+#endif
+        g_display_count = -1;
+    }
+    TRACE_END(t, "init");
+}
+
+/*
+ * Identify the physical bus a display is on. Commands with the same key
+ * must be serialized; different keys can run in parallel.
+ * Returns -1 for a display that does not exist.
+ */
+int display_bus_key(int display_num) {
+    if (display_num < 1 || display_num > display_count())
+        return g_backend == BACKEND_DDCUTIL ? display_num : -1;
+    return g_displays[display_num - 1].bus;
+}
+
+/*
+ * Decide whether a failed transaction gets another attempt, and if so
+ * sleep the backoff for it. attempt is the 0-based attempt that failed.
+ * libddcutil has already retried inside the call, so its failures are
+ * final here.
+ */
+static int retry_after(ddcci_status status, int attempt) {
+    static __thread uint32_t seed;
+
+    if (g_backend == BACKEND_LIBDDCUTIL || !ddcci_status_is_transient(status) ||
+        attempt + 1 >= MCCS_RETRY_ATTEMPTS)
+        return 0;
+
+    if (seed == 0)
+        seed = (uint32_t)monotonic_ms() ^ (uint32_t)(uintptr_t)&seed ^ 0x9E3779B9u;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    uint32_t ms = mccs_backoff_ms((unsigned)attempt, seed);
+    fprintf(stderr, "  %s, retrying in %u ms\n", ddcci_status_text(status), ms);
+    pace_sleep(ms);
+    return 1;
+}
+
+/*
+ * Report a transaction that failed for good. Anything but a clean
+ * "unsupported" may mean the cached bus now belongs to another monitor.
+ */
+static void transaction_failed(ddcci_status status) {
+    if (status != DDCCI_ERR_UNSUPPORTED)
+        topology_invalidate();
+}
+
+/*
+ * Read a value with the display's bus lock already held by the caller.
+ */
+static int read_value_locked(int display_num, uint8_t command_code,
+                             uint8_t register_address, ddcci_vcp_reply *reply) {
+    ddcci_status status;
+
+    for (int attempt = 0; ; attempt++) {
+        TRACE_BEGIN(t);
+        if (g_backend == BACKEND_NATIVE)
+            status = native_read_value(display_num, command_code, register_address, reply);
+        else if (g_backend == BACKEND_VIRTUAL)
+            status = virtual_read_value(display_num, command_code, register_address, reply);
+#ifdef HAVE_LIBDDCUTIL
+        else if (g_backend == BACKEND_LIBDDCUTIL)
+            status = libddcutil_read_value(display_num, command_code, register_address, reply);
+#endif
+        else
+            status = ddcutil_read_value(display_num, command_code, register_address, reply);
+        TRACE_END(t, "read_attempt");
+        if (status == DDCCI_OK || !retry_after(status, attempt))
+            break;
+    }
+
+    if (status == DDCCI_OK)
+        return 1;
+    transaction_failed(status);
+    return 0;
+}
+
+/*
+ * Write a value with the display's bus lock already held by the caller.
+ */
+static int write_value_locked(int display_num, uint16_t input_value,
+                              uint8_t command_code, uint8_t register_address) {
+    ddcci_status status;
+
+    for (int attempt = 0; ; attempt++) {
+        TRACE_BEGIN(t);
+        if (g_backend == BACKEND_NATIVE)
+            status = native_write_value(display_num, input_value,
+                                        command_code, register_address);
+        else if (g_backend == BACKEND_VIRTUAL)
+            status = virtual_write_value(display_num, input_value,
+                                         command_code, register_address);
+#ifdef HAVE_LIBDDCUTIL
+        else if (g_backend == BACKEND_LIBDDCUTIL)
+            status = libddcutil_write_value(display_num, input_value,
+                                            command_code, register_address);
+#endif
+        else
+            status = write_value_to_monitor(display_num, input_value,
+                                            command_code, register_address);
+        TRACE_END(t, "write_attempt");
+        if (status == DDCCI_OK || !retry_after(status, attempt))
+            break;
+    }
+
+    if (status == DDCCI_OK) {
+        if (mccs_code_drops_link(register_address, command_code))
+            timing_link_drop(display_id(display_num));
+        return 1;
+    }
+    transaction_failed(status);
+    return 0;
+}
+
+int read_value(int display_num, uint8_t command_code,
+               uint8_t register_address, ddcci_vcp_reply *reply) {
+    prepare_backend();
+
+    int lock = bus_lock(display_num);
+    if (lock == -1)
+        return 0;
+    int ok = read_value_locked(display_num, command_code, register_address, reply);
+    bus_unlock(lock);
+    return ok;
+}
+
+int write_value(int display_num, uint16_t input_value,
+                uint8_t command_code, uint8_t register_address) {
+    prepare_backend();
+
+    int lock = bus_lock(display_num);
+    if (lock == -1)
+        return 0;
+    int ok = write_value_locked(display_num, input_value, command_code, register_address);
+    bus_unlock(lock);
+    return ok;
+}
+
+// ============================================================
+// Capabilities
+// ============================================================
+
+// Parsed capabilities of the monitors this process has looked up. An
+// entry with known == 0 records that the cache has nothing for that key.
+typedef struct {
+    uint64_t key;
+    int known;
+    mccs_caps caps;
+} caps_entry;
+
+static caps_entry g_caps[MAX_I2C_BUSES];
+static int g_caps_count = 0;
+static pthread_mutex_t g_caps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Key of a display in the caps cache: the manufacturer, product and
+ * serial from its EDID, so the entry follows the monitor to any bus and
+ * survives EDID changes that leave its identity alone. Falls back to
+ * display_id(). Returns 0 for a display that does not exist.
+ */
+static uint64_t display_caps_key(int display_num) {
+    if (display_num < 1 || display_num > display_count())
+        return 0;
+    if (g_displays[display_num - 1].edid_id)
+        return g_displays[display_num - 1].edid_id;
+    return display_id(display_num);
+}
+
+/*
+ * Find the cached capabilities string of a monitor in
+ * $XDG_CACHE_HOME/writeValueToDisplay/caps, one "key string" per line.
+ * caps must hold MCCS_CAPS_MAX_LEN + 1 bytes. Returns 1 if found.
+ */
+static int caps_read_cached(uint64_t key, char *caps) {
+    char path[PATH_MAX];
+    char line[MCCS_CAPS_MAX_LEN + 32];
+    int found = 0;
+
+    if (!cache_path("caps", path, sizeof(path)))
+        return 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        unsigned long long cached_key;
+        int n = 0;
+
+        if (sscanf(line, "%llx %n", &cached_key, &n) != 1 || cached_key != key)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(caps, MCCS_CAPS_MAX_LEN + 1, "%s", line + n);
+        found = 1;
+    }
+    fclose(fp);
+    return found;
+}
+
+/*
+ * Store a monitor's capabilities string, replacing its old line.
+ */
+static void caps_save(uint64_t key, const char *caps) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    char line[MCCS_CAPS_MAX_LEN + 32];
+
+    if (!cache_path("caps", path, sizeof(path)))
+        return;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lu", path, (int)getpid(), (unsigned long)pthread_self());
+    FILE *out = fopen(tmp_path, "w");
+    if (!out)
+        return;
+
+    FILE *in = fopen(path, "r");
+    while (in && fgets(line, sizeof(line), in)) {
+        unsigned long long cached_key;
+        if (sscanf(line, "%llx", &cached_key) == 1 && cached_key != key && strchr(line, '\n'))
+            fputs(line, out);
+    }
+    if (in)
+        fclose(in);
+    fprintf(out, "%016llx %s\n", (unsigned long long)key, caps);
+
+    if (fclose(out) == 0 && rename(tmp_path, path) == 0)
+        return;
+    unlink(tmp_path);
+}
+
+/*
+ * Parsed capabilities of a monitor from the caps cache, or NULL if they
+ * were never read with --caps. The cache file is read at most once per
+ * monitor and process.
+ */
+static const mccs_caps *caps_lookup(uint64_t key) {
+    caps_entry *entry = NULL;
+    char text[MCCS_CAPS_MAX_LEN + 1];
+
+    pthread_mutex_lock(&g_caps_lock);
+    for (int i = 0; !entry && i < g_caps_count; i++) {
+        if (g_caps[i].key == key)
+            entry = &g_caps[i];
+    }
+    if (!entry && g_caps_count < MAX_I2C_BUSES) {
+        entry = &g_caps[g_caps_count++];
+        entry->key = key;
+        entry->known = caps_read_cached(key, text) && mccs_caps_parse(text, &entry->caps);
+    }
+    pthread_mutex_unlock(&g_caps_lock);
+    return entry && entry->known ? &entry->caps : NULL;
+}
+
+/*
+ * Remember freshly read capabilities in this process and the cache.
+ */
+static void caps_store(uint64_t key, const char *text) {
+    caps_entry *entry = NULL;
+
+    pthread_mutex_lock(&g_caps_lock);
+    for (int i = 0; !entry && i < g_caps_count; i++) {
+        if (g_caps[i].key == key)
+            entry = &g_caps[i];
+    }
+    if (!entry && g_caps_count < MAX_I2C_BUSES) {
+        entry = &g_caps[g_caps_count++];
+        entry->key = key;
+    }
+    if (entry)
+        entry->known = mccs_caps_parse(text, &entry->caps);
+    caps_save(key, text);
+    pthread_mutex_unlock(&g_caps_lock);
+}
+
+/*
+ * Read the capabilities string from the monitor. DDC/CI allows one
+ * outstanding request, so fragments are requested back to back, spaced
+ * only by the monitor's learned timing, and each fragment is retried on
+ * its own instead of restarting the whole string.
+ * caps must hold MCCS_CAPS_MAX_LEN + 1 bytes. Returns 1 on success.
+ */
+static int read_caps_fragments(int display_num, char *caps) {
+    ddcci_status status = DDCCI_OK;
+    size_t len = 0;
+    uint16_t offset = 0;
+
+    caps[0] = '\0';
+
+    if (g_backend == BACKEND_DDCUTIL || g_backend == BACKEND_LIBDDCUTIL) {
+#ifdef HAVE_LIBDDCUTIL
+        if (g_backend == BACKEND_LIBDDCUTIL)
+            status = libddcutil_read_caps(display_num, caps);
+        else
+#endif
+            status = ddcutil_read_caps(display_num, caps);
+        if (status == DDCCI_OK)
+            return 1;
+        transaction_failed(status);
+        return 0;
+    }
+
+    for (;;) {
+        uint8_t data[DDCCI_MAX_FRAGMENT];
+        size_t n = 0;
+
+        for (int attempt = 0; ; attempt++) {
+            TRACE_BEGIN(t);
+            if (g_backend == BACKEND_NATIVE)
+                status = native_caps_fragment(display_num, offset, data, &n);
+            else
+                status = virtual_caps_fragment(display_num, offset, data, &n);
+            TRACE_END(t, "caps_fragment");
+            if (status == DDCCI_OK || !retry_after(status, attempt))
+                break;
+        }
+
+        if (status != DDCCI_OK) {
+            transaction_failed(status);
+            return 0;
+        }
+        if (n == 0)
+            return caps[0] != '\0';
+        if (!mccs_caps_append(caps, &len, data, n)) {
+            fprintf(stderr, "  Capabilities string longer than %d bytes\n", MCCS_CAPS_MAX_LEN);
+            return 0;
+        }
+        offset = (uint16_t)(offset + n);
+    }
+}
+
+/*
+ * Read the capabilities string under one bus lock, so no other process
+ * gets a request in between two fragments.
+ */
+int read_caps(int display_num, char *caps) {
+    prepare_backend();
+
+    int lock = bus_lock(display_num);
+    if (lock == -1)
+        return 0;
+    int ok = read_caps_fragments(display_num, caps);
+    bus_unlock(lock);
+    return ok;
+}
+
+// ============================================================
+// Command parsing and execution
+// ============================================================
+
+typedef struct {
+    int display_index;
+    uint16_t input_value;       // Written as the high and low value bytes
+    uint8_t command_code;
+    uint8_t register_address;
+    int shadow_ttl;             // --if-changed: max shadow age in seconds, -1 to always write
+    int verify;                 // --verify: read the value back after writing it
+    char selector[48];          // "serial:S", "connector:C", "model:M" or a display set,
+                                // "" to use display_index
+} vcp_command;
+
+// --display: index or selector for every command, which then omits
+// the display_index argument
+static const char *g_display_arg = NULL;
+
+// Primary display, resolved once per process and again after a hotplug
+static int g_primary_display = 0;
+
+/*
+ * Parse a display argument: an index, a selector "serial:S",
+ * "connector:C" or "model:M", or a display set: "all", a list of
+ * indices "0,2,3", or a selector with * and ? wildcards ("model:GSM*").
+ * Spaces are dropped from a selector, since lookups ignore them and the
+ * daemon protocol splits on them.
+ * Returns 0 for an unknown selector kind or an over-long selector.
+ */
+int parse_display(const char *arg, vcp_command *cmd) {
+    size_t len = 0;
+
+    cmd->display_index = -1;
+    cmd->selector[0] = '\0';
+    if (strcmp(arg, "all") != 0 && !strchr(arg, ',') && !strchr(arg, ':')) {
+        cmd->display_index = atoi(arg);
+        return 1;
+    }
+    if (strchr(arg, ':') && strncmp(arg, "serial:", 7) != 0 &&
+        strncmp(arg, "connector:", 10) != 0 && strncmp(arg, "model:", 6) != 0)
+        return 0;
+
+    for (; *arg; arg++) {
+        if (*arg == ' ')
+            continue;
+        if (len == sizeof(cmd->selector) - 1)
+            return 0;
+        cmd->selector[len++] = *arg;
+    }
+    cmd->selector[len] = '\0';
+    return 1;
+}
+
+/*
+ * Check whether a command addresses a set of displays rather than one.
+ */
+int display_is_set(const vcp_command *cmd) {
+    return strcmp(cmd->selector, "all") == 0 || strchr(cmd->selector, ',') ||
+           strpbrk(cmd->selector, "*?");
+}
+
+/*
+ * Expand a display set into 1-based display numbers, in the order given
+ * for a list and display order otherwise. A list keeps indices that do
+ * not exist, so the write to them fails and is reported.
+ * display_nums must hold MAX_I2C_BUSES entries.
+ * Returns the number of displays.
+ */
+int resolve_display_set(const vcp_command *cmd, int *display_nums) {
+    int count = display_count();
+    int n = 0;
+
+    if (strchr(cmd->selector, ':')) {
+        for (int i = 0; i < count; i++) {
+            if (display_matches(i + 1, cmd->selector))
+                display_nums[n++] = i + 1;
+        }
+        return n;
+    }
+
+    for (const char *p = cmd->selector; p && n < MAX_I2C_BUSES; p = strchr(p, ',')) {
+        if (*p == ',')
+            p++;
+        if (strncmp(p, "all", 3) == 0) {
+            for (int i = 0; i < count && n < MAX_I2C_BUSES; i++)
+                display_nums[n++] = i + 1;
+            continue;
+        }
+
+        int display_num = atoi(p) + 1;
+        int seen = 0;
+        for (int i = 0; i < n; i++)
+            seen |= display_nums[i] == display_num;
+        if (!seen)
+            display_nums[n++] = display_num;
+    }
+    return n;
+}
+
+/*
+ * Parse positional arguments: display_index input_value command_code [register_address]
+ * display_index is left out under --display.
+ * Returns 1 on success, 0 on wrong argument count.
+ */
+int parse_command(int argc, char *argv[], vcp_command *cmd) {
+    const char *display = g_display_arg;
+    if (!display) {
+        if (argc < 1)
+            return 0;
+        display = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc != 2 && argc != 3)
+        return 0;
+
+    long value = strtol(argv[0], NULL, 16);
+    if (value < 0 || value > 0xFFFF || !parse_display(display, cmd))
+        return 0;
+
+    cmd->input_value = (uint16_t)value;
+    cmd->command_code = (uint8_t)strtol(argv[1], NULL, 16);
+    // Uses default register address 0x51 used for VCP codes
+    cmd->register_address = (argc == 3) ? (uint8_t)strtol(argv[2], NULL, 16) : 0x51;
+    cmd->shadow_ttl = -1;
+    cmd->verify = 0;
+    return 1;
+}
+
+/*
+ * Parse --get positional arguments: display_index command_code [register_address]
+ * display_index is left out under --display.
+ * Returns 1 on success, 0 on wrong argument count.
+ */
+int parse_read_command(int argc, char *argv[], vcp_command *cmd) {
+    const char *display = g_display_arg;
+    if (!display) {
+        if (argc < 1)
+            return 0;
+        display = argv[0];
+        argv++;
+        argc--;
+    }
+    if ((argc != 1 && argc != 2) || !parse_display(display, cmd))
+        return 0;
+
+    cmd->input_value = 0;
+    cmd->command_code = (uint8_t)strtol(argv[0], NULL, 16);
+    cmd->register_address = (argc == 2) ? (uint8_t)strtol(argv[1], NULL, 16) : 0x51;
+    cmd->shadow_ttl = -1;
+    cmd->verify = 0;
+    return 1;
+}
+
+/*
+ * Split a command line into whitespace separated tokens, in place.
+ */
+static int split_args(char *line, char *args[], int max_args) {
+    int count = 0;
+    char *save = NULL;
+
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok && count < max_args;
+         tok = strtok_r(NULL, " \t\r\n", &save))
+        args[count++] = tok;
+    return count;
+}
+
+/*
+ * Convert display_index or the selector to ddcutil display number
+ * (1-based). Returns 0 if no display matches the selector, or for a
+ * display set, which only batch writes expand.
+ */
+int resolve_display_num(const vcp_command *cmd) {
+    if (display_is_set(cmd)) {
+        printf("%s selects several displays, only writes can be broadcast\n", cmd->selector);
+        return 0;
+    }
+    if (cmd->selector[0]) {
+        int display_num = display_by_selector(cmd->selector);
+        if (display_num == 0)
+            printf("No display matches %s\n", cmd->selector);
+        return display_num;
+    }
+
+    if (cmd->display_index == -1) {
+        if (g_primary_display == 0)
+            g_primary_display = detect_primary_display();
+        return g_primary_display;
+    }
+    return cmd->display_index + 1;
+}
+
+/*
+ * Write a command's value and, with --verify and a code that allows it,
+ * read it back. The read is the next transaction on the bus, so it waits
+ * only the monitor's learned write delay, and only a mismatch costs
+ * another write. The caller holds the bus lock from the first write to
+ * the last read, so no other process can write in between and be
+ * mistaken for the monitor ignoring ours. Returns 1 if the write
+ * succeeded and, where checked, reads back.
+ */
+static int write_verified_locked(int display_num, const vcp_command *cmd) {
+    if (!cmd->verify || !mccs_verify_applies(cmd->register_address, cmd->command_code))
+        return write_value_locked(display_num, cmd->input_value, cmd->command_code, cmd->register_address);
+
+    int ok = 0;
+    t_verifying = 1;
+    for (int attempt = 0; attempt < MCCS_VERIFY_ATTEMPTS; attempt++) {
+        ddcci_vcp_reply reply;
+
+        if (!write_value_locked(display_num, cmd->input_value, cmd->command_code, cmd->register_address))
+            break;
+        if (!read_value_locked(display_num, cmd->command_code, cmd->register_address, &reply)) {
+            printf("VCP 0x%02X on display %d could not be read back\n",
+                   cmd->command_code, display_num - 1);
+            break;
+        }
+        ok = mccs_verify_matches(cmd->input_value, &reply);
+        timing_confirm(display_id(display_num), ok);
+        if (ok)
+            break;
+        fprintf(stderr, "  VCP 0x%02X reads back 0x%02X instead of 0x%02X%s\n",
+                cmd->command_code, reply.cur_value, cmd->input_value,
+                attempt + 1 < MCCS_VERIFY_ATTEMPTS ? ", writing again" : "");
+        if (attempt + 1 == MCCS_VERIFY_ATTEMPTS)
+            printf("VCP 0x%02X on display %d did not take 0x%02X\n",
+                   cmd->command_code, display_num - 1, cmd->input_value);
+    }
+    t_verifying = 0;
+    return ok;
+}
+
+/*
+ * Check a value known for a command's code against the value to write.
+ * Input source (0x60) values live in the low byte; some monitors report
+ * garbage in the high byte.
+ */
+static int shadow_matches(const vcp_command *cmd, uint16_t current) {
+    if (cmd->command_code == 0x60 && cmd->register_address == DDCCI_HOST_ADDR)
+        current &= 0xFF;
+    return current == cmd->input_value;
+}
+
+// Report a write skipped by --if-changed. Returns 1.
+static int skip_unchanged(int display_num, const vcp_command *cmd) {
+    printf("VCP 0x%02X on display %d is already 0x%02X, skipped\n",
+           cmd->command_code, display_num - 1, cmd->input_value);
+    return 1;
+}
+
+/*
+ * Write a command's value to a resolved display. With --if-changed the
+ * write is skipped when the monitor already has the value. A shadow
+ * entry no older than the TTL, from our last write or read of that code,
+ * settles it without a bus transaction. Otherwise a standard VCP code is
+ * read from the monitor, which another program or the OSD may have
+ * changed, under the same bus lock as the write that may follow, so no
+ * other process can write in between; vendor registers cannot be read
+ * and are written. One-shot commands such as factory resets are never
+ * shadowed.
+ * Returns 1 on success (written or skipped).
+ */
+int apply_command(int display_num, const vcp_command *cmd) {
+    if (display_num == 0)
+        return 0;
+
+    uint64_t id = display_id(display_num);
+
+    // Once a monitor's capabilities are known, codes it does not list are
+    // refused here; a monitor silently ignores a Set VCP it cannot handle
+    if (cmd->register_address == DDCCI_HOST_ADDR) {
+        const mccs_caps *caps = caps_lookup(display_caps_key(display_num));
+        if (caps && !mccs_caps_supports(caps, cmd->command_code)) {
+            printf("VCP 0x%02X is not in the capabilities of display %d\n",
+                   cmd->command_code, display_num - 1);
+            return 0;
+        }
+    }
+
+    int shadowed = id && !mccs_code_is_action(cmd->register_address, cmd->command_code);
+    uint16_t current = 0;
+    if (cmd->shadow_ttl >= 0 && shadowed &&
+        shadow_lookup(id, cmd->register_address, cmd->command_code, cmd->shadow_ttl, &current) &&
+        shadow_matches(cmd, current))
+        return skip_unchanged(display_num, cmd);
+
+    prepare_backend();
+    int lock = bus_lock(display_num);
+    if (lock == -1)
+        return 0;
+
+    if (cmd->shadow_ttl >= 0 && shadowed && cmd->register_address == DDCCI_HOST_ADDR) {
+        ddcci_vcp_reply reply;
+        if (read_value_locked(display_num, cmd->command_code, cmd->register_address, &reply)) {
+            shadow_store(id, cmd->register_address, cmd->command_code, reply.cur_value);
+            if (shadow_matches(cmd, reply.cur_value)) {
+                bus_unlock(lock);
+                return skip_unchanged(display_num, cmd);
+            }
+        }
+    }
+
+    int ok = write_verified_locked(display_num, cmd);
+    bus_unlock(lock);
+    if (!ok) {
+        if (shadowed)
+            shadow_forget(id, cmd->register_address, cmd->command_code);
+        return 0;
+    }
+
+    if (shadowed)
+        shadow_store(id, cmd->register_address, cmd->command_code, cmd->input_value);
+    return 1;
+}
+
+/*
+ * Resolve the display and write the value. Returns 1 on success.
+ */
+int execute_command(const vcp_command *cmd) {
+    return apply_command(resolve_display_num(cmd), cmd);
+}
+
+/*
+ * Resolve the display, read the value and print it. Returns 1 on success.
+ */
+int execute_read(const vcp_command *cmd) {
+    int display_num = resolve_display_num(cmd);
+    ddcci_vcp_reply reply;
+
+    if (display_num == 0 || !read_value(display_num, cmd->command_code, cmd->register_address, &reply))
+        return 0;
+
+    // What the monitor reports keeps the --if-changed shadow honest
+    uint64_t id = display_id(display_num);
+    if (id && !mccs_code_is_action(cmd->register_address, cmd->command_code))
+        shadow_store(id, cmd->register_address, cmd->command_code, reply.cur_value);
+
+    printf("VCP 0x%02X: current 0x%04X (%u), max 0x%04X (%u)\n", reply.code,
+           reply.cur_value, reply.cur_value, reply.max_value, reply.max_value);
+    return 1;
+}
+
+/*
+ * Resolve the display and print its capabilities, from the caps cache
+ * unless --rescan, else read from the monitor and cached.
+ * Returns 1 on success.
+ */
+int execute_caps(const vcp_command *cmd) {
+    int display_num = resolve_display_num(cmd);
+    char text[MCCS_CAPS_MAX_LEN + 1];
+    mccs_caps caps;
+
+    if (display_num == 0)
+        return 0;
+    prepare_backend();
+    uint64_t key = display_caps_key(display_num);
+    int cached = !g_rescan && key && caps_read_cached(key, text);
+
+    if (!cached) {
+        if (!read_caps(display_num, text))
+            return 0;
+        if (key)
+            caps_store(key, text);
+    }
+
+    printf("Capabilities of display %d%s:\n%s\n", display_num - 1, cached ? " (cached)" : "", text);
+    if (!mccs_caps_parse(text, &caps)) {
+        printf("No vcp() list in the capabilities string\n");
+        return 1;
+    }
+    mccs_caps_print(stdout, &caps);
+    return 1;
+}
+
+/*
+ * Print every display with its connector and EDID identity: PNP model
+ * id, monitor name and serial number.
+ * Returns the number of displays.
+ */
+int execute_list(void) {
+    prepare_backend();
+    int count = display_count();
+
+    for (int i = 0; i < count; i++) {
+        edid_info info;
+        char serial[16];
+
+        printf("Display %d: %s", i, g_displays[i].connector);
+        if (!display_edid(i + 1, &info)) {
+            printf(", no EDID\n");
+            continue;
+        }
+        if (info.serial_text[0])
+            snprintf(serial, sizeof(serial), "%s", info.serial_text);
+        else
+            snprintf(serial, sizeof(serial), "%lu", (unsigned long)info.serial);
+        printf(", %s%04X \"%s\", serial %s\n", info.vendor, info.product, info.name, serial);
+    }
+    return count;
+}
+
+/*
+ * Ramp a continuous VCP code from its current value to the command's
+ * value over duration_ms, in this one process. Each write goes out as
+ * soon as the learned timing of the monitor allows it and carries the
+ * value the ramp has reached by then: steps the bus could not keep up
+ * with are coalesced into that write instead of queued, so the fade
+ * ends on time. When the bus is faster than the ramp, sleeps until the
+ * value next changes.
+ * Returns 1 when the target was written.
+ */
+int execute_fade(const vcp_command *cmd, uint32_t duration_ms) {
+    int display_num = resolve_display_num(cmd);
+    ddcci_vcp_reply reply;
+
+    if (display_num == 0)
+        return 0;
+    if (cmd->register_address != DDCCI_HOST_ADDR || !fade_code_is_continuous(cmd->command_code)) {
+        printf("VCP 0x%02X is not a continuous control, it cannot be faded\n", cmd->command_code);
+        return 0;
+    }
+
+    prepare_backend();
+    const mccs_caps *caps = caps_lookup(display_caps_key(display_num));
+    if (caps && !mccs_caps_supports(caps, cmd->command_code)) {
+        printf("VCP 0x%02X is not in the capabilities of display %d\n",
+               cmd->command_code, display_num - 1);
+        return 0;
+    }
+
+    // The ramp starts from what the monitor reports, which also gives
+    // the maximum to clamp the target to
+    if (!read_value(display_num, cmd->command_code, cmd->register_address, &reply))
+        return 0;
+    uint16_t target = cmd->input_value;
+    if (reply.max_value && target > reply.max_value)
+        target = reply.max_value;
+
+    fade_ramp ramp = { reply.cur_value, target, duration_ms };
+    uint16_t value = ramp.from;
+    unsigned writes = 0;
+    uint64_t start = monotonic_ms();
+
+    while (value != ramp.to) {
+        uint64_t elapsed = monotonic_ms() - start;
+        uint16_t next = fade_value_at(&ramp, elapsed);
+
+        if (next == value) {
+            pace_sleep((uint32_t)(fade_next_ms(&ramp, value) - elapsed));
+            continue;
+        }
+        TRACE_BEGIN(t);
+        int ok = write_value(display_num, next, cmd->command_code, cmd->register_address);
+        TRACE_END(t, "fade_step");
+        if (!ok)
+            return 0;
+        value = next;
+        writes++;
+    }
+
+    printf("VCP 0x%02X on display %d faded from 0x%02X to 0x%02X in %lu ms, %u writes\n",
+           cmd->command_code, display_num - 1, ramp.from, ramp.to,
+           (unsigned long)(monotonic_ms() - start), writes);
+    return 1;
+}
+
+
+// ============================================================
+// Batch mode
+// ============================================================
+
+typedef struct {
+    vcp_command *items;
+    int count;
+    int capacity;
+} vcp_batch;
+
+static int batch_append(vcp_batch *batch, const vcp_command *cmd) {
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity ? batch->capacity * 2 : 16;
+        vcp_command *items = realloc(batch->items, capacity * sizeof(*items));
+        if (!items) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 0;
+        }
+        batch->items = items;
+        batch->capacity = capacity;
+    }
+    batch->items[batch->count++] = *cmd;
+    return 1;
+}
+
+/*
+ * Parse commands from argv, separated by "," arguments:
+ *   0 0x32 0x10 , 1 0x32 0x10 , 2 0x90 0xF4 0x50
+ * Returns 1 on success, 0 on a malformed command.
+ */
+int parse_batch_args(int argc, char *argv[], vcp_batch *batch) {
+    int start = 0;
+
+    for (int i = 0; i <= argc; i++) {
+        if (i < argc && strcmp(argv[i], ",") != 0)
+            continue;
+
+        vcp_command cmd;
+        if (!parse_command(i - start, argv + start, &cmd)) {
+            fprintf(stderr, "Malformed command #%d\n", batch->count + 1);
+            return 0;
+        }
+        if (!batch_append(batch, &cmd))
+            return 0;
+        start = i + 1;
+    }
+    return 1;
+}
+
+/*
+ * Parse one command per line from a file, or stdin for "-".
+ * Blank lines and lines starting with '#' are ignored.
+ * Returns 1 on success, 0 on error.
+ */
+int parse_batch_file(const char *path, vcp_batch *batch) {
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[MAX_LINE_LEN];
+    int line_num = 0;
+    int ok = 1;
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    while (ok && fgets(line, sizeof(line), fp)) {
+        line_num++;
+
+        char *args[MAX_LINE_LEN / 2];
+        int count = split_args(line, args, MAX_LINE_LEN / 2);
+        if (count == 0 || args[0][0] == '#')
+            continue;
+
+        vcp_command cmd;
+        if (!parse_command(count, args, &cmd)) {
+            fprintf(stderr, "%s:%d: malformed command\n", path, line_num);
+            ok = 0;
+        } else {
+            ok = batch_append(batch, &cmd);
+        }
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+    return ok;
+}
+
+// Jobs queued for one physical bus, run in batch order by one worker.
+// A job is one command on one display; a command for a display set
+// has a job per display.
+typedef struct {
+    int key;
+    int count;
+    int *indices;               // Into the jobs, in batch order
+    const vcp_batch *batch;
+    const int *commands;        // Command of each job
+    const int *display_nums;    // Display of each job
+    int *results;               // Of each job
+    pthread_t thread;
+} bus_queue;
+
+static void *bus_queue_run(void *arg) {
+    bus_queue *queue = arg;
+
+    for (int i = 0; i < queue->count; i++) {
+        int idx = queue->indices[i];
+        const vcp_command *cmd = &queue->batch->items[queue->commands[idx]];
+
+        // MCCS: the monitor needs time to process a Set VCP before the
+        // next command on the same bus. The native and virtual backends
+        // pace themselves with the learned per-monitor delay.
+        if (i > 0 && g_backend == BACKEND_DDCUTIL)
+            usleep(DDCCI_SET_VCP_DELAY_MS * 1000);
+
+        queue->results[idx] = apply_command(queue->display_nums[idx], cmd);
+    }
+    return NULL;
+}
+
+/*
+ * Resolve the displays of one command: its display, or every display
+ * of a display set. display_nums must hold MAX_I2C_BUSES entries.
+ * Returns the number of displays, 0 for a set that matches none.
+ */
+static int resolve_command_displays(const vcp_command *cmd, int *display_nums) {
+    if (!display_is_set(cmd)) {
+        display_nums[0] = resolve_display_num(cmd);
+        return 1;
+    }
+
+    int n = resolve_display_set(cmd, display_nums);
+    if (n == 0)
+        printf("No display matches %s\n", cmd->selector);
+    return n;
+}
+
+// Jobs of a batch: one per command and display, a command for a display
+// set fanning out to one job per display. The jobs of command i are
+// first_job[i] to first_job[i + 1].
+typedef struct {
+    int *first_job;
+    int *commands;              // Command of each job
+    int *display_nums;          // Display of each job
+    int count;
+} batch_plan;
+
+static void batch_plan_free(batch_plan *plan) {
+    free(plan->first_job);
+    free(plan->commands);
+    free(plan->display_nums);
+}
+
+/*
+ * Resolve the displays of every command into jobs. Returns 0 if memory
+ * ran out.
+ */
+static int batch_plan_build(const vcp_batch *batch, batch_plan *plan) {
+    int capacity = batch->count;
+
+    plan->count = 0;
+    plan->first_job = calloc(batch->count + 1, sizeof(int));
+    plan->commands = calloc(capacity + 1, sizeof(int));
+    plan->display_nums = calloc(capacity + 1, sizeof(int));
+    if (!plan->first_job || !plan->commands || !plan->display_nums)
+        goto fail;
+
+    prepare_backend();
+    for (int i = 0; i < batch->count; i++) {
+        int set[MAX_I2C_BUSES];
+        int n = resolve_command_displays(&batch->items[i], set);
+
+        if (plan->count + n > capacity) {
+            capacity = (plan->count + n) * 2;
+            int *grown_commands = realloc(plan->commands, capacity * sizeof(int));
+            if (grown_commands)
+                plan->commands = grown_commands;
+            int *grown_displays = realloc(plan->display_nums, capacity * sizeof(int));
+            if (grown_displays)
+                plan->display_nums = grown_displays;
+            if (!grown_commands || !grown_displays)
+                goto fail;
+        }
+
+        plan->first_job[i] = plan->count;
+        for (int k = 0; k < n; k++) {
+            plan->commands[plan->count] = i;
+            plan->display_nums[plan->count++] = set[k];
+        }
+    }
+    plan->first_job[batch->count] = plan->count;
+    return 1;
+
+fail:
+    fprintf(stderr, "Memory allocation failed\n");
+    batch_plan_free(plan);
+    memset(plan, 0, sizeof(*plan));
+    return 0;
+}
+
+/*
+ * Check that command i succeeded, i.e. every display it resolved to was
+ * written. A display set reports how many of its displays were.
+ */
+static int batch_command_ok(const vcp_batch *batch, const batch_plan *plan, const int *results, int i) {
+    const vcp_command *cmd = &batch->items[i];
+    int total = plan->first_job[i + 1] - plan->first_job[i];
+    int written = 0;
+
+    for (int k = plan->first_job[i]; k < plan->first_job[i + 1]; k++)
+        written += results[k];
+    if (display_is_set(cmd) && total > 0)
+        printf("%s: %d of %d displays written\n", cmd->selector, written, total);
+    return total > 0 && written == total;
+}
+
+/*
+ * Execute every command through the one initialized backend.
+ * Commands are grouped by physical bus; each bus gets its own worker so
+ * different monitors are written concurrently, while commands on the
+ * same bus stay in order with the MCCS inter-command delay. A command
+ * for a display set fans out to one job per display, all queued before
+ * any worker starts, and succeeds only if every display was written.
+ * Returns the number of failed commands.
+ */
+int execute_batch(const vcp_batch *batch) {
+    int failures = 0;
+    int queue_count = 0;
+    int *queue_of = NULL;
+    int *results = NULL;
+    int *indices = NULL;
+    bus_queue *queues = NULL;
+    batch_plan plan;
+
+    // Resolve displays and the backend up front; workers only write
+    if (!batch_plan_build(batch, &plan))
+        return batch->count;
+
+    int job_count = plan.count;
+    queue_of = calloc(job_count + 1, sizeof(int));
+    results = calloc(job_count + 1, sizeof(int));
+    indices = calloc(job_count + 1, sizeof(int));
+    queues = calloc(job_count + 1, sizeof(bus_queue));
+    if (!queue_of || !results || !indices || !queues) {
+        fprintf(stderr, "Memory allocation failed\n");
+        failures = batch->count;
+        goto out;
+    }
+
+    for (int i = 0; i < job_count; i++) {
+        // Unknown displays get their own queue and fail there
+        int key = display_bus_key(plan.display_nums[i]);
+        int q = 0;
+        while (q < queue_count && (key < 0 || queues[q].key != key))
+            q++;
+        if (q == queue_count) {
+            queues[q].key = key;
+            queues[q].batch = batch;
+            queues[q].commands = plan.commands;
+            queues[q].display_nums = plan.display_nums;
+            queues[q].results = results;
+            queue_count++;
+        }
+        queues[q].count++;
+        queue_of[i] = q;
+    }
+
+    // Carve per-queue index lists out of one array, keeping batch order
+    for (int q = 0, offset = 0; q < queue_count; q++) {
+        queues[q].indices = indices + offset;
+        offset += queues[q].count;
+        queues[q].count = 0;
+    }
+    for (int i = 0; i < job_count; i++) {
+        bus_queue *queue = &queues[queue_of[i]];
+        queue->indices[queue->count++] = i;
+    }
+
+    if (queue_count == 1) {
+        bus_queue_run(&queues[0]);
+    } else {
+        int started = 0;
+        for (; started < queue_count; started++) {
+            if (pthread_create(&queues[started].thread, NULL, bus_queue_run, &queues[started]) != 0)
+                break;
+        }
+        // Run whatever could not get a thread on this one
+        for (int q = started; q < queue_count; q++)
+            bus_queue_run(&queues[q]);
+        for (int q = 0; q < started; q++)
+            pthread_join(queues[q].thread, NULL);
+    }
+
+    for (int i = 0; i < batch->count; i++) {
+        if (!batch_command_ok(batch, &plan, results, i)) {
+            if (batch->count > 1)
+                printf("Command #%d failed\n", i + 1);
+            failures++;
+        }
+    }
+
+out:
+    batch_plan_free(&plan);
+    free(queue_of);
+    free(results);
+    free(indices);
+    free(queues);
+    return failures;
+}
+
+
+// ============================================================
+// Hotplug
+// ============================================================
+
+// The daemon keeps its display map current from kernel uevents: DRM
+// connector changes and i2c-dev buses coming and going. The uevent
+// thread only notes what changed; the executor applies it between
+// writes, so the map never changes under a transaction.
+typedef struct {
+    int all;                    // Unknown scope, check every connector
+    int connector_count;
+    char connectors[8][32];     // DRM connectors that changed
+    uint64_t buses;             // Bitmap of i2c-N buses added or removed
+} hotplug_changes;
+
+/*
+ * Drop a display slot and close its bus; later displays move up one.
+ */
+static void display_remove(int slot) {
+    if (g_bus_fds[slot] >= 0)
+        close(g_bus_fds[slot]);
+    memmove(&g_displays[slot], &g_displays[slot + 1],
+            (g_display_count - slot - 1) * sizeof(g_displays[0]));
+    memmove(&g_bus_fds[slot], &g_bus_fds[slot + 1],
+            (g_display_count - slot - 1) * sizeof(g_bus_fds[0]));
+    g_display_count--;
+}
+
+/*
+ * Add a display in bus order, the slot a full enumeration would give it.
+ */
+static void display_insert(const display_entry *entry) {
+    int slot = 0;
+
+    if (g_display_count >= MAX_I2C_BUSES)
+        return;
+    while (slot < g_display_count && g_displays[slot].bus < entry->bus)
+        slot++;
+    memmove(&g_displays[slot + 1], &g_displays[slot],
+            (g_display_count - slot) * sizeof(g_displays[0]));
+    memmove(&g_bus_fds[slot + 1], &g_bus_fds[slot],
+            (g_display_count - slot) * sizeof(g_bus_fds[0]));
+    g_displays[slot] = *entry;
+    g_bus_fds[slot] = -1;
+    g_display_count++;
+}
+
+static int display_slot_of_bus(int bus) {
+    for (int i = 0; i < g_display_count; i++) {
+        if (g_displays[i].bus == bus)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Update the display on one bus from what is attached now: removed if
+ * there is no monitor, added or replaced if its EDID changed, left alone
+ * (with its bus still open) otherwise. edid is NULL for no monitor.
+ * Returns 1 if the display map changed.
+ */
+static int hotplug_update_bus(int bus, const uint8_t *edid, const char *connector) {
+    int slot = display_slot_of_bus(bus);
+
+    if (slot >= 0 && edid && g_displays[slot].edid_hash == edid_hash(edid))
+        return 0;
+    if (slot < 0 && !edid)
+        return 0;
+
+    if (slot >= 0)
+        display_remove(slot);
+    if (edid) {
+        display_entry entry;
+        entry.bus = bus;
+        entry.edid_hash = edid_hash(edid);
+        entry.edid_id = edid_identity(edid);
+        snprintf(entry.connector, sizeof(entry.connector), "%s", connector);
+        edid_remember(edid);
+        display_insert(&entry);
+    }
+    printf("Hotplug: %s on /dev/i2c-%d %s\n", connector, bus,
+           !edid ? "removed" : slot >= 0 ? "changed" : "added");
+    return 1;
+}
+
+/*
+ * Read the EDID of a monitor on a bus DRM does not know about.
+ */
+static int hotplug_probe_bus(int bus, uint8_t *edid) {
+    if (!is_display_adapter(bus))
+        return 0;
+
+    int fd = i2c_open_bus(bus);
+    if (fd < 0)
+        return 0;
+    int found = read_edid(fd, edid);
+    close(fd);
+    return found;
+}
+
+/*
+ * Apply noted changes to the display map, touching only the connectors
+ * and buses named: DRM connectors are re-read from sysfs, buses without
+ * a connector are probed for an EDID as enumerate_ddc_buses() does.
+ * The ddcutil backends decide themselves which displays are usable, so
+ * for them a change means enumerating again.
+ * Returns 1 if the display map changed.
+ */
+static int hotplug_apply(const hotplug_changes *changes) {
+    drm_connector connectors[MAX_I2C_BUSES];
+    uint64_t drm_buses = 0;
+    int changed = 0;
+
+    if (g_backend == BACKEND_VIRTUAL || g_display_count < 0)
+        return 0;
+    if (g_backend != BACKEND_NATIVE) {
+        for (int i = 0; i < g_display_count; i++) {
+            if (g_bus_fds[i] >= 0)
+                close(g_bus_fds[i]);
+        }
+        // Skip the topology cache for this one enumeration
+        int rescan = g_rescan;
+        g_display_count = -1;
+        g_rescan = 1;
+        printf("Hotplug: %d displays after detecting again\n", display_count());
+        g_rescan = rescan;
+        changed = 1;
+    } else {
+        int count = drm_scan_connectors(connectors, MAX_I2C_BUSES);
+        for (int i = 0; i < count; i++) {
+            const drm_connector *conn = &connectors[i];
+            int named = changes->all;
+            uint8_t edid[EDID_BLOCK_LEN];
+
+            if (conn->bus < 0 || conn->bus >= MAX_I2C_BUSES)
+                continue;
+            drm_buses |= 1ULL << conn->bus;
+            for (int k = 0; !named && k < changes->connector_count; k++)
+                named = connector_matches(conn->name, changes->connectors[k]);
+            if (!named && !(changes->buses >> conn->bus & 1))
+                continue;
+
+            const uint8_t *found = NULL;
+            if (conn->connected && conn->has_edid)
+                found = conn->edid;
+            else if (conn->connected && hotplug_probe_bus(conn->bus, edid))
+                found = edid;
+            changed |= hotplug_update_bus(conn->bus, found, conn->name);
+        }
+
+        for (int bus = 0; bus < MAX_I2C_BUSES; bus++) {
+            uint8_t edid[EDID_BLOCK_LEN];
+            if (!(changes->buses >> bus & 1) || (drm_buses >> bus & 1))
+                continue;
+            changed |= hotplug_update_bus(bus, hotplug_probe_bus(bus, edid) ? edid : NULL, "-");
+        }
+    }
+
+    if (changed) {
+        pthread_mutex_lock(&g_display_index_lock);
+        g_display_index_built = 0;
+        pthread_mutex_unlock(&g_display_index_lock);
+        g_primary_display = 0;
+        if (g_display_count > 0)
+            topology_save(topology_signature());
+        edid_flush();
+    }
+    return changed;
+}
+
+/*
+ * Subscribe to kernel uevents. Returns -1 where netlink is not
+ * available, e.g. in some containers.
+ */
+static int uevent_open(void) {
+    struct sockaddr_nl addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;     // Kernel events, not udev's rebroadcast
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Name of the connector with a DRM object id, from the CONNECTOR= key of
+ * a hotplug event. Returns 0 if none has it (or the kernel is too old to
+ * export connector_id).
+ */
+static int drm_connector_by_id(const char *id, char *name, size_t size) {
+    drm_connector connectors[MAX_I2C_BUSES];
+    int count = drm_scan_connectors(connectors, MAX_I2C_BUSES);
+
+    for (int i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        char value[32];
+
+        snprintf(path, sizeof(path), "/sys/class/drm/%.31s/connector_id", connectors[i].name);
+        if (read_sysfs_line(path, value, sizeof(value)) && strcmp(value, id) == 0) {
+            snprintf(name, size, "%.31s", connectors[i].name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Note what one uevent ("ACTION@DEVPATH\0KEY=VALUE\0...") changed.
+ * Returns 1 if it concerns displays.
+ */
+static int uevent_parse(const char *msg, size_t len, hotplug_changes *changes) {
+    const char *action = "", *subsystem = "", *devpath = "", *devname = "", *connector = "";
+    int hotplug = 0;
+
+    for (size_t off = strlen(msg) + 1; off < len; off += strlen(msg + off) + 1) {
+        const char *key = msg + off;
+        if (strncmp(key, "ACTION=", 7) == 0)
+            action = key + 7;
+        else if (strncmp(key, "SUBSYSTEM=", 10) == 0)
+            subsystem = key + 10;
+        else if (strncmp(key, "DEVPATH=", 8) == 0)
+            devpath = key + 8;
+        else if (strncmp(key, "DEVNAME=", 8) == 0)
+            devname = key + 8;
+        else if (strncmp(key, "CONNECTOR=", 10) == 0)
+            connector = key + 10;
+        else if (strcmp(key, "HOTPLUG=1") == 0)
+            hotplug = 1;
+    }
+
+    int bus;
+    if (strcmp(subsystem, "i2c-dev") == 0 && sscanf(devname, "i2c-%d", &bus) == 1) {
+        if (bus < 0 || bus >= MAX_I2C_BUSES || (strcmp(action, "add") != 0 && strcmp(action, "remove") != 0))
+            return 0;
+        changes->buses |= 1ULL << bus;
+        return 1;
+    }
+    if (strcmp(subsystem, "drm") != 0)
+        return 0;
+
+    // Connector added or removed with its card, or a hotplug on the card,
+    // naming the connector by object id where the kernel knows it
+    char name[32];
+    const char *base = strrchr(devpath, '/');
+    base = base ? base + 1 : devpath;
+    if (strncmp(base, "card", 4) == 0 && strchr(base, '-') && strcmp(action, "change") != 0)
+        snprintf(name, sizeof(name), "%.31s", base);
+    else if (hotplug && connector[0] && drm_connector_by_id(connector, name, sizeof(name)))
+        ;
+    else if (hotplug || strcmp(action, "change") != 0)
+        name[0] = '\0';
+    else
+        return 0;
+
+    if (!name[0] || changes->connector_count == 8)
+        changes->all = 1;
+    else
+        snprintf(changes->connectors[changes->connector_count++], sizeof(changes->connectors[0]), "%s", name);
+    return 1;
+}
+
+// ============================================================
+// Daemon mode
+// ============================================================
+
+#define DAEMON_LINE_LEN 4096
+#define MAX_DAEMON_ARGS (DAEMON_LINE_LEN / 2)
+
+static const char *g_socket_path = NULL;
+
+/*
+ * Socket path: $XDG_RUNTIME_DIR/writeValueToDisplay.sock, or a per-user
+ * path in /tmp when no runtime dir is set.
+ */
+static void daemon_socket_address(struct sockaddr_un *addr) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (runtime_dir && runtime_dir[0])
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/writeValueToDisplay.sock", runtime_dir);
+    else
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/writeValueToDisplay-%u.sock", (unsigned)getuid());
+}
+
+/*
+ * Read one reply line from the daemon.
+ */
+static int read_reply(int fd, char *buf, size_t size) {
+    size_t len = 0;
+
+    while (len < size - 1) {
+        if (read(fd, buf + len, 1) != 1)
+            break;
+        if (buf[len++] == '\n')
+            break;
+    }
+    buf[len] = '\0';
+    return len > 0;
+}
+
+/*
+ * Check that the daemon behind a connected socket runs as this user. In
+ * /tmp anyone could have created the socket path first and would get to
+ * see and answer our commands.
+ */
+static int daemon_peer_is_ours(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    return cred.uid == getuid();
+}
+
+/*
+ * Send commands first to first + count - 1 of a batch as one request
+ * and count the failures the daemon reports.
+ * Returns -1 if the daemon did not reply.
+ */
+static int daemon_request(int fd, const vcp_batch *batch, int first, int count, const char *line, int len) {
+    char reply[DAEMON_LINE_LEN];
+    int failures = 0;
+
+    if (write(fd, line, len) != len || !read_reply(fd, reply, sizeof(reply)))
+        return -1;
+    if (strncmp(reply, "OK", 2) == 0)
+        return 0;
+
+    // ERR failed N... lists the failed commands of the request, 1-based
+    if (strncmp(reply, "ERR failed ", 11) == 0) {
+        char *save = NULL;
+        for (char *tok = strtok_r(reply + 11, " \r\n", &save); tok; tok = strtok_r(NULL, " \r\n", &save)) {
+            if (batch->count > 1)
+                printf("Command #%d failed\n", first + atoi(tok));
+            failures++;
+        }
+    }
+    if (failures == 0) {
+        printf("%s", reply);
+        failures = count;
+    }
+    return failures;
+}
+
+/*
+ * Forward commands to a running daemon over one connection. The batch
+ * goes as one request, split only where it outgrows a request line, so
+ * the daemon can write different buses concurrently.
+ * Returns the number of failed commands, or -1 if no daemon is listening.
+ */
+int forward_to_daemon(const vcp_batch *batch) {
+    struct sockaddr_un addr;
+    char line[DAEMON_LINE_LEN];
+    int failures = 0;
+    int len = 0;
+    int first = 0;
+
+    daemon_socket_address(&addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!daemon_peer_is_ours(fd)) {
+        fprintf(stderr, "%s belongs to another user, running locally\n", addr.sun_path);
+        close(fd);
+        return -1;
+    }
+
+    for (int i = 0; i <= batch->count; i++) {
+        char text[MAX_LINE_LEN];
+        int n = 0;
+
+        if (i < batch->count) {
+            const vcp_command *cmd = &batch->items[i];
+            if (cmd->selector[0])
+                n = snprintf(text, sizeof(text), "%s ", cmd->selector);
+            else
+                n = snprintf(text, sizeof(text), "%d ", cmd->display_index);
+            n += snprintf(text + n, sizeof(text) - n, "0x%02X 0x%02X 0x%02X",
+                          cmd->input_value, cmd->command_code, cmd->register_address);
+        }
+
+        // Send what is collected when the batch ends or the line is full
+        if (len > 0 && (i == batch->count || len + n + 4 > (int)sizeof(line))) {
+            line[len++] = '\n';
+            int result = daemon_request(fd, batch, first, i - first, line, len);
+            if (result < 0) {
+                printf("Daemon did not reply\n");
+                failures += batch->count - first;
+                break;
+            }
+            failures += result;
+            len = 0;
+        }
+        if (i == batch->count)
+            break;
+
+        if (len == 0) {
+            // Options are the same for every command of a batch
+            const vcp_command *cmd = &batch->items[i];
+            first = i;
+            if (cmd->shadow_ttl >= 0)
+                len = snprintf(line, sizeof(line), "--if-changed=%d ", cmd->shadow_ttl);
+            if (cmd->verify)
+                len += snprintf(line + len, sizeof(line) - len, "--verify ");
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, " , ");
+        }
+        len += snprintf(line + len, sizeof(line) - len, "%s", text);
+    }
+
+    close(fd);
+    return failures;
+}
+
+static void daemon_shutdown(int sig) {
+    (void)sig;
+    if (g_socket_path)
+        unlink(g_socket_path);
+    _exit(0);
+}
+
+// A request being served: its jobs still to finish, and whether any of
+// them was superseded
+typedef struct {
+    int pending;
+    int superseded;
+} daemon_request_state;
+
+// A job of a request waiting for the worker of its bus. A queued job is
+// superseded by one of a later request for the same display and code,
+// which takes its place in the queue.
+typedef struct daemon_job {
+    const vcp_command *cmd;
+    int display_num;
+    int *result;
+    daemon_request_state *request;
+    struct daemon_job *next;
+} daemon_job;
+
+// Jobs for one physical bus in arrival order, run one at a time by the
+// bus's own worker thread
+typedef struct {
+    int key;
+    daemon_job *queue;
+    uint64_t last_ms;           // When the last job on the bus finished
+} daemon_bus;
+
+// Buses seen so far, jobs being run and requests being resolved, and
+// display changes to apply once every bus is idle. While changes are
+// pending or applied, new requests wait so they resolve against the
+// updated map.
+static daemon_bus g_daemon_buses[MAX_I2C_BUSES];
+static int g_daemon_bus_count = 0;
+static int g_daemon_running = 0;
+static hotplug_changes g_hotplug;
+static int g_hotplug_pending = 0;
+static int g_hotplug_applying = 0;
+static pthread_mutex_t g_daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_daemon_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Apply pending display changes if no bus has work. Called with
+ * g_daemon_lock held; drops it while the map is rebuilt.
+ */
+static void daemon_hotplug_if_idle(void) {
+    if (!g_hotplug_pending || g_hotplug_applying || g_daemon_running)
+        return;
+    for (int i = 0; i < g_daemon_bus_count; i++) {
+        if (g_daemon_buses[i].queue)
+            return;
+    }
+
+    hotplug_changes changes = g_hotplug;
+    memset(&g_hotplug, 0, sizeof(g_hotplug));
+    g_hotplug_pending = 0;
+    g_hotplug_applying = 1;
+    pthread_mutex_unlock(&g_daemon_lock);
+
+    hotplug_apply(&changes);
+    fflush(stdout);
+
+    pthread_mutex_lock(&g_daemon_lock);
+    g_hotplug_applying = 0;
+    pthread_cond_broadcast(&g_daemon_cond);
+}
+
+/*
+ * Run the jobs of one bus in order. Buses have a worker each, so a slow
+ * monitor does not hold up writes to the others.
+ */
+static void *daemon_bus_worker(void *arg) {
+    daemon_bus *bus = arg;
+
+    pthread_mutex_lock(&g_daemon_lock);
+    for (;;) {
+        while (!bus->queue)
+            pthread_cond_wait(&g_daemon_cond, &g_daemon_lock);
+
+        daemon_job *job = bus->queue;
+        bus->queue = job->next;
+        g_daemon_running++;
+        pthread_mutex_unlock(&g_daemon_lock);
+
+        // MCCS: the monitor needs time to process a Set VCP before the
+        // next command on the same bus. The native and virtual backends
+        // pace themselves with the learned per-monitor delay.
+        if (g_backend == BACKEND_DDCUTIL) {
+            uint64_t since = monotonic_us() / 1000 - bus->last_ms;
+            if (since < DDCCI_SET_VCP_DELAY_MS)
+                usleep((DDCCI_SET_VCP_DELAY_MS - since) * 1000);
+        }
+
+        int ok = apply_command(job->display_num, job->cmd);
+        bus->last_ms = monotonic_us() / 1000;
+        fflush(stdout);
+        TRACE_FLUSH();
+
+        pthread_mutex_lock(&g_daemon_lock);
+        g_daemon_running--;
+        *job->result = ok;
+        job->request->pending--;
+        pthread_cond_broadcast(&g_daemon_cond);
+        daemon_hotplug_if_idle();
+    }
+    return NULL;
+}
+
+/*
+ * Find the bus with key, starting its worker the first time. Called with
+ * g_daemon_lock held. Returns NULL if no worker can be had.
+ */
+static daemon_bus *daemon_bus_for(int key) {
+    for (int i = 0; i < g_daemon_bus_count; i++) {
+        if (g_daemon_buses[i].key == key)
+            return &g_daemon_buses[i];
+    }
+    if (g_daemon_bus_count == MAX_I2C_BUSES)
+        return NULL;
+
+    daemon_bus *bus = &g_daemon_buses[g_daemon_bus_count];
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    bus->key = key;
+    bus->queue = NULL;
+    bus->last_ms = 0;
+    int started = pthread_create(&thread, &attr, daemon_bus_worker, bus) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started)
+        return NULL;
+    g_daemon_bus_count++;
+    return bus;
+}
+
+/*
+ * Queue a job on its bus. Last writer wins: a job of another request
+ * still queued for the same display and code is answered as superseded
+ * and replaced, so a burst such as a held brightness hotkey costs the
+ * transaction in flight plus one with the newest value, however fast it
+ * arrives. Jobs of one request are never merged with each other.
+ */
+static void daemon_enqueue(daemon_bus *bus, daemon_job *job) {
+    daemon_job **link = &bus->queue;
+
+    while (*link) {
+        daemon_job *queued = *link;
+        if (queued->request != job->request && queued->display_num == job->display_num &&
+            queued->cmd->register_address == job->cmd->register_address &&
+            queued->cmd->command_code == job->cmd->command_code)
+            break;
+        link = &queued->next;
+    }
+    if (*link) {
+        daemon_job *queued = *link;
+        job->next = queued->next;
+        *queued->result = 1;
+        queued->request->superseded = 1;
+        queued->request->pending--;
+    } else {
+        job->next = NULL;
+    }
+    *link = job;
+}
+
+/*
+ * Run a client's batch on the bus workers and wait for it. failed gets
+ * one flag per command.
+ * Returns the number of failed commands; superseded is set if a write
+ * was replaced by a newer one.
+ */
+static int daemon_execute(const vcp_batch *batch, int *failed, int *superseded) {
+    daemon_request_state request = { 0, 0 };
+    int failures = 0;
+    batch_plan plan;
+
+    // Resolving selectors may read EDIDs, so it runs outside the lock
+    // that bus workers take to report their results. Counting as running
+    // keeps a display change from being applied meanwhile.
+    pthread_mutex_lock(&g_daemon_lock);
+    while (g_hotplug_pending || g_hotplug_applying)
+        pthread_cond_wait(&g_daemon_cond, &g_daemon_lock);
+    g_daemon_running++;
+    pthread_mutex_unlock(&g_daemon_lock);
+
+    int planned = batch_plan_build(batch, &plan);
+    int *results = NULL;
+    daemon_job *jobs = NULL;
+    int *keys = NULL;
+    if (planned) {
+        results = calloc(plan.count + 1, sizeof(int));
+        jobs = calloc(plan.count + 1, sizeof(daemon_job));
+        keys = calloc(plan.count + 1, sizeof(int));
+        if (!results || !jobs || !keys) {
+            fprintf(stderr, "Memory allocation failed\n");
+            plan.count = 0;
+        }
+        for (int i = 0; i < plan.count; i++)
+            keys[i] = display_bus_key(plan.display_nums[i]);
+    }
+
+    pthread_mutex_lock(&g_daemon_lock);
+    g_daemon_running--;
+    if (!planned) {
+        daemon_hotplug_if_idle();
+        pthread_mutex_unlock(&g_daemon_lock);
+        for (int i = 0; i < batch->count; i++)
+            failed[i] = 1;
+        return batch->count;
+    }
+
+    for (int i = 0; i < plan.count; i++) {
+        daemon_bus *bus = keys[i] >= 0 ? daemon_bus_for(keys[i]) : NULL;
+
+        // Displays that resolved to nothing fail without a bus
+        if (!bus)
+            continue;
+        jobs[i].cmd = &batch->items[plan.commands[i]];
+        jobs[i].display_num = plan.display_nums[i];
+        jobs[i].result = &results[i];
+        jobs[i].request = &request;
+        request.pending++;
+        daemon_enqueue(bus, &jobs[i]);
+    }
+    pthread_cond_broadcast(&g_daemon_cond);
+    daemon_hotplug_if_idle();
+
+    while (request.pending)
+        pthread_cond_wait(&g_daemon_cond, &g_daemon_lock);
+    pthread_mutex_unlock(&g_daemon_lock);
+
+    for (int i = 0; i < batch->count; i++) {
+        failed[i] = !results || !batch_command_ok(batch, &plan, results, i);
+        failures += failed[i];
+    }
+    *superseded = request.superseded;
+
+    batch_plan_free(&plan);
+    free(results);
+    free(jobs);
+    free(keys);
+    return failures;
+}
+
+/*
+ * Serve one request line: optional leading --if-changed=SECONDS and
+ * --verify, then commands separated by ','. Writes the reply: OK, OK
+ * superseded, or ERR failed followed by the failed commands, 1-based.
+ */
+static int daemon_serve_request(int client, char *line) {
+    char *args[MAX_DAEMON_ARGS];
+    char reply[DAEMON_LINE_LEN];
+    vcp_batch batch = { NULL, 0, 0 };
+    int count = split_args(line, args, MAX_DAEMON_ARGS);
+    int shadow_ttl = -1;
+    int verify = 0;
+    int first = 0;
+
+    if (first < count && sscanf(args[first], "--if-changed=%d", &shadow_ttl) == 1)
+        first++;
+    if (first < count && strcmp(args[first], "--verify") == 0) {
+        verify = 1;
+        first++;
+    }
+
+    if (!parse_batch_args(count - first, args + first, &batch)) {
+        snprintf(reply, sizeof(reply), "ERR bad command\n");
+    } else {
+        int *failed = calloc(batch.count, sizeof(int));
+        int superseded = 0;
+
+        for (int i = 0; i < batch.count; i++) {
+            batch.items[i].shadow_ttl = shadow_ttl;
+            batch.items[i].verify = verify;
+        }
+
+        if (!failed) {
+            snprintf(reply, sizeof(reply), "ERR out of memory\n");
+        } else if (daemon_execute(&batch, failed, &superseded) == 0) {
+            snprintf(reply, sizeof(reply), superseded ? "OK superseded\n" : "OK\n");
+        } else {
+            int len = snprintf(reply, sizeof(reply), "ERR failed");
+            for (int i = 0; i < batch.count && len < (int)sizeof(reply) - 8; i++) {
+                if (failed[i])
+                    len += snprintf(reply + len, sizeof(reply) - len, " %d", i + 1);
+            }
+            snprintf(reply + len, sizeof(reply) - len, "\n");
+        }
+        free(failed);
+    }
+    free(batch.items);
+
+    return write(client, reply, strlen(reply)) >= 0;
+}
+
+/*
+ * Serve one client connection: one request per line, one reply per line.
+ */
+static void daemon_serve_client(int client) {
+    char buf[DAEMON_LINE_LEN];
+    size_t used = 0;
+    ssize_t n;
+
+    while ((n = read(client, buf + used, sizeof(buf) - 1 - used)) > 0) {
+        used += n;
+        buf[used] = '\0';
+
+        char *nl;
+        while ((nl = strchr(buf, '\n')) != NULL) {
+            *nl = '\0';
+            if (!daemon_serve_request(client, buf))
+                return;
+
+            used -= (nl + 1 - buf);
+            memmove(buf, nl + 1, used + 1);
+        }
+
+        // Drop over-long lines
+        if (used == sizeof(buf) - 1)
+            used = 0;
+    }
+}
+
+/*
+ * Listen for kernel uevents and hand display changes to the bus workers,
+ * or apply them here when every bus is idle. Only messages from the
+ * kernel itself are trusted.
+ */
+static void *daemon_uevent_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char msg[8192];
+
+    for (;;) {
+        struct sockaddr_nl sender;
+        struct iovec iov = { msg, sizeof(msg) - 1 };
+        struct msghdr hdr;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &sender;
+        hdr.msg_namelen = sizeof(sender);
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+
+        ssize_t len = recvmsg(fd, &hdr, 0);
+        if (len < 0) {
+            if (errno == EINTR || errno == ENOBUFS)
+                continue;
+            break;
+        }
+        if (len == 0 || sender.nl_pid != 0)
+            continue;
+        msg[len] = '\0';
+
+        pthread_mutex_lock(&g_daemon_lock);
+        if (uevent_parse(msg, (size_t)len, &g_hotplug)) {
+            g_hotplug_pending = 1;
+            daemon_hotplug_if_idle();
+        }
+        pthread_mutex_unlock(&g_daemon_lock);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void *daemon_client_thread(void *arg) {
+    int client = (int)(intptr_t)arg;
+
+    daemon_serve_client(client);
+    close(client);
+    return NULL;
+}
+
+/*
+ * Run as a long-lived daemon: initialize the backend and display map
+ * once, then execute commands received on the Unix-domain socket.
+ */
+int run_daemon(void) {
+    static struct sockaddr_un addr;
+
+    daemon_socket_address(&addr);
+
+    // Refuse to start twice; clear a stale socket left by a crash
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        close(probe);
+        fprintf(stderr, "A daemon is already listening on %s\n", addr.sun_path);
+        return 1;
+    }
+    if (probe >= 0)
+        close(probe);
+    unlink(addr.sun_path);
+
+    // Create the socket owner-only from the start; a chmod after bind
+    // would leave a window where other users can connect
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_umask = umask(077);
+    int bound = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    int bind_errno = errno;
+    umask(old_umask);
+    if (!bound || listen(fd, 16) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", addr.sun_path, strerror(bound ? errno : bind_errno));
+        return 1;
+    }
+    g_socket_path = addr.sun_path;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, daemon_shutdown);
+    signal(SIGTERM, daemon_shutdown);
+
+    // Warm up the display map before the first command arrives
+    prepare_backend();
+    printf("Daemon found %d displays\n", display_count());
+    printf("Listening on %s\n", addr.sun_path);
+    fflush(stdout);
+
+    // Without uevents the map is still checked against the topology
+    // signature when the daemon starts, just not kept current
+    int uevent_fd = uevent_open();
+    pthread_t uevent_thread;
+    if (uevent_fd < 0 || pthread_create(&uevent_thread, NULL, daemon_uevent_thread,
+                                        (void *)(intptr_t)uevent_fd) != 0) {
+        fprintf(stderr, "No kernel uevents, restart the daemon after plugging monitors\n");
+        if (uevent_fd >= 0)
+            close(uevent_fd);
+    }
+
+    // One thread per client, so writes arriving while a bus is busy
+    // reach its queue and can be merged
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, daemon_client_thread, (void *)(intptr_t)client) != 0)
+            daemon_client_thread((void *)(intptr_t)client);
+    }
+    pthread_attr_destroy(&attr);
+
+    close(fd);
+    unlink(addr.sun_path);
+    return 1;
+}
+
+
+// ============================================================
+// Benchmark
+// ============================================================
+
+enum { PHASE_ENUMERATE, PHASE_INIT, PHASE_PACING, PHASE_TRANSFER, PHASE_TOTAL, PHASE_COUNT };
+
+/*
+ * Run one command count times and report where the time goes:
+ *   enumerate  display map, from the topology cache unless --rescan
+ *   init       backend selection
+ *   pacing     MCCS delays, reply delays and retry backoff slept
+ *   transfer   the rest of each transaction (I2C, ddcutil, emulator)
+ *   total      each transaction end to end, retries included
+ * Returns 0 when every transaction succeeded.
+ */
+int run_bench(const vcp_command *cmd, int read_mode, unsigned count, bench_format format) {
+    bench_phase phases[PHASE_COUNT] = {
+        { "enumerate", NULL, 0, 0 }, { "init", NULL, 0, 0 }, { "pacing", NULL, 0, 0 },
+        { "transfer", NULL, 0, 0 }, { "total", NULL, 0, 0 }
+    };
+    bench_run run = { NULL, count, 0, 0.0 };
+
+    uint64_t t0 = monotonic_us();
+    display_count();
+    uint64_t t1 = monotonic_us();
+    prepare_backend();
+    bench_add(&phases[PHASE_ENUMERATE], t1 - t0);
+    bench_add(&phases[PHASE_INIT], monotonic_us() - t1);
+
+    int display_num = resolve_display_num(cmd);
+    uint64_t start = monotonic_us();
+    for (unsigned i = 0; i < count; i++) {
+        ddcci_vcp_reply reply;
+        uint64_t paced = t_paced_us;
+        uint64_t begin = monotonic_us();
+        int ok = read_mode
+            ? read_value(display_num, cmd->command_code, cmd->register_address, &reply)
+            : write_value(display_num, cmd->input_value, cmd->command_code, cmd->register_address);
+        uint64_t total = monotonic_us() - begin;
+
+        paced = t_paced_us - paced;
+        bench_add(&phases[PHASE_PACING], paced);
+        bench_add(&phases[PHASE_TRANSFER], total > paced ? total - paced : 0);
+        bench_add(&phases[PHASE_TOTAL], total);
+        if (!ok)
+            run.failures++;
+    }
+    run.seconds = (monotonic_us() - start) / 1e6;
+    run.backend = backend_name();
+
+    bench_report(stdout, format, &run, phases, PHASE_COUNT);
+    for (int i = 0; i < PHASE_COUNT; i++)
+        bench_free(&phases[i]);
+    return run.failures ? 1 : 0;
+}
+
+
+void print_usage(void) {
+    printf("Incorrect Number of arguments!\n\n");
+
+    printf("Arguments:\n");
+    printf("display_index   - Index assigned to monitor (0 for first screen, -1 for primary),\n");
+    printf("                  or serial:S, connector:C (e.g. DP-1) or model:M from --list\n");
+    printf("input_value     - value to write to screen (hex, up to 0xFFFF)\n");
+    printf("command_code    - VCP code or other (hex)\n");
+    printf("register_address - Address to write to, default 0x51 for VCP codes (hex)\n\n");
+
+    printf("Options:\n");
+    printf("--backend=native  - Write directly to /dev/i2c-N (default)\n");
+    printf("--backend=ddcutil - Invoke the ddcutil CLI\n");
+    printf("--backend=libddcutil - Call libddcutil in process (make LIBDDCUTIL=1)\n");
+    printf("--backend=virtual - Emulated monitors for testing, configured by %s\n", VIRTUAL_ENV);
+    printf("--daemon          - Stay resident and serve commands over a Unix socket\n");
+    printf("--no-daemon       - Do not forward to a running daemon\n");
+    printf("--rescan          - Ignore the cached display topology and enumerate again, without the daemon\n");
+    printf("--get             - Read a value instead: [display_index] [command_code] [register_address]\n");
+    printf("--caps            - Print and cache a display's capabilities: [display_index]\n");
+    printf("--list            - Print every display with its connector, model and serial\n");
+    printf("--display SEL     - display_index for every command, which then leaves it out\n");
+    printf("--fade MS         - Ramp a continuous code (0x10, 0x12, ...) to the value over MS milliseconds\n");
+    printf("--if-changed[=S]  - Skip writes of values the monitor already has (shadow TTL S seconds, default %d)\n",
+           SHADOW_DEFAULT_TTL);
+    printf("--verify          - Read each written value back and write again on a mismatch\n");
+    printf("--batch FILE      - Read one command per line from FILE (- for stdin)\n");
+    printf("--bench N         - Run the command N times and report latency per phase\n");
+    printf("--bench-format=F  - Benchmark report as text (default), csv or json\n\n");
+
+    printf("Usage:\n");
+    printf("writeValueToDisplay [display_index] [input_value] [command_code]\n");
+    printf("OR\n");
+    printf("writeValueToDisplay [display_index] [input_value] [command_code] [register_address]\n");
+    printf("OR\n");
+    printf("writeValueToDisplay [command] , [command] , ...\n");
+    printf("OR\n");
+    printf("writeValueToDisplay --batch [file]\n");
+    printf("OR\n");
+    printf("writeValueToDisplay --get [display_index] [command_code]\n");
+    printf("OR\n");
+    printf("writeValueToDisplay --caps [display_index]\n");
+    printf("OR\n");
+    printf("writeValueToDisplay --list\n");
+    printf("OR\n");
+    printf("writeValueToDisplay --fade [ms] [display_index] [input_value] [command_code]\n");
+}
+
+int main(int argc, char *argv[]) {
+    int daemon_mode = 0;
+    int use_daemon = 1;
+    int read_mode = 0;
+    int caps_mode = 0;
+    int list_mode = 0;
+    int shadow_ttl = -1;
+    int verify = 0;
+    const char *batch_file = NULL;
+    unsigned bench_count = 0;
+    uint32_t fade_ms = 0;
+    bench_format bench_fmt = BENCH_TEXT;
+
+    TRACE_INIT();
+
+    // Leading options: --backend=native|ddcutil|libddcutil|virtual, --daemon, --no-daemon,
+    // --rescan, --get, --caps, --list, --display SEL, --if-changed[=SECONDS], --verify, --batch FILE,
+    // --fade MS, --bench N, --bench-format=text|csv|json
+    // A daemon keeps the backend and display map it started with, so
+    // asking for a particular backend or a fresh scan runs locally
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--backend=native") == 0) {
+            g_backend = BACKEND_NATIVE;
+            use_daemon = 0;
+        } else if (strcmp(argv[1], "--backend=ddcutil") == 0) {
+            g_backend = BACKEND_DDCUTIL;
+            use_daemon = 0;
+        } else if (strcmp(argv[1], "--backend=libddcutil") == 0) {
+#ifdef HAVE_LIBDDCUTIL
+            g_backend = BACKEND_LIBDDCUTIL;
+            use_daemon = 0;
+#else
+            fprintf(stderr, "Built without libddcutil, rebuild with make LIBDDCUTIL=1\n");
+            return 1;
+#endif
+        } else if (strcmp(argv[1], "--backend=virtual") == 0) {
+            g_backend = BACKEND_VIRTUAL;
+            use_daemon = 0;
+        } else if (strcmp(argv[1], "--daemon") == 0) {
+            daemon_mode = 1;
+        } else if (strcmp(argv[1], "--no-daemon") == 0) {
+            use_daemon = 0;
+        } else if (strcmp(argv[1], "--rescan") == 0) {
+            g_rescan = 1;
+            use_daemon = 0;
+        } else if (strcmp(argv[1], "--get") == 0) {
+            read_mode = 1;
+        } else if (strcmp(argv[1], "--caps") == 0) {
+            caps_mode = 1;
+        } else if (strcmp(argv[1], "--list") == 0) {
+            list_mode = 1;
+        } else if (strcmp(argv[1], "--if-changed") == 0) {
+            shadow_ttl = SHADOW_DEFAULT_TTL;
+        } else if (sscanf(argv[1], "--if-changed=%d", &shadow_ttl) == 1 && shadow_ttl >= 0) {
+            // TTL given explicitly
+        } else if (strcmp(argv[1], "--verify") == 0) {
+            verify = 1;
+        } else if (strcmp(argv[1], "--display") == 0 && argc > 2) {
+            g_display_arg = argv[2];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--batch") == 0 && argc > 2) {
+            batch_file = argv[2];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--fade") == 0 && argc > 2 && atoi(argv[2]) > 0 &&
+                   atoi(argv[2]) <= FADE_MAX_MS) {
+            fade_ms = (uint32_t)atoi(argv[2]);
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--bench") == 0 && argc > 2 && atoi(argv[2]) > 0) {
+            bench_count = (unsigned)atoi(argv[2]);
+            argv++;
+            argc--;
+        } else if (strncmp(argv[1], "--bench-format=", 15) == 0 &&
+                   bench_parse_format(argv[1] + 15, &bench_fmt)) {
+            // Format given
+        } else {
+            fprintf(stderr, "Unknown option: %s\n\n", argv[1]);
+            print_usage();
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+
+    if (daemon_mode)
+        return run_daemon();
+
+    // Usage: writeValueToDisplay --bench N [--get] [display_index] [input_value] [command_code] ...
+    // Always runs locally, a daemon would hide the costs being measured
+    if (bench_count) {
+        vcp_command cmd;
+        int parsed = read_mode ? parse_read_command(argc - 1, argv + 1, &cmd)
+                               : parse_command(argc - 1, argv + 1, &cmd);
+        if (batch_file || !parsed) {
+            print_usage();
+            return 1;
+        }
+        return run_bench(&cmd, read_mode, bench_count, bench_fmt);
+    }
+
+    // Usage: writeValueToDisplay --fade MS [display_index] [input_value] [command_code] [register_address]
+    // Runs locally: the whole ramp is one process, however many steps it takes
+    if (fade_ms) {
+        vcp_command cmd;
+        if (batch_file || read_mode || caps_mode || list_mode || !parse_command(argc - 1, argv + 1, &cmd)) {
+            print_usage();
+            return 1;
+        }
+        if (!execute_fade(&cmd, fade_ms)) {
+            printf("Fading value failed\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // Usage: writeValueToDisplay --caps [display_index]
+    if (caps_mode) {
+        vcp_command cmd = { -1, 0, 0, DDCCI_HOST_ADDR, -1, 0, "" };
+        const char *display = argc == 2 ? argv[1] : g_display_arg;
+        if (batch_file || read_mode || argc > 2 || (argc == 2 && g_display_arg) ||
+            (display && !parse_display(display, &cmd))) {
+            print_usage();
+            return 1;
+        }
+        if (!execute_caps(&cmd)) {
+            printf("Reading capabilities failed\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // Usage: writeValueToDisplay --list
+    if (list_mode) {
+        if (batch_file || read_mode || argc > 1) {
+            print_usage();
+            return 1;
+        }
+        if (!execute_list()) {
+            printf("No displays found\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // Usage: writeValueToDisplay --get [display_index] [command_code] [register_address]
+    if (read_mode) {
+        vcp_command cmd;
+        if (batch_file || !parse_read_command(argc - 1, argv + 1, &cmd)) {
+            print_usage();
+            return 1;
+        }
+        if (!execute_read(&cmd)) {
+            printf("Reading value failed\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // Usage: writeValueToDisplay [display_index] [input_value] [command_code] [register_address] [, ...]
+    vcp_batch batch = { NULL, 0, 0 };
+    if (batch_file) {
+        if (argc != 1 || !parse_batch_file(batch_file, &batch)) {
+            if (argc != 1)
+                print_usage();
+            return 1;
+        }
+    } else if (!parse_batch_args(argc - 1, argv + 1, &batch)) {
+        print_usage();
+        return 1;
+    }
+
+    for (int i = 0; i < batch.count; i++) {
+        batch.items[i].shadow_ttl = shadow_ttl;
+        batch.items[i].verify = verify;
+    }
+
+    // Hand the commands to a running daemon, which already has the
+    // backend initialized and the display map enumerated
+    int failures = -1;
+    if (use_daemon)
+        failures = forward_to_daemon(&batch);
+    if (failures < 0)
+        failures = execute_batch(&batch);
+    free(batch.items);
+
+    if (failures) {
+        if (batch.count > 1)
+            printf("%d of %d commands failed\n", failures, batch.count);
+        else
+            printf("Changing value failed\n");
         return 1;
     }
 
@@ -1,49 +1,766 @@
 #pragma comment(lib, "nvapi64.lib")
 #pragma comment(lib, "user32.lib")
+#pragma comment(lib, "advapi32.lib")
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <windows.h>
+#include <sddl.h>
 #include <tchar.h>
 #include "nvapi.h"
 #include "adl_sdk.h"
+#include "ddcci.h"
+#include "edid.h"
+#include "mccs_timing.h"
+#include "mccs_caps.h"
+#include "ddcci_emu.h"
+#include "bench.h"
+#include "fade.h"
+#include "mccs_verify.h"
+#include "trace.h"
 
 
 // ============================================================
-// NVIDIA Backend
+// Display topology cache
+// ============================================================
+
+// One cached display. For NVIDIA a/b are the physical GPU index and the
+// output id, for ADL the adapter index and display index.
+struct TopologyEntry
+{
+    int a;
+    int b;
+    unsigned long long edid_hash;
+    unsigned long long edid_id;     // edid_identity(), 0 if unknown
+    char name[64];      // e.g. \\.\DISPLAY1, "-" if unknown
+};
+
+static bool g_rescan = false;            // --rescan: ignore the topology cache
+static bool g_topologyCached = false;    // Display map came from the on-disk cache
+
+// Cache file: %LOCALAPPDATA%\writeValueToDisplay\<name>. Creates the directory.
+bool CachePath(const char* name, char* path, size_t size)
+{
+    char dir[MAX_PATH];
+    DWORD len = GetEnvironmentVariableA("LOCALAPPDATA", dir, sizeof(dir));
+    if (len == 0 || len >= sizeof(dir))
+        return false;
+
+    strcat_s(dir, sizeof(dir), "\\writeValueToDisplay");
+    if (!CreateDirectoryA(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+        return false;
+
+    _snprintf_s(path, size, _TRUNCATE, "%s\\%s", dir, name);
+    return true;
+}
+
+// Take the cross-process lock file <name> in the cache directory, so a
+// read-modify-write of a shared cache file does not lose what another
+// process saved meanwhile. Returns the handle, whose close drops the lock,
+// or INVALID_HANDLE_VALUE without a cache directory.
+HANDLE CacheLock(const char* name)
+{
+    char path[MAX_PATH];
+    if (!CachePath(name, path, sizeof(path)))
+        return INVALID_HANDLE_VALUE;
+
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return INVALID_HANDLE_VALUE;
+
+    OVERLAPPED range = {};
+    if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &range))
+    {
+        CloseHandle(file);
+        return INVALID_HANDLE_VALUE;
+    }
+    return file;
+}
+
+// Cheap fingerprint of the current display hardware: every display
+// adapter and attached monitor device id with its state flags. Reading
+// these never touches the I2C bus, and any hotplug or monitor swap
+// alters the result.
+unsigned long long TopologySignature()
+{
+    unsigned long long hash = EDID_HASH_INIT;
+
+    DISPLAY_DEVICE adapter;
+    ZeroMemory(&adapter, sizeof(adapter));
+    adapter.cb = sizeof(adapter);
+    for (DWORD i = 0; EnumDisplayDevices(NULL, i, &adapter, 0); i++)
+    {
+        hash = edid_hash_update(hash, adapter.DeviceName, strlen(adapter.DeviceName));
+        hash = edid_hash_update(hash, &adapter.StateFlags, sizeof(adapter.StateFlags));
+
+        DISPLAY_DEVICE monitor;
+        ZeroMemory(&monitor, sizeof(monitor));
+        monitor.cb = sizeof(monitor);
+        for (DWORD j = 0; EnumDisplayDevices(adapter.DeviceName, j, &monitor, 0); j++)
+        {
+            hash = edid_hash_update(hash, monitor.DeviceID, strlen(monitor.DeviceID));
+            hash = edid_hash_update(hash, &monitor.StateFlags, sizeof(monitor.StateFlags));
+        }
+    }
+
+    return hash;
+}
+
+// Load the cached topology for a backend if its signature still matches.
+// Returns the entry count, or -1 on a miss.
+int TopologyLoad(const char* backend, TopologyEntry* entries, int max_entries)
+{
+    char path[MAX_PATH];
+    char line[MAX_PATH];
+    char cached_backend[16] = "";
+    unsigned long long cached_signature = 0;
+
+    if (g_rescan || !CachePath("topology", path, sizeof(path)))
+        return -1;
+
+    FILE* fp = NULL;
+    if (fopen_s(&fp, path, "r") != 0)
+        return -1;
+
+    if (!fgets(line, sizeof(line), fp) ||
+        sscanf_s(line, "signature %llx %15s", &cached_signature, cached_backend, (unsigned)sizeof(cached_backend)) != 2 ||
+        cached_signature != TopologySignature() || strcmp(cached_backend, backend) != 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    int count = 0;
+    while (count < max_entries && fgets(line, sizeof(line), fp))
+    {
+        TopologyEntry& entry = entries[count];
+        int index = -1;
+        if (sscanf_s(line, "%d %d %d %llx %llx %63s", &index, &entry.a, &entry.b, &entry.edid_hash,
+                &entry.edid_id, entry.name, (unsigned)sizeof(entry.name)) != 6 || index != count)
+        {
+            fclose(fp);
+            return -1;
+        }
+        count++;
+    }
+
+    fclose(fp);
+    g_topologyCached = true;
+    return count;
+}
+
+void TopologySave(const char* backend, const TopologyEntry* entries, int count)
+{
+    char path[MAX_PATH];
+    char tmp_path[MAX_PATH + 16];
+
+    if (!CachePath("topology", path, sizeof(path)))
+        return;
+
+    // Write to a temp file and rename, so concurrent readers never see
+    // a partial cache
+    _snprintf_s(tmp_path, sizeof(tmp_path), _TRUNCATE, "%s.%lu", path, GetCurrentProcessId());
+    FILE* fp = NULL;
+    if (fopen_s(&fp, tmp_path, "w") != 0)
+        return;
+
+    fprintf(fp, "signature %016llx %s\n", TopologySignature(), backend);
+    for (int i = 0; i < count; i++)
+        fprintf(fp, "%d %d %d %016llx %016llx %s\n", i, entries[i].a, entries[i].b, entries[i].edid_hash,
+            entries[i].edid_id, entries[i].name);
+
+    if (fclose(fp) == 0 && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+        return;
+    DeleteFileA(tmp_path);
+}
+
+// Drop the on-disk cache after a failure on a cached display, so the
+// next run enumerates again
+void TopologyInvalidate()
+{
+    char path[MAX_PATH];
+    if (g_topologyCached && CachePath("topology", path, sizeof(path)))
+    {
+        DeleteFileA(path);
+        g_topologyCached = false;
+    }
+}
+
+
+// ============================================================
+// EDID cache
+// ============================================================
+
+#define EDID_CACHE_MAX 64
+
+// EDID blocks of the monitors seen, keyed by the hash of the raw block,
+// with their parsed identity. The cache file keeps the raw block, so a
+// hash that matches guarantees the content and the parser can change
+// without invalidating it.
+struct EdidEntry
+{
+    unsigned long long hash;
+    uint8_t block[EDID_BLOCK_LEN];
+    edid_info info;
+};
+
+static EdidEntry g_edid[EDID_CACHE_MAX];
+static int g_edidCount = -1;        // -1 until the cache file is loaded
+static bool g_edidDirty = false;
+static std::mutex g_edidMutex;
+
+// Load %LOCALAPPDATA%\writeValueToDisplay\edid, one "hash hex-block" per
+// line. Lines whose block does not hash to their key are dropped.
+// Caller holds g_edidMutex.
+void EdidLoad()
+{
+    char path[MAX_PATH];
+    char line[2 * EDID_BLOCK_LEN + 32];
+
+    g_edidCount = 0;
+    if (!CachePath("edid", path, sizeof(path)))
+        return;
+
+    FILE* fp = NULL;
+    if (fopen_s(&fp, path, "r") != 0)
+        return;
+
+    while (g_edidCount < EDID_CACHE_MAX && fgets(line, sizeof(line), fp))
+    {
+        EdidEntry& entry = g_edid[g_edidCount];
+        unsigned long long hash = 0;
+        int n = 0;
+        if (sscanf_s(line, "%llx %n", &hash, &n) != 1 || !edid_from_hex(line + n, entry.block) ||
+            edid_hash(entry.block) != hash || !edid_parse(entry.block, &entry.info))
+            continue;
+        entry.hash = hash;
+        g_edidCount++;
+    }
+    fclose(fp);
+}
+
+// Find a block by hash. Caller holds g_edidMutex.
+EdidEntry* EdidFind(unsigned long long hash)
+{
+    if (g_edidCount < 0)
+        EdidLoad();
+    for (int i = 0; i < g_edidCount; i++)
+    {
+        if (g_edid[i].hash == hash)
+            return &g_edid[i];
+    }
+    return NULL;
+}
+
+// Add a block read from a monitor. When the cache is full the oldest
+// entry makes room.
+void EdidRemember(const uint8_t* edid)
+{
+    unsigned long long hash = edid_hash(edid);
+    std::lock_guard<std::mutex> lock(g_edidMutex);
+
+    if (EdidFind(hash))
+        return;
+    if (g_edidCount == EDID_CACHE_MAX)
+    {
+        memmove(&g_edid[0], &g_edid[1], (EDID_CACHE_MAX - 1) * sizeof(EdidEntry));
+        g_edidCount--;
+    }
+    EdidEntry& entry = g_edid[g_edidCount];
+    memcpy(entry.block, edid, EDID_BLOCK_LEN);
+    if (edid_parse(entry.block, &entry.info))
+    {
+        entry.hash = hash;
+        g_edidCount++;
+        g_edidDirty = true;
+    }
+}
+
+// Write the cache file if blocks were added
+void EdidFlush()
+{
+    char path[MAX_PATH];
+    char tmp_path[MAX_PATH + 16];
+    char hex[2 * EDID_BLOCK_LEN + 1];
+    std::lock_guard<std::mutex> lock(g_edidMutex);
+
+    if (!g_edidDirty || !CachePath("edid", path, sizeof(path)))
+        return;
+    g_edidDirty = false;
+
+    _snprintf_s(tmp_path, sizeof(tmp_path), _TRUNCATE, "%s.%lu", path, GetCurrentProcessId());
+    FILE* fp = NULL;
+    if (fopen_s(&fp, tmp_path, "w") != 0)
+        return;
+
+    for (int i = 0; i < g_edidCount; i++)
+    {
+        edid_to_hex(g_edid[i].block, hex);
+        fprintf(fp, "%016llx %s\n", g_edid[i].hash, hex);
+    }
+    if (fclose(fp) == 0 && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+        return;
+    DeleteFileA(tmp_path);
+}
+
+
+// ============================================================
+// VCP shadow cache
+// ============================================================
+
+#define SHADOW_MAX_ENTRIES 256
+#define SHADOW_DEFAULT_TTL 300      // Seconds a shadow value is trusted by --if-changed
+
+// Last value we wrote to or read from one code on one monitor, trusted by
+// --if-changed for the TTL instead of a bus transaction.
+struct ShadowEntry
+{
+    unsigned long long display_id;
+    BYTE register_address;
+    BYTE command_code;
+    WORD value;
+    time_t stamp;
+};
+
+// Shared by batch workers and daemon clients, and persisted next to the
+// topology cache so one-shot runs and the daemon see each other's writes
+static ShadowEntry g_shadow[SHADOW_MAX_ENTRIES];
+static int g_shadowCount = -1;
+static std::mutex g_shadowMutex;
+
+// Caller holds g_shadowMutex
+void ShadowLoad()
+{
+    char path[MAX_PATH];
+    char line[MAX_PATH];
+
+    g_shadowCount = 0;
+    if (!CachePath("shadow", path, sizeof(path)))
+        return;
+
+    FILE* fp = NULL;
+    if (fopen_s(&fp, path, "r") != 0)
+        return;
+
+    while (g_shadowCount < SHADOW_MAX_ENTRIES && fgets(line, sizeof(line), fp))
+    {
+        ShadowEntry& entry = g_shadow[g_shadowCount];
+        unsigned int reg, code, value;
+        long long stamp;
+        if (sscanf_s(line, "%llx %x %x %x %lld", &entry.display_id, &reg, &code, &value, &stamp) != 5)
+            continue;
+        entry.register_address = (BYTE)reg;
+        entry.command_code = (BYTE)code;
+        entry.value = (WORD)value;
+        entry.stamp = (time_t)stamp;
+        g_shadowCount++;
+    }
+    fclose(fp);
+}
+
+// Caller holds g_shadowMutex
+void ShadowSave()
+{
+    char path[MAX_PATH];
+    char tmp_path[MAX_PATH + 16];
+
+    if (!CachePath("shadow", path, sizeof(path)))
+        return;
+
+    _snprintf_s(tmp_path, sizeof(tmp_path), _TRUNCATE, "%s.%lu", path, GetCurrentProcessId());
+    FILE* fp = NULL;
+    if (fopen_s(&fp, tmp_path, "w") != 0)
+        return;
+
+    for (int i = 0; i < g_shadowCount; i++)
+    {
+        const ShadowEntry& entry = g_shadow[i];
+        fprintf(fp, "%016llx %02x %02x %04x %lld\n", entry.display_id, entry.register_address,
+            entry.command_code, entry.value, (long long)entry.stamp);
+    }
+
+    if (fclose(fp) == 0 && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+        return;
+    DeleteFileA(tmp_path);
+}
+
+// Take the cross-process lock of the shadow file and re-read it, so a
+// change is merged into what other processes saved since we last looked
+// instead of overwriting it with our older copy. Caller holds
+// g_shadowMutex. Returns the lock handle, or INVALID_HANDLE_VALUE without
+// a cache directory, in which case the table stays in memory only.
+HANDLE ShadowBeginUpdate()
+{
+    HANDLE file = CacheLock("shadow.lock");
+    ShadowLoad();
+    return file;
+}
+
+// Caller holds g_shadowMutex; closing the handle drops the lock
+void ShadowEndUpdate(HANDLE file, bool changed)
+{
+    if (changed)
+        ShadowSave();
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+}
+
+// Caller holds g_shadowMutex
+ShadowEntry* ShadowFind(unsigned long long id, BYTE register_address, BYTE command_code)
+{
+    if (g_shadowCount < 0)
+        ShadowLoad();
+
+    for (int i = 0; i < g_shadowCount; i++)
+    {
+        ShadowEntry& entry = g_shadow[i];
+        if (entry.display_id == id && entry.register_address == register_address && entry.command_code == command_code)
+            return &entry;
+    }
+    return NULL;
+}
+
+// Look up a value no older than ttl seconds, as last saved by any process
+bool ShadowLookup(unsigned long long id, BYTE register_address, BYTE command_code, int ttl, WORD* value)
+{
+    std::lock_guard<std::mutex> lock(g_shadowMutex);
+    ShadowLoad();
+    ShadowEntry* entry = ShadowFind(id, register_address, command_code);
+    if (!entry || time(NULL) - entry->stamp >= ttl)
+        return false;
+    *value = entry->value;
+    return true;
+}
+
+// Record a value just written to the monitor
+void ShadowStore(unsigned long long id, BYTE register_address, BYTE command_code, WORD value)
+{
+    std::lock_guard<std::mutex> lock(g_shadowMutex);
+    HANDLE file = ShadowBeginUpdate();
+    ShadowEntry* entry = ShadowFind(id, register_address, command_code);
+    if (!entry)
+    {
+        if (g_shadowCount < SHADOW_MAX_ENTRIES)
+        {
+            entry = &g_shadow[g_shadowCount++];
+        }
+        else
+        {
+            // Full: reuse the stalest entry
+            entry = &g_shadow[0];
+            for (int i = 1; i < g_shadowCount; i++)
+            {
+                if (g_shadow[i].stamp < entry->stamp)
+                    entry = &g_shadow[i];
+            }
+        }
+        entry->display_id = id;
+        entry->register_address = register_address;
+        entry->command_code = command_code;
+    }
+    entry->value = value;
+    entry->stamp = time(NULL);
+    ShadowEndUpdate(file, true);
+}
+
+// Forget a value after a failed write left the monitor state unknown
+void ShadowForget(unsigned long long id, BYTE register_address, BYTE command_code)
+{
+    std::lock_guard<std::mutex> lock(g_shadowMutex);
+    HANDLE file = ShadowBeginUpdate();
+    ShadowEntry* entry = ShadowFind(id, register_address, command_code);
+    if (entry)
+        *entry = g_shadow[--g_shadowCount];
+    ShadowEndUpdate(file, entry != NULL);
+}
+
+
+// ============================================================
+// Adaptive MCCS timing
 // ============================================================
 
-// This function calculates the (XOR) checksum of the I2C register
-void CalculateI2cChecksum(const NV_I2C_INFO& i2cInfo)
+#define TIMING_MAX_ENTRIES 64
+
+// Learned delays of one monitor, plus when its last transaction ended
+struct TimingEntry
+{
+    unsigned long long display_id;
+    mccs_timing timing;
+    ULONGLONG last_op_ms;       // GetTickCount64, 0 before the first transaction
+    bool link_down;             // Input or power switched, failures say nothing about timing
+};
+
+// Shared by batch workers and daemon clients; the delays are persisted
+// so every run starts from what earlier runs learned
+static TimingEntry g_timing[TIMING_MAX_ENTRIES];
+static int g_timingCount = -1;
+static std::mutex g_timingMutex;
+
+unsigned long long DisplayId(int display_index);
+
+// Time this thread has spent in pacing sleeps, for --bench
+static thread_local ULONGLONG t_pacedUs = 0;
+
+ULONGLONG MonotonicUs()
+{
+    static LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (ULONGLONG)(now.QuadPart / frequency.QuadPart * 1000000 +
+        now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+}
+
+// Sleep for an MCCS delay or retry backoff, accounting the time slept
+void PaceSleep(DWORD ms)
+{
+    ULONGLONG start = MonotonicUs();
+    TRACE_BEGIN(t);
+    Sleep(ms);
+    TRACE_END(t, "sleep");
+    t_pacedUs += MonotonicUs() - start;
+}
+
+// Parse one line of the timing file into a freshly initialised model.
+// Entries without floor times predate their expiry and are loaded with
+// the floors already expired. Returns false for a malformed line.
+bool TimingParse(const char* line, unsigned long long* id, mccs_timing* timing)
+{
+    unsigned long long write_time = 0, reply_time = 0;
+    unsigned int write_ms, write_floor, reply_ms, reply_floor;
+    unsigned int write_min = DDCCI_SET_VCP_DELAY_MS;
+
+    int fields = sscanf_s(line, "%llx %u %u %u %u %llu %llu %u", id, &write_ms, &write_floor,
+        &reply_ms, &reply_floor, &write_time, &reply_time, &write_min);
+    if (fields != 5 && fields != 8)
+        return false;
+    mccs_timing_init(timing);
+    timing->write.ms = (uint16_t)write_ms;
+    timing->write.floor_ms = (uint16_t)write_floor;
+    timing->write.floor_time = write_time;
+    timing->write.min_ms = write_min == MCCS_TIMING_MIN_MS ? MCCS_TIMING_MIN_MS : DDCCI_SET_VCP_DELAY_MS;
+    timing->reply.ms = (uint16_t)reply_ms;
+    timing->reply.floor_ms = (uint16_t)reply_floor;
+    timing->reply.floor_time = reply_time;
+    mccs_timing_expire(timing, (uint64_t)time(NULL));
+    return true;
+}
+
+// Take over the persisted part of a delay another process saved
+void TimingAdopt(mccs_delay* delay, const mccs_delay& saved)
+{
+    delay->ms = saved.ms;
+    delay->floor_ms = saved.floor_ms;
+    delay->floor_time = saved.floor_time;
+    delay->min_ms = saved.min_ms;
+}
+
+// Caller holds g_timingMutex
+void TimingLoad()
+{
+    char path[MAX_PATH];
+    char line[MAX_PATH];
+
+    g_timingCount = 0;
+    if (!CachePath("timing", path, sizeof(path)))
+        return;
+
+    FILE* fp = NULL;
+    if (fopen_s(&fp, path, "r") != 0)
+        return;
+
+    while (g_timingCount < TIMING_MAX_ENTRIES && fgets(line, sizeof(line), fp))
+    {
+        TimingEntry& entry = g_timing[g_timingCount];
+        if (!TimingParse(line, &entry.display_id, &entry.timing))
+            continue;
+        entry.last_op_ms = 0;
+        entry.link_down = false;
+        g_timingCount++;
+    }
+    fclose(fp);
+}
+
+// Caller holds g_timingMutex. Returns NULL only when the table is full.
+TimingEntry* TimingFind(unsigned long long id)
+{
+    if (g_timingCount < 0)
+        TimingLoad();
+
+    for (int i = 0; i < g_timingCount; i++)
+    {
+        if (g_timing[i].display_id == id)
+            return &g_timing[i];
+    }
+    if (g_timingCount == TIMING_MAX_ENTRIES)
+        return NULL;
+
+    TimingEntry& entry = g_timing[g_timingCount++];
+    entry.display_id = id;
+    mccs_timing_init(&entry.timing);
+    entry.last_op_ms = 0;
+    entry.link_down = false;
+    return &entry;
+}
+
+// Save the delays of a changed entry. The file is shared by one-shot runs
+// and the daemon, which loads it once, so it is re-read under its lock
+// first: every other monitor keeps what was last saved for it, and our
+// table takes that over, instead of our older copy overwriting it.
+// Caller holds g_timingMutex.
+void TimingSave(const TimingEntry* changed)
 {
-    // Calculate the i2c packet checksum and place the
-    // value into the packet
+    char path[MAX_PATH];
+    char tmp_path[MAX_PATH + 16];
+    char line[MAX_PATH];
 
-    // i2c checksum is the result of xor'ing all the bytes in the
-    // packet (except for the last data byte, which is the checksum
-    // itself)
+    if (!CachePath("timing", path, sizeof(path)))
+        return;
 
-    // Packet consists of:
+    HANDLE lock = CacheLock("timing.lock");
+    FILE* fp = NULL;
+    if (fopen_s(&fp, path, "r") == 0)
+    {
+        while (fgets(line, sizeof(line), fp))
+        {
+            unsigned long long id;
+            mccs_timing saved;
+            if (!TimingParse(line, &id, &saved) || id == changed->display_id)
+                continue;
+            TimingEntry* entry = TimingFind(id);
+            if (entry)
+            {
+                TimingAdopt(&entry->timing.write, saved.write);
+                TimingAdopt(&entry->timing.reply, saved.reply);
+            }
+        }
+        fclose(fp);
+    }
 
-    // The device address...
-    BYTE checksum = i2cInfo.i2cDevAddress;
+    _snprintf_s(tmp_path, sizeof(tmp_path), _TRUNCATE, "%s.%lu", path, GetCurrentProcessId());
+    if (fopen_s(&fp, tmp_path, "w") == 0)
+    {
+        for (int i = 0; i < g_timingCount; i++)
+        {
+            const mccs_timing& t = g_timing[i].timing;
+            fprintf(fp, "%016llx %u %u %u %u %llu %llu %u\n", g_timing[i].display_id,
+                t.write.ms, t.write.floor_ms, t.reply.ms, t.reply.floor_ms,
+                (unsigned long long)t.write.floor_time, (unsigned long long)t.reply.floor_time, t.write.min_ms);
+        }
+        if (fclose(fp) != 0 || !MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+            DeleteFileA(tmp_path);
+    }
+    if (lock != INVALID_HANDLE_VALUE)
+        CloseHandle(lock);
+}
 
-    // Register address...
-    for (unsigned int i = 0; i < i2cInfo.regAddrSize; ++i)
+// Wait until the monitor is ready for its next transaction: the learned
+// write delay after the end of the previous one. Nothing is waited for
+// the first transaction, or when enough time has passed anyway.
+// Returns true if a delay was enforced, so the outcome of the transaction
+// says something about whether that delay was long enough.
+bool TimingGate(unsigned long long id)
+{
+    ULONGLONG wait_ms = 0;
+    bool gated = false;
     {
-        checksum ^= i2cInfo.pbI2cRegAddress[i];
+        std::lock_guard<std::mutex> lock(g_timingMutex);
+        TimingEntry* entry = TimingFind(id);
+        if (entry && entry->last_op_ms)
+        {
+            ULONGLONG elapsed = GetTickCount64() - entry->last_op_ms;
+            gated = elapsed < (ULONGLONG)entry->timing.write.ms + MCCS_TIMING_MIN_MS;
+            if (elapsed < entry->timing.write.ms)
+                wait_ms = entry->timing.write.ms - elapsed;
+        }
     }
 
-    // And data bytes less last byte for checksum...
-    for (unsigned int i = 0; i < i2cInfo.cbSize - 1; ++i)
+    if (wait_ms)
+        PaceSleep((DWORD)wait_ms);
+    return gated;
+}
+
+// Fold an outcome into one of an entry's delays. Failures that say
+// nothing about timing are ignored, and so is every failure while the
+// monitor may be away after an input or power switch, until it answers
+// again. Caller holds g_timingMutex.
+void TimingAdapt(TimingEntry* entry, mccs_delay* delay, ddcci_status status)
+{
+    int outcome = mccs_timing_outcome(status);
+
+    if (outcome > 0)
+        entry->link_down = false;
+    if (outcome < 0 || (outcome == 0 && entry->link_down))
+        return;
+    if (mccs_delay_adapt(delay, outcome, (uint64_t)time(NULL)))
+        TimingSave(entry);
+}
+
+// Record the end of a transaction and, if it was gated, whether the
+// monitor accepted it
+void TimingDone(unsigned long long id, bool gated, ddcci_status status)
+{
+    std::lock_guard<std::mutex> lock(g_timingMutex);
+    TimingEntry* entry = TimingFind(id);
+    if (entry)
     {
-        checksum ^= i2cInfo.pbData[i];
+        entry->last_op_ms = GetTickCount64();
+        if (gated)
+            TimingAdapt(entry, &entry->timing.write, status);
     }
+}
+
+// Note a successful write of a code after which the monitor may stop
+// answering for a while (see mccs_code_drops_link())
+void TimingLinkDrop(unsigned long long id)
+{
+    std::lock_guard<std::mutex> lock(g_timingMutex);
+    TimingEntry* entry = TimingFind(id);
+    if (entry)
+        entry->link_down = true;
+}
+
+// Record whether a written value read back as written
+void TimingConfirm(unsigned long long id, bool ok)
+{
+    std::lock_guard<std::mutex> lock(g_timingMutex);
+    TimingEntry* entry = TimingFind(id);
+    if (entry && mccs_timing_confirm(&entry->timing, ok, (uint64_t)time(NULL)))
+        TimingSave(entry);
+}
 
-    // Store calculated checksum in the last byte of i2c packet
-    i2cInfo.pbData[i2cInfo.cbSize - 1] = checksum;
+// Delay between a request and reading its reply, in milliseconds
+DWORD TimingReplyDelay(unsigned long long id)
+{
+    std::lock_guard<std::mutex> lock(g_timingMutex);
+    TimingEntry* entry = TimingFind(id);
+    return entry ? entry->timing.reply.ms : DDCCI_REPLY_DELAY_MS;
+}
+
+// Record whether a reply was ready and intact after the reply delay
+void TimingReplyDone(unsigned long long id, ddcci_status status)
+{
+    std::lock_guard<std::mutex> lock(g_timingMutex);
+    TimingEntry* entry = TimingFind(id);
+    if (entry)
+    {
+        entry->last_op_ms = GetTickCount64();
+        TimingAdapt(entry, &entry->timing.reply, status);
+    }
 }
 
+
+// ============================================================
+// NVIDIA Backend
+// ============================================================
+
 // This macro initializes the i2cinfo structure
 #define  INIT_I2CINFO(i2cInfo, i2cVersion, displayId, isDDCPort,   \
         i2cDevAddr, regAddr, regSize, dataBuf, bufSize, speed)     \
@@ -59,8 +776,27 @@ do {                                                               \
     i2cInfo.i2cSpeed        = speed;                               \
 }while (0)
 
+// Failure class of an NVAPI I2C call: NVAPI_ERROR is what the driver
+// returns when the display does not acknowledge, busy and timeout are
+// worth another try, anything else will not go away by retrying.
+ddcci_status ClassifyNvapi(NvAPI_Status nvapiStatus)
+{
+    switch (nvapiStatus)
+    {
+    case NVAPI_OK:
+        return DDCCI_OK;
+    case NVAPI_ERROR:
+        return DDCCI_ERR_NAK;
+    case NVAPI_DEVICE_BUSY:
+    case NVAPI_TIMEOUT:
+        return DDCCI_ERR_BUS_BUSY;
+    default:
+        return DDCCI_ERR_IO;
+    }
+}
+
 // This function writes the input_value to the display over the I2C bus by issuing commands and data
-BOOL WriteValueToMonitor(NvPhysicalGpuHandle hPhysicalGpu, NvU32 displayId,BYTE input_value, BYTE command_code, BYTE register_address)
+ddcci_status WriteValueToMonitor(NvPhysicalGpuHandle hPhysicalGpu, NvU32 displayId, WORD input_value, BYTE command_code, BYTE register_address)
 {
     NvAPI_Status nvapiStatus = NVAPI_OK;
 
@@ -72,84 +808,423 @@ BOOL WriteValueToMonitor(NvPhysicalGpuHandle hPhysicalGpu, NvU32 displayId,BYTE
     // the upper 7 bits, and the LSB contains the Read/Write flag:
     // Write = 0 and Read =1;
     //
-    NvU8 i2cDeviceAddr = 0x37;
-    NvU8 i2cWriteDeviceAddr = i2cDeviceAddr << 1; //0x6E
-    NvU8 i2cReadDeviceAddr = i2cWriteDeviceAddr | 1; //0x6F
+    NvU8 i2cWriteDeviceAddr = DDCCI_DEST_ADDR; //0x6E
 
 
     //
-    // Now Send a write packet to modify current brightness value to 20 (0x14)
+    // Now Send a write packet to modify the value
     // The packet consists of the following bytes
     // 0x6E - i2cWriteDeviceAddr
     // Ox?? - register_address
     // 0x84 - 0x80 OR n where n = 4 bytes for "modify a value" request
     // 0x03 - change a value flag
     // 0x?? - command_code
-    // Ox00 - input_value high byte
+    // 0x?? - input_value high byte
     // 0x?? - input_value low byte
     // 0x?? - checksum, , xor'ing all the above bytes
     //
-    BYTE registerAddr[] = { register_address };
-    BYTE modifyBytes[] = { 0x84, 0x03, command_code, 0x00, input_value, 0xDD };
+    // The codec packet starts at register_address; NVAPI sends the device
+    // address itself, so packet[0] is the register and the rest is data.
+    //
+    BYTE packet[DDCCI_SET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_set_vcp(packet, register_address, command_code, input_value);
+    TRACE_END(t_build, "build_set_vcp");
 
     INIT_I2CINFO(i2cInfo, NV_I2C_INFO_VER, displayId, TRUE, i2cWriteDeviceAddr,
-        registerAddr, sizeof(registerAddr), modifyBytes, sizeof(modifyBytes), 27);
-    CalculateI2cChecksum(i2cInfo);
+        packet[0], 1, packet[1], DDCCI_SET_VCP_LEN - 1, 27);
 
+    TRACE_BEGIN(t);
     nvapiStatus = NvAPI_I2CWrite(hPhysicalGpu, &i2cInfo);
+    TRACE_END(t, "nvapi_i2c_write");
     if (nvapiStatus != NVAPI_OK)
     {
         printf("  NvAPI_I2CWrite (revise brightness) failed with status %d\n", nvapiStatus);
-        return FALSE;
+        return ClassifyNvapi(nvapiStatus);
     }
 
-    return TRUE;
-}
-
-bool InitNvidia()
-{
-    NvAPI_Status status = NvAPI_Initialize();
-    return (status == NVAPI_OK);
+    return DDCCI_OK;
 }
 
-bool NvidiaWriteValue(int display_index, BYTE input_value, BYTE command_code, BYTE register_address)
+// This function reads a VCP value: it sends a Get VCP Feature request, waits
+// for the display to prepare the reply, then reads the reply back.
+// timingId selects the learned delays of the monitor.
+ddcci_status ReadValueFromMonitor(NvPhysicalGpuHandle hPhysicalGpu, NvU32 displayId, unsigned long long timingId, BYTE command_code, BYTE register_address, ddcci_vcp_reply* reply)
 {
     NvAPI_Status nvapiStatus = NVAPI_OK;
 
-    // Enumerate display handles
-    NvDisplayHandle hDisplay_a[NVAPI_MAX_PHYSICAL_GPUS * NVAPI_MAX_DISPLAY_HEADS] = { 0 };
-    for (unsigned int i = 0; nvapiStatus == NVAPI_OK; i++)
-    {
-        nvapiStatus = NvAPI_EnumNvidiaDisplayHandle(i, &hDisplay_a[i]);
+    NV_I2C_INFO i2cInfo = { 0 };
+    i2cInfo.version = NV_I2C_INFO_VER;
+    NvU8 i2cWriteDeviceAddr = DDCCI_DEST_ADDR;     //0x6E
+    NvU8 i2cReadDeviceAddr = DDCCI_DEST_ADDR | 1;  //0x6F
 
-        if (nvapiStatus != NVAPI_OK && nvapiStatus != NVAPI_END_ENUMERATION)
-        {
-            printf("NvAPI_EnumNvidiaDisplayHandle() failed with status %d\n", nvapiStatus);
-            return false;
-        }
-    }
+    //
+    // 1. Request the value
+    // 0x6E - i2cWriteDeviceAddr
+    // Ox?? - register_address
+    // 0x82 - 0x80 OR n where n = 2 bytes for "read a value" request
+    // 0x01 - read a value flag
+    // 0x?? - command_code
+    // 0x?? - checksum
+    //
+    BYTE request[DDCCI_GET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_get_vcp(request, register_address, command_code);
+    TRACE_END(t_build, "build_get_vcp");
 
-    // Get GPU associated with display
-    NvPhysicalGpuHandle hGpu = NULL;
-    NvU32 pGpuCount = 0;
-    nvapiStatus = NvAPI_GetPhysicalGPUsFromDisplay(hDisplay_a[display_index], &hGpu, &pGpuCount);
+    INIT_I2CINFO(i2cInfo, NV_I2C_INFO_VER, displayId, TRUE, i2cWriteDeviceAddr,
+        request[0], 1, request[1], DDCCI_GET_VCP_LEN - 1, 27);
+
+    bool gated = TimingGate(timingId);
+    TRACE_BEGIN(t);
+    nvapiStatus = NvAPI_I2CWrite(hPhysicalGpu, &i2cInfo);
+    TRACE_END(t, "nvapi_i2c_write");
+    TimingDone(timingId, gated, nvapiStatus == NVAPI_OK ? DDCCI_OK : ClassifyNvapi(nvapiStatus));
     if (nvapiStatus != NVAPI_OK)
     {
-        printf("NvAPI_GetPhysicalGPUFromDisplay() failed with status %d\n", nvapiStatus);
-        return false;
+        printf("  NvAPI_I2CWrite (request value) failed with status %d\n", nvapiStatus);
+        return ClassifyNvapi(nvapiStatus);
     }
 
-    // Get the display id for I2C calls
-    NvU32 outputID = 0;
-    nvapiStatus = NvAPI_GetAssociatedDisplayOutputId(hDisplay_a[display_index], &outputID);
+    // Time for the display to prepare its reply
+    PaceSleep(TimingReplyDelay(timingId));
+
+    //
+    // 2. Read the reply, a direct read from 0x6F without a register address:
+    // 0x6E, 0x88, 0x02, result code, command_code, type, max hi/lo, current hi/lo, checksum
+    //
+    BYTE readBytes[DDCCI_GET_VCP_REPLY_LEN] = { 0 };
+    BYTE noRegAddr = 0;
+
+    INIT_I2CINFO(i2cInfo, NV_I2C_INFO_VER, displayId, TRUE, i2cReadDeviceAddr,
+        noRegAddr, 0, readBytes, sizeof(readBytes), 27);
+
+    TRACE_BEGIN(t_read);
+    nvapiStatus = NvAPI_I2CRead(hPhysicalGpu, &i2cInfo);
+    TRACE_END(t_read, "nvapi_i2c_read");
     if (nvapiStatus != NVAPI_OK)
     {
-        printf("NvAPI_GetAssociatedDisplayOutputId() failed with status %d\n", nvapiStatus);
-        return false;
+        TimingReplyDone(timingId, ClassifyNvapi(nvapiStatus));
+        printf("  NvAPI_I2CRead (read value) failed with status %d\n", nvapiStatus);
+        return ClassifyNvapi(nvapiStatus);
     }
 
-    BOOL result = WriteValueToMonitor(hGpu, outputID, input_value, command_code, register_address);
-    return (result == TRUE);
+    ddcci_status status = ddcci_parse_get_vcp_reply(readBytes, sizeof(readBytes), reply);
+    if (status == DDCCI_OK && reply->code != command_code)
+        status = DDCCI_ERR_PROTOCOL;
+
+    // A clean "unsupported" answer still means the reply was ready in time
+    TimingReplyDone(timingId, status);
+    if (status != DDCCI_OK)
+        printf("  Get VCP 0x%02X failed: %s\n", command_code, ddcci_status_text(status));
+
+    return status;
+}
+
+// This function reads one fragment of the capabilities string: it sends a
+// Capabilities Request for offset, waits for the display to prepare the
+// reply, then reads the reply back. data receives up to
+// DDCCI_MAX_FRAGMENT bytes; *data_len is 0 at the end of the string.
+ddcci_status CapsFragmentFromMonitor(NvPhysicalGpuHandle hPhysicalGpu, NvU32 displayId, unsigned long long timingId, WORD offset, BYTE* data, size_t* data_len)
+{
+    NvAPI_Status nvapiStatus = NVAPI_OK;
+
+    NV_I2C_INFO i2cInfo = { 0 };
+    i2cInfo.version = NV_I2C_INFO_VER;
+    NvU8 i2cWriteDeviceAddr = DDCCI_DEST_ADDR;     //0x6E
+    NvU8 i2cReadDeviceAddr = DDCCI_DEST_ADDR | 1;  //0x6F
+
+    //
+    // 1. Request the fragment
+    // 0x6E - i2cWriteDeviceAddr
+    // 0x51 - host address
+    // 0x83 - 0x80 OR n where n = 3 bytes for a capabilities request
+    // 0xF3 - capabilities request flag
+    // 0x?? - offset high byte, then low byte
+    // 0x?? - checksum
+    //
+    BYTE request[DDCCI_CAPS_REQUEST_LEN];
+    ddcci_build_caps_request(request, offset);
+
+    INIT_I2CINFO(i2cInfo, NV_I2C_INFO_VER, displayId, TRUE, i2cWriteDeviceAddr,
+        request[0], 1, request[1], DDCCI_CAPS_REQUEST_LEN - 1, 27);
+
+    bool gated = TimingGate(timingId);
+    nvapiStatus = NvAPI_I2CWrite(hPhysicalGpu, &i2cInfo);
+    TimingDone(timingId, gated, nvapiStatus == NVAPI_OK ? DDCCI_OK : ClassifyNvapi(nvapiStatus));
+    if (nvapiStatus != NVAPI_OK)
+    {
+        printf("  NvAPI_I2CWrite (request capabilities) failed with status %d\n", nvapiStatus);
+        return ClassifyNvapi(nvapiStatus);
+    }
+
+    PaceSleep(TimingReplyDelay(timingId));
+
+    //
+    // 2. Read the reply:
+    // 0x6E, 0x80 OR (3 + n), 0xE3, offset hi/lo, n data bytes, checksum
+    //
+    BYTE readBytes[DDCCI_FRAGMENT_REPLY_MAX_LEN] = { 0 };
+    BYTE noRegAddr = 0;
+
+    INIT_I2CINFO(i2cInfo, NV_I2C_INFO_VER, displayId, TRUE, i2cReadDeviceAddr,
+        noRegAddr, 0, readBytes, sizeof(readBytes), 27);
+
+    nvapiStatus = NvAPI_I2CRead(hPhysicalGpu, &i2cInfo);
+    if (nvapiStatus != NVAPI_OK)
+    {
+        TimingReplyDone(timingId, ClassifyNvapi(nvapiStatus));
+        printf("  NvAPI_I2CRead (read capabilities) failed with status %d\n", nvapiStatus);
+        return ClassifyNvapi(nvapiStatus);
+    }
+
+    ddcci_status status = mccs_caps_parse_fragment(readBytes, sizeof(readBytes), offset, data, data_len);
+    TimingReplyDone(timingId, status);
+    if (status != DDCCI_OK)
+        printf("  Capabilities fragment at %u failed: %s\n", offset, ddcci_status_text(status));
+
+    return status;
+}
+
+bool InitNvidia()
+{
+    NvAPI_Status status = NvAPI_Initialize();
+    return (status == NVAPI_OK);
+}
+
+// NVIDIA display map, enumerated once per process and kept hot for
+// the lifetime of the daemon
+struct NvDisplay
+{
+    NvDisplayHandle hDisplay;
+    NvPhysicalGpuHandle hGpu;   // NULL until first use
+    NvU32 outputID;
+    unsigned long long edidHash;    // 0 if unknown
+    unsigned long long edidId;      // edid_identity(), 0 if unknown
+    char name[64];                  // e.g. \\.\DISPLAY1, "-" if unknown
+};
+
+static NvDisplay g_nvDisplays[NVAPI_MAX_PHYSICAL_GPUS * NVAPI_MAX_DISPLAY_HEADS];
+static int g_nvDisplayCount = -1;
+
+// Read the display's EDID base block. Returns false if it has none.
+bool NvidiaReadEdid(NvPhysicalGpuHandle hGpu, NvU32 outputID, uint8_t* block)
+{
+    NV_EDID edid = { 0 };
+    edid.version = NV_EDID_VER;
+    if (NvAPI_GPU_GetEDID(hGpu, outputID, &edid) != NVAPI_OK || !edid_has_header(edid.EDID_Data))
+        return false;
+    memcpy(block, edid.EDID_Data, EDID_BLOCK_LEN);
+    return true;
+}
+
+// Content hash and identity of the display's EDID, both 0 if it cannot
+// be read. The block goes to the EDID cache.
+void NvidiaEdidIds(NvPhysicalGpuHandle hGpu, NvU32 outputID, TopologyEntry& entry)
+{
+    uint8_t block[EDID_BLOCK_LEN];
+    entry.edid_hash = 0;
+    entry.edid_id = 0;
+    if (!NvidiaReadEdid(hGpu, outputID, block))
+        return;
+    entry.edid_hash = edid_hash(block);
+    entry.edid_id = edid_identity(block);
+    EdidRemember(block);
+}
+
+bool NvidiaResolveDisplay(int display_index, NvPhysicalGpuHandle* hGpu, NvU32* outputID);
+
+// Fill the display map from the topology cache, turning cached GPU
+// indices back into handles. Returns the display count, or -1 on a miss.
+int NvidiaLoadTopology()
+{
+    TopologyEntry entries[_countof(g_nvDisplays)];
+    int count = TopologyLoad("nvidia", entries, _countof(entries));
+    if (count < 0)
+        return -1;
+
+    NvPhysicalGpuHandle hGpus[NVAPI_MAX_PHYSICAL_GPUS] = { 0 };
+    NvU32 gpuCount = 0;
+    if (NvAPI_EnumPhysicalGPUs(hGpus, &gpuCount) != NVAPI_OK)
+        return -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (entries[i].a < 0 || (NvU32)entries[i].a >= gpuCount)
+            return -1;
+        g_nvDisplays[i].hDisplay = NULL;
+        g_nvDisplays[i].hGpu = hGpus[entries[i].a];
+        g_nvDisplays[i].outputID = (NvU32)entries[i].b;
+        g_nvDisplays[i].edidHash = entries[i].edid_hash;
+        g_nvDisplays[i].edidId = entries[i].edid_id;
+        strcpy_s(g_nvDisplays[i].name, sizeof(g_nvDisplays[i].name), entries[i].name);
+    }
+    return count;
+}
+
+// Resolve every display and save the map to the topology cache
+void NvidiaSaveTopology()
+{
+    TopologyEntry entries[_countof(g_nvDisplays)];
+    NvPhysicalGpuHandle hGpus[NVAPI_MAX_PHYSICAL_GPUS] = { 0 };
+    NvU32 gpuCount = 0;
+    if (NvAPI_EnumPhysicalGPUs(hGpus, &gpuCount) != NVAPI_OK)
+        return;
+
+    for (int i = 0; i < g_nvDisplayCount; i++)
+    {
+        NvPhysicalGpuHandle hGpu = NULL;
+        NvU32 outputID = 0;
+        if (!NvidiaResolveDisplay(i, &hGpu, &outputID))
+            return;
+
+        TopologyEntry& entry = entries[i];
+        entry.a = -1;
+        for (NvU32 g = 0; g < gpuCount; g++)
+        {
+            if (hGpus[g] == hGpu)
+                entry.a = (int)g;
+        }
+        entry.b = (int)outputID;
+        NvidiaEdidIds(hGpu, outputID, entry);
+        g_nvDisplays[i].edidHash = entry.edid_hash;
+        g_nvDisplays[i].edidId = entry.edid_id;
+
+        NvAPI_ShortString displayName = "";
+        if (NvAPI_GetAssociatedNvidiaDisplayName(g_nvDisplays[i].hDisplay, displayName) != NVAPI_OK)
+            strcpy_s(displayName, sizeof(displayName), "-");
+        strcpy_s(entry.name, sizeof(entry.name), displayName);
+        strcpy_s(g_nvDisplays[i].name, sizeof(g_nvDisplays[i].name), displayName);
+    }
+
+    TopologySave("nvidia", entries, g_nvDisplayCount);
+    EdidFlush();
+}
+
+// Load the display map from the topology cache, or enumerate display
+// handles on first use. Returns the display count, or -1 on error.
+int NvidiaDisplayCount()
+{
+    if (g_nvDisplayCount >= 0)
+        return g_nvDisplayCount;
+
+    TRACE_BEGIN(t);
+    g_nvDisplayCount = NvidiaLoadTopology();
+    if (g_nvDisplayCount >= 0)
+    {
+        TRACE_END(t, "topology_load");
+        return g_nvDisplayCount;
+    }
+
+    NvAPI_Status nvapiStatus = NVAPI_OK;
+    int count = 0;
+    for (unsigned int i = 0; nvapiStatus == NVAPI_OK && i < _countof(g_nvDisplays); i++)
+    {
+        NvDisplayHandle hDisplay = NULL;
+        nvapiStatus = NvAPI_EnumNvidiaDisplayHandle(i, &hDisplay);
+
+        if (nvapiStatus == NVAPI_OK)
+        {
+            g_nvDisplays[count].hDisplay = hDisplay;
+            g_nvDisplays[count].hGpu = NULL;
+            g_nvDisplays[count].edidHash = 0;
+            g_nvDisplays[count].edidId = 0;
+            strcpy_s(g_nvDisplays[count].name, sizeof(g_nvDisplays[count].name), "-");
+            count++;
+        }
+        else if (nvapiStatus != NVAPI_END_ENUMERATION)
+        {
+            printf("NvAPI_EnumNvidiaDisplayHandle() failed with status %d\n", nvapiStatus);
+            return -1;
+        }
+    }
+
+    g_nvDisplayCount = count;
+    if (count > 0)
+        NvidiaSaveTopology();
+    TRACE_END(t, "enumerate");
+    return g_nvDisplayCount;
+}
+
+// Resolve the GPU and output id used for I2C calls on a display
+bool NvidiaResolveDisplay(int display_index, NvPhysicalGpuHandle* hGpu, NvU32* outputID)
+{
+    int count = NvidiaDisplayCount();
+    if (count < 0)
+        return false;
+
+    if (display_index < 0 || display_index >= count)
+    {
+        printf("Display index %d not found (only %d NVIDIA displays detected)\n", display_index, count);
+        return false;
+    }
+
+    NvDisplay& display = g_nvDisplays[display_index];
+    if (display.hGpu == NULL)
+    {
+        NvAPI_Status nvapiStatus = NVAPI_OK;
+
+        // Get GPU associated with display
+        NvPhysicalGpuHandle hDisplayGpu = NULL;
+        NvU32 pGpuCount = 0;
+        nvapiStatus = NvAPI_GetPhysicalGPUsFromDisplay(display.hDisplay, &hDisplayGpu, &pGpuCount);
+        if (nvapiStatus != NVAPI_OK)
+        {
+            printf("NvAPI_GetPhysicalGPUFromDisplay() failed with status %d\n", nvapiStatus);
+            return false;
+        }
+
+        // Get the display id for I2C calls
+        NvU32 displayOutputID = 0;
+        nvapiStatus = NvAPI_GetAssociatedDisplayOutputId(display.hDisplay, &displayOutputID);
+        if (nvapiStatus != NVAPI_OK)
+        {
+            printf("NvAPI_GetAssociatedDisplayOutputId() failed with status %d\n", nvapiStatus);
+            return false;
+        }
+
+        display.hGpu = hDisplayGpu;
+        display.outputID = displayOutputID;
+    }
+
+    *hGpu = display.hGpu;
+    *outputID = display.outputID;
+    return true;
+}
+
+ddcci_status NvidiaWriteValue(int display_index, WORD input_value, BYTE command_code, BYTE register_address)
+{
+    NvPhysicalGpuHandle hGpu = NULL;
+    NvU32 outputID = 0;
+    if (!NvidiaResolveDisplay(display_index, &hGpu, &outputID))
+        return DDCCI_ERR_IO;
+
+    unsigned long long id = DisplayId(display_index);
+    bool gated = TimingGate(id);
+    ddcci_status status = WriteValueToMonitor(hGpu, outputID, input_value, command_code, register_address);
+    TimingDone(id, gated, status);
+    return status;
+}
+
+
+ddcci_status NvidiaReadValue(int display_index, BYTE command_code, BYTE register_address, ddcci_vcp_reply* reply)
+{
+    NvPhysicalGpuHandle hGpu = NULL;
+    NvU32 outputID = 0;
+    if (!NvidiaResolveDisplay(display_index, &hGpu, &outputID))
+        return DDCCI_ERR_IO;
+
+    return ReadValueFromMonitor(hGpu, outputID, DisplayId(display_index), command_code, register_address, reply);
+}
+
+ddcci_status NvidiaCapsFragment(int display_index, WORD offset, BYTE* data, size_t* data_len)
+{
+    NvPhysicalGpuHandle hGpu = NULL;
+    NvU32 outputID = 0;
+    if (!NvidiaResolveDisplay(display_index, &hGpu, &outputID))
+        return DDCCI_ERR_IO;
+
+    return CapsFragmentFromMonitor(hGpu, outputID, DisplayId(display_index), offset, data, data_len);
 }
 
 
@@ -164,6 +1239,7 @@ typedef int (*ADL_ADAPTER_NUMBEROFADAPTERS_GET_FUNC)(int*);
 typedef int (*ADL_ADAPTER_ADAPTERINFO_GET_FUNC)(LPAdapterInfo, int);
 typedef int (*ADL_DISPLAY_DISPLAYINFO_GET_FUNC)(int, int*, ADLDisplayInfo**, int);
 typedef int (*ADL_DISPLAY_DDCBLOCKACCESS_GET_FUNC)(int iAdapterIndex, int iDisplayIndex, int iOption, int iCommandIndex, int iSendMsgLen, char* lpucSendMsgBuf, int* lpulRecvMsgLen, char* lpucRecvMsgBuf);
+typedef int (*ADL_DISPLAY_EDIDDATA_GET_FUNC)(int iAdapterIndex, int iDisplayIndex, ADLDisplayEDIDData* lpEDIDData);
 
 // ADL global state
 static HMODULE hADLModule = NULL;
@@ -173,192 +1249,2483 @@ static ADL_ADAPTER_NUMBEROFADAPTERS_GET_FUNC pfn_ADL_Adapter_NumberOfAdapters_Ge
 static ADL_ADAPTER_ADAPTERINFO_GET_FUNC     pfn_ADL_Adapter_AdapterInfo_Get = NULL;
 static ADL_DISPLAY_DISPLAYINFO_GET_FUNC     pfn_ADL_Display_DisplayInfo_Get = NULL;
 static ADL_DISPLAY_DDCBLOCKACCESS_GET_FUNC  pfn_ADL_Display_DDCBlockAccess_Get = NULL;
+static ADL_DISPLAY_EDIDDATA_GET_FUNC        pfn_ADL_Display_EdidData_Get = NULL;    // Optional
+
+// ADL memory allocation callback (required by ADL)
+void* __stdcall ADL_Main_Memory_Alloc(int iSize)
+{
+    return malloc(iSize);
+}
+
+void __stdcall ADL_Main_Memory_Free(void** lpBuffer)
+{
+    if (NULL != *lpBuffer)
+    {
+        free(*lpBuffer);
+        *lpBuffer = NULL;
+    }
+}
+
+bool InitADL()
+{
+    hADLModule = LoadLibrary(_T("atiadlxx.dll"));
+    // A 32 bit calling application on 64 bit OS will fail to LoadLibrary.
+    // Try to load the 32 bit library (atiadlxy.dll) instead
+    if (hADLModule == NULL)
+        hADLModule = LoadLibrary(_T("atiadlxy.dll"));
+
+    if (hADLModule == NULL)
+        return false;
+
+    pfn_ADL_Main_Control_Create = (ADL_MAIN_CONTROL_CREATE_FUNC)GetProcAddress(hADLModule, "ADL_Main_Control_Create");
+    pfn_ADL_Main_Control_Destroy = (ADL_MAIN_CONTROL_DESTROY_FUNC)GetProcAddress(hADLModule, "ADL_Main_Control_Destroy");
+    pfn_ADL_Adapter_NumberOfAdapters_Get = (ADL_ADAPTER_NUMBEROFADAPTERS_GET_FUNC)GetProcAddress(hADLModule, "ADL_Adapter_NumberOfAdapters_Get");
+    pfn_ADL_Adapter_AdapterInfo_Get = (ADL_ADAPTER_ADAPTERINFO_GET_FUNC)GetProcAddress(hADLModule, "ADL_Adapter_AdapterInfo_Get");
+    pfn_ADL_Display_DisplayInfo_Get = (ADL_DISPLAY_DISPLAYINFO_GET_FUNC)GetProcAddress(hADLModule, "ADL_Display_DisplayInfo_Get");
+    pfn_ADL_Display_DDCBlockAccess_Get = (ADL_DISPLAY_DDCBLOCKACCESS_GET_FUNC)GetProcAddress(hADLModule, "ADL_Display_DDCBlockAccess_Get");
+    pfn_ADL_Display_EdidData_Get = (ADL_DISPLAY_EDIDDATA_GET_FUNC)GetProcAddress(hADLModule, "ADL_Display_EdidData_Get");
+
+    if (pfn_ADL_Main_Control_Create == NULL ||
+        pfn_ADL_Main_Control_Destroy == NULL ||
+        pfn_ADL_Adapter_NumberOfAdapters_Get == NULL ||
+        pfn_ADL_Adapter_AdapterInfo_Get == NULL ||
+        pfn_ADL_Display_DisplayInfo_Get == NULL ||
+        pfn_ADL_Display_DDCBlockAccess_Get == NULL)
+    {
+        FreeLibrary(hADLModule);
+        hADLModule = NULL;
+        return false;
+    }
+
+    // Initialize ADL. Second parameter 1 = only active adapters.
+    int adlResult = pfn_ADL_Main_Control_Create(ADL_Main_Memory_Alloc, 1);
+    if (adlResult != ADL_OK)
+    {
+        FreeLibrary(hADLModule);
+        hADLModule = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void FreeADL()
+{
+    if (pfn_ADL_Main_Control_Destroy)
+        pfn_ADL_Main_Control_Destroy();
+    if (hADLModule)
+    {
+        FreeLibrary(hADLModule);
+        hADLModule = NULL;
+    }
+}
+
+// The legacy (non-ADL2) ADL API is not thread safe. Parallel batches
+// serialize the driver calls themselves; inter-command delays still overlap.
+static std::mutex g_adlMutex;
+
+// ADL display map (connected + mapped displays, flattened across
+// adapters), enumerated once per process
+#define MAX_ADL_DISPLAYS 64
+
+struct AdlDisplay
+{
+    int iAdapterIndex;
+    int iDisplayIndex;
+    unsigned long long edidHash;    // 0 if unknown
+    unsigned long long edidId;      // edid_identity(), 0 if unknown
+};
+
+static AdlDisplay g_adlDisplays[MAX_ADL_DISPLAYS];
+static int g_adlDisplayCount = -1;
+
+// Read the display's EDID base block. Returns false if it has none.
+// Caller holds g_adlMutex.
+bool ADLReadEdidLocked(int iAdapterIndex, int iDisplayIndex, uint8_t* block)
+{
+    if (pfn_ADL_Display_EdidData_Get == NULL)
+        return false;
+
+    ADLDisplayEDIDData edid;
+    memset(&edid, 0, sizeof(edid));
+    edid.iSize = sizeof(edid);
+    edid.iBlockIndex = 0;
+    if (pfn_ADL_Display_EdidData_Get(iAdapterIndex, iDisplayIndex, &edid) != ADL_OK ||
+        edid.iEDIDSize < EDID_BLOCK_LEN || !edid_has_header((const uint8_t*)edid.cEDIDData))
+        return false;
+    memcpy(block, edid.cEDIDData, EDID_BLOCK_LEN);
+    return true;
+}
+
+bool ADLReadEdid(int iAdapterIndex, int iDisplayIndex, uint8_t* block)
+{
+    std::lock_guard<std::mutex> lock(g_adlMutex);
+    return ADLReadEdidLocked(iAdapterIndex, iDisplayIndex, block);
+}
+
+// Content hash and identity of the display's EDID, both 0 if it cannot
+// be read. The block goes to the EDID cache. Caller holds g_adlMutex.
+void ADLEdidIds(int iAdapterIndex, int iDisplayIndex, TopologyEntry& entry)
+{
+    uint8_t block[EDID_BLOCK_LEN];
+    entry.edid_hash = 0;
+    entry.edid_id = 0;
+    if (!ADLReadEdidLocked(iAdapterIndex, iDisplayIndex, block))
+        return;
+    entry.edid_hash = edid_hash(block);
+    entry.edid_id = edid_identity(block);
+    EdidRemember(block);
+}
+
+// Caller holds g_adlMutex
+void ADLSaveTopology(int count)
+{
+    TopologyEntry entries[MAX_ADL_DISPLAYS];
+    for (int i = 0; i < count; i++)
+    {
+        entries[i].a = g_adlDisplays[i].iAdapterIndex;
+        entries[i].b = g_adlDisplays[i].iDisplayIndex;
+        ADLEdidIds(entries[i].a, entries[i].b, entries[i]);
+        g_adlDisplays[i].edidHash = entries[i].edid_hash;
+        g_adlDisplays[i].edidId = entries[i].edid_id;
+        strcpy_s(entries[i].name, sizeof(entries[i].name), "-");
+    }
+    TopologySave("adl", entries, count);
+    EdidFlush();
+}
+
+// Load the display map from the topology cache, or enumerate displays on
+// first use, under g_adlMutex since bus workers may be calling ADL
+// already. Returns the display count, or -1 on error.
+int ADLDisplayCount()
+{
+    if (g_adlDisplayCount >= 0)
+        return g_adlDisplayCount;
+
+    std::lock_guard<std::mutex> lock(g_adlMutex);
+    if (g_adlDisplayCount >= 0)
+        return g_adlDisplayCount;
+
+    TRACE_BEGIN(t);
+    TopologyEntry entries[MAX_ADL_DISPLAYS];
+    int cached = TopologyLoad("adl", entries, MAX_ADL_DISPLAYS);
+    if (cached >= 0)
+    {
+        for (int i = 0; i < cached; i++)
+        {
+            g_adlDisplays[i].iAdapterIndex = entries[i].a;
+            g_adlDisplays[i].iDisplayIndex = entries[i].b;
+            g_adlDisplays[i].edidHash = entries[i].edid_hash;
+            g_adlDisplays[i].edidId = entries[i].edid_id;
+        }
+        g_adlDisplayCount = cached;
+        TRACE_END(t, "topology_load");
+        return g_adlDisplayCount;
+    }
+
+    // Get number of adapters
+    int iNumberAdapters = 0;
+    if (pfn_ADL_Adapter_NumberOfAdapters_Get(&iNumberAdapters) != ADL_OK || iNumberAdapters <= 0)
+    {
+        printf("No AMD adapters found\n");
+        return -1;
+    }
+
+    // Get adapter info
+    LPAdapterInfo lpAdapterInfo = (LPAdapterInfo)malloc(sizeof(AdapterInfo) * iNumberAdapters);
+    if (lpAdapterInfo == NULL)
+    {
+        printf("Memory allocation failed\n");
+        return -1;
+    }
+    memset(lpAdapterInfo, 0, sizeof(AdapterInfo) * iNumberAdapters);
+    pfn_ADL_Adapter_AdapterInfo_Get(lpAdapterInfo, sizeof(AdapterInfo) * iNumberAdapters);
+
+    // Build flat list of connected+mapped displays
+    int flatIndex = 0;
+
+    for (int i = 0; i < iNumberAdapters; i++)
+    {
+        int iAdapterIndex = lpAdapterInfo[i].iAdapterIndex;
+        int iNumberDisplays = 0;
+        ADLDisplayInfo* lpDisplayInfo = NULL;
+
+        if (pfn_ADL_Display_DisplayInfo_Get(iAdapterIndex, &iNumberDisplays, &lpDisplayInfo, 0) != ADL_OK)
+            continue;
+
+        for (int j = 0; j < iNumberDisplays && flatIndex < MAX_ADL_DISPLAYS; j++)
+        {
+            // Only use connected AND mapped displays
+            if ((lpDisplayInfo[j].iDisplayInfoValue &
+                (ADL_DISPLAY_DISPLAYINFO_DISPLAYCONNECTED | ADL_DISPLAY_DISPLAYINFO_DISPLAYMAPPED)) !=
+                (ADL_DISPLAY_DISPLAYINFO_DISPLAYCONNECTED | ADL_DISPLAY_DISPLAYINFO_DISPLAYMAPPED))
+                continue;
+
+            // Is the display mapped to this adapter?
+            if (iAdapterIndex != lpDisplayInfo[j].displayID.iDisplayLogicalAdapterIndex)
+                continue;
+
+            g_adlDisplays[flatIndex].iAdapterIndex = iAdapterIndex;
+            g_adlDisplays[flatIndex].iDisplayIndex = lpDisplayInfo[j].displayID.iDisplayLogicalIndex;
+            g_adlDisplays[flatIndex].edidHash = 0;
+            g_adlDisplays[flatIndex].edidId = 0;
+            flatIndex++;
+        }
+
+        ADL_Main_Memory_Free((void**)&lpDisplayInfo);
+    }
+
+    free(lpAdapterInfo);
+
+    // Published last: lookups outside the lock must not see the map
+    // before its EDID hashes are in
+    if (flatIndex > 0)
+        ADLSaveTopology(flatIndex);
+    g_adlDisplayCount = flatIndex;
+    TRACE_END(t, "enumerate");
+    return g_adlDisplayCount;
+}
+
+// Failure class of an ADL call: plain ADL_ERR is what DDC block access
+// returns when the display does not acknowledge.
+ddcci_status ClassifyAdl(int adlResult)
+{
+    switch (adlResult)
+    {
+    case ADL_OK:
+        return DDCCI_OK;
+    case ADL_ERR:
+        return DDCCI_ERR_NAK;
+    case ADL_ERR_SERVER_BUSY:
+    case ADL_ERR_RESOURCE_CONFLICT:
+    case ADL_ERR_GPU_IN_USE:
+        return DDCCI_ERR_BUS_BUSY;
+    default:
+        return DDCCI_ERR_IO;
+    }
+}
+
+ddcci_status ADLWriteValue(int display_index, WORD input_value, BYTE command_code, BYTE register_address)
+{
+    int count = ADLDisplayCount();
+    if (count < 0)
+        return DDCCI_ERR_IO;
+
+    if (display_index < 0 || display_index >= count)
+    {
+        printf("Display index %d not found (only %d AMD displays detected)\n", display_index, count);
+        return DDCCI_ERR_IO;
+    }
+
+    int targetAdapterIdx = g_adlDisplays[display_index].iAdapterIndex;
+    int targetDisplayIdx = g_adlDisplays[display_index].iDisplayIndex;
+
+    // Build DDC/CI packet (identical format to NVAPI)
+    // 0x6E - I2C write address (0x37 << 1)
+    // register_address - sub-address (e.g. 0x51 for VCP, 0x50 for LG custom)
+    // 0x84 - 0x80 | 4 (4 bytes follow, excluding checksum)
+    // 0x03 - "set VCP" command
+    // command_code - VCP code
+    // input_value - value high byte, then low byte
+    // checksum - XOR of all preceding bytes
+    unsigned char packet[1 + DDCCI_SET_VCP_LEN];
+    packet[0] = DDCCI_DEST_ADDR;
+    TRACE_BEGIN(t_build);
+    ddcci_build_set_vcp(packet + 1, register_address, command_code, input_value);
+    TRACE_END(t_build, "build_set_vcp");
+
+    unsigned long long id = DisplayId(display_index);
+    bool gated = TimingGate(id);
+    int recvLen = 0;
+    int adlResult;
+    {
+        std::lock_guard<std::mutex> lock(g_adlMutex);
+        TRACE_BEGIN(t);
+        adlResult = pfn_ADL_Display_DDCBlockAccess_Get(targetAdapterIdx, targetDisplayIdx, 0, 0, sizeof(packet), (char*)packet, &recvLen, NULL);
+        TRACE_END(t, "adl_ddc_write");
+    }
+    TimingDone(id, gated, ClassifyAdl(adlResult));
+
+    if (adlResult != ADL_OK)
+        printf("ADL_Display_DDCBlockAccess_Get failed with error %d\n", adlResult);
+
+    return ClassifyAdl(adlResult);
+}
+
+ddcci_status ADLReadValue(int display_index, BYTE command_code, BYTE register_address, ddcci_vcp_reply* reply)
+{
+    int count = ADLDisplayCount();
+    if (count < 0)
+        return DDCCI_ERR_IO;
+
+    if (display_index < 0 || display_index >= count)
+    {
+        printf("Display index %d not found (only %d AMD displays detected)\n", display_index, count);
+        return DDCCI_ERR_IO;
+    }
+
+    int targetAdapterIdx = g_adlDisplays[display_index].iAdapterIndex;
+    int targetDisplayIdx = g_adlDisplays[display_index].iDisplayIndex;
+
+    // Get VCP request with the 0x6E prefix; ADL writes it, waits for the
+    // display and reads the reply into the receive buffer in one call
+    unsigned char request[1 + DDCCI_GET_VCP_LEN];
+    request[0] = DDCCI_DEST_ADDR;
+    TRACE_BEGIN(t_build);
+    ddcci_build_get_vcp(request + 1, register_address, command_code);
+    TRACE_END(t_build, "build_get_vcp");
+
+    unsigned char readBytes[DDCCI_GET_VCP_REPLY_LEN] = { 0 };
+    int recvLen = sizeof(readBytes);
+    int adlResult;
+    unsigned long long id = DisplayId(display_index);
+    bool gated = TimingGate(id);
+    {
+        std::lock_guard<std::mutex> lock(g_adlMutex);
+        TRACE_BEGIN(t);
+        adlResult = pfn_ADL_Display_DDCBlockAccess_Get(targetAdapterIdx, targetDisplayIdx, 0, 0,
+            sizeof(request), (char*)request, &recvLen, (char*)readBytes);
+        TRACE_END(t, "adl_ddc_transaction");
+    }
+
+    if (adlResult != ADL_OK)
+    {
+        TimingDone(id, gated, ClassifyAdl(adlResult));
+        printf("ADL_Display_DDCBlockAccess_Get failed with error %d\n", adlResult);
+        return ClassifyAdl(adlResult);
+    }
+
+    // ADL waits for the reply itself, so the write delay is the only
+    // one to learn here
+    ddcci_status status = ddcci_parse_get_vcp_reply(readBytes, sizeof(readBytes), reply);
+    if (status == DDCCI_OK && reply->code != command_code)
+        status = DDCCI_ERR_PROTOCOL;
+    TimingDone(id, gated, status);
+    if (status != DDCCI_OK)
+        printf("  Get VCP 0x%02X failed: %s\n", command_code, ddcci_status_text(status));
+
+    return status;
+}
+
+
+ddcci_status ADLCapsFragment(int display_index, WORD offset, BYTE* data, size_t* data_len)
+{
+    int count = ADLDisplayCount();
+    if (count < 0)
+        return DDCCI_ERR_IO;
+
+    if (display_index < 0 || display_index >= count)
+    {
+        printf("Display index %d not found (only %d AMD displays detected)\n", display_index, count);
+        return DDCCI_ERR_IO;
+    }
+
+    int targetAdapterIdx = g_adlDisplays[display_index].iAdapterIndex;
+    int targetDisplayIdx = g_adlDisplays[display_index].iDisplayIndex;
+
+    // Capabilities Request with the 0x6E prefix; the reply fragment comes
+    // back in the receive buffer like a Get VCP reply
+    unsigned char request[1 + DDCCI_CAPS_REQUEST_LEN];
+    request[0] = DDCCI_DEST_ADDR;
+    ddcci_build_caps_request(request + 1, offset);
+
+    unsigned char readBytes[DDCCI_FRAGMENT_REPLY_MAX_LEN] = { 0 };
+    int recvLen = sizeof(readBytes);
+    int adlResult;
+    unsigned long long id = DisplayId(display_index);
+    bool gated = TimingGate(id);
+    {
+        std::lock_guard<std::mutex> lock(g_adlMutex);
+        adlResult = pfn_ADL_Display_DDCBlockAccess_Get(targetAdapterIdx, targetDisplayIdx, 0, 0,
+            sizeof(request), (char*)request, &recvLen, (char*)readBytes);
+    }
+
+    if (adlResult != ADL_OK)
+    {
+        TimingDone(id, gated, ClassifyAdl(adlResult));
+        printf("ADL_Display_DDCBlockAccess_Get failed with error %d\n", adlResult);
+        return ClassifyAdl(adlResult);
+    }
+
+    ddcci_status status = mccs_caps_parse_fragment(readBytes, sizeof(readBytes), offset, data, data_len);
+    TimingDone(id, gated, status);
+    if (status != DDCCI_OK)
+        printf("  Capabilities fragment at %u failed: %s\n", offset, ddcci_status_text(status));
+
+    return status;
+}
+
+
+// ============================================================
+// Virtual Backend
+// ============================================================
+
+// Environment variable configuring the emulated monitors, see
+// ddcci_emu_config_parse(), e.g. "displays=1,latency=60,nak=50"
+#define VIRTUAL_ENV "WRITEVALUETODISPLAY_VIRTUAL"
+
+// Monitor state lives for the process, so it carries across the
+// commands of one batch or one daemon
+static ddcci_emu g_virtual[DDCCI_EMU_MAX_DISPLAYS];
+static int g_virtualCount = -1;
+static std::mutex g_virtualMutex;
+
+bool InitVirtual()
+{
+    ddcci_emu_config config;
+    char spec[MAX_PATH] = "";
+
+    ddcci_emu_config_init(&config);
+    DWORD len = GetEnvironmentVariableA(VIRTUAL_ENV, spec, sizeof(spec));
+    if (len >= sizeof(spec) || !ddcci_emu_config_parse(&config, spec))
+        printf("Ignoring unknown settings in %s\n", VIRTUAL_ENV);
+
+    for (int i = 0; i < config.displays; i++)
+        ddcci_emu_init(&g_virtual[i], &config, i);
+    g_virtualCount = config.displays;
+    return true;
+}
+
+int VirtualDisplayCount()
+{
+    return g_virtualCount;
+}
+
+unsigned long long VirtualEdidHash(int display_index)
+{
+    return edid_hash(g_virtual[display_index].edid);
+}
+
+unsigned long long VirtualEdidId(int display_index)
+{
+    return edid_identity(g_virtual[display_index].edid);
+}
+
+// Same packets and timing model as the NVIDIA backend, against an
+// emulated monitor
+ddcci_status VirtualWriteValue(int display_index, WORD input_value, BYTE command_code, BYTE register_address)
+{
+    if (display_index < 0 || display_index >= g_virtualCount)
+    {
+        printf("Display index %d not found (only %d virtual displays)\n", display_index, g_virtualCount);
+        return DDCCI_ERR_IO;
+    }
+
+    BYTE packet[DDCCI_SET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_set_vcp(packet, register_address, command_code, input_value);
+    TRACE_END(t_build, "build_set_vcp");
+
+    unsigned long long id = DisplayId(display_index);
+    bool gated = TimingGate(id);
+    ddcci_status status;
+    {
+        std::lock_guard<std::mutex> lock(g_virtualMutex);
+        TRACE_BEGIN(t);
+        status = ddcci_emu_write(&g_virtual[display_index], packet, sizeof(packet), GetTickCount64());
+        TRACE_END(t, "emu_write");
+    }
+    TimingDone(id, gated, status);
+
+    if (status != DDCCI_OK)
+        printf("  Write to virtual display %d failed: %s\n", display_index, ddcci_status_text(status));
+    return status;
+}
+
+ddcci_status VirtualReadValue(int display_index, BYTE command_code, BYTE register_address, ddcci_vcp_reply* reply)
+{
+    if (display_index < 0 || display_index >= g_virtualCount)
+    {
+        printf("Display index %d not found (only %d virtual displays)\n", display_index, g_virtualCount);
+        return DDCCI_ERR_IO;
+    }
+
+    ddcci_emu* emu = &g_virtual[display_index];
+    BYTE request[DDCCI_GET_VCP_LEN];
+    TRACE_BEGIN(t_build);
+    ddcci_build_get_vcp(request, register_address, command_code);
+    TRACE_END(t_build, "build_get_vcp");
+
+    unsigned long long id = DisplayId(display_index);
+    bool gated = TimingGate(id);
+    ddcci_status status;
+    {
+        std::lock_guard<std::mutex> lock(g_virtualMutex);
+        TRACE_BEGIN(t);
+        status = ddcci_emu_write(emu, request, sizeof(request), GetTickCount64());
+        TRACE_END(t, "emu_write");
+    }
+    TimingDone(id, gated, status);
+
+    if (status != DDCCI_OK)
+    {
+        printf("  Write to virtual display %d failed: %s\n", display_index, ddcci_status_text(status));
+        return status;
+    }
+
+    PaceSleep(TimingReplyDelay(id));
+
+    BYTE readBytes[DDCCI_GET_VCP_REPLY_LEN] = { 0 };
+    {
+        std::lock_guard<std::mutex> lock(g_virtualMutex);
+        TRACE_BEGIN(t);
+        status = ddcci_emu_read(emu, readBytes, sizeof(readBytes), GetTickCount64());
+        TRACE_END(t, "emu_read");
+    }
+
+    if (status == DDCCI_OK)
+    {
+        status = ddcci_parse_get_vcp_reply(readBytes, sizeof(readBytes), reply);
+        if (status == DDCCI_OK && reply->code != command_code)
+            status = DDCCI_ERR_PROTOCOL;
+    }
+
+    TimingReplyDone(id, status);
+    if (status != DDCCI_OK)
+        printf("  Get VCP 0x%02X failed: %s\n", command_code, ddcci_status_text(status));
+    return status;
+}
+
+
+ddcci_status VirtualCapsFragment(int display_index, WORD offset, BYTE* data, size_t* data_len)
+{
+    if (display_index < 0 || display_index >= g_virtualCount)
+    {
+        printf("Display index %d not found (only %d virtual displays)\n", display_index, g_virtualCount);
+        return DDCCI_ERR_IO;
+    }
+
+    ddcci_emu* emu = &g_virtual[display_index];
+    BYTE request[DDCCI_CAPS_REQUEST_LEN];
+    ddcci_build_caps_request(request, offset);
+
+    unsigned long long id = DisplayId(display_index);
+    bool gated = TimingGate(id);
+    ddcci_status status;
+    {
+        std::lock_guard<std::mutex> lock(g_virtualMutex);
+        status = ddcci_emu_write(emu, request, sizeof(request), GetTickCount64());
+    }
+    TimingDone(id, gated, status);
+
+    if (status != DDCCI_OK)
+    {
+        printf("  Write to virtual display %d failed: %s\n", display_index, ddcci_status_text(status));
+        return status;
+    }
+
+    PaceSleep(TimingReplyDelay(id));
+
+    BYTE readBytes[DDCCI_FRAGMENT_REPLY_MAX_LEN] = { 0 };
+    {
+        std::lock_guard<std::mutex> lock(g_virtualMutex);
+        status = ddcci_emu_read(emu, readBytes, sizeof(readBytes), GetTickCount64());
+    }
+
+    if (status == DDCCI_OK)
+        status = mccs_caps_parse_fragment(readBytes, sizeof(readBytes), offset, data, data_len);
+
+    TimingReplyDone(id, status);
+    if (status != DDCCI_OK)
+        printf("  Capabilities fragment at %u failed: %s\n", offset, ddcci_status_text(status));
+    return status;
+}
+
+
+// ============================================================
+// Primary display auto-detect (GPU-agnostic)
+// ============================================================
+
+int AutoDetectPrimaryDisplay()
+{
+    DISPLAY_DEVICE dd;
+    ZeroMemory(&dd, sizeof(dd));
+    dd.cb = sizeof(dd);
+
+    for (DWORD iDevNum = 0; EnumDisplayDevices(NULL, iDevNum, &dd, 0); iDevNum++)
+    {
+        if (dd.StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE)
+        {
+            printf("Primary display device found: %s\n", dd.DeviceName);
+            printf("Using display index %d for primary display\n", (int)iDevNum);
+            return (int)iDevNum;
+        }
+    }
+
+    printf("Primary display not found, defaulting to index 0\n");
+    return 0;
+}
+
+
+// ============================================================
+// Command parsing and execution
+// ============================================================
+
+#define MAX_LINE_LEN 256
+
+enum Backend
+{
+    BACKEND_NONE,
+    BACKEND_NVIDIA,
+    BACKEND_ADL,
+    BACKEND_VIRTUAL
+};
+
+static Backend g_backend = BACKEND_NONE;
+static bool g_useVirtual = false;   // --backend=virtual
+
+struct VcpCommand
+{
+    int display_index;
+    WORD input_value;   // Written as the high and low value bytes
+    BYTE command_code;  //VCP code or equivalent
+    BYTE register_address;
+    int shadow_ttl;     // --if-changed: max shadow age in seconds, -1 to always write
+    bool verify;        // --verify: read the value back after writing it
+    char selector[48];  // "serial:S", "connector:C", "model:M" or a display set, "" to use display_index
+};
+
+// --display: index or selector for every command, which then omits the
+// display_index argument
+static const char* g_displayArg = NULL;
+
+// Parse a display argument: an index, a selector "serial:S",
+// "connector:C" or "model:M", or a display set: "all", a list of indices
+// "0,2,3", or a selector with * and ? wildcards ("model:GSM*"). Spaces
+// are dropped from a selector, since lookups ignore them and the daemon
+// protocol splits on them. Fails on an unknown kind or over-long selector.
+bool ParseDisplay(const char* arg, VcpCommand& cmd)
+{
+    size_t len = 0;
+
+    cmd.display_index = -1;
+    cmd.selector[0] = '\0';
+    if (strcmp(arg, "all") != 0 && !strchr(arg, ',') && !strchr(arg, ':'))
+    {
+        cmd.display_index = atoi(arg);
+        return true;
+    }
+    if (strchr(arg, ':') && strncmp(arg, "serial:", 7) != 0 &&
+        strncmp(arg, "connector:", 10) != 0 && strncmp(arg, "model:", 6) != 0)
+        return false;
+
+    for (; *arg; arg++)
+    {
+        if (*arg == ' ')
+            continue;
+        if (len == sizeof(cmd.selector) - 1)
+            return false;
+        cmd.selector[len++] = *arg;
+    }
+    cmd.selector[len] = '\0';
+    return true;
+}
+
+// Whether a command addresses a set of displays rather than one
+bool DisplayIsSet(const VcpCommand& cmd)
+{
+    return strcmp(cmd.selector, "all") == 0 || strchr(cmd.selector, ',') || strpbrk(cmd.selector, "*?");
+}
+
+// Parse positional arguments: display_index input_value command_code [register_address]
+bool ParseCommand(int argc, char* argv[], VcpCommand& cmd)
+{
+    const char* display = g_displayArg;
+    if (!display)
+    {
+        if (argc < 1)
+            return false;
+        display = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc != 2 && argc != 3)
+        return false;
+
+    long value = strtol(argv[0], NULL, 16);
+    if (value < 0 || value > 0xFFFF || !ParseDisplay(display, cmd))
+        return false;
+
+    cmd.input_value = (WORD)value;
+    cmd.command_code = (BYTE)strtol(argv[1], NULL, 16);
+    // Uses default register addres 0x51 used for VCP codes
+    cmd.register_address = (argc == 3) ? (BYTE)strtol(argv[2], NULL, 16) : 0x51;
+    cmd.shadow_ttl = -1;
+    cmd.verify = false;
+    return true;
+}
+
+// Parse --get positional arguments: display_index command_code [register_address]
+bool ParseReadCommand(int argc, char* argv[], VcpCommand& cmd)
+{
+    const char* display = g_displayArg;
+    if (!display)
+    {
+        if (argc < 1)
+            return false;
+        display = argv[0];
+        argv++;
+        argc--;
+    }
+    if ((argc != 1 && argc != 2) || !ParseDisplay(display, cmd))
+        return false;
+
+    cmd.input_value = 0;
+    cmd.command_code = (BYTE)strtol(argv[0], NULL, 16);
+    cmd.register_address = (argc == 2) ? (BYTE)strtol(argv[1], NULL, 16) : 0x51;
+    cmd.shadow_ttl = -1;
+    cmd.verify = false;
+    return true;
+}
+
+// Pick the GPU backend: NVIDIA first, then AMD ADL, unless emulated
+// monitors were asked for
+bool InitBackend()
+{
+    if (g_useVirtual && InitVirtual())
+    {
+        printf("Using %d virtual displays\n", VirtualDisplayCount());
+        g_backend = BACKEND_VIRTUAL;
+        return true;
+    }
+
+    TRACE_BEGIN(t_nvidia);
+    bool nvidia = InitNvidia();
+    TRACE_END(t_nvidia, "init_nvidia");
+    if (nvidia)
+    {
+        printf("Using NVIDIA GPU\n");
+        g_backend = BACKEND_NVIDIA;
+        return true;
+    }
+
+    TRACE_BEGIN(t_adl);
+    bool adl = InitADL();
+    TRACE_END(t_adl, "init_adl");
+    if (adl)
+    {
+        printf("Using AMD GPU\n");
+        g_backend = BACKEND_ADL;
+        return true;
+    }
+
+    printf("No supported GPU found (NVIDIA or AMD required)\n");
+    return false;
+}
+
+int BackendDisplayCount()
+{
+    switch (g_backend)
+    {
+    case BACKEND_NVIDIA:
+        return NvidiaDisplayCount();
+    case BACKEND_ADL:
+        return ADLDisplayCount();
+    case BACKEND_VIRTUAL:
+        return VirtualDisplayCount();
+    default:
+        return -1;
+    }
+}
+
+void FreeBackend()
+{
+    if (g_backend == BACKEND_ADL)
+        FreeADL();
+    g_backend = BACKEND_NONE;
+}
+
+int DisplayBySelector(const char* selector);
+
+// Auto-detect primary display if display_index is -1, or look up the
+// selector. Returns -1 if no display matches the selector, or for a
+// display set, which only batch writes expand.
+int ResolveDisplayIndex(const VcpCommand& cmd)
+{
+    // Primary display is resolved once per process
+    static int primary_index = -1;
+
+    if (DisplayIsSet(cmd))
+    {
+        printf("%s selects several displays, only writes can be broadcast\n", cmd.selector);
+        return -1;
+    }
+    if (cmd.selector[0])
+    {
+        int display_index = DisplayBySelector(cmd.selector);
+        if (display_index < 0)
+            printf("No display matches %s\n", cmd.selector);
+        return display_index;
+    }
+
+    if (cmd.display_index != -1)
+        return cmd.display_index;
+
+    // Emulated monitors are not attached to the desktop
+    if (g_backend == BACKEND_VIRTUAL)
+        return 0;
+
+    if (primary_index == -1)
+        primary_index = AutoDetectPrimaryDisplay();
+    return primary_index;
+}
+
+// Physical bus a display is on. Commands with equal keys must be
+// serialized; different keys can run in parallel.
+struct BusKey
+{
+    void* device;   // NVIDIA GPU handle, or ADL adapter index
+    int port;       // NVIDIA output id, or ADL display index
+
+    bool operator==(const BusKey& other) const
+    {
+        return device == other.device && port == other.port;
+    }
+};
+
+// Returns false for a display that does not exist
+bool DisplayBusKey(int display_index, BusKey& key)
+{
+    if (g_backend == BACKEND_NVIDIA)
+    {
+        NvPhysicalGpuHandle hGpu = NULL;
+        NvU32 outputID = 0;
+        if (!NvidiaResolveDisplay(display_index, &hGpu, &outputID))
+            return false;
+        key.device = hGpu;
+        key.port = (int)outputID;
+        return true;
+    }
+
+    if (g_backend == BACKEND_ADL)
+    {
+        if (display_index < 0 || display_index >= ADLDisplayCount())
+            return false;
+        key.device = (void*)(INT_PTR)g_adlDisplays[display_index].iAdapterIndex;
+        key.port = g_adlDisplays[display_index].iDisplayIndex;
+        return true;
+    }
+
+    if (g_backend == BACKEND_VIRTUAL)
+    {
+        if (display_index < 0 || display_index >= VirtualDisplayCount())
+            return false;
+        key.device = &g_virtual[display_index];
+        key.port = 0;
+        return true;
+    }
+
+    return false;
+}
+
+// Decide whether a failed transaction gets another attempt, and if so
+// sleep the backoff for it. attempt is the 0-based attempt that failed.
+bool RetryAfter(ddcci_status status, int attempt)
+{
+    static thread_local unsigned int seed = 0;
+
+    if (!ddcci_status_is_transient(status) || attempt + 1 >= MCCS_RETRY_ATTEMPTS)
+        return false;
+
+    if (seed == 0)
+        seed = (unsigned int)GetTickCount64() ^ GetCurrentThreadId() ^ 0x9E3779B9u;
+    seed = seed * 1664525u + 1013904223u;
+
+    uint32_t ms = mccs_backoff_ms((unsigned)attempt, seed >> 8);
+    printf("  %s, retrying in %u ms\n", ddcci_status_text(status), ms);
+    PaceSleep(ms);
+    return true;
+}
+
+// A transaction that failed for good: anything but a clean "unsupported"
+// may mean the cached display now belongs to a different monitor.
+void TransactionFailed(ddcci_status status)
+{
+    if (status != DDCCI_ERR_UNSUPPORTED)
+        TopologyInvalidate();
+}
+
+#define BUS_LOCK_TIMEOUT_MS 5000    // Longest wait for another process's transaction
+
+// Every signed-in user, service and scheduled task may wait on and
+// release a bus mutex, whichever account created it first; the default
+// DACL would shut out everyone but its creator. SYSTEM and
+// administrators get full access.
+#define BUS_LOCK_SDDL "D:(A;;0x00100001;;;AU)(A;;GA;;;SY)(A;;GA;;;BA)"
+
+static PSECURITY_DESCRIPTOR g_busLockSecurity = NULL;
+static std::mutex g_busLockMutex;
+
+// Security of the bus mutexes, built on first use. Returns NULL on error.
+PSECURITY_DESCRIPTOR BusLockSecurity()
+{
+    std::lock_guard<std::mutex> lock(g_busLockMutex);
+    if (!g_busLockSecurity)
+        ConvertStringSecurityDescriptorToSecurityDescriptorA(BUS_LOCK_SDDL, SDDL_REVISION_1, &g_busLockSecurity, NULL);
+    return g_busLockSecurity;
+}
+
+// Take the cross-process lock of a display's bus, so concurrent
+// invocations (two hotkeys, a scheduled task and a user, the daemon and
+// --no-daemon) are serialized instead of interleaving transactions on it.
+// The lock is a named mutex per monitor, keyed by its EDID identity since
+// driver handles differ between processes, in the Global namespace so a
+// scheduled task or service in another session takes turns too. Windows
+// queues the waiters and hands an abandoned mutex to the next one if the
+// holder dies. A mutex that cannot be created or opened fails like a busy
+// bus, rather than letting the transaction run unserialized.
+// Returns the held mutex, NULL if the bus could not be locked within
+// BUS_LOCK_TIMEOUT_MS, or INVALID_HANDLE_VALUE when no lock applies.
+HANDLE BusLock(int display_index)
+{
+    unsigned long long id = g_backend == BACKEND_VIRTUAL ? 0 : DisplayId(display_index);
+    if (!id)
+        return INVALID_HANDLE_VALUE;
+
+    char name[64];
+    _snprintf_s(name, sizeof(name), _TRUNCATE, "Global\\writeValueToDisplay-%016llx", id);
+    SECURITY_ATTRIBUTES security = { sizeof(security), BusLockSecurity(), FALSE };
+    HANDLE mutex = security.lpSecurityDescriptor ?
+        CreateMutexExA(&security, name, 0, SYNCHRONIZE | MUTEX_MODIFY_STATE) : NULL;
+    if (!mutex)
+    {
+        printf("  Cannot open the lock of display %d (error %lu)\n", display_index, GetLastError());
+        return NULL;
+    }
+
+    TRACE_BEGIN(t);
+    DWORD wait = WaitForSingleObject(mutex, BUS_LOCK_TIMEOUT_MS);
+    TRACE_END(t, "bus_lock");
+    if (wait == WAIT_OBJECT_0 || wait == WAIT_ABANDONED)
+        return mutex;
+
+    printf("  Display %d is busy, another process held it for %d ms\n", display_index, BUS_LOCK_TIMEOUT_MS);
+    CloseHandle(mutex);
+    return NULL;
+}
+
+// Release a lock taken by BusLock()
+void BusUnlock(HANDLE mutex)
+{
+    if (mutex && mutex != INVALID_HANDLE_VALUE)
+    {
+        ReleaseMutex(mutex);
+        CloseHandle(mutex);
+    }
+}
+
+// Write a value with the display's bus lock already held by the caller
+bool WriteValueLocked(int display_index, const VcpCommand& cmd)
+{
+    ddcci_status status = DDCCI_ERR_IO;
+
+    for (int attempt = 0; ; attempt++)
+    {
+        TRACE_BEGIN(t);
+        switch (g_backend)
+        {
+        case BACKEND_NVIDIA:
+            status = NvidiaWriteValue(display_index, cmd.input_value, cmd.command_code, cmd.register_address);
+            break;
+        case BACKEND_ADL:
+            status = ADLWriteValue(display_index, cmd.input_value, cmd.command_code, cmd.register_address);
+            break;
+        case BACKEND_VIRTUAL:
+            status = VirtualWriteValue(display_index, cmd.input_value, cmd.command_code, cmd.register_address);
+            break;
+        default:
+            return false;
+        }
+        TRACE_END(t, "write_attempt");
+        if (status == DDCCI_OK || !RetryAfter(status, attempt))
+            break;
+    }
+
+    if (status == DDCCI_OK)
+    {
+        if (mccs_code_drops_link(cmd.register_address, cmd.command_code))
+            TimingLinkDrop(DisplayId(display_index));
+        return true;
+    }
+    TransactionFailed(status);
+    return false;
+}
+
+// Read a value with the display's bus lock already held by the caller
+bool ReadValueLocked(int display_index, const VcpCommand& cmd, ddcci_vcp_reply* reply)
+{
+    ddcci_status status = DDCCI_ERR_IO;
+
+    for (int attempt = 0; ; attempt++)
+    {
+        TRACE_BEGIN(t);
+        switch (g_backend)
+        {
+        case BACKEND_NVIDIA:
+            status = NvidiaReadValue(display_index, cmd.command_code, cmd.register_address, reply);
+            break;
+        case BACKEND_ADL:
+            status = ADLReadValue(display_index, cmd.command_code, cmd.register_address, reply);
+            break;
+        case BACKEND_VIRTUAL:
+            status = VirtualReadValue(display_index, cmd.command_code, cmd.register_address, reply);
+            break;
+        default:
+            return false;
+        }
+        TRACE_END(t, "read_attempt");
+        if (status == DDCCI_OK || !RetryAfter(status, attempt))
+            break;
+    }
+
+    if (status == DDCCI_OK)
+        return true;
+    TransactionFailed(status);
+    return false;
+}
+
+bool WriteValue(int display_index, const VcpCommand& cmd)
+{
+    HANDLE lock = BusLock(display_index);
+    if (!lock)
+        return false;
+    bool ok = WriteValueLocked(display_index, cmd);
+    BusUnlock(lock);
+    return ok;
+}
+
+bool ReadValue(int display_index, const VcpCommand& cmd, ddcci_vcp_reply* reply)
+{
+    HANDLE lock = BusLock(display_index);
+    if (!lock)
+        return false;
+    bool ok = ReadValueLocked(display_index, cmd, reply);
+    BusUnlock(lock);
+    return ok;
+}
+
+// Stable identity of a display for the shadow and timing caches: its EDID
+// hash, so state follows the monitor when display indices change, else its index.
+// Returns 0 for a display that does not exist.
+unsigned long long DisplayId(int display_index)
+{
+    if (g_backend == BACKEND_NVIDIA && display_index >= 0 && display_index < NvidiaDisplayCount())
+        return g_nvDisplays[display_index].edidHash ? g_nvDisplays[display_index].edidHash : display_index + 1;
+    if (g_backend == BACKEND_ADL && display_index >= 0 && display_index < ADLDisplayCount())
+        return g_adlDisplays[display_index].edidHash ? g_adlDisplays[display_index].edidHash : display_index + 1;
+    if (g_backend == BACKEND_VIRTUAL && display_index >= 0 && display_index < VirtualDisplayCount())
+        return VirtualEdidHash(display_index);
+    return 0;
+}
+
+// Key of a display in the caps cache: the manufacturer, product and serial
+// from its EDID, so the entry follows the monitor to any output and
+// survives EDID changes that leave its identity alone, else DisplayId().
+unsigned long long DisplayCapsKey(int display_index)
+{
+    unsigned long long id = 0;
+    if (g_backend == BACKEND_NVIDIA && display_index >= 0 && display_index < NvidiaDisplayCount())
+        id = g_nvDisplays[display_index].edidId;
+    else if (g_backend == BACKEND_ADL && display_index >= 0 && display_index < ADLDisplayCount())
+        id = g_adlDisplays[display_index].edidId;
+    else if (g_backend == BACKEND_VIRTUAL && display_index >= 0 && display_index < VirtualDisplayCount())
+        id = VirtualEdidId(display_index);
+    return id ? id : DisplayId(display_index);
+}
+
+// Parsed EDID of a display. Looked up by the hash the topology recorded,
+// so a cached topology costs no driver call; on a miss the block is read
+// again with NvAPI_GPU_GetEDID or ADL_Display_EdidData_Get, checked
+// against that hash and cached. Emulated monitors are parsed in place.
+// Returns false if the display has no EDID.
+bool DisplayEdid(int display_index, edid_info& info)
+{
+    if (g_backend == BACKEND_VIRTUAL)
+        return display_index >= 0 && display_index < VirtualDisplayCount() &&
+               edid_parse(g_virtual[display_index].edid, &info);
+
+    unsigned long long hash = 0;
+    if (g_backend == BACKEND_NVIDIA && display_index >= 0 && display_index < NvidiaDisplayCount())
+        hash = g_nvDisplays[display_index].edidHash;
+    else if (g_backend == BACKEND_ADL && display_index >= 0 && display_index < ADLDisplayCount())
+        hash = g_adlDisplays[display_index].edidHash;
+    if (!hash)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(g_edidMutex);
+        EdidEntry* entry = EdidFind(hash);
+        if (entry)
+        {
+            info = entry->info;
+            return true;
+        }
+    }
+
+    uint8_t block[EDID_BLOCK_LEN];
+    bool read = false;
+    if (g_backend == BACKEND_NVIDIA)
+    {
+        NvPhysicalGpuHandle hGpu = NULL;
+        NvU32 outputID = 0;
+        read = NvidiaResolveDisplay(display_index, &hGpu, &outputID) && NvidiaReadEdid(hGpu, outputID, block);
+    }
+    else
+    {
+        read = ADLReadEdid(g_adlDisplays[display_index].iAdapterIndex,
+                           g_adlDisplays[display_index].iDisplayIndex, block);
+    }
+    if (!read || edid_hash(block) != hash)
+        return false;
+
+    EdidRemember(block);
+    EdidFlush();
+    return edid_parse(block, &info) != 0;
+}
+
+// serial:, connector: and model: keys of every display, built on first use
+static edid_index g_displayIndex;
+static bool g_displayIndexBuilt = false;
+static std::mutex g_displayIndexMutex;
+
+const mccs_caps* CapsLookup(unsigned long long key);
+
+// GDI device name of a display (\\.\DISPLAY1), Virtual-N for an emulated
+// monitor, or "" if unknown
+void DisplayName(int display_index, char* name, size_t size)
+{
+    name[0] = '\0';
+    if (g_backend == BACKEND_NVIDIA && display_index >= 0 && display_index < NvidiaDisplayCount() &&
+        strcmp(g_nvDisplays[display_index].name, "-") != 0)
+        strcpy_s(name, size, g_nvDisplays[display_index].name);
+    else if (g_backend == BACKEND_VIRTUAL)
+        _snprintf_s(name, size, _TRUNCATE, "Virtual-%d", display_index + 1);
+}
+
+// Index every display by the serial and model keys of its EDID, the
+// model() of its cached capabilities, and its GDI device name with and
+// without the \\.\ prefix (virtual monitors: Virtual-N), once per
+// process, so a lookup is one hash probe instead of a driver call per
+// display. Built from the topology, EDID and caps caches, so a warm
+// machine resolves selectors without enumerating.
+const edid_index& DisplayIndex()
+{
+    std::lock_guard<std::mutex> lock(g_displayIndexMutex);
+    if (!g_displayIndexBuilt)
+    {
+        int count = BackendDisplayCount();
+        edid_info info;
+
+        edid_index_clear(&g_displayIndex);
+        for (int i = 0; i < count; i++)
+        {
+            if (DisplayEdid(i, info))
+                edid_index_add_info(&g_displayIndex, &info, i);
+
+            const mccs_caps* caps = CapsLookup(DisplayCapsKey(i));
+            if (caps)
+                edid_index_add(&g_displayIndex, "model", caps->model, i);
+
+            char name[64];
+            DisplayName(i, name, sizeof(name));
+            edid_index_add(&g_displayIndex, "connector", name, i);
+            if (strncmp(name, "\\\\.\\", 4) == 0)
+                edid_index_add(&g_displayIndex, "connector", name + 4, i);
+        }
+        g_displayIndexBuilt = true;
+    }
+    return g_displayIndex;
+}
+
+// Display whose EDID serial number (descriptor text or numeric) is serial,
+// or -1 if none
+int DisplayBySerial(const char* serial)
+{
+    return edid_index_find(&DisplayIndex(), "serial", serial);
+}
+
+// First display whose EDID monitor name, PNP model id ("GSM5B7F") or
+// capabilities model() is model, or -1 if none
+int DisplayByModel(const char* model)
+{
+    return edid_index_find(&DisplayIndex(), "model", model);
+}
+
+// Display named by a selector: "serial:S", "connector:C" or "model:M",
+// or -1 if none
+int DisplayBySelector(const char* selector)
+{
+    const char* value = strchr(selector, ':');
+    if (!value)
+        return -1;
+    if (strncmp(selector, "serial:", 7) == 0)
+        return DisplayBySerial(value + 1);
+    if (strncmp(selector, "model:", 6) == 0)
+        return DisplayByModel(value + 1);
+    if (strncmp(selector, "connector:", 10) == 0)
+        return edid_index_find(&DisplayIndex(), "connector", value + 1);
+    return -1;
+}
+
+// Check a display against a selector whose value has * and ? wildcards,
+// e.g. "model:GSM*" or "connector:DISPLAY*", on the same keys as the index
+bool DisplayMatches(int display_index, const char* selector)
+{
+    const char* value = strchr(selector, ':');
+    edid_info info;
+    if (!value)
+        return false;
+    value++;
+
+    if (strncmp(selector, "connector:", 10) == 0)
+    {
+        char name[64];
+        DisplayName(display_index, name, sizeof(name));
+        return name[0] && (edid_match(value, name) ||
+                           (strncmp(name, "\\\\.\\", 4) == 0 && edid_match(value, name + 4)));
+    }
+
+    const char* kind = strncmp(selector, "serial:", 7) == 0 ? "serial" : "model";
+    if (DisplayEdid(display_index, info) && edid_info_matches(&info, kind, value))
+        return true;
+    if (strcmp(kind, "model") != 0)
+        return false;
+
+    const mccs_caps* caps = CapsLookup(DisplayCapsKey(display_index));
+    return caps && caps->model[0] && edid_match(value, caps->model);
+}
+
+// Parsed capabilities of the monitors this process has looked up. An
+// entry with known == false records that the cache has nothing for the key.
+struct CapsEntry
+{
+    unsigned long long key;
+    bool known;
+    mccs_caps caps;
+};
+
+static CapsEntry g_caps[TIMING_MAX_ENTRIES];
+static int g_capsCount = 0;
+static std::mutex g_capsMutex;
+
+// Find the cached capabilities string of a monitor in
+// %LOCALAPPDATA%\writeValueToDisplay\caps, one "key string" per line.
+// caps must hold MCCS_CAPS_MAX_LEN + 1 bytes.
+bool CapsReadCached(unsigned long long key, char* caps)
+{
+    char path[MAX_PATH];
+    char line[MCCS_CAPS_MAX_LEN + 32];
+    bool found = false;
+
+    if (!CachePath("caps", path, sizeof(path)))
+        return false;
+
+    FILE* fp = NULL;
+    if (fopen_s(&fp, path, "r") != 0)
+        return false;
+
+    while (!found && fgets(line, sizeof(line), fp))
+    {
+        unsigned long long cached_key = 0;
+        int n = 0;
+        if (sscanf_s(line, "%llx %n", &cached_key, &n) != 1 || cached_key != key)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        strcpy_s(caps, MCCS_CAPS_MAX_LEN + 1, line + n);
+        found = true;
+    }
+    fclose(fp);
+    return found;
+}
+
+// Store a monitor's capabilities string, replacing its old line.
+// Caller holds g_capsMutex.
+void CapsSave(unsigned long long key, const char* caps)
+{
+    char path[MAX_PATH];
+    char tmp_path[MAX_PATH + 16];
+    char line[MCCS_CAPS_MAX_LEN + 32];
+
+    if (!CachePath("caps", path, sizeof(path)))
+        return;
+
+    _snprintf_s(tmp_path, sizeof(tmp_path), _TRUNCATE, "%s.%lu", path, GetCurrentProcessId());
+    FILE* out = NULL;
+    if (fopen_s(&out, tmp_path, "w") != 0)
+        return;
+
+    FILE* in = NULL;
+    if (fopen_s(&in, path, "r") == 0)
+    {
+        while (fgets(line, sizeof(line), in))
+        {
+            unsigned long long cached_key = 0;
+            if (sscanf_s(line, "%llx", &cached_key) == 1 && cached_key != key && strchr(line, '\n'))
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%016llx %s\n", key, caps);
+
+    if (fclose(out) == 0 && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+        return;
+    DeleteFileA(tmp_path);
+}
+
+// Parsed capabilities of a monitor from the caps cache, or NULL if they
+// were never read with --caps. The cache file is read at most once per
+// monitor and process.
+const mccs_caps* CapsLookup(unsigned long long key)
+{
+    char text[MCCS_CAPS_MAX_LEN + 1];
+    std::lock_guard<std::mutex> lock(g_capsMutex);
+
+    CapsEntry* entry = NULL;
+    for (int i = 0; !entry && i < g_capsCount; i++)
+    {
+        if (g_caps[i].key == key)
+            entry = &g_caps[i];
+    }
+    if (!entry && g_capsCount < TIMING_MAX_ENTRIES)
+    {
+        entry = &g_caps[g_capsCount++];
+        entry->key = key;
+        entry->known = CapsReadCached(key, text) && mccs_caps_parse(text, &entry->caps);
+    }
+    return entry && entry->known ? &entry->caps : NULL;
+}
+
+// Remember freshly read capabilities in this process and the cache
+void CapsStore(unsigned long long key, const char* text)
+{
+    std::lock_guard<std::mutex> lock(g_capsMutex);
+
+    CapsEntry* entry = NULL;
+    for (int i = 0; !entry && i < g_capsCount; i++)
+    {
+        if (g_caps[i].key == key)
+            entry = &g_caps[i];
+    }
+    if (!entry && g_capsCount < TIMING_MAX_ENTRIES)
+    {
+        entry = &g_caps[g_capsCount++];
+        entry->key = key;
+    }
+    if (entry)
+        entry->known = mccs_caps_parse(text, &entry->caps) != 0;
+    CapsSave(key, text);
+}
+
+// Read the capabilities string from the monitor. DDC/CI allows one
+// outstanding request, so fragments are requested back to back, spaced
+// only by the monitor's learned timing, and each fragment is retried on
+// its own instead of restarting the whole string.
+// caps must hold MCCS_CAPS_MAX_LEN + 1 bytes.
+bool ReadCapsFragments(int display_index, char* caps)
+{
+    ddcci_status status = DDCCI_OK;
+    size_t len = 0;
+    WORD offset = 0;
+
+    caps[0] = '\0';
+    for (;;)
+    {
+        BYTE data[DDCCI_MAX_FRAGMENT];
+        size_t n = 0;
+
+        for (int attempt = 0; ; attempt++)
+        {
+            TRACE_BEGIN(t);
+            switch (g_backend)
+            {
+            case BACKEND_NVIDIA:
+                status = NvidiaCapsFragment(display_index, offset, data, &n);
+                break;
+            case BACKEND_ADL:
+                status = ADLCapsFragment(display_index, offset, data, &n);
+                break;
+            case BACKEND_VIRTUAL:
+                status = VirtualCapsFragment(display_index, offset, data, &n);
+                break;
+            default:
+                return false;
+            }
+            TRACE_END(t, "caps_fragment");
+            if (status == DDCCI_OK || !RetryAfter(status, attempt))
+                break;
+        }
+
+        if (status != DDCCI_OK)
+        {
+            TransactionFailed(status);
+            return false;
+        }
+        if (n == 0)
+            return caps[0] != '\0';
+        if (!mccs_caps_append(caps, &len, data, n))
+        {
+            printf("  Capabilities string longer than %d bytes\n", MCCS_CAPS_MAX_LEN);
+            return false;
+        }
+        offset = (WORD)(offset + n);
+    }
+}
+
+// Read the capabilities string under one bus lock, so no other process
+// gets a request in between two fragments
+bool ReadCaps(int display_index, char* caps)
+{
+    HANDLE lock = BusLock(display_index);
+    if (!lock)
+        return false;
+    bool ok = ReadCapsFragments(display_index, caps);
+    BusUnlock(lock);
+    return ok;
+}
+
+// Write a command's value and, with --verify and a code that allows it,
+// read it back. The read is the next transaction on the bus, so it waits
+// only the monitor's learned write delay, and only a mismatch costs
+// another write. The caller holds the bus lock from the first write to
+// the last read, so no other process can write in between and be
+// mistaken for the monitor ignoring ours.
+static bool WriteVerifiedLocked(int display_index, const VcpCommand& cmd)
+{
+    if (!cmd.verify || !mccs_verify_applies(cmd.register_address, cmd.command_code))
+        return WriteValueLocked(display_index, cmd);
+
+    bool ok = false;
+    for (int attempt = 0; attempt < MCCS_VERIFY_ATTEMPTS; attempt++)
+    {
+        ddcci_vcp_reply reply;
+
+        if (!WriteValueLocked(display_index, cmd))
+            break;
+        if (!ReadValueLocked(display_index, cmd, &reply))
+        {
+            printf("VCP 0x%02X on display %d could not be read back\n", cmd.command_code, display_index);
+            break;
+        }
+        ok = mccs_verify_matches(cmd.input_value, &reply) != 0;
+        TimingConfirm(DisplayId(display_index), ok);
+        if (ok)
+            break;
+        fprintf(stderr, "  VCP 0x%02X reads back 0x%02X instead of 0x%02X%s\n", cmd.command_code,
+            reply.cur_value, cmd.input_value, attempt + 1 < MCCS_VERIFY_ATTEMPTS ? ", writing again" : "");
+        if (attempt + 1 == MCCS_VERIFY_ATTEMPTS)
+            printf("VCP 0x%02X on display %d did not take 0x%02X\n", cmd.command_code, display_index, cmd.input_value);
+    }
+    return ok;
+}
+
+// Check a value known for a command's code against the value to write.
+// Input source (0x60) values live in the low byte; some monitors report
+// garbage in the high byte.
+static bool ShadowMatches(const VcpCommand& cmd, WORD current)
+{
+    if (cmd.command_code == 0x60 && cmd.register_address == DDCCI_HOST_ADDR)
+        current &= 0xFF;
+    return current == cmd.input_value;
+}
+
+// Report a write skipped by --if-changed
+static bool SkipUnchanged(int display_index, const VcpCommand& cmd)
+{
+    printf("VCP 0x%02X on display %d is already 0x%02X, skipped\n", cmd.command_code, display_index, cmd.input_value);
+    return true;
+}
+
+// Write a command's value to a resolved display. With --if-changed the
+// write is skipped when the monitor already has the value. A shadow entry
+// no older than the TTL, from our last write or read of that code,
+// settles it without a bus transaction. Otherwise a standard VCP code is
+// read from the monitor, which another program or the OSD may have
+// changed, under the same bus lock as the write that may follow, so no
+// other process can write in between; vendor registers cannot be read and
+// are written. One-shot commands such as factory resets are never
+// shadowed.
+bool ApplyCommand(int display_index, const VcpCommand& cmd)
+{
+    // No display matched the selector
+    if (display_index == -1)
+        return false;
+
+    unsigned long long id = DisplayId(display_index);
+
+    // Once a monitor's capabilities are known, codes it does not list are
+    // refused here; a monitor silently ignores a Set VCP it cannot handle
+    if (cmd.register_address == DDCCI_HOST_ADDR)
+    {
+        const mccs_caps* caps = CapsLookup(DisplayCapsKey(display_index));
+        if (caps && !mccs_caps_supports(caps, cmd.command_code))
+        {
+            printf("VCP 0x%02X is not in the capabilities of display %d\n", cmd.command_code, display_index);
+            return false;
+        }
+    }
+
+    bool shadowed = id && !mccs_code_is_action(cmd.register_address, cmd.command_code);
+    WORD current = 0;
+    if (cmd.shadow_ttl >= 0 && shadowed &&
+        ShadowLookup(id, cmd.register_address, cmd.command_code, cmd.shadow_ttl, &current) &&
+        ShadowMatches(cmd, current))
+        return SkipUnchanged(display_index, cmd);
+
+    HANDLE lock = BusLock(display_index);
+    if (!lock)
+        return false;
+
+    if (cmd.shadow_ttl >= 0 && shadowed && cmd.register_address == DDCCI_HOST_ADDR)
+    {
+        ddcci_vcp_reply reply;
+        if (ReadValueLocked(display_index, cmd, &reply))
+        {
+            ShadowStore(id, cmd.register_address, cmd.command_code, reply.cur_value);
+            if (ShadowMatches(cmd, reply.cur_value))
+            {
+                BusUnlock(lock);
+                return SkipUnchanged(display_index, cmd);
+            }
+        }
+    }
+
+    bool ok = WriteVerifiedLocked(display_index, cmd);
+    BusUnlock(lock);
+    if (!ok)
+    {
+        if (shadowed)
+            ShadowForget(id, cmd.register_address, cmd.command_code);
+        return false;
+    }
+
+    if (shadowed)
+        ShadowStore(id, cmd.register_address, cmd.command_code, cmd.input_value);
+    return true;
+}
+
+bool ExecuteCommand(const VcpCommand& cmd)
+{
+    return ApplyCommand(ResolveDisplayIndex(cmd), cmd);
+}
+
+// Read the value and print it
+bool ExecuteRead(const VcpCommand& cmd)
+{
+    int display_index = ResolveDisplayIndex(cmd);
+    ddcci_vcp_reply reply;
+    if (display_index == -1 || !ReadValue(display_index, cmd, &reply))
+        return false;
+
+    // What the monitor reports keeps the --if-changed shadow honest
+    unsigned long long id = DisplayId(display_index);
+    if (id && !mccs_code_is_action(cmd.register_address, cmd.command_code))
+        ShadowStore(id, cmd.register_address, cmd.command_code, reply.cur_value);
+
+    printf("VCP 0x%02X: current 0x%04X (%u), max 0x%04X (%u)\n", reply.code,
+        reply.cur_value, reply.cur_value, reply.max_value, reply.max_value);
+    return true;
+}
+
+// Print the display's capabilities, from the caps cache unless --rescan,
+// else read from the monitor and cached
+bool ExecuteCaps(const VcpCommand& cmd)
+{
+    char text[MCCS_CAPS_MAX_LEN + 1];
+    mccs_caps caps;
+    int display_index = ResolveDisplayIndex(cmd);
+    if (display_index == -1)
+        return false;
+
+    unsigned long long key = DisplayCapsKey(display_index);
+    bool cached = !g_rescan && key && CapsReadCached(key, text);
+
+    if (!cached)
+    {
+        if (!ReadCaps(display_index, text))
+            return false;
+        if (key)
+            CapsStore(key, text);
+    }
+
+    printf("Capabilities of display %d%s:\n%s\n", display_index, cached ? " (cached)" : "", text);
+    if (!mccs_caps_parse(text, &caps))
+    {
+        printf("No vcp() list in the capabilities string\n");
+        return true;
+    }
+    mccs_caps_print(stdout, &caps);
+    return true;
+}
+
+// Print every display with its device name and EDID identity: PNP model
+// id, monitor name and serial number. Returns the number of displays.
+int ExecuteList()
+{
+    int count = BackendDisplayCount();
+    for (int i = 0; i < count; i++)
+    {
+        edid_info info;
+        char serial[16];
+        char name[64];
+
+        DisplayName(i, name, sizeof(name));
+        printf("Display %d: %s", i, name[0] ? name : "-");
+        if (!DisplayEdid(i, info))
+        {
+            printf(", no EDID\n");
+            continue;
+        }
+        if (info.serial_text[0])
+            strcpy_s(serial, sizeof(serial), info.serial_text);
+        else
+            _snprintf_s(serial, sizeof(serial), _TRUNCATE, "%lu", (unsigned long)info.serial);
+        printf(", %s%04X \"%s\", serial %s\n", info.vendor, info.product, info.name, serial);
+    }
+    return count > 0 ? count : 0;
+}
+
+// Ramp a continuous VCP code from its current value to the command's
+// value over duration_ms, in this one process. Each write goes out as
+// soon as the learned timing of the monitor allows it and carries the
+// value the ramp has reached by then: steps the bus could not keep up
+// with are coalesced into that write instead of queued, so the fade ends
+// on time. When the bus is faster than the ramp, sleeps until the value
+// next changes.
+bool ExecuteFade(const VcpCommand& cmd, DWORD duration_ms)
+{
+    int display_index = ResolveDisplayIndex(cmd);
+    ddcci_vcp_reply reply;
+    if (display_index == -1)
+        return false;
+    if (cmd.register_address != DDCCI_HOST_ADDR || !fade_code_is_continuous(cmd.command_code))
+    {
+        printf("VCP 0x%02X is not a continuous control, it cannot be faded\n", cmd.command_code);
+        return false;
+    }
+
+    const mccs_caps* caps = CapsLookup(DisplayCapsKey(display_index));
+    if (caps && !mccs_caps_supports(caps, cmd.command_code))
+    {
+        printf("VCP 0x%02X is not in the capabilities of display %d\n", cmd.command_code, display_index);
+        return false;
+    }
+
+    // The ramp starts from what the monitor reports, which also gives the
+    // maximum to clamp the target to
+    if (!ReadValue(display_index, cmd, &reply))
+        return false;
+    WORD target = cmd.input_value;
+    if (reply.max_value && target > reply.max_value)
+        target = reply.max_value;
+
+    fade_ramp ramp = { reply.cur_value, target, (uint32_t)duration_ms };
+    VcpCommand step = cmd;
+    step.input_value = ramp.from;
+    unsigned writes = 0;
+    ULONGLONG start = MonotonicUs() / 1000;
+
+    while (step.input_value != ramp.to)
+    {
+        ULONGLONG elapsed = MonotonicUs() / 1000 - start;
+        WORD next = fade_value_at(&ramp, elapsed);
+        if (next == step.input_value)
+        {
+            PaceSleep((DWORD)(fade_next_ms(&ramp, step.input_value) - elapsed));
+            continue;
+        }
+
+        step.input_value = next;
+        TRACE_BEGIN(t);
+        bool ok = WriteValue(display_index, step);
+        TRACE_END(t, "fade_step");
+        if (!ok)
+            return false;
+        writes++;
+    }
+
+    printf("VCP 0x%02X on display %d faded from 0x%02X to 0x%02X in %llu ms, %u writes\n",
+        cmd.command_code, display_index, ramp.from, ramp.to, (unsigned long long)(MonotonicUs() / 1000 - start), writes);
+    return true;
+}
+
+
+// ============================================================
+// Batch mode
+// ============================================================
+
+typedef std::vector<VcpCommand> VcpBatch;
+
+// Split a command line into whitespace separated tokens, in place
+int SplitArgs(char* line, char* args[], int max_args)
+{
+    int count = 0;
+    char* context = NULL;
+    for (char* tok = strtok_s(line, " \t\r\n", &context); tok && count < max_args;
+         tok = strtok_s(NULL, " \t\r\n", &context))
+        args[count++] = tok;
+    return count;
+}
+
+// Parse commands from argv, separated by "," arguments:
+//   0 0x32 0x10 , 1 0x32 0x10 , 2 0x90 0xF4 0x50
+bool ParseBatchArgs(int argc, char* argv[], VcpBatch& batch)
+{
+    int start = 0;
+    for (int i = 0; i <= argc; i++)
+    {
+        if (i < argc && strcmp(argv[i], ",") != 0)
+            continue;
+
+        VcpCommand cmd;
+        if (!ParseCommand(i - start, argv + start, cmd))
+        {
+            printf("Malformed command #%d\n", (int)batch.size() + 1);
+            return false;
+        }
+        batch.push_back(cmd);
+        start = i + 1;
+    }
+    return true;
+}
+
+// Parse one command per line from a file, or stdin for "-".
+// Blank lines and lines starting with '#' are ignored.
+bool ParseBatchFile(const char* path, VcpBatch& batch)
+{
+    FILE* fp = stdin;
+    if (strcmp(path, "-") != 0 && fopen_s(&fp, path, "r") != 0)
+    {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+
+    char line[MAX_LINE_LEN];
+    int line_num = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp))
+    {
+        line_num++;
+
+        char* args[MAX_LINE_LEN / 2];
+        int count = SplitArgs(line, args, MAX_LINE_LEN / 2);
+        if (count == 0 || args[0][0] == '#')
+            continue;
+
+        VcpCommand cmd;
+        if (!ParseCommand(count, args, cmd))
+        {
+            printf("%s:%d: malformed command\n", path, line_num);
+            ok = false;
+        }
+        else
+        {
+            batch.push_back(cmd);
+        }
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+    return ok;
+}
+
+// Jobs queued for one physical bus, run in batch order by one worker.
+// A job is one command on one display; a command for a display set has
+// a job per display.
+struct BusQueue
+{
+    BusKey key;
+    bool valid;
+    std::vector<size_t> indices;    // Into the jobs, in batch order
+};
+
+// Expand a display set into display indices, in the order given for a
+// list and display order otherwise. A list keeps indices that do not
+// exist, so the write to them fails and is reported.
+std::vector<int> ResolveDisplaySet(const VcpCommand& cmd)
+{
+    std::vector<int> displays;
+    int count = BackendDisplayCount();
+
+    if (strchr(cmd.selector, ':'))
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (DisplayMatches(i, cmd.selector))
+                displays.push_back(i);
+        }
+        return displays;
+    }
+
+    for (const char* p = cmd.selector; p; p = strchr(p, ','))
+    {
+        if (*p == ',')
+            p++;
+        if (strncmp(p, "all", 3) == 0)
+        {
+            for (int i = 0; i < count; i++)
+                displays.push_back(i);
+            continue;
+        }
+
+        int display_index = atoi(p);
+        bool seen = false;
+        for (int d : displays)
+            seen |= d == display_index;
+        if (!seen)
+            displays.push_back(display_index);
+    }
+    return displays;
+}
+
+// Jobs of a batch: one per command and display, a command for a display
+// set fanning out to one job per display. The jobs of command i are
+// first_job[i] to first_job[i + 1].
+struct BatchPlan
+{
+    std::vector<size_t> first_job;
+    std::vector<size_t> commands;       // Command of each job
+    std::vector<int> display_index;     // Display of each job
+};
+
+BatchPlan BuildBatchPlan(const VcpBatch& batch)
+{
+    BatchPlan plan;
+    plan.first_job.resize(batch.size() + 1);
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        plan.first_job[i] = plan.commands.size();
+        if (!DisplayIsSet(batch[i]))
+        {
+            plan.commands.push_back(i);
+            plan.display_index.push_back(ResolveDisplayIndex(batch[i]));
+            continue;
+        }
+
+        std::vector<int> displays = ResolveDisplaySet(batch[i]);
+        if (displays.empty())
+            printf("No display matches %s\n", batch[i].selector);
+        for (int d : displays)
+        {
+            plan.commands.push_back(i);
+            plan.display_index.push_back(d);
+        }
+    }
+    plan.first_job[batch.size()] = plan.commands.size();
+    return plan;
+}
+
+// Check that command i succeeded, i.e. every display it resolved to was
+// written. A display set reports how many of its displays were.
+bool BatchCommandOk(const VcpBatch& batch, const BatchPlan& plan, const std::vector<char>& results, size_t i)
+{
+    size_t total = plan.first_job[i + 1] - plan.first_job[i];
+    size_t written = 0;
+    for (size_t k = plan.first_job[i]; k < plan.first_job[i + 1]; k++)
+        written += results[k];
+    if (DisplayIsSet(batch[i]) && total > 0)
+        printf("%s: %d of %d displays written\n", batch[i].selector, (int)written, (int)total);
+    return total > 0 && written == total;
+}
+
+// Execute every command through the one initialized backend.
+// Commands are grouped by physical bus; each bus gets its own worker so
+// different monitors are written concurrently, while commands on the
+// same bus stay in order with the MCCS inter-command delay. A command
+// for a display set fans out to one job per display, all queued before
+// any worker starts, and succeeds only if every display was written.
+// Returns the number of failed commands.
+int ExecuteBatch(const VcpBatch& batch)
+{
+    std::vector<BusQueue> queues;
+
+    // Resolve displays up front; workers only write
+    BatchPlan plan = BuildBatchPlan(batch);
+
+    std::vector<char> results(plan.commands.size(), 0);
+    for (size_t i = 0; i < plan.commands.size(); i++)
+    {
+        // Unknown displays get their own queue and fail there
+        BusKey key = { NULL, 0 };
+        bool valid = DisplayBusKey(plan.display_index[i], key);
+
+        size_t q = 0;
+        while (q < queues.size() && !(valid && queues[q].valid && queues[q].key == key))
+            q++;
+        if (q == queues.size())
+            queues.push_back(BusQueue{ key, valid, {} });
+        queues[q].indices.push_back(i);
+    }
+
+    auto run_queue = [&](const BusQueue& queue)
+    {
+        for (size_t i = 0; i < queue.indices.size(); i++)
+        {
+            size_t idx = queue.indices[i];
+
+            // MCCS: the monitor needs time to process a Set VCP before the
+            // next command on the same bus; the backends wait the learned
+            // per-monitor delay before each transaction
+            results[idx] = ApplyCommand(plan.display_index[idx], batch[plan.commands[idx]]) ? 1 : 0;
+        }
+    };
+
+    if (queues.size() == 1)
+    {
+        run_queue(queues[0]);
+    }
+    else
+    {
+        std::vector<std::thread> workers;
+        for (const BusQueue& queue : queues)
+            workers.emplace_back(run_queue, std::cref(queue));
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        if (!BatchCommandOk(batch, plan, results, i))
+        {
+            if (batch.size() > 1)
+                printf("Command #%d failed\n", (int)i + 1);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+
+// ============================================================
+// Daemon mode
+// ============================================================
+
+#define PIPE_NAME "\\\\.\\pipe\\writeValueToDisplay"
+#define DAEMON_LINE_LEN 4096
+#define MAX_DAEMON_ARGS (DAEMON_LINE_LEN / 2)
+
+#define SID_TEXT_LEN 192
+
+// String SID of the user a process runs as
+bool ProcessUserSid(HANDLE process, char* sid, size_t size)
+{
+    HANDLE token;
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token))
+        return false;
+
+    union
+    {
+        TOKEN_USER user;
+        BYTE buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    } info;
+    DWORD needed = 0;
+    BOOL ok = GetTokenInformation(token, TokenUser, &info, sizeof(info), &needed);
+    CloseHandle(token);
+
+    char* text = NULL;
+    if (!ok || !ConvertSidToStringSidA(info.user.User.Sid, &text))
+        return false;
+    strcpy_s(sid, size, text);
+    LocalFree(text);
+    return true;
+}
 
-// ADL memory allocation callback (required by ADL)
-void* __stdcall ADL_Main_Memory_Alloc(int iSize)
+// Check that the daemon serving a pipe runs as our user. The pipe name
+// is well known, so another user could have created it first and would
+// get to see and answer our commands.
+bool DaemonPeerIsOurs(HANDLE pipe)
 {
-    return malloc(iSize);
+    char ours[SID_TEXT_LEN];
+    char theirs[SID_TEXT_LEN];
+    ULONG pid = 0;
+
+    if (!GetNamedPipeServerProcessId(pipe, &pid) || !ProcessUserSid(GetCurrentProcess(), ours, sizeof(ours)))
+        return false;
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!process)
+        return false;
+    bool same = ProcessUserSid(process, theirs, sizeof(theirs)) && strcmp(ours, theirs) == 0;
+    CloseHandle(process);
+    return same;
 }
 
-void __stdcall ADL_Main_Memory_Free(void** lpBuffer)
+// Security of the daemon's pipe: full access for the user the daemon
+// runs as, and no one else. Free lpSecurityDescriptor with LocalFree().
+bool DaemonPipeSecurity(SECURITY_ATTRIBUTES* sa)
 {
-    if (NULL != *lpBuffer)
+    char sid[SID_TEXT_LEN];
+    char sddl[SID_TEXT_LEN + 16];
+
+    if (!ProcessUserSid(GetCurrentProcess(), sid, sizeof(sid)))
+        return false;
+    _snprintf_s(sddl, sizeof(sddl), _TRUNCATE, "D:P(A;;GA;;;%s)", sid);
+    sa->nLength = sizeof(*sa);
+    sa->bInheritHandle = FALSE;
+    return ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl, SDDL_REVISION_1,
+        &sa->lpSecurityDescriptor, NULL) != 0;
+}
+
+// Send commands first to first + count - 1 of a batch as one request and
+// count the failures the daemon reports.
+// Returns -1 if no daemon of ours is listening, -2 if it did not reply.
+int DaemonRequest(const VcpBatch& batch, size_t first, size_t count, const char* line, int len)
+{
+    char reply[DAEMON_LINE_LEN];
+    DWORD replyLen = 0;
+
+    // Waits for the daemon if it is busy with another client. The daemon
+    // may identify us but not act as us.
+    HANDLE pipe;
+    for (;;)
     {
-        free(*lpBuffer);
-        *lpBuffer = NULL;
+        pipe = CreateFileA(PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+            SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, NULL);
+        if (pipe != INVALID_HANDLE_VALUE || GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(PIPE_NAME, 5000))
+            break;
+    }
+    if (pipe == INVALID_HANDLE_VALUE)
+        return GetLastError() == ERROR_FILE_NOT_FOUND ? -1 : -2;
+
+    if (!DaemonPeerIsOurs(pipe))
+    {
+        CloseHandle(pipe);
+        printf("%s belongs to another user, running locally\n", PIPE_NAME);
+        return -1;
+    }
+
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    BOOL ok = SetNamedPipeHandleState(pipe, &mode, NULL, NULL) &&
+        TransactNamedPipe(pipe, (LPVOID)line, (DWORD)len, reply, sizeof(reply) - 1, &replyLen, NULL);
+    CloseHandle(pipe);
+    if (!ok)
+        return -2;
+    reply[replyLen] = '\0';
+    if (strncmp(reply, "OK", 2) == 0)
+        return 0;
+
+    // ERR failed N... lists the failed commands of the request, 1-based
+    int failures = 0;
+    if (strncmp(reply, "ERR failed ", 11) == 0)
+    {
+        char* context = NULL;
+        for (char* tok = strtok_s(reply + 11, " \r\n", &context); tok; tok = strtok_s(NULL, " \r\n", &context))
+        {
+            if (batch.size() > 1)
+                printf("Command #%d failed\n", (int)first + atoi(tok));
+            failures++;
+        }
+    }
+    if (failures == 0)
+    {
+        printf("%s", reply);
+        failures = (int)count;
     }
+    return failures;
 }
 
-bool InitADL()
+// Forward commands to a running daemon. The batch goes as one request,
+// split only where it outgrows a request, so the daemon can write
+// different buses concurrently.
+// Returns the number of failed commands, or -1 if no daemon is listening.
+int ForwardToDaemon(const VcpBatch& batch)
 {
-    hADLModule = LoadLibrary(_T("atiadlxx.dll"));
-    // A 32 bit calling application on 64 bit OS will fail to LoadLibrary.
-    // Try to load the 32 bit library (atiadlxy.dll) instead
-    if (hADLModule == NULL)
-        hADLModule = LoadLibrary(_T("atiadlxy.dll"));
+    char line[DAEMON_LINE_LEN];
+    int failures = 0;
+    int len = 0;
+    size_t first = 0;
 
-    if (hADLModule == NULL)
-        return false;
+    for (size_t i = 0; i <= batch.size(); i++)
+    {
+        char text[MAX_LINE_LEN];
+        int n = 0;
 
-    pfn_ADL_Main_Control_Create = (ADL_MAIN_CONTROL_CREATE_FUNC)GetProcAddress(hADLModule, "ADL_Main_Control_Create");
-    pfn_ADL_Main_Control_Destroy = (ADL_MAIN_CONTROL_DESTROY_FUNC)GetProcAddress(hADLModule, "ADL_Main_Control_Destroy");
-    pfn_ADL_Adapter_NumberOfAdapters_Get = (ADL_ADAPTER_NUMBEROFADAPTERS_GET_FUNC)GetProcAddress(hADLModule, "ADL_Adapter_NumberOfAdapters_Get");
-    pfn_ADL_Adapter_AdapterInfo_Get = (ADL_ADAPTER_ADAPTERINFO_GET_FUNC)GetProcAddress(hADLModule, "ADL_Adapter_AdapterInfo_Get");
-    pfn_ADL_Display_DisplayInfo_Get = (ADL_DISPLAY_DISPLAYINFO_GET_FUNC)GetProcAddress(hADLModule, "ADL_Display_DisplayInfo_Get");
-    pfn_ADL_Display_DDCBlockAccess_Get = (ADL_DISPLAY_DDCBLOCKACCESS_GET_FUNC)GetProcAddress(hADLModule, "ADL_Display_DDCBlockAccess_Get");
+        if (i < batch.size())
+        {
+            const VcpCommand& cmd = batch[i];
+            if (cmd.selector[0])
+                n = _snprintf_s(text, sizeof(text), _TRUNCATE, "%s ", cmd.selector);
+            else
+                n = _snprintf_s(text, sizeof(text), _TRUNCATE, "%d ", cmd.display_index);
+            n += _snprintf_s(text + n, sizeof(text) - n, _TRUNCATE, "0x%02X 0x%02X 0x%02X",
+                cmd.input_value, cmd.command_code, cmd.register_address);
+        }
 
-    if (pfn_ADL_Main_Control_Create == NULL ||
-        pfn_ADL_Main_Control_Destroy == NULL ||
-        pfn_ADL_Adapter_NumberOfAdapters_Get == NULL ||
-        pfn_ADL_Adapter_AdapterInfo_Get == NULL ||
-        pfn_ADL_Display_DisplayInfo_Get == NULL ||
-        pfn_ADL_Display_DDCBlockAccess_Get == NULL)
+        // Send what is collected when the batch ends or the request is full
+        if (len > 0 && (i == batch.size() || len + n + 4 > (int)sizeof(line)))
+        {
+            int result = DaemonRequest(batch, first, i - first, line, len);
+            if (result == -1 && first == 0)
+                return -1;
+            if (result < 0)
+            {
+                printf("Daemon did not reply (error %lu)\n", GetLastError());
+                return failures + (int)(batch.size() - first);
+            }
+            failures += result;
+            len = 0;
+        }
+        if (i == batch.size())
+            break;
+
+        if (len == 0)
+        {
+            // Options are the same for every command of a batch
+            const VcpCommand& cmd = batch[i];
+            first = i;
+            if (cmd.shadow_ttl >= 0)
+                len = _snprintf_s(line, sizeof(line), _TRUNCATE, "--if-changed=%d ", cmd.shadow_ttl);
+            if (cmd.verify)
+                len += _snprintf_s(line + len, sizeof(line) - len, _TRUNCATE, "--verify ");
+        }
+        else
+        {
+            len += _snprintf_s(line + len, sizeof(line) - len, _TRUNCATE, " , ");
+        }
+        len += _snprintf_s(line + len, sizeof(line) - len, _TRUNCATE, "%s", text);
+    }
+
+    return failures;
+}
+
+// A request being served: its jobs still to finish, and whether any of
+// them was superseded
+struct DaemonRequestState
+{
+    int pending = 0;
+    bool superseded = false;
+};
+
+// A job of a request waiting for the worker of its bus. A queued job is
+// superseded by one of a later request for the same display and code,
+// which takes its place in the queue.
+struct DaemonJob
+{
+    const VcpCommand* cmd = NULL;
+    int display_index = 0;
+    char* result = NULL;
+    DaemonRequestState* request = NULL;
+    DaemonJob* next = NULL;
+};
+
+// Jobs for one physical bus in arrival order, run one at a time by the
+// bus's own worker thread
+struct DaemonBus
+{
+    BusKey key;
+    DaemonJob* queue = NULL;
+};
+
+// Buses seen so far; each lives as long as the daemon, as does its worker
+std::vector<DaemonBus*> g_daemonBuses;
+std::mutex g_daemonMutex;
+std::condition_variable g_daemonCond;
+
+// Run the jobs of one bus in order. Buses have a worker each, so a slow
+// monitor does not hold up writes to the others.
+void DaemonBusWorker(DaemonBus* bus)
+{
+    std::unique_lock<std::mutex> lock(g_daemonMutex);
+    for (;;)
     {
-        FreeLibrary(hADLModule);
-        hADLModule = NULL;
-        return false;
+        g_daemonCond.wait(lock, [bus] { return bus->queue != NULL; });
+        DaemonJob* job = bus->queue;
+        bus->queue = job->next;
+        lock.unlock();
+
+        bool ok = ApplyCommand(job->display_index, *job->cmd);
+        fflush(stdout);
+        TRACE_FLUSH();
+
+        lock.lock();
+        *job->result = ok ? 1 : 0;
+        job->request->pending--;
+        g_daemonCond.notify_all();
     }
+}
 
-    // Initialize ADL. Second parameter 1 = only active adapters.
-    int adlResult = pfn_ADL_Main_Control_Create(ADL_Main_Memory_Alloc, 1);
-    if (adlResult != ADL_OK)
+// Find the bus with key, starting its worker the first time. Called with
+// g_daemonMutex held.
+DaemonBus* DaemonBusFor(const BusKey& key)
+{
+    for (DaemonBus* bus : g_daemonBuses)
     {
-        FreeLibrary(hADLModule);
-        hADLModule = NULL;
-        return false;
+        if (bus->key == key)
+            return bus;
     }
 
-    return true;
+    DaemonBus* bus = new DaemonBus;
+    bus->key = key;
+    g_daemonBuses.push_back(bus);
+    std::thread(DaemonBusWorker, bus).detach();
+    return bus;
 }
 
-void FreeADL()
+// Queue a job on its bus. Last writer wins: a job of another request
+// still queued for the same display and code is answered as superseded
+// and replaced, so a burst such as a held brightness hotkey costs the
+// transaction in flight plus one with the newest value, however fast it
+// arrives. Jobs of one request are never merged with each other.
+void DaemonEnqueue(DaemonBus* bus, DaemonJob* job)
 {
-    if (pfn_ADL_Main_Control_Destroy)
-        pfn_ADL_Main_Control_Destroy();
-    if (hADLModule)
+    DaemonJob** link = &bus->queue;
+    while (*link)
     {
-        FreeLibrary(hADLModule);
-        hADLModule = NULL;
+        DaemonJob* queued = *link;
+        if (queued->request != job->request && queued->display_index == job->display_index &&
+            queued->cmd->register_address == job->cmd->register_address &&
+            queued->cmd->command_code == job->cmd->command_code)
+            break;
+        link = &queued->next;
+    }
+    if (*link)
+    {
+        DaemonJob* queued = *link;
+        job->next = queued->next;
+        *queued->result = 1;
+        queued->request->superseded = true;
+        queued->request->pending--;
     }
+    *link = job;
 }
 
-bool ADLWriteValue(int display_index, BYTE input_value, BYTE command_code, BYTE register_address)
+// Run a client's batch on the bus workers and wait for it. failed gets
+// one flag per command.
+// Returns the number of failed commands; superseded is set if a write was
+// replaced by a newer one.
+int DaemonExecute(const VcpBatch& batch, std::vector<bool>& failed, bool& superseded)
 {
-    // Get number of adapters
-    int iNumberAdapters = 0;
-    if (pfn_ADL_Adapter_NumberOfAdapters_Get(&iNumberAdapters) != ADL_OK || iNumberAdapters <= 0)
+    DaemonRequestState request;
+
+    // Resolving selectors may read EDIDs from the driver, so it happens
+    // before the lock that bus workers take to report their results
+    BatchPlan plan = BuildBatchPlan(batch);
+    std::vector<char> results(plan.commands.size(), 0);
+    std::vector<DaemonJob> jobs(plan.commands.size());
+    std::vector<BusKey> keys(plan.commands.size());
+    std::vector<bool> exists(plan.commands.size());
+    for (size_t i = 0; i < jobs.size(); i++)
     {
-        printf("No AMD adapters found\n");
-        return false;
+        keys[i] = { NULL, 0 };
+        exists[i] = DisplayBusKey(plan.display_index[i], keys[i]);
     }
 
-    // Get adapter info
-    LPAdapterInfo lpAdapterInfo = (LPAdapterInfo)malloc(sizeof(AdapterInfo) * iNumberAdapters);
-    if (lpAdapterInfo == NULL)
+    std::unique_lock<std::mutex> lock(g_daemonMutex);
+    for (size_t i = 0; i < jobs.size(); i++)
     {
-        printf("Memory allocation failed\n");
-        return false;
+        // Displays that do not exist fail without a bus
+        if (!exists[i])
+            continue;
+
+        jobs[i].cmd = &batch[plan.commands[i]];
+        jobs[i].display_index = plan.display_index[i];
+        jobs[i].result = &results[i];
+        jobs[i].request = &request;
+        request.pending++;
+        DaemonEnqueue(DaemonBusFor(keys[i]), &jobs[i]);
     }
-    memset(lpAdapterInfo, 0, sizeof(AdapterInfo) * iNumberAdapters);
-    pfn_ADL_Adapter_AdapterInfo_Get(lpAdapterInfo, sizeof(AdapterInfo) * iNumberAdapters);
+    g_daemonCond.notify_all();
 
-    // Build flat list of connected+mapped displays
-    int targetAdapterIdx = -1;
-    int targetDisplayIdx = -1;
-    int flatIndex = 0;
+    g_daemonCond.wait(lock, [&request] { return request.pending == 0; });
+    lock.unlock();
 
-    for (int i = 0; i < iNumberAdapters; i++)
+    int failures = 0;
+    failed.assign(batch.size(), false);
+    for (size_t i = 0; i < batch.size(); i++)
     {
-        int iAdapterIndex = lpAdapterInfo[i].iAdapterIndex;
-        int iNumberDisplays = 0;
-        ADLDisplayInfo* lpDisplayInfo = NULL;
+        failed[i] = !BatchCommandOk(batch, plan, results, i);
+        failures += failed[i] ? 1 : 0;
+    }
+    superseded = request.superseded;
+    return failures;
+}
 
-        if (pfn_ADL_Display_DisplayInfo_Get(iAdapterIndex, &iNumberDisplays, &lpDisplayInfo, 0) != ADL_OK)
-            continue;
+// Serve one client on its own pipe instance: one request, one reply.
+// A request is optional leading --if-changed=SECONDS and --verify, then
+// commands separated by ','. The reply is OK, OK superseded, or ERR
+// failed followed by the failed commands, 1-based.
+void DaemonServeClient(HANDLE hPipe)
+{
+    char line[DAEMON_LINE_LEN];
+    DWORD lineLen = 0;
+    if (ReadFile(hPipe, line, sizeof(line) - 1, &lineLen, NULL))
+    {
+        line[lineLen] = '\0';
+
+        std::vector<char*> args(MAX_DAEMON_ARGS);
+        int count = SplitArgs(line, args.data(), MAX_DAEMON_ARGS);
 
-        for (int j = 0; j < iNumberDisplays; j++)
+        int shadow_ttl = -1;
+        bool verify = false;
+        int first = 0;
+        if (first < count && sscanf_s(args[first], "--if-changed=%d", &shadow_ttl) == 1)
+            first++;
+        if (first < count && strcmp(args[first], "--verify") == 0)
         {
-            // Only use connected AND mapped displays
-            if ((lpDisplayInfo[j].iDisplayInfoValue &
-                (ADL_DISPLAY_DISPLAYINFO_DISPLAYCONNECTED | ADL_DISPLAY_DISPLAYINFO_DISPLAYMAPPED)) !=
-                (ADL_DISPLAY_DISPLAYINFO_DISPLAYCONNECTED | ADL_DISPLAY_DISPLAYINFO_DISPLAYMAPPED))
-                continue;
+            verify = true;
+            first++;
+        }
 
-            // Is the display mapped to this adapter?
-            if (iAdapterIndex != lpDisplayInfo[j].displayID.iDisplayLogicalAdapterIndex)
-                continue;
+        VcpBatch batch;
+        char reply[DAEMON_LINE_LEN];
+        if (!ParseBatchArgs(count - first, args.data() + first, batch))
+        {
+            strcpy_s(reply, sizeof(reply), "ERR bad command\n");
+        }
+        else
+        {
+            for (VcpCommand& cmd : batch)
+            {
+                cmd.shadow_ttl = shadow_ttl;
+                cmd.verify = verify;
+            }
 
-            if (flatIndex == display_index)
+            std::vector<bool> failed;
+            bool superseded = false;
+            if (DaemonExecute(batch, failed, superseded) == 0)
             {
-                targetAdapterIdx = iAdapterIndex;
-                targetDisplayIdx = lpDisplayInfo[j].displayID.iDisplayLogicalIndex;
+                strcpy_s(reply, sizeof(reply), superseded ? "OK superseded\n" : "OK\n");
+            }
+            else
+            {
+                int len = _snprintf_s(reply, sizeof(reply), _TRUNCATE, "ERR failed");
+                for (size_t i = 0; i < batch.size() && len < (int)sizeof(reply) - 8; i++)
+                {
+                    if (failed[i])
+                        len += _snprintf_s(reply + len, sizeof(reply) - len, _TRUNCATE, " %d", (int)i + 1);
+                }
+                _snprintf_s(reply + len, sizeof(reply) - len, _TRUNCATE, "\n");
             }
-            flatIndex++;
         }
 
-        ADL_Main_Memory_Free((void**)&lpDisplayInfo);
+        DWORD written = 0;
+        WriteFile(hPipe, reply, (DWORD)strlen(reply), &written, NULL);
+        FlushFileBuffers(hPipe);
     }
 
-    free(lpAdapterInfo);
+    DisconnectNamedPipe(hPipe);
+    CloseHandle(hPipe);
+}
 
-    if (targetAdapterIdx == -1)
-    {
-        printf("Display index %d not found (only %d AMD displays detected)\n", display_index, flatIndex);
-        return false;
-    }
+// Run as a long-lived daemon: initialize the backend and display map
+// once, then execute commands received on the named pipe.
+int RunDaemon()
+{
+    if (!InitBackend())
+        return 1;
 
-    // Build DDC/CI packet (identical format to NVAPI)
-    // 0x6E - I2C write address (0x37 << 1)
-    // register_address - sub-address (e.g. 0x51 for VCP, 0x50 for LG custom)
-    // 0x84 - 0x80 | 4 (4 bytes follow, excluding checksum)
-    // 0x03 - "set VCP" command
-    // command_code - VCP code
-    // 0x00 - value high byte
-    // input_value - value low byte
-    // checksum - XOR of all preceding bytes
-    unsigned char packet[8] = { 0x6E, register_address, 0x84, 0x03, command_code, 0x00, input_value, 0x00 };
+    // Warm up the display map before the first command arrives
+    printf("Daemon found %d displays\n", BackendDisplayCount());
 
-    // Calculate XOR checksum
-    unsigned char checksum = 0;
-    for (int i = 0; i < 7; i++)
-        checksum ^= packet[i];
-    packet[7] = checksum;
+    // Only our own user may connect: the default DACL of a pipe lets
+    // everyone read it
+    SECURITY_ATTRIBUTES security;
+    if (!DaemonPipeSecurity(&security))
+    {
+        printf("Failed to build the security of %s (error %lu)\n", PIPE_NAME, GetLastError());
+        FreeBackend();
+        return 1;
+    }
 
-    int recvLen = 0;
-    int adlResult = pfn_ADL_Display_DDCBlockAccess_Get(targetAdapterIdx, targetDisplayIdx, 0, 0, 8, (char*)packet, &recvLen, NULL);
+    // Every client gets its own pipe instance and thread, so writes
+    // arriving while a bus is busy reach its queue and can be merged.
+    // Only the first instance may create the pipe.
+    DWORD firstInstance = FILE_FLAG_FIRST_PIPE_INSTANCE;
 
-    if (adlResult != ADL_OK)
+    for (;;)
     {
-        printf("ADL_Display_DDCBlockAccess_Get failed with error %d\n", adlResult);
-        return false;
+        HANDLE hPipe = CreateNamedPipeA(PIPE_NAME,
+            PIPE_ACCESS_DUPLEX | firstInstance,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES, DAEMON_LINE_LEN, DAEMON_LINE_LEN, 0, &security);
+        if (hPipe == INVALID_HANDLE_VALUE)
+        {
+            if (firstInstance)
+                printf("Failed to create %s (error %lu), is a daemon already running?\n", PIPE_NAME, GetLastError());
+            else
+                printf("CreateNamedPipe failed with error %lu\n", GetLastError());
+            break;
+        }
+        if (firstInstance)
+            printf("Listening on %s\n", PIPE_NAME);
+        firstInstance = 0;
+
+        BOOL connected = ConnectNamedPipe(hPipe, NULL) ? TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+        if (!connected)
+        {
+            printf("ConnectNamedPipe failed with error %lu\n", GetLastError());
+            CloseHandle(hPipe);
+            break;
+        }
+        std::thread(DaemonServeClient, hPipe).detach();
     }
 
-    return true;
+    LocalFree(security.lpSecurityDescriptor);
+    FreeBackend();
+    return 1;
 }
 
 
 // ============================================================
-// Primary display auto-detect (GPU-agnostic)
+// Benchmark
 // ============================================================
 
-int AutoDetectPrimaryDisplay()
+enum { PHASE_INIT, PHASE_ENUMERATE, PHASE_PACING, PHASE_TRANSFER, PHASE_TOTAL, PHASE_COUNT };
+
+// Run one command count times and report where the time goes:
+//   init       GPU library initialization
+//   enumerate  display map, from the topology cache unless --rescan
+//   pacing     MCCS delays, reply delays and retry backoff slept
+//   transfer   the rest of each transaction (NVAPI, ADL, emulator)
+//   total      each transaction end to end, retries included
+// Returns 0 when every transaction succeeded.
+int RunBench(const VcpCommand& cmd, bool read_mode, unsigned count, bench_format format)
 {
-    DISPLAY_DEVICE dd;
-    ZeroMemory(&dd, sizeof(dd));
-    dd.cb = sizeof(dd);
+    bench_phase phases[PHASE_COUNT] = {
+        { "init", NULL, 0, 0 }, { "enumerate", NULL, 0, 0 }, { "pacing", NULL, 0, 0 },
+        { "transfer", NULL, 0, 0 }, { "total", NULL, 0, 0 }
+    };
+    bench_run run = { NULL, count, 0, 0.0 };
+
+    ULONGLONG t0 = MonotonicUs();
+    if (!InitBackend())
+        return 1;
+    ULONGLONG t1 = MonotonicUs();
+    BackendDisplayCount();
+    bench_add(&phases[PHASE_INIT], t1 - t0);
+    bench_add(&phases[PHASE_ENUMERATE], MonotonicUs() - t1);
+
+    int display_index = ResolveDisplayIndex(cmd);
+    ULONGLONG start = MonotonicUs();
+    for (unsigned i = 0; i < count; i++)
+    {
+        ddcci_vcp_reply reply;
+        ULONGLONG paced = t_pacedUs;
+        ULONGLONG begin = MonotonicUs();
+        bool ok = read_mode ? ReadValue(display_index, cmd, &reply) : WriteValue(display_index, cmd);
+        ULONGLONG total = MonotonicUs() - begin;
+
+        paced = t_pacedUs - paced;
+        bench_add(&phases[PHASE_PACING], paced);
+        bench_add(&phases[PHASE_TRANSFER], total > paced ? total - paced : 0);
+        bench_add(&phases[PHASE_TOTAL], total);
+        if (!ok)
+            run.failures++;
+    }
+    run.seconds = (MonotonicUs() - start) / 1e6;
 
-    for (DWORD iDevNum = 0; EnumDisplayDevices(NULL, iDevNum, &dd, 0); iDevNum++)
+    switch (g_backend)
     {
-        if (dd.StateFlags & DISPLAY_DEVICE_PRIMARY_DEVICE)
-        {
-            printf("Primary display device found: %s\n", dd.DeviceName);
-            printf("Using display index %d for primary display\n", (int)iDevNum);
-            return (int)iDevNum;
-        }
+    case BACKEND_NVIDIA:  run.backend = "nvidia"; break;
+    case BACKEND_ADL:     run.backend = "adl"; break;
+    default:              run.backend = "virtual"; break;
     }
+    bench_report(stdout, format, &run, phases, PHASE_COUNT);
 
-    printf("Primary display not found, defaulting to index 0\n");
-    return 0;
+    for (int i = 0; i < PHASE_COUNT; i++)
+        bench_free(&phases[i]);
+    FreeBackend();
+    return run.failures ? 1 : 0;
 }
 
 
@@ -368,76 +3735,270 @@ int AutoDetectPrimaryDisplay()
 
 int main(int argc, char* argv[]) {
 
-    int display_index = 0;
-    BYTE input_value = 0;
-    BYTE command_code = 0;  //VCP code or equivalent
-    BYTE register_address = 0x51;
+    bool daemon_mode = false;
+    bool use_daemon = true;
+    bool read_mode = false;
+    bool caps_mode = false;
+    bool list_mode = false;
+    int shadow_ttl = -1;
+    bool verify = false;
+    const char* batch_file = NULL;
+    unsigned bench_count = 0;
+    DWORD fade_ms = 0;
+    bench_format bench_fmt = BENCH_TEXT;
+    bool args_ok = true;
+
+    TRACE_INIT();
+
+    // Leading options: --backend=virtual, --daemon, --no-daemon, --rescan, --get, --caps, --list, --display SEL, --if-changed[=SECONDS],
+    // --verify, --batch FILE, --fade MS, --bench N, --bench-format=text|csv|json
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        // A daemon keeps the backend and display map it started with, so
+        // asking for emulated monitors or a fresh scan runs locally
+        if (strcmp(argv[1], "--backend=virtual") == 0) {
+            g_useVirtual = true;
+            use_daemon = false;
+        }
+        else if (strcmp(argv[1], "--daemon") == 0) {
+            daemon_mode = true;
+        }
+        else if (strcmp(argv[1], "--no-daemon") == 0) {
+            use_daemon = false;
+        }
+        else if (strcmp(argv[1], "--rescan") == 0) {
+            g_rescan = true;
+            use_daemon = false;
+        }
+        else if (strcmp(argv[1], "--get") == 0) {
+            read_mode = true;
+        }
+        else if (strcmp(argv[1], "--caps") == 0) {
+            caps_mode = true;
+        }
+        else if (strcmp(argv[1], "--list") == 0) {
+            list_mode = true;
+        }
+        else if (strcmp(argv[1], "--if-changed") == 0) {
+            shadow_ttl = SHADOW_DEFAULT_TTL;
+        }
+        else if (sscanf_s(argv[1], "--if-changed=%d", &shadow_ttl) == 1 && shadow_ttl >= 0) {
+            // TTL given explicitly
+        }
+        else if (strcmp(argv[1], "--verify") == 0) {
+            verify = true;
+        }
+        else if (strcmp(argv[1], "--display") == 0 && argc > 2) {
+            g_displayArg = argv[2];
+            argv++;
+            argc--;
+        }
+        else if (strcmp(argv[1], "--batch") == 0 && argc > 2) {
+            batch_file = argv[2];
+            argv++;
+            argc--;
+        }
+        else if (strcmp(argv[1], "--fade") == 0 && argc > 2 && atoi(argv[2]) > 0 && atoi(argv[2]) <= FADE_MAX_MS) {
+            fade_ms = (DWORD)atoi(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (strcmp(argv[1], "--bench") == 0 && argc > 2 && atoi(argv[2]) > 0) {
+            bench_count = (unsigned)atoi(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (strncmp(argv[1], "--bench-format=", 15) == 0 && bench_parse_format(argv[1] + 15, &bench_fmt)) {
+            // Format given
+        }
+        else {
+            printf("Unknown option: %s\n\n", argv[1]);
+            args_ok = false;
+            break;
+        }
+        argv++;
+        argc--;
+    }
 
-    // Usage: writeValueToMonitor.exe [display_index] [input_value] [command_code]
-    // Uses default register addres 0x51 used for VCP codes
-    if (argc == 4) {
-        display_index = atoi(argv[1]);
-        input_value = (BYTE)strtol(argv[2], NULL, 16);
-        command_code = (BYTE)strtol(argv[3], NULL, 16);
+    if (args_ok && daemon_mode)
+        return RunDaemon();
+
+    // Usage: writeValueToMonitor.exe --bench N [--get] [display_index] [input_value] [command_code] ...
+    // Always runs locally, a daemon would hide the costs being measured
+    if (args_ok && bench_count)
+    {
+        VcpCommand bench_cmd;
+        args_ok = !batch_file && (read_mode ? ParseReadCommand(argc - 1, argv + 1, bench_cmd)
+                                            : ParseCommand(argc - 1, argv + 1, bench_cmd));
+        if (args_ok)
+            return RunBench(bench_cmd, read_mode, bench_count, bench_fmt);
     }
 
-    // Usage: writeValueToMonitor.exe [display_index] [input_value] [command_code] [register_address]
-    // Uses default register addres 0x51 used for VCP codes
-    else if (argc == 5) {
-        display_index = atoi(argv[1]);
-        input_value = (BYTE)strtol(argv[2], NULL, 16);
-        command_code = (BYTE)strtol(argv[3], NULL, 16);
-        register_address = (BYTE)strtol(argv[4], NULL, 16);
+    // Usage: writeValueToMonitor.exe --fade MS [display_index] [input_value] [command_code] [register_address]
+    // Runs locally: the whole ramp is one process, however many steps it takes
+    if (args_ok && fade_ms)
+    {
+        VcpCommand fade_cmd;
+        args_ok = !batch_file && !read_mode && !caps_mode && !list_mode && ParseCommand(argc - 1, argv + 1, fade_cmd);
+        if (args_ok)
+        {
+            if (!InitBackend())
+                return 1;
+            bool ok = ExecuteFade(fade_cmd, fade_ms);
+            FreeBackend();
+            if (!ok)
+            {
+                printf("Fading value failed\n");
+                return 1;
+            }
+            return 0;
+        }
+    }
+
+    // Usage: writeValueToMonitor.exe --caps [display_index]
+    if (args_ok && caps_mode)
+    {
+        VcpCommand caps_cmd = { -1, 0, 0, DDCCI_HOST_ADDR, -1, false, "" };
+        const char* display = argc == 2 ? argv[1] : g_displayArg;
+        args_ok = !batch_file && !read_mode && argc <= 2 && !(argc == 2 && g_displayArg) &&
+                  (!display || ParseDisplay(display, caps_cmd));
+        if (args_ok)
+        {
+            if (!InitBackend())
+                return 1;
+            bool ok = ExecuteCaps(caps_cmd);
+            FreeBackend();
+            if (!ok)
+            {
+                printf("Reading capabilities failed\n");
+                return 1;
+            }
+            return 0;
+        }
+    }
+
+    // Usage: writeValueToMonitor.exe --list
+    if (args_ok && list_mode)
+    {
+        args_ok = !batch_file && !read_mode && argc == 1;
+        if (args_ok)
+        {
+            if (!InitBackend())
+                return 1;
+            int count = ExecuteList();
+            FreeBackend();
+            if (!count)
+            {
+                printf("No displays found\n");
+                return 1;
+            }
+            return 0;
+        }
+    }
+
+    // Usage: writeValueToMonitor.exe --get [display_index] [command_code] [register_address]
+    VcpCommand read_cmd;
+    if (args_ok && read_mode)
+    {
+        args_ok = !batch_file && ParseReadCommand(argc - 1, argv + 1, read_cmd);
+        if (args_ok)
+        {
+            if (!InitBackend())
+                return 1;
+            bool ok = ExecuteRead(read_cmd);
+            FreeBackend();
+            if (!ok)
+            {
+                printf("Reading value failed\n");
+                return 1;
+            }
+            return 0;
+        }
+    }
+
+    // Usage: writeValueToMonitor.exe [display_index] [input_value] [command_code] [register_address] [, ...]
+    VcpBatch batch;
+    if (args_ok)
+    {
+        if (batch_file)
+            args_ok = (argc == 1) && ParseBatchFile(batch_file, batch);
+        else
+            args_ok = ParseBatchArgs(argc - 1, argv + 1, batch);
     }
-    else {
+
+    if (!args_ok) {
         printf("Incorrect Number of arguments!\n\n");
 
         printf("Arguments:\n");
-        printf("display_index   - Index assigned to monitor (0 for first screen)\n");
-        printf("input_value     - value to right to screen\n");
+        printf("display_index   - Index assigned to monitor (0 for first screen),\n");
+        printf("                  or serial:S, connector:C (e.g. DISPLAY1) or model:M from --list\n");
+        printf("input_value     - value to right to screen (up to 0xFFFF)\n");
         printf("command_code    - VCP code or other\n");
         printf("register_address - Adress to write to, default 0x51 for VCP codes\n\n");
 
+        printf("Options:\n");
+        printf("--backend=virtual - Emulated monitors for testing, configured by %s\n", VIRTUAL_ENV);
+        printf("--daemon        - Stay resident and serve commands over a named pipe\n");
+        printf("--no-daemon     - Do not forward to a running daemon\n");
+        printf("--rescan        - Ignore the cached display topology and enumerate again, without the daemon\n");
+        printf("--get           - Read a value instead: [display_index] [command_code] [register_address]\n");
+        printf("--caps          - Print and cache a display's capabilities: [display_index]\n");
+        printf("--list          - Print every display with its model and serial\n");
+        printf("--display SEL   - display_index for every command, which then leaves it out\n");
+        printf("--fade MS       - Ramp a continuous code (0x10, 0x12, ...) to the value over MS milliseconds\n");
+        printf("--if-changed[=S] - Skip writes of values the monitor already has (shadow TTL S seconds, default %d)\n", SHADOW_DEFAULT_TTL);
+        printf("--verify        - Read each written value back and write again on a mismatch\n");
+        printf("--batch FILE    - Read one command per line from FILE (- for stdin)\n");
+        printf("--bench N       - Run the command N times and report latency per phase\n");
+        printf("--bench-format=F - Benchmark report as text (default), csv or json\n\n");
+
         printf("Usage:\n");
         printf("writeValueToScreen.exe [display_index] [input_value] [command_code]\n");
         printf("OR\n");
         printf("writeValueToScreen.exe [display_index] [input_value] [command_code] [register_address]\n");
+        printf("OR\n");
+        printf("writeValueToScreen.exe [command] , [command] , ...\n");
+        printf("OR\n");
+        printf("writeValueToScreen.exe --batch [file]\n");
+        printf("OR\n");
+        printf("writeValueToScreen.exe --get [display_index] [command_code]\n");
+        printf("OR\n");
+        printf("writeValueToScreen.exe --caps [display_index]\n");
+        printf("OR\n");
+        printf("writeValueToScreen.exe --list\n");
+        printf("OR\n");
+        printf("writeValueToScreen.exe --fade [ms] [display_index] [input_value] [command_code]\n");
         return 1;
     }
 
-    // Auto-detect primary display if display_index is -1
-    if (display_index == -1)
+    for (VcpCommand& cmd : batch)
     {
-        display_index = AutoDetectPrimaryDisplay();
+        cmd.shadow_ttl = shadow_ttl;
+        cmd.verify = verify;
     }
 
-    // Try NVIDIA first
-    if (InitNvidia())
+    // Hand the commands to a running daemon, which already has the
+    // backend initialized and the display map enumerated
+    int failures = -1;
+    if (use_daemon)
+        failures = ForwardToDaemon(batch);
+
+    if (failures < 0)
     {
-        printf("Using NVIDIA GPU\n");
-        bool ok = NvidiaWriteValue(display_index, input_value, command_code, register_address);
-        if (!ok)
-        {
-            printf("Changing input failed\n");
-        }
-        printf("\n");
-        return ok ? 0 : 1;
+        if (!InitBackend())
+            return 1;
+        failures = ExecuteBatch(batch);
+        FreeBackend();
     }
 
-    // Try AMD ADL
-    if (InitADL())
+    if (failures)
     {
-        printf("Using AMD GPU\n");
-        bool ok = ADLWriteValue(display_index, input_value, command_code, register_address);
-        FreeADL();
-        if (!ok)
-        {
+        if (batch.size() > 1)
+            printf("%d of %d commands failed\n", failures, (int)batch.size());
+        else
             printf("Changing input failed\n");
-        }
-        printf("\n");
-        return ok ? 0 : 1;
+        return 1;
     }
 
-    printf("No supported GPU found (NVIDIA or AMD required)\n");
-    return 1;
+    printf("\n");
+    return 0;
 }